@@ -0,0 +1,10 @@
+echo "Running benchmarks"
+
+for i in benchmarks/*_bench
+do
+    if test -f $i
+    then
+        echo "== $i" | tee -a benchmarks/bench.log
+        ./$i 2>&1 | tee -a benchmarks/bench.log
+    fi
+done
@@ -0,0 +1,84 @@
+/*
+ * miss_bench.cpp
+ * The cost of looking up keys that aren't in the table
+ *
+ * Fills a table with n keys, then times n lookups of keys that aren't
+ * there, first through get (which throws on a miss) and then through
+ * try_get (which doesn't). This is done both for an in-memory table and
+ * for one on disk with a buffer pool of pool_pages pages, far too few to
+ * hold it, so that the misses also miss in the pool.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "dstruct/hashtable.hpp"
+
+const char *fname = "./benchmarks/miss_bench.store";
+const size_t pool_pages = 10;
+
+
+template <typename F>
+double ns_per_op(size_t n, F fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i=0; i<n; i++) {
+        fn(i);
+    }
+    auto stop = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::nano>(stop - start).count() / n;
+}
+
+
+void run(const char *name, HashTable<int32_t, int32_t> *table, size_t n)
+{
+    for (size_t i=0; i<n; i++) {
+        table->insert(i + 1, i);
+    }
+
+    // hits, as a baseline
+    volatile int32_t sink = 0;
+    double hit = ns_per_op(n, [&](size_t i) {
+        sink = table->get(i + 1);
+    });
+
+    size_t misses = 0;
+    double thrown = ns_per_op(n, [&](size_t i) {
+        try {
+            sink = table->get(n + i + 1);
+        } catch (KeyNotFoundException &e) {
+            misses++;
+        }
+    });
+
+    double returned = ns_per_op(n, [&](size_t i) {
+        int32_t val;
+        if (!table->try_get(n + i + 1, &val)) misses++;
+    });
+
+    printf("%-8s hit %8.1f ns   miss (get) %8.1f ns   miss (try_get) %8.1f ns\n",
+            name, hit, thrown, returned);
+    if (misses != 2 * n) printf("%-8s unexpected hits: %zu\n", name, 2 * n - misses);
+}
+
+
+int main(int argc, char **argv)
+{
+    size_t n = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 100000;
+    size_t buckets = n / 2 + 1;
+
+    auto mem = new HashTable<int32_t, int32_t>(buckets);
+    run("memory", mem, n);
+    delete mem;
+
+    unlink(fname);
+    auto pool = new BufferedIOHandler(new RawIOHandler(fname), pool_pages);
+    auto disk = new HashTable<int32_t, int32_t>(pool, buckets);
+    run("disk", disk, n);
+    delete disk;
+    unlink(fname);
+
+    return EXIT_SUCCESS;
+}
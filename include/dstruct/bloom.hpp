@@ -0,0 +1,202 @@
+/*
+ * bloom.hpp
+ * A blocked Bloom filter, for answering "definitely not there" from memory
+ *
+ * The filter is split into cacheline sized blocks. A key picks one block
+ * from its hash and sets (or checks) probe_cnt bits inside it, so a lookup
+ * touches exactly one cacheline, however many bits it checks. This costs a
+ * little in false positive rate over a classic Bloom filter of the same
+ * size (at 10 bits per key, roughly 1% rather than 0.8%), which is a good
+ * trade against a cache miss per probe.
+ *
+ * Bits can't be taken back out of a Bloom filter, so removing a key leaves
+ * it in the filter. Removed keys only ever cause false positives, never
+ * false negatives, and the filter can be rebuilt from scratch to get rid
+ * of them.
+ */
+#ifndef bloomfilt
+#define bloomfilt
+
+#include "kvs.hpp"
+#include "io/exceptions.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+class BloomFilter
+{
+    private:
+        static constexpr size_t const block_words = CACHELINE / sizeof(uint64_t);
+        static constexpr size_t const block_bits = CACHELINE * 8;
+        static constexpr size_t const probe_cnt = 6;
+        static constexpr uint64_t const magic = 0x6d6f6f6c62737666ull;
+
+        struct alignas(CACHELINE) Block
+        {
+            uint64_t words[block_words];
+        };
+
+        /*
+         * The sidecar file is this header, followed by the blocks.
+         */
+        struct Header
+        {
+            uint64_t magic;
+            uint64_t block_cnt;
+            uint64_t key_cnt;
+        };
+
+        std::vector<Block> blocks;
+        size_t key_cnt;
+
+        /*
+         * std::hash is the identity for integers, so mix the hash up before
+         * using it. The high half picks the block, and the low half is
+         * split into the two hashes that the probes are derived from.
+         */
+        static uint64_t inline mix(uint64_t hash)
+        {
+            hash ^= hash >> 33;
+            hash *= 0xff51afd7ed558ccdull;
+            hash ^= hash >> 33;
+            hash *= 0xc4ceb9fe1a85ec53ull;
+            hash ^= hash >> 33;
+            return hash;
+        }
+
+        Block &block_of(uint64_t mixed)
+        {
+            uint64_t high = mixed >> 32;
+            return this->blocks[(high * this->blocks.size()) >> 32];
+        }
+
+    public:
+        /*
+         * Size the filter for expected_keys keys at bits_per_key bits
+         * each, rounded up to a whole number of blocks.
+         */
+        BloomFilter(size_t expected_keys, size_t bits_per_key=10)
+        {
+            size_t bits = expected_keys * bits_per_key;
+            size_t block_cnt = (bits + block_bits - 1) / block_bits;
+            if (block_cnt == 0) block_cnt = 1;
+
+            this->blocks.resize(block_cnt);
+            this->clear();
+        }
+
+
+        void add(uint64_t hash)
+        {
+            uint64_t mixed = mix(hash);
+            Block &block = this->block_of(mixed);
+            uint32_t h1 = mixed;
+            uint32_t h2 = (mixed >> 16) | 1;
+
+            for (size_t i=0; i<probe_cnt; i++) {
+                uint32_t bit = (h1 + i * h2) % block_bits;
+                block.words[bit / 64] |= (uint64_t) 1 << (bit % 64);
+            }
+
+            this->key_cnt++;
+        }
+
+
+        /*
+         * False means the key was never added. True means it probably was.
+         */
+        bool may_contain(uint64_t hash)
+        {
+            uint64_t mixed = mix(hash);
+            Block &block = this->block_of(mixed);
+            uint32_t h1 = mixed;
+            uint32_t h2 = (mixed >> 16) | 1;
+
+            for (size_t i=0; i<probe_cnt; i++) {
+                uint32_t bit = (h1 + i * h2) % block_bits;
+                if (!(block.words[bit / 64] & ((uint64_t) 1 << (bit % 64)))) return false;
+            }
+
+            return true;
+        }
+
+
+        void clear()
+        {
+            memset(this->blocks.data(), 0, this->blocks.size() * sizeof(Block));
+            this->key_cnt = 0;
+        }
+
+
+        /*
+         * The number of adds since the filter was created or cleared,
+         * counting any repeats.
+         */
+        size_t get_key_count()
+        {
+            return this->key_cnt;
+        }
+
+
+        size_t get_bytes()
+        {
+            return this->blocks.size() * sizeof(Block);
+        }
+
+
+        /*
+         * Write the filter to path. It is written alongside path and then
+         * renamed into place, so anyone loading it sees either the old
+         * filter or the new one, never half of each.
+         */
+        void save(const char *path)
+        {
+            std::string staging = std::string(path) + ".tmp";
+            FILE *out = fopen(staging.c_str(), "wb");
+            if (!out) throw IOException();
+
+            Header header = {magic, this->blocks.size(), this->key_cnt};
+            bool failed = fwrite(&header, sizeof(header), 1, out) != 1 ||
+                          fwrite(this->blocks.data(), sizeof(Block), this->blocks.size(),
+                                  out) != this->blocks.size();
+            failed = fclose(out) || failed;
+
+            if (failed || rename(staging.c_str(), path)) {
+                unlink(staging.c_str());
+                throw IOException();
+            }
+        }
+
+
+        /*
+         * Read a filter written by save. Returns nullptr if there is no
+         * filter at path, or what is there isn't one.
+         */
+        static BloomFilter *load(const char *path)
+        {
+            FILE *in = fopen(path, "rb");
+            if (!in) return nullptr;
+
+            Header header;
+            BloomFilter *filter = nullptr;
+            if (fread(&header, sizeof(header), 1, in) == 1 && header.magic == magic &&
+                    header.block_cnt > 0) {
+                filter = new BloomFilter(0);
+                filter->blocks.resize(header.block_cnt);
+                filter->key_cnt = header.key_cnt;
+                if (fread(filter->blocks.data(), sizeof(Block), header.block_cnt, in) !=
+                        header.block_cnt) {
+                    delete filter;
+                    filter = nullptr;
+                }
+            }
+
+            fclose(in);
+            return filter;
+        }
+};
+
+#endif
@@ -0,0 +1,356 @@
+/*
+ * cache.hpp
+ * A small in-process key to value cache for hot keys
+ *
+ * Each segment is an S3-FIFO cache (Yang et al., SOSP '23). New keys go
+ * into a small FIFO holding a tenth of the segment. Keys that are hit
+ * again before they reach its head move on to the main FIFO, and the rest
+ * are evicted, leaving their key behind in a ghost FIFO. A key that comes
+ * back while it is still a ghost goes straight into main. Main is a FIFO
+ * with a little reinsertion: a key at its head that has been hit since it
+ * was last there goes round again. Between them, one-hit wonders are
+ * flushed out quickly, and a skewed working set settles in main, with
+ * nothing more than a counter bump on a hit.
+ *
+ * KeyCache stripes keys over several segments, each with its own lock, so
+ * that threads hitting different keys rarely contend.
+ */
+#ifndef keycache
+#define keycache
+
+#include "kvs.hpp"
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+template <typename TKey, typename TValue>
+class S3FifoCache
+{
+    private:
+        static constexpr uint8_t const max_freq = 3;
+
+        struct Entry
+        {
+            TValue val;
+            uint64_t id;
+            uint8_t freq;
+            bool in_main;
+        };
+
+        /*
+         * The FIFOs hold {key, id} pairs. Erasing a key only takes it out
+         * of entries, and leaves its place in the FIFO behind; the id tells
+         * the two apart from a later entry for the same key when that
+         * place reaches the head.
+         */
+        typedef std::pair<TKey, uint64_t> slot_t;
+
+        std::unordered_map<TKey, Entry> entries;
+        std::deque<slot_t> small;
+        std::deque<slot_t> main;
+        std::deque<TKey> ghost;
+        std::unordered_set<TKey> ghosts;
+
+        size_t capacity;
+        size_t small_capacity;
+        size_t small_cnt;
+        size_t main_cnt;
+        uint64_t next_id;
+
+
+        bool live(const slot_t &slot)
+        {
+            auto entry = this->entries.find(slot.first);
+            return entry != this->entries.end() && entry->second.id == slot.second;
+        }
+
+
+        void remember(TKey key)
+        {
+            if (this->ghosts.insert(key).second) this->ghost.push_back(key);
+
+            while (this->ghost.size() > this->capacity) {
+                this->ghosts.erase(this->ghost.front());
+                this->ghost.pop_front();
+            }
+        }
+
+
+        void evict_small()
+        {
+            while (!this->small.empty()) {
+                slot_t slot = this->small.front();
+                this->small.pop_front();
+                if (!this->live(slot)) continue;
+
+                Entry &entry = this->entries.at(slot.first);
+                this->small_cnt--;
+                if (entry.freq > 0) {
+                    entry.freq = 0;
+                    entry.in_main = true;
+                    this->main.push_back(slot);
+                    this->main_cnt++;
+                } else {
+                    this->entries.erase(slot.first);
+                    this->remember(slot.first);
+                }
+                return;
+            }
+        }
+
+
+        void evict_main()
+        {
+            while (!this->main.empty()) {
+                slot_t slot = this->main.front();
+                this->main.pop_front();
+                if (!this->live(slot)) continue;
+
+                Entry &entry = this->entries.at(slot.first);
+                if (entry.freq > 0) {
+                    entry.freq--;
+                    this->main.push_back(slot);
+                } else {
+                    this->entries.erase(slot.first);
+                    this->main_cnt--;
+                    return;
+                }
+            }
+        }
+
+
+        /*
+         * Erased keys leave dead slots in the FIFOs until they reach the
+         * head. If keys come and go without the cache ever filling up,
+         * that could be never, so once there are as many dead slots as
+         * live ones, sweep them out.
+         */
+        void sweep()
+        {
+            if (this->small.size() + this->main.size() <= 2 * this->capacity) return;
+
+            for (auto fifo : {&this->small, &this->main}) {
+                std::deque<slot_t> kept;
+                for (auto &slot : *fifo) {
+                    if (this->live(slot)) kept.push_back(slot);
+                }
+                fifo->swap(kept);
+            }
+        }
+
+
+        void make_room()
+        {
+            while (this->small_cnt + this->main_cnt >= this->capacity) {
+                if (this->small_cnt >= this->small_capacity || this->main_cnt == 0) {
+                    this->evict_small();
+                } else {
+                    this->evict_main();
+                }
+            }
+        }
+
+
+    public:
+        S3FifoCache(size_t capacity)
+        {
+            this->capacity = (capacity) ? capacity : 1;
+            this->small_capacity = this->capacity / 10;
+            if (this->small_capacity == 0) this->small_capacity = 1;
+            this->small_cnt = 0;
+            this->main_cnt = 0;
+            this->next_id = 0;
+        }
+
+
+        bool get(TKey key, TValue *val)
+        {
+            auto entry = this->entries.find(key);
+            if (entry == this->entries.end()) return false;
+
+            if (entry->second.freq < max_freq) entry->second.freq++;
+            *val = entry->second.val;
+            return true;
+        }
+
+
+        /*
+         * Cache val for key, replacing whatever was cached for it before.
+         */
+        void put(TKey key, TValue val)
+        {
+            auto existing = this->entries.find(key);
+            if (existing != this->entries.end()) {
+                existing->second.val = val;
+                return;
+            }
+
+            this->sweep();
+            this->make_room();
+
+            bool to_main = this->ghosts.erase(key);
+            slot_t slot = {key, this->next_id++};
+            this->entries.insert({key, Entry{val, slot.second, 0, to_main}});
+
+            if (to_main) {
+                this->main.push_back(slot);
+                this->main_cnt++;
+            } else {
+                this->small.push_back(slot);
+                this->small_cnt++;
+            }
+        }
+
+
+        /*
+         * Update the value cached for key, if there is one.
+         */
+        void update(TKey key, TValue val)
+        {
+            auto existing = this->entries.find(key);
+            if (existing != this->entries.end()) existing->second.val = val;
+        }
+
+
+        void erase(TKey key)
+        {
+            auto existing = this->entries.find(key);
+            if (existing == this->entries.end()) return;
+
+            if (existing->second.in_main) {
+                this->main_cnt--;
+            } else {
+                this->small_cnt--;
+            }
+            this->entries.erase(existing);
+        }
+
+
+        void clear()
+        {
+            this->entries.clear();
+            this->small.clear();
+            this->main.clear();
+            this->ghost.clear();
+            this->ghosts.clear();
+            this->small_cnt = 0;
+            this->main_cnt = 0;
+        }
+
+
+        size_t size()
+        {
+            return this->entries.size();
+        }
+};
+
+
+template <typename TKey, typename TValue>
+class KeyCache
+{
+    private:
+        struct alignas(CACHELINE) Segment
+        {
+            std::mutex lock;
+            S3FifoCache<TKey, TValue> cache;
+
+            Segment(size_t capacity) : cache(capacity) {}
+        };
+
+        std::vector<Segment *> segments;
+
+        /*
+         * As with shard_of in sharded.hpp, mix the hash so that the segment
+         * doesn't just follow the key's low bits.
+         */
+        Segment *segment_of(TKey key)
+        {
+            std::hash<TKey> hash_key;
+            uint64_t mixed = (uint64_t) hash_key(key) * 0x9E3779B97F4A7C15ull;
+            return this->segments[((unsigned __int128) mixed * this->segments.size()) >> 64];
+        }
+
+    public:
+        /*
+         * A cache of up to capacity keys in all, split evenly over
+         * segment_cnt segments.
+         */
+        KeyCache(size_t capacity, size_t segment_cnt=16)
+        {
+            if (segment_cnt == 0) segment_cnt = 1;
+            if (segment_cnt > capacity && capacity > 0) segment_cnt = capacity;
+
+            size_t per_segment = (capacity + segment_cnt - 1) / segment_cnt;
+            for (size_t i=0; i<segment_cnt; i++) {
+                this->segments.push_back(new Segment(per_segment));
+            }
+        }
+
+
+        bool get(TKey key, TValue *val)
+        {
+            Segment *segment = this->segment_of(key);
+            std::lock_guard<std::mutex> guard(segment->lock);
+            return segment->cache.get(key, val);
+        }
+
+
+        void put(TKey key, TValue val)
+        {
+            Segment *segment = this->segment_of(key);
+            std::lock_guard<std::mutex> guard(segment->lock);
+            segment->cache.put(key, val);
+        }
+
+
+        void update(TKey key, TValue val)
+        {
+            Segment *segment = this->segment_of(key);
+            std::lock_guard<std::mutex> guard(segment->lock);
+            segment->cache.update(key, val);
+        }
+
+
+        void erase(TKey key)
+        {
+            Segment *segment = this->segment_of(key);
+            std::lock_guard<std::mutex> guard(segment->lock);
+            segment->cache.erase(key);
+        }
+
+
+        void clear()
+        {
+            for (auto segment : this->segments) {
+                std::lock_guard<std::mutex> guard(segment->lock);
+                segment->cache.clear();
+            }
+        }
+
+
+        size_t size()
+        {
+            size_t total = 0;
+            for (auto segment : this->segments) {
+                std::lock_guard<std::mutex> guard(segment->lock);
+                total += segment->cache.size();
+            }
+
+            return total;
+        }
+
+
+        ~KeyCache()
+        {
+            for (auto segment : this->segments) {
+                delete segment;
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * changelog.hpp
+ * A bounded, in-memory record of the changes made to a table, in order
+ *
+ * Each change made through a table with a log enabled is appended to it,
+ * under the table's storage_lock, so the log's order is the order the
+ * changes were applied in. Changes are numbered from 1, and each records
+ * the state a key was left in, rather than the call that left it there:
+ * an insert of a key that is already present changes nothing and isn't
+ * logged, and an insert or upsert that does change something is logged as
+ * a PUT of the value the key ended up with. So replaying any run of
+ * changes leaves every key they touch as the last of them says, whatever
+ * state it started from, which is what lets a replica take a snapshot at
+ * some point after the change it starts replaying from.
+ *
+ * Only the newest capacity changes are kept. A reader that falls further
+ * behind than that has lost its place, and has to start again from a
+ * snapshot.
+ *
+ * Every log gets a random generation when it is created, so that a
+ * reader holding a change number from a log that has since gone away (in
+ * a process that restarted, say) can tell that it means nothing here.
+ */
+#ifndef changelog
+#define changelog
+
+#include "kvs.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <vector>
+
+enum class change_t : uint8_t {
+    PUT = 1,
+    REMOVE = 2
+};
+
+template <typename TKey, typename TValue>
+struct Change
+{
+    change_t kind;
+    TKey key;
+
+    // unused for a REMOVE
+    TValue val;
+};
+
+template <typename TKey, typename TValue>
+class ChangeLog
+{
+    private:
+        std::deque<Change<TKey, TValue>> changes;
+        size_t capacity;
+        uint64_t generation;
+
+        // the number of the oldest change still in changes, and the number
+        // the next one appended will get
+        uint64_t first_seq;
+        uint64_t next_seq;
+
+        std::mutex lock;
+        std::condition_variable appended;
+
+    public:
+        ChangeLog(size_t capacity)
+        {
+            this->capacity = (capacity) ? capacity : 1;
+            this->first_seq = 1;
+            this->next_seq = 1;
+
+            std::random_device seed;
+            this->generation = ((uint64_t) seed() << 32) | seed();
+        }
+
+
+        void append(change_t kind, TKey key, TValue val)
+        {
+            {
+                std::lock_guard<std::mutex> guard(this->lock);
+                this->changes.push_back(Change<TKey, TValue>{kind, key, val});
+                this->next_seq++;
+
+                if (this->changes.size() > this->capacity) {
+                    this->changes.pop_front();
+                    this->first_seq++;
+                }
+            }
+
+            this->appended.notify_all();
+        }
+
+
+        /*
+         * Copy up to max changes, starting with change number from, onto
+         * the end of out. If there are none yet, wait up to timeout for
+         * one to be appended. Returns false, without copying anything, if
+         * change from has already been dropped from the log (or is from
+         * the future).
+         */
+        template <typename Rep, typename Period>
+        bool read(uint64_t from, size_t max, std::vector<Change<TKey, TValue>> &out,
+                std::chrono::duration<Rep, Period> timeout)
+        {
+            std::unique_lock<std::mutex> guard(this->lock);
+            if (from < this->first_seq || from > this->next_seq) return false;
+
+            this->appended.wait_for(guard, timeout, [this, from]() {
+                return this->next_seq > from;
+            });
+            if (from < this->first_seq) return false;
+
+            size_t start = from - this->first_seq;
+            size_t end = std::min(this->changes.size(), start + max);
+            out.insert(out.end(), this->changes.begin() + start, this->changes.begin() + end);
+            return true;
+        }
+
+
+        /*
+         * Whether change from could still be read, either because it is in
+         * the log or because it is the next one to be appended.
+         */
+        bool retains(uint64_t from)
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            return from >= this->first_seq && from <= this->next_seq;
+        }
+
+
+        uint64_t get_next_seq()
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            return this->next_seq;
+        }
+
+
+        uint64_t get_generation()
+        {
+            return this->generation;
+        }
+
+
+        size_t get_capacity()
+        {
+            return this->capacity;
+        }
+};
+
+#endif
@@ -0,0 +1,481 @@
+/*
+ * compact.hpp
+ * A hash table for uint64_t keys and values with bit-packed buckets
+ *
+ * HashTable<uint64_t, uint64_t> stores each element as a full 16 bytes, so
+ * only three fit in a cacheline bucket. In most of our uint64 workloads
+ * (counters, IDs) the keys that hash to one bucket are close together, as
+ * are the values, and most of those bytes are the same from one element
+ * to the next. CompactHashTable stores each bucket frame-of-reference
+ * style instead: the smallest key and value in the bucket are kept in
+ * full, and every element is stored as the difference from them, packed
+ * into just as many bits as the largest difference needs.
+ *
+ * A bucket is a single cacheline:
+ *
+ *     [0, 8)    key base
+ *     [8, 16)   value base
+ *     16        element count
+ *     17        key width in bits
+ *     18        value width in bits
+ *     [19, 56)  count key deltas, then count value deltas, bit-packed
+ *     [56, 64)  offset of the next bucket in the chain, or 0
+ *
+ * which fits anywhere from 2 elements (where the deltas need all 64 bits)
+ * up to 18 (16 bits or less for keys and values together), against 3 for
+ * the plain layout.
+ *
+ * Buckets are rewritten whole on every insert or remove, and a lookup
+ * checks whether the key can be in a bucket at all (it must be at least
+ * the base, and its delta must fit the width) before it unpacks anything.
+ * Otherwise it behaves just like HashTable.
+ */
+#ifndef compacttab
+#define compacttab
+
+#include "dstruct/hashtable.hpp"
+#include "io/mem.hpp"
+#include "io/raw.hpp"
+#include "io/buffered.hpp"
+#include "kvs.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+class CompactHashTable
+{
+    private:
+        static constexpr size_t const bucket_bytes = CACHELINE;
+        static constexpr size_t const key_base_at = 0;
+        static constexpr size_t const value_base_at = 8;
+        static constexpr size_t const count_at = 16;
+        static constexpr size_t const key_bits_at = 17;
+        static constexpr size_t const value_bits_at = 18;
+        static constexpr size_t const packed_at = 19;
+        static constexpr size_t const next_at = bucket_bytes - sizeof(off_t);
+        static constexpr size_t const packed_bits = (next_at - packed_at) * 8;
+
+        IOHandler *storage;
+        size_t bucket_cnt;
+        std::mutex storage_lock;
+
+        /*
+         * A bucket decoded into plain arrays, for when it needs rewriting.
+         */
+        struct Unpacked
+        {
+            std::vector<uint64_t> keys;
+            std::vector<uint64_t> values;
+        };
+
+        static uint64_t inline width_mask(unsigned width)
+        {
+            return (width >= 64) ? ~(uint64_t) 0 : ((uint64_t) 1 << width) - 1;
+        }
+
+        static unsigned inline bits_needed(uint64_t val)
+        {
+            return (val) ? 64 - __builtin_clzll(val) : 0;
+        }
+
+        /*
+         * Pull width bits out of the packed area, starting from bit pos.
+         * An 8 byte load covers any field of up to 57 bits; wider ones need
+         * one more byte. Every load stays inside the bucket, as the packed
+         * area is followed by the next pointer.
+         */
+        static uint64_t inline get_bits(const byte *packed, size_t pos, unsigned width)
+        {
+            if (width == 0) return 0;
+
+            size_t at = pos / 8;
+            unsigned shift = pos % 8;
+            uint64_t word;
+            memcpy(&word, packed + at, sizeof(word));
+
+            uint64_t val = word >> shift;
+            if (shift + width > 64) {
+                val |= (uint64_t) packed[at + 8] << (64 - shift);
+            }
+
+            return val & width_mask(width);
+        }
+
+        static void inline put_bits(byte *packed, size_t pos, unsigned width, uint64_t val)
+        {
+            if (width == 0) return;
+
+            size_t at = pos / 8;
+            unsigned shift = pos % 8;
+            uint64_t word;
+            memcpy(&word, packed + at, sizeof(word));
+
+            word &= ~(width_mask(width) << shift);
+            word |= (val & width_mask(width)) << shift;
+            memcpy(packed + at, &word, sizeof(word));
+
+            if (shift + width > 64) {
+                unsigned spill = shift + width - 64;
+                packed[at + 8] &= ~(byte) width_mask(spill);
+                packed[at + 8] |= (byte) ((val >> (64 - shift)) & width_mask(spill));
+            }
+        }
+
+        static size_t inline hash_bucket(uint64_t key, size_t bucket_cnt)
+        {
+            std::hash<uint64_t> hash_key;
+            return hash_key(key) % bucket_cnt;
+        }
+
+        static off_t inline bucket_offset(size_t bucket_no)
+        {
+            return (off_t) bucket_no * bucket_bytes;
+        }
+
+        static size_t inline count(const byte *bucket)
+        {
+            return bucket[count_at];
+        }
+
+        static off_t inline next_bucket(const byte *bucket)
+        {
+            off_t next;
+            memcpy(&next, bucket + next_at, sizeof(next));
+            return next;
+        }
+
+        /*
+         * Find key in bucket, returning its slot, or -1 if it isn't there.
+         */
+        static int find(const byte *bucket, uint64_t key)
+        {
+            size_t cnt = count(bucket);
+            if (cnt == 0) return -1;
+
+            uint64_t key_base;
+            memcpy(&key_base, bucket + key_base_at, sizeof(key_base));
+            unsigned key_bits = bucket[key_bits_at];
+
+            if (key < key_base) return -1;
+            uint64_t delta = key - key_base;
+            if (delta & ~width_mask(key_bits)) return -1;
+
+            const byte *packed = bucket + packed_at;
+            for (size_t i=0; i<cnt; i++) {
+                if (get_bits(packed, i * key_bits, key_bits) == delta) return i;
+            }
+
+            return -1;
+        }
+
+        static uint64_t value_at(const byte *bucket, size_t slot)
+        {
+            uint64_t value_base;
+            memcpy(&value_base, bucket + value_base_at, sizeof(value_base));
+            unsigned key_bits = bucket[key_bits_at];
+            unsigned value_bits = bucket[value_bits_at];
+            size_t values_at = count(bucket) * key_bits;
+
+            return value_base + get_bits(bucket + packed_at,
+                    values_at + slot * value_bits, value_bits);
+        }
+
+        static void unpack(const byte *bucket, Unpacked *out)
+        {
+            size_t cnt = count(bucket);
+            uint64_t key_base, value_base;
+            memcpy(&key_base, bucket + key_base_at, sizeof(key_base));
+            memcpy(&value_base, bucket + value_base_at, sizeof(value_base));
+            unsigned key_bits = bucket[key_bits_at];
+            unsigned value_bits = bucket[value_bits_at];
+            const byte *packed = bucket + packed_at;
+
+            out->keys.resize(cnt);
+            out->values.resize(cnt);
+            for (size_t i=0; i<cnt; i++) {
+                out->keys[i] = key_base + get_bits(packed, i * key_bits, key_bits);
+                out->values[i] = value_base + get_bits(packed,
+                        cnt * key_bits + i * value_bits, value_bits);
+            }
+        }
+
+        /*
+         * Work out the widths needed to pack elements, and return false if
+         * they won't fit in one bucket.
+         */
+        static bool layout(const Unpacked &elements, uint64_t *key_base,
+                uint64_t *value_base, unsigned *key_bits, unsigned *value_bits)
+        {
+            *key_base = 0;
+            *value_base = 0;
+            *key_bits = 0;
+            *value_bits = 0;
+
+            size_t cnt = elements.keys.size();
+            if (cnt > 255) return false;
+            if (cnt == 0) return true;
+
+            auto keys = std::minmax_element(elements.keys.begin(), elements.keys.end());
+            auto values = std::minmax_element(elements.values.begin(), elements.values.end());
+
+            *key_base = *keys.first;
+            *value_base = *values.first;
+            *key_bits = bits_needed(*keys.second - *keys.first);
+            *value_bits = bits_needed(*values.second - *values.first);
+
+            return cnt * (*key_bits + *value_bits) <= packed_bits;
+        }
+
+        /*
+         * Rewrite bucket to hold elements, keeping its next pointer. The
+         * elements must fit, as checked by layout.
+         */
+        static void pack(byte *bucket, const Unpacked &elements)
+        {
+            uint64_t key_base, value_base;
+            unsigned key_bits, value_bits;
+            layout(elements, &key_base, &value_base, &key_bits, &value_bits);
+
+            size_t cnt = elements.keys.size();
+            memset(bucket, 0, next_at);
+            memcpy(bucket + key_base_at, &key_base, sizeof(key_base));
+            memcpy(bucket + value_base_at, &value_base, sizeof(value_base));
+            bucket[count_at] = (byte) cnt;
+            bucket[key_bits_at] = (byte) key_bits;
+            bucket[value_bits_at] = (byte) value_bits;
+
+            byte *packed = bucket + packed_at;
+            for (size_t i=0; i<cnt; i++) {
+                put_bits(packed, i * key_bits, key_bits, elements.keys[i] - key_base);
+                put_bits(packed, cnt * key_bits + i * value_bits, value_bits,
+                        elements.values[i] - value_base);
+            }
+        }
+
+        void init(size_t bucket_cnt)
+        {
+            this->bucket_cnt = bucket_cnt;
+            if (this->storage->get_flen() < bucket_offset(bucket_cnt)) {
+                byte x = 0;
+                this->storage->write(&x, 1, bucket_offset(bucket_cnt) - 1);
+            }
+        }
+
+    public:
+        CompactHashTable(size_t bucket_cnt)
+        {
+            this->storage = new MemIOHandler(128);
+            this->init(bucket_cnt);
+        }
+
+
+        CompactHashTable(const char *fname, size_t bucket_cnt)
+        {
+            this->storage = new BufferedIOHandler(new RawIOHandler(fname), 0);
+            this->init(bucket_cnt);
+        }
+
+
+        /*
+         * Build a table on top of storage, which the table takes ownership
+         * of.
+         */
+        CompactHashTable(IOHandler *storage, size_t bucket_cnt)
+        {
+            this->storage = storage;
+            this->init(bucket_cnt);
+        }
+
+
+        uint64_t insert(uint64_t key, uint64_t val)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            STAT_INC(TABLE_INSERT);
+            off_t offset = bucket_offset(hash_bucket(key, this->bucket_cnt));
+            byte bucket[bucket_bytes];
+            Unpacked elements;
+
+            // First make sure the key isn't already there, remembering the
+            // last link of the chain in case we need to extend it.
+            off_t last = offset;
+            while (true) {
+                this->storage->read(bucket, bucket_bytes, offset);
+                int slot = find(bucket, key);
+                if (slot != -1) return value_at(bucket, slot);
+
+                last = offset;
+                offset = next_bucket(bucket);
+                if (offset == 0) break;
+            }
+
+            // Then add it to the first bucket it will fit in.
+            offset = bucket_offset(hash_bucket(key, this->bucket_cnt));
+            while (true) {
+                this->storage->read(bucket, bucket_bytes, offset);
+                unpack(bucket, &elements);
+                elements.keys.push_back(key);
+                elements.values.push_back(val);
+
+                uint64_t key_base, value_base;
+                unsigned key_bits, value_bits;
+                if (layout(elements, &key_base, &value_base, &key_bits, &value_bits)) {
+                    pack(bucket, elements);
+                    this->storage->write(bucket, next_at, offset);
+                    return val;
+                }
+
+                offset = next_bucket(bucket);
+                if (offset == 0) break;
+            }
+
+            // Nothing had room, so start a new link at the end of the file.
+            elements.keys.assign(1, key);
+            elements.values.assign(1, val);
+            memset(bucket, 0, bucket_bytes);
+            pack(bucket, elements);
+
+            off_t write_offset = this->storage->get_flen();
+            this->storage->write(bucket, bucket_bytes, write_offset);
+            this->storage->write((byte *) &write_offset, sizeof(off_t), last + next_at);
+
+            return val;
+        }
+
+
+        uint64_t get(uint64_t key)
+        {
+            uint64_t val;
+            if (!this->try_get(key, &val)) throw KeyNotFoundException();
+
+            return val;
+        }
+
+
+        /*
+         * As HashTable::try_get, a get that reports a miss by returning
+         * false.
+         */
+        bool try_get(uint64_t key, uint64_t *val)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            STAT_INC(TABLE_GET);
+            off_t offset = bucket_offset(hash_bucket(key, this->bucket_cnt));
+            byte bucket[bucket_bytes];
+
+            while (true) {
+                this->storage->read(bucket, bucket_bytes, offset);
+                int slot = find(bucket, key);
+                if (slot != -1) {
+                    STAT_INC(TABLE_HIT);
+                    *val = value_at(bucket, slot);
+                    return true;
+                }
+                offset = next_bucket(bucket);
+                if (offset == 0) break;
+            }
+
+            STAT_INC(TABLE_MISS);
+            return false;
+        }
+
+
+        bool contains(uint64_t key)
+        {
+            uint64_t val;
+            return this->try_get(key, &val);
+        }
+
+
+        void remove(uint64_t key)
+        {
+            if (!this->try_remove(key)) throw KeyNotFoundException();
+        }
+
+
+        bool try_remove(uint64_t key)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            STAT_INC(TABLE_REMOVE);
+            off_t offset = bucket_offset(hash_bucket(key, this->bucket_cnt));
+            byte bucket[bucket_bytes];
+            Unpacked elements;
+
+            while (true) {
+                this->storage->read(bucket, bucket_bytes, offset);
+                int slot = find(bucket, key);
+                if (slot != -1) {
+                    // Removing an element never makes the rest need more
+                    // room, so the bucket can always be repacked in place.
+                    unpack(bucket, &elements);
+                    elements.keys.erase(elements.keys.begin() + slot);
+                    elements.values.erase(elements.values.begin() + slot);
+                    pack(bucket, elements);
+                    this->storage->write(bucket, next_at, offset);
+                    return true;
+                }
+                offset = next_bucket(bucket);
+                if (offset == 0) break;
+            }
+
+            return false;
+        }
+
+
+        /*
+         * Call fn(key, value) for every element in the table. The table is
+         * locked for the duration.
+         */
+        template <typename F>
+        void for_each(F fn)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            byte bucket[bucket_bytes];
+            Unpacked elements;
+
+            for (size_t i=0; i<this->bucket_cnt; i++) {
+                off_t offset = bucket_offset(i);
+                while (true) {
+                    this->storage->read(bucket, bucket_bytes, offset);
+                    unpack(bucket, &elements);
+                    for (size_t j=0; j<elements.keys.size(); j++) {
+                        fn(elements.keys[j], elements.values[j]);
+                    }
+                    offset = next_bucket(bucket);
+                    if (offset == 0) break;
+                }
+            }
+        }
+
+
+        /*
+         * How many elements a bucket can hold when its key and value deltas
+         * need key_bits and value_bits bits.
+         */
+        static size_t capacity(unsigned key_bits, unsigned value_bits)
+        {
+            size_t per_element = key_bits + value_bits;
+            return std::min((size_t) 255, (per_element) ? packed_bits / per_element : 255);
+        }
+
+
+        size_t get_bucket_count()
+        {
+            return this->bucket_cnt;
+        }
+
+
+        IOHandler *get_io_handler()
+        {
+            return this->storage;
+        }
+
+
+        ~CompactHashTable()
+        {
+            delete this->storage;
+        }
+};
+
+#endif
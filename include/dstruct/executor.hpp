@@ -0,0 +1,332 @@
+/*
+ * executor.hpp
+ * A shared-nothing execution mode for sharded tables
+ *
+ * ShardExecutor hands each shard of a ShardedHashTable to exactly one
+ * worker thread, which is the only thread that ever touches that shard's
+ * buckets, buffer pool or file. Everyone else submits requests to the
+ * owning worker through its ring and gets a future back. As each shard's
+ * data (and its lock) is only ever used from one core, none of it bounces
+ * between caches, however many threads are submitting.
+ */
+#ifndef shardexec
+#define shardexec
+
+#include "dstruct/sharded.hpp"
+#include "util/affinity.hpp"
+#include "util/parallel.hpp"
+#include "util/ring.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum class request_t {
+    GET,
+    INSERT,
+    REMOVE,
+    TASK
+};
+
+template <typename TKey, typename TValue>
+class ShardExecutor
+{
+    private:
+        typedef HashTable<TKey, TValue> table_t;
+
+        /*
+         * A single request, as it sits in a worker's ring. Exactly one of
+         * result and done is set, depending on whether the request produces
+         * a value.
+         */
+        struct Request
+        {
+            request_t type;
+            size_t shard;
+            TKey key;
+            TValue val;
+            std::promise<TValue> *result;
+            std::promise<void> *done;
+            std::function<void(table_t *)> *task;
+        };
+
+        struct Worker
+        {
+            Ring<Request> *ring;
+            std::thread thread;
+
+            /*
+             * An idle worker spins for a while and then goes to sleep here.
+             * Submitters only touch the lock if they see sleeping set, so
+             * it stays off the fast path.
+             */
+            std::mutex sleep_lock;
+            std::condition_variable wakeup;
+            std::atomic<bool> sleeping;
+        };
+
+        /*
+         * Number of requests each worker's ring can hold. Submitters wait
+         * for room when it is full.
+         */
+        static constexpr size_t const ring_capacity = 1024;
+
+        /*
+         * Number of polls of an empty ring before a worker goes to sleep.
+         */
+        static constexpr size_t const idle_spins = 1000;
+
+        ShardedHashTable<TKey, TValue> *table;
+        std::vector<Worker *> workers;
+        std::atomic<bool> stopping;
+
+
+        Worker *owner(size_t shard)
+        {
+            return this->workers[shard % this->workers.size()];
+        }
+
+
+        void submit(Request &request)
+        {
+            Worker *worker = this->owner(request.shard);
+            while (!worker->ring->push(request)) {
+                std::this_thread::yield();
+            }
+
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (worker->sleeping.load()) {
+                std::lock_guard<std::mutex> guard(worker->sleep_lock);
+                worker->wakeup.notify_one();
+            }
+        }
+
+
+        void perform(Request &request)
+        {
+            table_t *shard = this->table->get_shard(request.shard);
+
+            try {
+                switch (request.type) {
+                    case request_t::GET:
+                        request.result->set_value(shard->get(request.key));
+                        break;
+                    case request_t::INSERT:
+                        request.result->set_value(shard->insert(request.key, request.val));
+                        break;
+                    case request_t::REMOVE:
+                        shard->remove(request.key);
+                        request.done->set_value();
+                        break;
+                    case request_t::TASK:
+                        (*request.task)(shard);
+                        request.done->set_value();
+                        break;
+                }
+            } catch (...) {
+                if (request.result) {
+                    request.result->set_exception(std::current_exception());
+                } else {
+                    request.done->set_exception(std::current_exception());
+                }
+            }
+
+            delete request.result;
+            delete request.done;
+            delete request.task;
+        }
+
+
+        /*
+         * A worker runs requests as they arrive until it is told to stop,
+         * and then finishes off anything still in its ring before exiting.
+         */
+        void run(Worker *worker, int cpu)
+        {
+            if (cpu >= 0) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                pin_thread(&set);
+            }
+
+            Request request;
+            size_t idle = 0;
+
+            while (true) {
+                if (worker->ring->pop(&request)) {
+                    this->perform(request);
+                    idle = 0;
+                    continue;
+                }
+
+                if (this->stopping.load()) return;
+
+                if (++idle < idle_spins) {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                // The timeout is only a backstop; submitters wake us up
+                // whenever they see we're asleep.
+                std::unique_lock<std::mutex> guard(worker->sleep_lock);
+                worker->sleeping.store(true);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (worker->ring->empty() && !this->stopping.load()) {
+                    worker->wakeup.wait_for(guard, std::chrono::milliseconds(1));
+                }
+                worker->sleeping.store(false);
+                idle = 0;
+            }
+        }
+
+
+        Request make_request(request_t type, size_t shard, TKey key, TValue val)
+        {
+            Request request;
+            request.type = type;
+            request.shard = shard;
+            request.key = key;
+            request.val = val;
+            request.result = nullptr;
+            request.done = nullptr;
+            request.task = nullptr;
+            return request;
+        }
+
+
+    public:
+        /*
+         * Start worker_cnt workers over table, which the executor takes
+         * ownership of. Shard s belongs to worker s % worker_cnt, and
+         * worker_cnt is capped at the number of shards. If pin is set, each
+         * worker is pinned to its own core. The table must not be used
+         * directly while the executor is running.
+         */
+        ShardExecutor(ShardedHashTable<TKey, TValue> *table, size_t worker_cnt=0,
+                bool pin=false)
+        {
+            this->table = table;
+            this->stopping.store(false);
+
+            size_t shard_cnt = table->get_shard_count();
+            if (worker_cnt == 0) worker_cnt = default_thread_count();
+            if (worker_cnt > shard_cnt) worker_cnt = shard_cnt;
+
+            size_t cpu_cnt = default_thread_count();
+            for (size_t i=0; i<worker_cnt; i++) {
+                Worker *worker = new Worker();
+                worker->ring = new Ring<Request>(ring_capacity);
+                worker->sleeping.store(false);
+                this->workers.push_back(worker);
+            }
+
+            for (size_t i=0; i<worker_cnt; i++) {
+                int cpu = (pin) ? (int) (i % cpu_cnt) : -1;
+                this->workers[i]->thread = std::thread(&ShardExecutor::run, this,
+                        this->workers[i], cpu);
+            }
+        }
+
+
+        std::future<TValue> get(TKey key)
+        {
+            Request request = this->make_request(request_t::GET,
+                    this->table->shard(key), key, TValue());
+            request.result = new std::promise<TValue>();
+            std::future<TValue> future = request.result->get_future();
+
+            this->submit(request);
+            return future;
+        }
+
+
+        std::future<TValue> insert(TKey key, TValue val)
+        {
+            Request request = this->make_request(request_t::INSERT,
+                    this->table->shard(key), key, val);
+            request.result = new std::promise<TValue>();
+            std::future<TValue> future = request.result->get_future();
+
+            this->submit(request);
+            return future;
+        }
+
+
+        std::future<void> remove(TKey key)
+        {
+            Request request = this->make_request(request_t::REMOVE,
+                    this->table->shard(key), key, TValue());
+            request.done = new std::promise<void>();
+            std::future<void> future = request.done->get_future();
+
+            this->submit(request);
+            return future;
+        }
+
+
+        /*
+         * Run fn(table) on the worker that owns shard, where table is the
+         * shard's HashTable. This is the way to run a batch of operations
+         * against a shard in one go, without a round trip through the ring
+         * for each of them.
+         */
+        template <typename F>
+        std::future<void> execute(size_t shard, F fn)
+        {
+            // check the shard number here, rather than on the worker
+            this->table->get_shard(shard);
+
+            Request request = this->make_request(request_t::TASK, shard, TKey(), TValue());
+            request.task = new std::function<void(table_t *)>(fn);
+            request.done = new std::promise<void>();
+            std::future<void> future = request.done->get_future();
+
+            this->submit(request);
+            return future;
+        }
+
+
+        size_t shard(TKey key)
+        {
+            return this->table->shard(key);
+        }
+
+
+        size_t get_worker_count()
+        {
+            return this->workers.size();
+        }
+
+
+        /*
+         * Requests already submitted are carried out before the workers
+         * exit. Submitting new ones once destruction has begun isn't
+         * allowed.
+         */
+        ~ShardExecutor()
+        {
+            this->stopping.store(true);
+            for (auto worker : this->workers) {
+                {
+                    std::lock_guard<std::mutex> guard(worker->sleep_lock);
+                    worker->wakeup.notify_one();
+                }
+                worker->thread.join();
+            }
+
+            for (auto worker : this->workers) {
+                delete worker->ring;
+                delete worker;
+            }
+
+            delete this->table;
+        }
+};
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * expiring.hpp
+ * Values that carry their own expiry time
+ *
+ * A table whose entries should time out stores Expiring<TValue> as its
+ * value type, as in HashTable<uint64_t, Expiring<uint64_t>>, which puts the
+ * expiry time in the slot right after the value. HashTable checks it with
+ * expiry_traits: an element past its expiry time is absent as far as
+ * lookups, removes and scans are concerned, its slot is reused by inserts
+ * just like an empty one, and a sweeper can reclaim it in the background
+ * (see HashTable::sweep). For any other value type the checks compile away
+ * to nothing.
+ *
+ * Expiry times are milliseconds since the Unix epoch, by the system clock,
+ * so that they mean the same thing to every process that opens the file,
+ * and 0 is never.
+ */
+#ifndef expiring
+#define expiring
+
+#include <chrono>
+#include <cstdint>
+
+/*
+ * The current time, as an expiry time.
+ */
+inline uint64_t expiry_now()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+template <typename TValue>
+struct Expiring
+{
+    TValue value;
+    uint64_t expires;
+
+    /*
+     * val, expiring ttl from now. The struct is zeroed first, so that any
+     * padding in it doesn't land in the table as garbage.
+     */
+    static Expiring after(TValue val, std::chrono::milliseconds ttl)
+    {
+        Expiring result = Expiring();
+        result.value = val;
+        result.expires = expiry_now() + ttl.count();
+        return result;
+    }
+
+    static Expiring never(TValue val)
+    {
+        Expiring result = Expiring();
+        result.value = val;
+        return result;
+    }
+
+    bool expired(uint64_t now) const
+    {
+        return this->expires != 0 && this->expires <= now;
+    }
+};
+
+
+/*
+ * Whether, and when, a table's values expire. Only Expiring values ever do.
+ */
+template <typename TValue>
+struct expiry_traits
+{
+    static constexpr bool const enabled = false;
+    static bool expired(const TValue &, uint64_t) { return false; }
+};
+
+template <typename TValue>
+struct expiry_traits<Expiring<TValue>>
+{
+    static constexpr bool const enabled = true;
+    static bool expired(const Expiring<TValue> &val, uint64_t now) { return val.expired(now); }
+};
+
+#endif
@@ -1,16 +1,44 @@
 /*
  *
  */
+#ifndef hashtab
+#define hashtab
 
 #include "io/mem.hpp"
 #include "io/raw.hpp"
 #include "io/buffered.hpp"
+#include "io/mapped.hpp"
+#include "io/epoch.hpp"
+#include "io/exceptions.hpp"
+#include "dstruct/bloom.hpp"
+#include "dstruct/cache.hpp"
+#include "dstruct/changelog.hpp"
+#include "dstruct/expiring.hpp"
+#include "util/parallel.hpp"
+#include "util/stats.hpp"
 #include "kvs.hpp"
+#ifdef __cpp_impl_coroutine
+#include "io/async.hpp"
+#endif
 #include <memory>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <stdexcept>
+#include <unistd.h>
+#include <iterator>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 class KeyNotFoundException: public std::runtime_error
 {
@@ -18,6 +46,78 @@ class KeyNotFoundException: public std::runtime_error
         KeyNotFoundException() : runtime_error("Requested Key not found in Table") {}
 };
 
+class ReadOnlyException: public std::runtime_error
+{
+    public:
+        ReadOnlyException() : runtime_error("Attempted to modify a read only Table") {}
+};
+
+enum class open_t {
+    READ_WRITE,
+    READ_ONLY
+};
+
+
+/*
+ * The results of HashTable::analyze, a health report on the structure of a
+ * table's file.
+ */
+struct TableAnalysis
+{
+    size_t primary_buckets;
+    size_t overflow_buckets;
+
+    // reachable overflow buckets without a single live element in them
+    size_t empty_overflow_buckets;
+
+    // bucket sized, non-zero regions of the file past the primary buckets
+    // that no chain leads to; the remains of an interrupted insert
+    size_t orphaned_buckets;
+
+    size_t elements;
+    size_t slots;
+
+    // empty slots that must once have held an element: any in a link that
+    // isn't the last in its chain, or that precede a live element in the
+    // last one, as inserts always fill the first free slot (elements that
+    // have expired count as empty throughout)
+    size_t dead_slots;
+
+    // elements / slots, over every reachable bucket
+    double load_factor;
+
+    // chain_lengths[n] is the number of primary buckets with a chain n links
+    // long (counting the primary bucket itself)
+    std::vector<size_t> chain_lengths;
+    size_t max_chain_length;
+    double mean_chain_length;
+
+    // the bucket count that would hold the current elements at the target
+    // fill without any overflow, on average
+    size_t recommended_bucket_cnt;
+
+    void print(FILE *out)
+    {
+        fprintf(out, "primary buckets:        %zu\n", this->primary_buckets);
+        fprintf(out, "overflow buckets:       %zu\n", this->overflow_buckets);
+        fprintf(out, "empty overflow buckets: %zu\n", this->empty_overflow_buckets);
+        fprintf(out, "orphaned buckets:       %zu\n", this->orphaned_buckets);
+        fprintf(out, "elements:               %zu\n", this->elements);
+        fprintf(out, "slots:                  %zu\n", this->slots);
+        fprintf(out, "dead slots:             %zu\n", this->dead_slots);
+        fprintf(out, "load factor:            %.3f\n", this->load_factor);
+        fprintf(out, "mean chain length:      %.3f\n", this->mean_chain_length);
+        fprintf(out, "max chain length:       %zu\n", this->max_chain_length);
+        fprintf(out, "recommended bucket cnt: %zu\n", this->recommended_bucket_cnt);
+        fprintf(out, "chain length histogram:\n");
+        for (size_t i=1; i<this->chain_lengths.size(); i++) {
+            if (this->chain_lengths[i]) {
+                fprintf(out, "    %6zu: %zu\n", i, this->chain_lengths[i]);
+            }
+        }
+    }
+};
+
 template <typename TKey, typename TValue>
 class HashTable
 {
@@ -54,11 +154,154 @@ class HashTable
         static constexpr size_t const elements_per_bucket =
                                              REDUCED_CACHELINE / element_sz;
 
+        /*
+         * Number of consecutive primary buckets read by a single I/O during a
+         * parallel scan.
+         */
+        static constexpr size_t const scan_block_buckets = 256;
+
+        /*
+         * Number of bucket images the bulk loader will accumulate in memory
+         * before writing them out in a single I/O.
+         */
+        static constexpr size_t const load_block_buckets = 4096;
+
+        /*
+         * Number of bytes copied out of storage per I/O when taking a
+         * snapshot. storage_lock is released between blocks.
+         */
+        static constexpr size_t const snapshot_block_bytes = 1 << 16;
+
+        /*
+         * The fraction of slots analyze aims to have filled when it
+         * recommends a bucket count.
+         */
+        static constexpr double const target_fill = 0.75;
+
 
         //std::unique_ptr<IOHandler> storage;
         IOHandler *storage;
         size_t bucket_cnt;
 
+        /*
+         * None of the IOHandlers are safe to share between threads (even a
+         * read can fault a page into the buffer pool), so every access to
+         * storage goes through this lock. Public operations take it for their
+         * whole duration; scans take it once per I/O so that they can run
+         * alongside point operations.
+         */
+        std::mutex storage_lock;
+
+        /*
+         * Only one snapshot can be in progress at a time.
+         */
+        std::mutex snapshot_lock;
+
+        bool read_only;
+        std::string fname;
+        Epoch *epoch;
+
+        /*
+         * The optional Bloom filter over every key in the table, checked
+         * before storage is touched so that most misses never reach it. It
+         * is saved to fname.bloom on publish and close. The first insert
+         * after that deletes the file again, as it no longer covers every
+         * key, and filter_saved says whether there may be a file to delete.
+         * So a table modified without its filter, or that crashed before
+         * saving it, never leaves a stale filter behind.
+         */
+        BloomFilter *filter;
+        bool filter_saved;
+
+        /*
+         * The optional cache of hot keys. It is filled on lookups and kept
+         * up to date by updates and removes, all under storage_lock, so a
+         * lookup that hits it doesn't need to take storage_lock at all.
+         */
+        KeyCache<TKey, TValue> *cache;
+
+        /*
+         * The optional log of changes made to the table, for replication
+         * (see changelog.hpp). Appended to under storage_lock.
+         */
+        ChangeLog<TKey, TValue> *log;
+
+        /*
+         * The overflow links of each chain that has any, by primary bucket,
+         * as far as lookups and inserts have walked them. Walking a chain
+         * costs a dependent read per link, so once a chain's layout is
+         * known, a walk starts by asking storage to prefetch every link at
+         * once, and then finds them already on their way in. An entry can
+         * go stale when a link is unhooked or relinked elsewhere, which only
+         * costs a wasted prefetch until the next walk corrects it. Guarded
+         * by storage_lock.
+         */
+        std::unordered_map<size_t, std::vector<off_t>> chains;
+
+        /*
+         * The background sweeper (see start_sweeper), and the primary
+         * bucket the next sweep starts from, which is guarded by
+         * storage_lock.
+         */
+        std::thread sweeper;
+        std::mutex sweeper_lock;
+        std::condition_variable sweeper_wake;
+        bool sweeper_stopping;
+        size_t sweep_cursor;
+
+        /*
+         * The version of each chain, by primary bucket, for validating
+         * transactions (see Transaction). A chain's version is bumped
+         * whenever an element in it is changed. They are only kept once a
+         * transaction has begun, and are guarded by storage_lock.
+         */
+        std::vector<uint64_t> versions;
+
+        /*
+         * The write-ahead log of the commit in progress, for a table stored
+         * in a file. Opened by the first commit with anything to write.
+         */
+        RawIOHandler *txn_log;
+
+        /*
+         * A write buffered by a transaction until it commits.
+         */
+        struct TxnWrite
+        {
+            change_t kind;
+            TValue val;
+        };
+        typedef std::unordered_map<size_t, uint64_t> TxnReads;
+        typedef std::unordered_map<TKey, TxnWrite> TxnWrites;
+
+        /*
+         * The state of key (its value, or that it was absent) from before
+         * it was first changed in epoch, kept for read views (see
+         * ReadView) pinned before then.
+         */
+        struct BeforeImage
+        {
+            TKey key;
+            uint64_t epoch;
+            bool present;
+            TValue val;
+        };
+
+        /*
+         * The version store. Every pin of a read view starts a new epoch,
+         * which the writes that follow it belong to, and while any view is
+         * pinned, an element's state is copied into before_images, by
+         * primary bucket, the first time it changes in an epoch. Each
+         * bucket's images, like image_order, which lists them all, are in
+         * epoch order, and once no view pinned before an image's epoch
+         * remains, the image is reclaimed from the front. Guarded by
+         * storage_lock.
+         */
+        uint64_t write_epoch;
+        std::multiset<uint64_t> pins;
+        std::unordered_map<size_t, std::vector<BeforeImage>> before_images;
+        std::deque<std::pair<uint64_t, size_t>> image_order;
+
         /*
          * Use std::hash to calculate the hash of the key, then force it into
          * range of the bucket count. I'll play around with replacing the %
@@ -75,7 +318,15 @@ class HashTable
          */
 
 
-        off_t inline bucket_offset(size_t bucket_no)
+        static size_t inline hash_bucket(TKey key, size_t bucket_cnt)
+        {
+            std::hash<TKey> hash_key;
+            size_t val = hash_key(key);
+            return val % bucket_cnt;
+        }
+
+
+        static off_t inline bucket_offset(size_t bucket_no)
         {
             return (off_t) bucket_no * bucket_bytes;
         }
@@ -131,185 +382,2345 @@ class HashTable
         }
 
 
-        void inline prepare_element(byte *element, TKey key, TValue val)
+        /*
+         * The time to check expiry against, or 0 for a table whose values
+         * don't expire, so that it never reads the clock.
+         */
+        static uint64_t inline expiry_clock()
         {
-            memcpy(element, &key, sizeof(TKey));
-            memcpy(element + sizeof(key), &val, sizeof(val));
+            return (expiry_traits<TValue>::enabled) ? expiry_now() : 0;
         }
 
 
-    public:
-        HashTable(size_t bucket_cnt)
+        /*
+         * True if the element at element_offset has passed its expiry time
+         * as of now. Always false unless TValue is Expiring.
+         */
+        bool inline is_expired(off_t element_offset, byte *bucket, uint64_t now)
         {
-            this->storage = new MemIOHandler(128);
-            byte x = 0;
-            storage->write(&x, 1, bucket_cnt * bucket_bytes - 1);
-            this->bucket_cnt = bucket_cnt;
+            if (!expiry_traits<TValue>::enabled) return false;
+
+            TValue val;
+            memcpy(&val, bucket + value_offset(element_offset), sizeof(TValue));
+            return expiry_traits<TValue>::expired(val, now);
         }
 
 
-        HashTable(const char *fname, size_t bucket_cnt)
+        bool inline is_live(off_t element_offset, byte *bucket, uint64_t now)
         {
-            this->storage = new BufferedIOHandler(new RawIOHandler(fname), 10);
-            byte x = 0;
-            storage->write(&x, 1, bucket_cnt * bucket_bytes - 1);
-            this->bucket_cnt = bucket_cnt;
+            return !is_empty(element_offset, bucket) && !is_expired(element_offset, bucket, now);
         }
 
 
-        TValue insert(TKey key, TValue val)
+        static void inline prepare_element(byte *element, TKey key, TValue val)
         {
-            off_t offset = get_bucket(key);
-            off_t insert_offset = -1;
-            off_t insert_bucket = offset;
+            memcpy(element, &key, sizeof(TKey));
+            memcpy(element + sizeof(key), &val, sizeof(val));
+        }
 
-            bool more_chain = true;
-            byte bucket[bucket_bytes] = {0};
 
-            while (more_chain) {
-                this->storage->read(bucket, bucket_bytes, offset);
-                for (size_t i=0; i<bucket_data_bytes; i+=element_sz) {
-                    int result = memcmp(&key, bucket + key_offset(i), sizeof(TKey));
-                    if (result == 0) {
-                        // the key is already present in table
-                        TValue retval;
-                        memcpy(&retval, bucket + value_offset(i), sizeof(TValue));
-                        return retval;
-                    } else if (result > 0 && insert_offset == -1 && is_empty(i, bucket)) {
-                        // As we're iterating over the chain, we may as well
-                        // locate the first empty spot where we *could* stick
-                        // the element, if we end up needing to insert it. By
-                        // sticking it in the first available spot, rather than
-                        // at the end, we can easily fill in holes left by
-                        // deletions.
-                        insert_offset = i;
-                        insert_bucket = offset;
-                    }
-                }
+        off_t inline next_bucket(byte *bucket)
+        {
+            return *((off_t *) (bucket + bucket_data_bytes));
+        }
 
-                off_t *next_offset = (off_t *) (bucket + bucket_data_bytes);
-                if (*next_offset == 0) {
-                    more_chain = false;
-                } else {
-                    offset = *next_offset;
-                }
-            }
 
-            // The key isn't in the table, so we need to write it.
-            byte element[element_sz];
-            prepare_element(element, key, val);
+        void inline read_element(byte *bucket, size_t slot, TKey *key, TValue *val)
+        {
+            off_t element_offset = slot * element_sz;
+            memcpy(key, bucket + key_offset(element_offset), sizeof(TKey));
+            memcpy(val, bucket + value_offset(element_offset), sizeof(TValue));
+        }
 
-            if (insert_offset != -1) {
-                // the key doesn't exist, and a valid insertion spot was found
-                off_t write_offset = insert_bucket + insert_offset;
-                this->storage->write(element, element_sz, write_offset);
-            } else {
-                // the key doesn't exist, and we need to add a new link to the
-                // chain to write it.
-                off_t write_offset = this->storage->get_flen();
-                this->storage->write(element, element_sz, write_offset);
-                byte x = 0;
 
-                // Ensuring that the length of the memory region is an even
-                // multiple of bucket_bytes. Talk about fighting with the
-                // limitations of an API...
-                this->storage->write(&x, 1, write_offset + this->bucket_bytes);
+        static uint64_t inline filter_hash(TKey key)
+        {
+            std::hash<TKey> hash_key;
+            return hash_key(key);
+        }
 
-                // update the offset in the previous chain link
-                this->storage->write((byte *) &write_offset, sizeof(off_t),
-                        offset + bucket_data_bytes);
-            }
 
-            return val;
+        /*
+         * True if the filter rules key out, in which case there is no need
+         * to look for it in storage.
+         */
+        bool inline filtered(TKey key)
+        {
+            if (!this->filter || this->filter->may_contain(filter_hash(key))) return false;
+
+            STAT_INC(TABLE_FILTERED);
+            return true;
         }
 
 
-        TValue get(TKey key)
+        std::string filter_path()
         {
-            off_t offset = get_bucket(key);
+            return this->fname + ".bloom";
+        }
 
-            bool more_chain = true;
-            byte bucket[bucket_bytes] = {0};
 
-            while (more_chain) {
-                this->storage->read(bucket, bucket_bytes, offset);
-                for (size_t i=0; i<bucket_data_bytes; i+=element_sz) {
-                    int result = memcmp(&key, bucket + key_offset(i), sizeof(TKey));
-                    if (result == 0) {
-                        TValue retval;
-                        memcpy(&retval, bucket + value_offset(i), sizeof(TValue));
-                        return retval;
+        /*
+         * Call fn(key, value) for every live element, bucket by bucket and
+         * in chain order, all under storage_lock, which the caller must
+         * hold.
+         */
+        template <typename F>
+        void locked_for_each(F fn)
+        {
+            byte bucket[bucket_bytes];
+            uint64_t now = expiry_clock();
+
+            for (size_t i=0; i<this->bucket_cnt; i++) {
+                off_t offset = bucket_offset(i);
+                while (true) {
+                    this->storage->read(bucket, bucket_bytes, offset);
+                    for (size_t j=0; j<elements_per_bucket; j++) {
+                        if (is_live(j * element_sz, bucket, now)) {
+                            TKey key;
+                            TValue val;
+                            read_element(bucket, j, &key, &val);
+                            fn(key, val);
+                        }
                     }
-                }
 
-                off_t *next_offset = (off_t *) (bucket + bucket_data_bytes);
-                if (*next_offset == 0) {
-                    more_chain = false;
-                } else {
-                    offset = *next_offset;
+                    offset = next_bucket(bucket);
+                    if (offset == 0) break;
                 }
             }
+        }
 
-            // element not in the table
-            throw KeyNotFoundException();
+
+        /*
+         * Add every key in the table to the (empty) filter. The caller must
+         * hold storage_lock.
+         */
+        void fill_filter()
+        {
+            this->locked_for_each([this](TKey key, TValue) {
+                this->filter->add(filter_hash(key));
+            });
         }
 
 
-        void remove(TKey key)
+        /*
+         * Pick up the latest published filter after a read only table has
+         * seen the file change, rebuilding it from the table if the writer
+         * didn't leave one. The caller must hold storage_lock.
+         */
+        void reload_filter()
         {
-            off_t offset = get_bucket(key);
+            BloomFilter *loaded = BloomFilter::load(this->filter_path().c_str());
+            if (loaded) {
+                delete this->filter;
+                this->filter = loaded;
+            } else {
+                this->filter->clear();
+                this->fill_filter();
+            }
+        }
 
-            bool more_chain = true;
-            byte bucket[bucket_bytes] = {0};
 
-            while (more_chain) {
-                this->storage->read(bucket, bucket_bytes, offset);
-                for (size_t i=0; i<bucket_data_bytes; i+=element_sz) {
-                    int result = memcmp(&key, bucket + key_offset(i), sizeof(TKey));
-                    if (result == 0) {
-                        byte zeroes[element_sz];
-                        memset(zeroes, 0, element_sz);
-                        this->storage->write(zeroes, element_sz, offset + key_offset(i));
-                        return;
-                    }
-                }
+        bool locked_refresh()
+        {
+            bool changed = this->storage->refresh();
+            if (changed && this->filter && !this->fname.empty()) this->reload_filter();
+            if (changed && this->cache) this->cache->clear();
+            if (changed) this->chains.clear();
+            return changed;
+        }
 
-                off_t *next_offset = (off_t *) (bucket + bucket_data_bytes);
-                if (*next_offset == 0) {
-                    more_chain = false;
+
+        bool inline cached(TKey key, TValue *val)
+        {
+            if (!this->cache->get(key, val) || expiry_traits<TValue>::expired(*val, expiry_clock())) {
+                STAT_INC(CACHE_MISS);
+                return false;
+            }
+
+            STAT_INC(TABLE_GET);
+            STAT_INC(TABLE_HIT);
+            STAT_INC(CACHE_HIT);
+            return true;
+        }
+
+
+        /*
+         * Prefetch the known overflow links of bucket_no's chain, merging
+         * links that sit next to each other in the file into a single
+         * request. The caller must hold storage_lock.
+         */
+        void prefetch_chain(size_t bucket_no)
+        {
+            auto chain = this->chains.find(bucket_no);
+            if (chain == this->chains.end()) return;
+
+            std::vector<off_t> &links = chain->second;
+            off_t start = links[0];
+            size_t size = bucket_bytes;
+            for (size_t i=1; i<links.size(); i++) {
+                if (links[i] == start + (off_t) size) {
+                    size += bucket_bytes;
                 } else {
-                    offset = *next_offset;
+                    this->storage->prefetch(start, size);
+                    start = links[i];
+                    size = bucket_bytes;
                 }
             }
 
-            // element not in the table
-            throw KeyNotFoundException();
+            this->storage->prefetch(start, size);
         }
 
 
-
-        size_t hash(TKey key)
+        /*
+         * Note that the link'th overflow link of bucket_no's chain (counting
+         * from 0) is at offset. The caller must hold storage_lock.
+         */
+        void inline record_link(size_t bucket_no, size_t link, off_t offset)
         {
-            std::hash<TKey> hash_key;
-            size_t val = hash_key(key);
-            return val % bucket_cnt;
+            std::vector<off_t> &links = this->chains[bucket_no];
+            if (link < links.size()) {
+                links[link] = offset;
+            } else {
+                links.resize(link + 1, offset);
+            }
         }
 
 
-        size_t get_bucket_count()
+        void save_filter()
         {
-            return this->bucket_cnt;
+            this->filter->save(this->filter_path().c_str());
+            this->filter_saved = true;
         }
 
 
-        IOHandler *get_io_handler()
+        /*
+         * Called before the table gains a key. See filter.
+         */
+        void drop_filter_file()
         {
-            return this->storage;
+            if (!this->filter_saved) return;
+
+            unlink(this->filter_path().c_str());
+            this->filter_saved = false;
         }
 
-        ~HashTable()
+
+        /*
+         * Write out the bucket images for buckets [begin, end) as part of a
+         * bulk load. group holds the elements, with those for bucket i
+         * located at [bound[i - begin], bound[i - begin + 1]), and any
+         * overflow buckets are allocated sequentially from overflow_offset.
+         */
+        static void write_partition(IOHandler *file, size_t begin, size_t end,
+                std::vector<std::pair<TKey, TValue>> &group,
+                std::vector<size_t> &bound, off_t overflow_offset)
         {
-            delete this->storage;
-        }
+            std::vector<byte> primary(load_block_buckets * bucket_bytes, 0);
+            std::vector<byte> overflow(load_block_buckets * bucket_bytes, 0);
+            size_t primary_start = begin;
+            size_t overflow_used = 0;
+            off_t overflow_start = overflow_offset;
 
-};
+            for (size_t i=begin; i<end; i++) {
+                if (i - primary_start == load_block_buckets) {
+                    file->write(primary.data(), primary.size(), bucket_offset(primary_start));
+                    memset(primary.data(), 0, primary.size());
+                    primary_start = i;
+                }
+
+                byte *link = primary.data() + bucket_offset(i - primary_start);
+                size_t slot = 0;
+
+                for (size_t j=bound[i - begin]; j<bound[i - begin + 1]; j++) {
+                    if (slot == elements_per_bucket) {
+                        // The current link is full, so chain on a new
+                        // overflow bucket. Its offset is fixed before the
+                        // overflow block is flushed, so the pointer written
+                        // into the current link is always valid.
+                        off_t next = overflow_start + bucket_offset(overflow_used);
+                        memcpy(link + bucket_data_bytes, &next, sizeof(off_t));
+
+                        if (overflow_used == load_block_buckets) {
+                            file->write(overflow.data(), overflow.size(), overflow_start);
+                            memset(overflow.data(), 0, overflow.size());
+                            overflow_start = next;
+                            overflow_used = 0;
+                        }
+
+                        link = overflow.data() + bucket_offset(overflow_used++);
+                        slot = 0;
+                    }
+
+                    prepare_element(link + slot * element_sz, group[j].first, group[j].second);
+                    slot++;
+                }
+            }
+
+            file->write(primary.data(), bucket_offset(end - primary_start),
+                    bucket_offset(primary_start));
+            if (overflow_used) {
+                file->write(overflow.data(), bucket_offset(overflow_used), overflow_start);
+            }
+        }
+
+
+        /*
+         * The body of bulk_load: lay out a table of bucket_cnt buckets
+         * holding the elements in [first, last), and write it into file in
+         * place of whatever was there. The partitions are written from
+         * several threads at once, so file has to be safe for that unless
+         * thread_cnt is 1.
+         */
+        template <typename RandomIt>
+        static void build(IOHandler *file, size_t bucket_cnt, RandomIt first, RandomIt last,
+                size_t thread_cnt)
+        {
+            typedef std::pair<TKey, TValue> kvp;
+
+            size_t n = last - first;
+            size_t part_cnt = (thread_cnt == 0) ? 1 : thread_cnt;
+            if (part_cnt > bucket_cnt) part_cnt = bucket_cnt;
+
+            // Partition p owns buckets [part_start(p), part_start(p + 1)).
+            auto part_start = [=](size_t p) {
+                return (p * bucket_cnt + part_cnt - 1) / part_cnt;
+            };
+            auto part_of = [=](size_t bucket_no) {
+                return bucket_no * part_cnt / bucket_cnt;
+            };
+
+            // Scatter the input so that each partition's elements can be
+            // gathered without any locking. scatter[t][p] holds the elements
+            // from thread t's slice of the input that belong to partition p.
+            std::vector<std::vector<std::vector<kvp>>> scatter(part_cnt,
+                    std::vector<std::vector<kvp>>(part_cnt));
+
+            parallel_ranges(n, part_cnt, [&](size_t t, size_t begin, size_t end) {
+                for (size_t i=begin; i<end; i++) {
+                    kvp element = first[i];
+                    size_t p = part_of(hash_bucket(element.first, bucket_cnt));
+                    scatter[t][p].push_back(element);
+                }
+            });
+
+            // Gather each partition's elements, grouped by bucket, and work
+            // out how many overflow buckets the partition will need.
+            std::vector<std::vector<kvp>> grouped(part_cnt);
+            std::vector<std::vector<size_t>> bounds(part_cnt);
+            std::vector<size_t> overflow_cnt(part_cnt, 0);
+
+            parallel_ranges(part_cnt, part_cnt, [&](size_t, size_t begin, size_t end) {
+                for (size_t p=begin; p<end; p++) {
+                    size_t base = part_start(p);
+                    size_t range = part_start(p + 1) - base;
+                    std::vector<size_t> &bound = bounds[p];
+                    bound.assign(range + 1, 0);
+
+                    for (size_t t=0; t<part_cnt; t++) {
+                        for (auto &element : scatter[t][p]) {
+                            bound[hash_bucket(element.first, bucket_cnt) - base + 1]++;
+                        }
+                    }
+
+                    for (size_t i=0; i<range; i++) {
+                        bound[i + 1] += bound[i];
+                    }
+
+                    // Iterating over t in order keeps elements within a
+                    // bucket in their original input order.
+                    std::vector<kvp> &group = grouped[p];
+                    group.resize(bound[range]);
+                    std::vector<size_t> fill(bound.begin(), bound.end() - 1);
+                    for (size_t t=0; t<part_cnt; t++) {
+                        for (auto &element : scatter[t][p]) {
+                            group[fill[hash_bucket(element.first, bucket_cnt) - base]++] = element;
+                        }
+                        std::vector<kvp>().swap(scatter[t][p]);
+                    }
+
+                    // Drop duplicates and zeroed elements, compacting each
+                    // bucket's elements down as we go.
+                    size_t out = 0;
+                    for (size_t i=0; i<range; i++) {
+                        size_t bucket_begin = out;
+                        for (size_t j=bound[i]; j<bound[i + 1]; j++) {
+                            byte element[element_sz];
+                            prepare_element(element, group[j].first, group[j].second);
+                            if (element[0] == 0 && !memcmp(element, element + 1, element_sz - 1))
+                                continue;
+
+                            bool duplicate = false;
+                            for (size_t k=bucket_begin; k<out && !duplicate; k++) {
+                                duplicate = !memcmp(&group[k].first, &group[j].first, sizeof(TKey));
+                            }
+
+                            if (!duplicate) group[out++] = group[j];
+                        }
+
+                        bound[i] = bucket_begin;
+                        size_t links = (out - bucket_begin + elements_per_bucket - 1) / elements_per_bucket;
+                        if (links > 1) overflow_cnt[p] += links - 1;
+                    }
+                    bound[range] = out;
+                }
+            });
+
+            // Overflow buckets are packed after the primary buckets in
+            // partition order.
+            std::vector<off_t> overflow_base(part_cnt + 1);
+            overflow_base[0] = bucket_offset(bucket_cnt);
+            for (size_t p=0; p<part_cnt; p++) {
+                overflow_base[p + 1] = overflow_base[p] + bucket_offset(overflow_cnt[p]);
+            }
+
+            file->truncate(0);
+            file->truncate(overflow_base[part_cnt]);
+            parallel_ranges(part_cnt, part_cnt, [&](size_t, size_t begin, size_t end) {
+                for (size_t p=begin; p<end; p++) {
+                    write_partition(file, part_start(p), part_start(p + 1),
+                            grouped[p], bounds[p], overflow_base[p]);
+                    std::vector<kvp>().swap(grouped[p]);
+                }
+            });
+        }
+
+
+        /*
+         * Read size bytes of bucket data into buffer, holding storage_lock
+         * only for the duration of the read itself.
+         */
+        void locked_read(byte *buffer, size_t size, off_t offset)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            this->storage->read(buffer, size, offset);
+        }
+
+
+        /*
+         * Tells storage how a scan is about to use the file, and withdraws
+         * the hint again once the scan is done, however it ends. Primary
+         * buckets are read front to back, and overflow buckets are visited
+         * once each in no particular order; either way, the pages don't
+         * belong in the buffer pool's working set afterwards.
+         */
+        class ScanHints
+        {
+            public:
+                ScanHints(HashTable *table) : table(table)
+                {
+                    std::lock_guard<std::mutex> guard(table->storage_lock);
+                    this->primary = table->bucket_offset(table->bucket_cnt);
+                    this->overflow = std::max(table->storage->get_flen() - this->primary,
+                                              (off_t) 0);
+
+                    table->storage->advise(0, this->primary, access_t::SEQUENTIAL);
+                    table->storage->advise(this->primary, this->overflow, access_t::ONCE);
+                }
+
+                ~ScanHints()
+                {
+                    std::lock_guard<std::mutex> guard(this->table->storage_lock);
+                    this->table->storage->advise(0, this->primary, access_t::NORMAL);
+                    this->table->storage->advise(this->primary, this->overflow,
+                            access_t::NORMAL);
+                }
+
+            private:
+                HashTable *table;
+                off_t primary;
+                off_t overflow;
+        };
+
+
+        /*
+         * Count the bucket sized stretches of the file past the primary
+         * buckets that aren't covered by any of the reachable overflow
+         * buckets, and that have something other than zeros in them. The
+         * zeros check skips over the slack that insert and page flushes
+         * leave between and after overflow buckets. An orphan is taken to
+         * start at the first non-zero byte found, as an insert always fills
+         * the first slot of a new overflow bucket.
+         */
+        size_t count_orphans(std::vector<off_t> &overflow)
+        {
+            off_t flen;
+            {
+                std::lock_guard<std::mutex> guard(this->storage_lock);
+                flen = this->storage->get_flen();
+            }
+
+            std::sort(overflow.begin(), overflow.end());
+            overflow.push_back(flen);
+
+            size_t orphans = 0;
+            off_t gap_start = this->bucket_offset(this->bucket_cnt);
+            byte gap[bucket_bytes];
+
+            for (auto bucket : overflow) {
+                while (gap_start + (off_t) bucket_bytes <= bucket) {
+                    this->locked_read(gap, bucket_bytes, gap_start);
+
+                    size_t first = 0;
+                    while (first < bucket_bytes && gap[first] == 0) first++;
+
+                    if (first < bucket_bytes && gap_start + (off_t) (first + bucket_bytes) <= bucket) {
+                        orphans++;
+                        gap_start += first + bucket_bytes;
+                    } else {
+                        gap_start += (first) ? first : 1;
+                    }
+                }
+
+                gap_start = std::max(gap_start, bucket + (off_t) bucket_bytes);
+            }
+
+            return orphans;
+        }
+
+
+        /*
+         * Call fn on each live element within a bucket, then follow the
+         * bucket's overflow chain and do the same for each link.
+         */
+        template <typename F>
+        void scan_chain(byte *bucket, F &fn)
+        {
+            byte link[bucket_bytes];
+            byte *current = bucket;
+            uint64_t now = expiry_clock();
+
+            while (true) {
+                for (size_t i=0; i<elements_per_bucket; i++) {
+                    if (is_live(i * element_sz, current, now)) {
+                        TKey key;
+                        TValue val;
+                        read_element(current, i, &key, &val);
+                        fn(key, val);
+                    }
+                }
+
+                off_t next = next_bucket(current);
+                if (next == 0) return;
+
+                locked_read(link, bucket_bytes, next);
+                current = link;
+            }
+        }
+
+
+        /*
+         * The body of insert and upsert. If key is already present, its
+         * value is overwritten when replace is set, and left alone if not.
+         * An expired element counts as absent, and its slot as free. The
+         * caller must hold storage_lock.
+         */
+        TValue put(TKey key, TValue val, bool replace)
+        {
+            this->drop_filter_file();
+            uint64_t now = expiry_clock();
+            size_t bucket_no = hash(key);
+            off_t offset = bucket_offset(bucket_no);
+            off_t insert_offset = -1;
+            off_t insert_bucket = offset;
+
+            bool more_chain = true;
+            byte bucket[bucket_bytes] = {0};
+            size_t overflow_links = 0;
+            this->prefetch_chain(bucket_no);
+
+            while (more_chain) {
+                this->storage->read(bucket, bucket_bytes, offset);
+                for (size_t i=0; i<elements_per_bucket * element_sz; i+=element_sz) {
+                    int result = memcmp(&key, bucket + key_offset(i), sizeof(TKey));
+                    if (result == 0) {
+                        // the key is already present in table
+                        bool expired = this->is_expired(i, bucket, now);
+                        if (replace || expired) {
+                            if (expired) {
+                                STAT_INC(TABLE_EXPIRED);
+                            }
+                            this->bump(bucket_no);
+                            if (!this->pins.empty()) {
+                                TValue old;
+                                memcpy(&old, bucket + value_offset(i), sizeof(TValue));
+                                this->preserve(bucket_no, key, !expired, old);
+                            }
+                            this->storage->write((byte *) &val, sizeof(TValue),
+                                    offset + value_offset(i));
+                            if (this->cache) this->cache->update(key, val);
+                            if (this->log) this->log->append(change_t::PUT, key, val);
+                            return val;
+                        }
+
+                        TValue retval;
+                        memcpy(&retval, bucket + value_offset(i), sizeof(TValue));
+                        return retval;
+                    } else if (insert_offset == -1 && ((result > 0 && is_empty(i, bucket)) ||
+                                                       is_expired(i, bucket, now))) {
+                        // As we're iterating over the chain, we may as well
+                        // locate the first empty spot where we *could* stick
+                        // the element, if we end up needing to insert it. By
+                        // sticking it in the first available spot, rather than
+                        // at the end, we can easily fill in holes left by
+                        // deletions, or by elements that have expired.
+                        insert_offset = i;
+                        insert_bucket = offset;
+                    }
+                }
+
+                off_t *next_offset = (off_t *) (bucket + bucket_data_bytes);
+                if (*next_offset == 0) {
+                    more_chain = false;
+                } else {
+                    offset = *next_offset;
+                    this->record_link(bucket_no, overflow_links++, offset);
+                }
+            }
+
+            // The key isn't in the table, so we need to write it.
+            this->preserve(bucket_no, key, false, TValue());
+            byte element[element_sz];
+            prepare_element(element, key, val);
+
+            if (insert_offset != -1) {
+                // the key doesn't exist, and a valid insertion spot was found
+                off_t write_offset = insert_bucket + insert_offset;
+                this->storage->write(element, element_sz, write_offset);
+            } else {
+                // the key doesn't exist, and we need to add a new link to the
+                // chain to write it.
+                off_t write_offset = this->storage->get_flen();
+                this->storage->write(element, element_sz, write_offset);
+                byte x = 0;
+
+                // Ensuring that the length of the memory region is an even
+                // multiple of bucket_bytes. Talk about fighting with the
+                // limitations of an API...
+                this->storage->write(&x, 1, write_offset + this->bucket_bytes);
+
+                // update the offset in the previous chain link
+                this->storage->write((byte *) &write_offset, sizeof(off_t),
+                        offset + bucket_data_bytes);
+                this->record_link(bucket_no, overflow_links, write_offset);
+            }
+
+            this->bump(bucket_no);
+            if (this->filter) this->filter->add(filter_hash(key));
+            if (this->log) this->log->append(change_t::PUT, key, val);
+            return val;
+        }
+
+
+        /*
+         * The positions [0, cnt) sorted by the bucket that key_at(i) hashes
+         * to. The sort is stable, so positions with equal keys stay in
+         * order.
+         */
+        template <typename F>
+        std::vector<size_t> bucket_order(size_t cnt, F key_at)
+        {
+            std::vector<size_t> buckets(cnt);
+            std::vector<size_t> order(cnt);
+            for (size_t i=0; i<cnt; i++) {
+                buckets[i] = this->hash(key_at(i));
+                order[i] = i;
+            }
+
+            std::stable_sort(order.begin(), order.end(), [&buckets](size_t a, size_t b) {
+                return buckets[a] < buckets[b];
+            });
+            return order;
+        }
+
+
+        /*
+         * The body of try_get, once the cache has been missed. The caller
+         * must hold storage_lock.
+         */
+        bool locked_get(TKey key, TValue *val)
+        {
+            STAT_INC(TABLE_GET);
+            uint64_t now = expiry_clock();
+            if (this->filtered(key)) {
+                STAT_INC(TABLE_MISS);
+                return false;
+            }
+            size_t bucket_no = hash(key);
+            off_t offset = bucket_offset(bucket_no);
+
+            bool more_chain = true;
+            byte bucket[bucket_bytes] = {0};
+            size_t links = 0;
+            size_t overflow_links = 0;
+            this->prefetch_chain(bucket_no);
+
+            while (more_chain) {
+                this->storage->read(bucket, bucket_bytes, offset);
+                links++;
+                for (size_t i=0; i<elements_per_bucket * element_sz; i+=element_sz) {
+                    int result = memcmp(&key, bucket + key_offset(i), sizeof(TKey));
+                    if (result == 0 && !this->is_expired(i, bucket, now)) {
+                        memcpy(val, bucket + value_offset(i), sizeof(TValue));
+                        if (this->cache) this->cache->put(key, *val);
+                        STAT_INC(TABLE_HIT);
+                        STAT_RECORD(CHAIN_LENGTH, links);
+                        return true;
+                    }
+                }
+
+                off_t *next_offset = (off_t *) (bucket + bucket_data_bytes);
+                if (*next_offset == 0) {
+                    more_chain = false;
+                } else {
+                    offset = *next_offset;
+                    this->record_link(bucket_no, overflow_links++, offset);
+                }
+            }
+
+            // element not in the table
+            STAT_INC(TABLE_MISS);
+            STAT_RECORD(CHAIN_LENGTH, links);
+            return false;
+        }
+
+
+        /*
+         * The body of try_remove. The caller must hold storage_lock.
+         */
+        bool locked_remove(TKey key)
+        {
+            STAT_INC(TABLE_REMOVE);
+            if (this->filtered(key)) return false;
+            uint64_t now = expiry_clock();
+            size_t bucket_no = hash(key);
+            off_t offset = bucket_offset(bucket_no);
+
+            bool more_chain = true;
+            byte bucket[bucket_bytes] = {0};
+            size_t overflow_links = 0;
+            this->prefetch_chain(bucket_no);
+
+            while (more_chain) {
+                this->storage->read(bucket, bucket_bytes, offset);
+                for (size_t i=0; i<elements_per_bucket * element_sz; i+=element_sz) {
+                    int result = memcmp(&key, bucket + key_offset(i), sizeof(TKey));
+                    if (result == 0) {
+                        // An expired element is reclaimed all the same, but
+                        // as far as the caller knows it wasn't there.
+                        bool expired = this->is_expired(i, bucket, now);
+                        if (!expired && !this->pins.empty()) {
+                            TValue old;
+                            memcpy(&old, bucket + value_offset(i), sizeof(TValue));
+                            this->preserve(bucket_no, key, true, old);
+                        }
+                        byte zeroes[element_sz];
+                        memset(zeroes, 0, element_sz);
+                        this->storage->write(zeroes, element_sz, offset + key_offset(i));
+                        if (this->cache) this->cache->erase(key);
+                        if (expired) {
+                            STAT_INC(TABLE_EXPIRED);
+                            return false;
+                        }
+                        this->bump(bucket_no);
+                        if (this->log) this->log->append(change_t::REMOVE, key, TValue());
+                        return true;
+                    }
+                }
+
+                off_t *next_offset = (off_t *) (bucket + bucket_data_bytes);
+                if (*next_offset == 0) {
+                    more_chain = false;
+                } else {
+                    offset = *next_offset;
+                    this->record_link(bucket_no, overflow_links++, offset);
+                }
+            }
+
+            // element not in the table
+            return false;
+        }
+
+
+        /*
+         * Keep the state key is in before it is changed, if any read view
+         * could need it. The caller must hold storage_lock.
+         */
+        void preserve(size_t bucket_no, TKey key, bool present, TValue val)
+        {
+            if (this->pins.empty()) return;
+
+            std::vector<BeforeImage> &images = this->before_images[bucket_no];
+            for (auto image = images.rbegin(); image != images.rend() &&
+                    image->epoch == this->write_epoch; ++image) {
+                if (!memcmp(&image->key, &key, sizeof(TKey))) return;
+            }
+
+            STAT_INC(VERSION_SAVE);
+            images.push_back(BeforeImage{key, this->write_epoch, present, val});
+            this->image_order.emplace_back(this->write_epoch, bucket_no);
+        }
+
+
+        /*
+         * Drop the before images no pinned view can need any more: an
+         * image made in epoch e is only wanted by views pinned before e.
+         * The caller must hold storage_lock.
+         */
+        void reclaim_images()
+        {
+            uint64_t oldest = (this->pins.empty()) ? UINT64_MAX : *this->pins.begin();
+
+            while (!this->image_order.empty() && this->image_order.front().first <= oldest) {
+                auto images = this->before_images.find(this->image_order.front().second);
+                images->second.erase(images->second.begin());
+                if (images->second.empty()) this->before_images.erase(images);
+
+                STAT_INC(VERSION_RECLAIM);
+                this->image_order.pop_front();
+            }
+        }
+
+
+        /*
+         * The state key was in as of epoch at, if it has changed since,
+         * in which case true is returned. The caller must hold
+         * storage_lock.
+         */
+        bool inline image_at(TKey key, size_t bucket_no, uint64_t at, bool *present, TValue *val)
+        {
+            auto images = this->before_images.find(bucket_no);
+            if (images == this->before_images.end()) return false;
+
+            // The first change after at is the one that holds its state.
+            for (auto &image : images->second) {
+                if (image.epoch > at && !memcmp(&image.key, &key, sizeof(TKey))) {
+                    *present = image.present &&
+                            !expiry_traits<TValue>::expired(image.val, expiry_clock());
+                    *val = image.val;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+
+        bool view_get(TKey key, uint64_t at, TValue *val)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+
+            bool present;
+            if (this->image_at(key, hash(key), at, &present, val)) {
+                STAT_INC(TABLE_GET);
+                if (present) {
+                    STAT_INC(TABLE_HIT);
+                } else {
+                    STAT_INC(TABLE_MISS);
+                }
+                return present;
+            }
+
+            return this->locked_get(key, val);
+        }
+
+
+        /*
+         * Call fn(key, value) for every element in the table as of epoch
+         * at. Each chain is read, and checked against the version store,
+         * under a single hold of storage_lock, but fn is called outside
+         * it.
+         */
+        template <typename F>
+        void view_for_each(uint64_t at, F &fn)
+        {
+            ScanHints hints(this);
+            byte bucket[bucket_bytes];
+            std::vector<std::pair<TKey, TValue>> elements;
+            std::vector<TKey> changed;
+
+            for (size_t i=0; i<this->bucket_cnt; i++) {
+                elements.clear();
+                changed.clear();
+                {
+                    std::lock_guard<std::mutex> guard(this->storage_lock);
+                    uint64_t now = expiry_clock();
+
+                    // Elements changed since at are taken from the
+                    // version store, and the rest from the chain.
+                    auto images = this->before_images.find(i);
+                    if (images != this->before_images.end()) {
+                        for (auto &image : images->second) {
+                            if (image.epoch <= at) continue;
+                            if (std::find_if(changed.begin(), changed.end(), [&image](TKey &key) {
+                                    return !memcmp(&key, &image.key, sizeof(TKey));
+                                }) != changed.end()) {
+                                continue;
+                            }
+
+                            changed.push_back(image.key);
+                            if (image.present && !expiry_traits<TValue>::expired(image.val, now)) {
+                                elements.emplace_back(image.key, image.val);
+                            }
+                        }
+                    }
+
+                    off_t offset = bucket_offset(i);
+                    while (true) {
+                        this->storage->read(bucket, bucket_bytes, offset);
+                        for (size_t j=0; j<elements_per_bucket; j++) {
+                            if (!is_live(j * element_sz, bucket, now)) continue;
+
+                            TKey key;
+                            TValue val;
+                            read_element(bucket, j, &key, &val);
+                            if (std::find_if(changed.begin(), changed.end(), [&key](TKey &other) {
+                                    return !memcmp(&key, &other, sizeof(TKey));
+                                }) == changed.end()) {
+                                elements.emplace_back(key, val);
+                            }
+                        }
+
+                        offset = next_bucket(bucket);
+                        if (offset == 0) break;
+                    }
+                }
+
+                for (auto &element : elements) {
+                    fn(element.first, element.second);
+                }
+            }
+        }
+
+
+        void unpin(uint64_t at)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            this->pins.erase(this->pins.find(at));
+            this->reclaim_images();
+        }
+
+
+        void inline bump(size_t bucket_no)
+        {
+            if (!this->versions.empty()) this->versions[bucket_no]++;
+        }
+
+
+        std::string txn_path()
+        {
+            return this->fname + ".txn";
+        }
+
+
+        /*
+         * FNV-1a, to tell a complete transaction log from a torn one.
+         */
+        static uint64_t txn_checksum(const byte *data, size_t size)
+        {
+            uint64_t sum = 14695981039346656037ull;
+            for (size_t i=0; i<size; i++) {
+                sum = (sum ^ (uint8_t) data[i]) * 1099511628211ull;
+            }
+
+            return sum;
+        }
+
+
+        /*
+         * Write writes to the transaction log, and sync it, in a single
+         * record: the number of writes, then each one as a change_t and an
+         * element, then a checksum of all that. The caller must hold
+         * storage_lock.
+         */
+        void log_transaction(const std::vector<std::pair<TKey, TxnWrite>> &writes)
+        {
+            size_t entry_bytes = 1 + element_sz;
+            std::vector<byte> record(2 * sizeof(uint64_t) + writes.size() * entry_bytes);
+
+            uint64_t cnt = writes.size();
+            memcpy(record.data(), &cnt, sizeof(cnt));
+            byte *entry = record.data() + sizeof(cnt);
+            for (auto &write : writes) {
+                entry[0] = (byte) write.second.kind;
+                prepare_element(entry + 1, write.first, write.second.val);
+                entry += entry_bytes;
+            }
+
+            uint64_t sum = txn_checksum(record.data(), entry - record.data());
+            memcpy(entry, &sum, sizeof(sum));
+
+            if (!this->txn_log) this->txn_log = new RawIOHandler(this->txn_path().c_str());
+            this->txn_log->write(record.data(), record.size(), 0);
+            this->txn_log->flush();
+        }
+
+
+        /*
+         * Finish a commit that was cut short after its writes were logged,
+         * by applying them again. A log that isn't complete belongs to a
+         * commit that never got as far as touching the table, and is
+         * thrown away.
+         */
+        void recover_transaction()
+        {
+            if (access(this->txn_path().c_str(), F_OK) == -1) return;
+
+            RawIOHandler log(this->txn_path().c_str());
+            size_t entry_bytes = 1 + element_sz;
+            std::vector<byte> record(log.get_flen());
+            if (record.size()) log.read(record.data(), record.size(), 0);
+
+            uint64_t cnt = 0;
+            uint64_t sum = 0;
+            if (record.size() >= 2 * sizeof(uint64_t)) {
+                memcpy(&cnt, record.data(), sizeof(cnt));
+                memcpy(&sum, record.data() + record.size() - sizeof(sum), sizeof(sum));
+            }
+
+            bool complete = record.size() >= 2 * sizeof(uint64_t) &&
+                    cnt == (record.size() - 2 * sizeof(uint64_t)) / entry_bytes &&
+                    record.size() == 2 * sizeof(uint64_t) + cnt * entry_bytes &&
+                    sum == txn_checksum(record.data(), record.size() - sizeof(sum));
+
+            if (complete) {
+                byte *entry = record.data() + sizeof(cnt);
+                for (uint64_t i=0; i<cnt; i++, entry+=entry_bytes) {
+                    TKey key;
+                    TValue val;
+                    memcpy(&key, entry + 1, sizeof(TKey));
+                    memcpy(&val, entry + 1 + sizeof(TKey), sizeof(TValue));
+                    if ((change_t) entry[0] == change_t::PUT) {
+                        this->put(key, val, true);
+                    } else {
+                        this->locked_remove(key);
+                    }
+                }
+                this->persist();
+            }
+
+            log.truncate(0);
+        }
+
+
+        /*
+         * The body of Transaction::try_get: look key up, noting the version
+         * of its chain in reads if this is the first look at it.
+         */
+        bool transaction_get(TKey key, TValue *val, TxnReads *reads)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->read_only) this->locked_refresh();
+
+            size_t bucket_no = this->hash(key);
+            reads->emplace(bucket_no, this->versions[bucket_no]);
+            return (this->cache && this->cached(key, val)) || this->locked_get(key, val);
+        }
+
+
+        /*
+         * The body of Transaction::commit.
+         */
+        bool commit_transaction(const TxnReads &reads, const TxnWrites &writes)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->read_only && !writes.empty()) throw ReadOnlyException();
+
+            for (auto &read : reads) {
+                if (this->versions[read.first] != read.second) {
+                    STAT_INC(TXN_CONFLICT);
+                    return false;
+                }
+            }
+
+            std::vector<std::pair<TKey, TxnWrite>> ordered(writes.begin(), writes.end());
+            std::vector<size_t> order = this->bucket_order(ordered.size(),
+                    [&ordered](size_t i) { return ordered[i].first; });
+            bool logged = !this->fname.empty() && !ordered.empty();
+            if (logged) this->log_transaction(ordered);
+
+            for (auto i : order) {
+                if (ordered[i].second.kind == change_t::PUT) {
+                    STAT_INC(TABLE_INSERT);
+                    this->put(ordered[i].first, ordered[i].second.val, true);
+                } else {
+                    this->locked_remove(ordered[i].first);
+                }
+            }
+
+            if (logged) {
+                this->persist();
+                this->txn_log->truncate(0);
+            }
+
+            STAT_INC(TXN_COMMIT);
+            return true;
+        }
+
+
+        /*
+         * Zero out the expired elements in bucket_no's chain, returning how
+         * many there were. The caller must hold storage_lock.
+         */
+        size_t locked_sweep(size_t bucket_no)
+        {
+            uint64_t now = expiry_clock();
+            off_t offset = bucket_offset(bucket_no);
+            byte bucket[bucket_bytes];
+            byte zeroes[element_sz] = {0};
+            size_t reclaimed = 0;
+
+            while (true) {
+                this->storage->read(bucket, bucket_bytes, offset);
+                for (size_t i=0; i<elements_per_bucket * element_sz; i+=element_sz) {
+                    if (is_empty(i, bucket) || !is_expired(i, bucket, now)) continue;
+
+                    TKey key;
+                    memcpy(&key, bucket + key_offset(i), sizeof(TKey));
+                    this->storage->write(zeroes, element_sz, offset + key_offset(i));
+                    if (this->cache) this->cache->erase(key);
+                    if (this->log) this->log->append(change_t::REMOVE, key, TValue());
+                    STAT_INC(TABLE_EXPIRED);
+                    reclaimed++;
+                }
+
+                offset = next_bucket(bucket);
+                if (offset == 0) break;
+            }
+
+            return reclaimed;
+        }
+
+
+        void run_sweeper(size_t buckets_per_second)
+        {
+            const std::chrono::milliseconds tick(100);
+            size_t owed = 0;
+
+            std::unique_lock<std::mutex> guard(this->sweeper_lock);
+            while (!this->sweeper_stopping) {
+                this->sweeper_wake.wait_for(guard, tick);
+                if (this->sweeper_stopping) break;
+
+                // a tick's share of the rate, carrying the remainder over
+                // so that rates under ten a second still come out right
+                owed += buckets_per_second;
+                size_t buckets = owed / 10;
+                owed %= 10;
+                if (buckets == 0) continue;
+
+                guard.unlock();
+                try {
+                    this->sweep(buckets);
+                } catch (std::exception &) {
+                    // Whatever was missed will be there on the next lap.
+                }
+                guard.lock();
+            }
+        }
+
+
+    public:
+        HashTable(size_t bucket_cnt)
+        {
+            this->storage = new MemIOHandler(128);
+            byte x = 0;
+            storage->write(&x, 1, bucket_cnt * bucket_bytes - 1);
+            this->bucket_cnt = bucket_cnt;
+            this->read_only = false;
+            this->epoch = nullptr;
+            this->filter = nullptr;
+            this->cache = nullptr;
+            this->log = nullptr;
+            this->filter_saved = false;
+            this->sweeper_stopping = false;
+            this->sweep_cursor = 0;
+            this->txn_log = nullptr;
+            this->write_epoch = 1;
+        }
+
+
+        /*
+         * Build a table on top of storage, which the table takes ownership
+         * of. This is the way to use any stack of IOHandlers other than the
+         * default, for instance a BufferedIOHandler over a
+         * CompressedIOHandler.
+         */
+        HashTable(IOHandler *storage, size_t bucket_cnt)
+        {
+            this->storage = storage;
+            this->bucket_cnt = bucket_cnt;
+            this->read_only = false;
+            this->epoch = nullptr;
+            this->filter = nullptr;
+            this->cache = nullptr;
+            this->log = nullptr;
+            this->filter_saved = false;
+            this->sweeper_stopping = false;
+            this->sweep_cursor = 0;
+            this->txn_log = nullptr;
+            this->write_epoch = 1;
+
+            if (storage->get_flen() < (off_t) (bucket_cnt * bucket_bytes)) {
+                byte x = 0;
+                storage->write(&x, 1, bucket_cnt * bucket_bytes - 1);
+            }
+        }
+
+
+        /*
+         * Open a table stored in fname. In READ_ONLY mode the file is mapped
+         * shared rather than read through a private buffer pool, so any
+         * number of reader processes share a single copy of it, and the
+         * table will refuse to modify it. Readers pick up whatever a writer
+         * publishes automatically.
+         *
+         * A writer's buffer pool is unbounded, so that nothing it changes
+         * reaches the file, where readers' mappings would see it, until it
+         * is published. For a table with a bounded pool, build the storage
+         * and use HashTable(IOHandler *, size_t).
+         */
+        HashTable(const char *fname, size_t bucket_cnt, open_t mode=open_t::READ_WRITE)
+        {
+            this->bucket_cnt = bucket_cnt;
+            this->read_only = (mode == open_t::READ_ONLY);
+            this->fname = fname;
+            this->epoch = nullptr;
+            this->filter = nullptr;
+            this->cache = nullptr;
+            this->log = nullptr;
+            this->filter_saved = !this->read_only;
+            this->sweeper_stopping = false;
+            this->sweep_cursor = 0;
+            this->txn_log = nullptr;
+            this->write_epoch = 1;
+
+            if (this->read_only) {
+                this->storage = new MappedIOHandler(fname);
+            } else {
+                this->storage = new BufferedIOHandler(new RawIOHandler(fname), 0);
+                byte x = 0;
+                storage->write(&x, 1, bucket_cnt * bucket_bytes - 1);
+                this->recover_transaction();
+            }
+        }
+
+
+        /*
+         * Build a new table file from scratch out of the elements in [first,
+         * last), which must be random access iterators over {key, value}
+         * pairs, and return a table opened on it. Any existing contents of
+         * fname are discarded. The result is the same as inserting each
+         * element in order into an empty table: for duplicate keys the first
+         * occurrence wins, and {0, 0} elements are dropped.
+         *
+         * Rather than going through insert, the input is partitioned by
+         * bucket range across thread_cnt threads. Each thread lays out the
+         * bucket images for its range in memory, including the overflow
+         * chains, and then writes them into the file in large sequential
+         * blocks. Overflow buckets are packed after the primary buckets,
+         * partition by partition, so each partition writes exactly two
+         * contiguous regions of the file.
+         */
+        template <typename RandomIt>
+        static HashTable *bulk_load(const char *fname, size_t bucket_cnt,
+                RandomIt first, RandomIt last, size_t thread_cnt=default_thread_count())
+        {
+            // Any filter or transaction log left over from the old
+            // contents no longer applies.
+            unlink((std::string(fname) + ".bloom").c_str());
+            unlink((std::string(fname) + ".txn").c_str());
+            RawIOHandler *file = new RawIOHandler(fname);
+
+            try {
+                build(file, bucket_cnt, first, last, thread_cnt);
+            } catch (...) {
+                delete file;
+                throw;
+            }
+
+            delete file;
+            return new HashTable(fname, bucket_cnt);
+        }
+
+
+        TValue insert(TKey key, TValue val)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->read_only) throw ReadOnlyException();
+            STAT_INC(TABLE_INSERT);
+            return this->put(key, val, false);
+        }
+
+
+        /*
+         * Like insert, but if key is already in the table its value is
+         * replaced with val. Returns val either way.
+         */
+        TValue upsert(TKey key, TValue val)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->read_only) throw ReadOnlyException();
+            STAT_INC(TABLE_INSERT);
+            return this->put(key, val, true);
+        }
+
+
+        TValue get(TKey key)
+        {
+            TValue val;
+            if (!this->try_get(key, &val)) throw KeyNotFoundException();
+
+            return val;
+        }
+
+
+        /*
+         * Look key up, and copy its value into val if it is there. Unlike
+         * get, a miss is reported by returning false rather than by
+         * throwing, which makes this much cheaper when misses are common.
+         */
+        bool try_get(TKey key, TValue *val)
+        {
+            // A read only table has to look for newly published changes
+            // before it can trust the cache, and that needs storage_lock.
+            if (this->cache && !this->read_only && this->cached(key, val)) return true;
+
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->read_only) {
+                this->locked_refresh();
+                if (this->cache && this->cached(key, val)) return true;
+            }
+
+            return this->locked_get(key, val);
+        }
+
+
+        bool contains(TKey key)
+        {
+            TValue val;
+            return this->try_get(key, &val);
+        }
+
+
+        /*
+         * Look up every key in [first, last) while holding storage_lock
+         * just once, rather than once per key. The keys are visited in
+         * bucket order, so that keys sharing a bucket, or neighbouring
+         * buckets, find them already in the buffer pool. The value for the
+         * i'th key is stored in values[i], and found[i] is set to whether
+         * it was there. Returns the number of keys found.
+         */
+        template <typename InputIt>
+        size_t get_batch(InputIt first, InputIt last, TValue *values, bool *found)
+        {
+            std::vector<TKey> keys(first, last);
+            std::vector<size_t> order = this->bucket_order(keys.size(),
+                    [&keys](size_t i) { return keys[i]; });
+
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->read_only) this->locked_refresh();
+
+            size_t hits = 0;
+            for (auto i : order) {
+                found[i] = (this->cache && this->cached(keys[i], &values[i])) ||
+                           this->locked_get(keys[i], &values[i]);
+                if (found[i]) hits++;
+            }
+
+            return hits;
+        }
+
+
+        /*
+         * Upsert every {key, value} pair in [first, last) under a single
+         * hold of storage_lock, in bucket order as with get_batch. Pairs
+         * with the same key are applied in their original order, so the
+         * last one wins.
+         */
+        template <typename InputIt>
+        void upsert_batch(InputIt first, InputIt last)
+        {
+            std::vector<std::pair<TKey, TValue>> elements;
+            for (; first != last; ++first) {
+                elements.emplace_back(first->first, first->second);
+            }
+            std::vector<size_t> order = this->bucket_order(elements.size(),
+                    [&elements](size_t i) { return elements[i].first; });
+
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->read_only) throw ReadOnlyException();
+
+            for (auto i : order) {
+                STAT_INC(TABLE_INSERT);
+                this->put(elements[i].first, elements[i].second, true);
+            }
+        }
+
+
+        /*
+         * Remove every key in [first, last) that is in the table, under a
+         * single hold of storage_lock. Returns the number removed, and if
+         * removed isn't null, sets removed[i] to whether the i'th key was.
+         */
+        template <typename InputIt>
+        size_t remove_batch(InputIt first, InputIt last, bool *removed=nullptr)
+        {
+            std::vector<TKey> keys(first, last);
+            std::vector<size_t> order = this->bucket_order(keys.size(),
+                    [&keys](size_t i) { return keys[i]; });
+
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->read_only) throw ReadOnlyException();
+
+            size_t cnt = 0;
+            for (auto i : order) {
+                bool hit = this->locked_remove(keys[i]);
+                if (removed) removed[i] = hit;
+                if (hit) cnt++;
+            }
+
+            return cnt;
+        }
+
+
+#ifdef __cpp_impl_coroutine
+        /*
+         * A coroutine version of get, for use with co_await. Each link of
+         * the chain is read through scheduler, so a lookup whose buckets
+         * aren't in the buffer pool suspends while they are fetched rather
+         * than blocking the thread. Spawn a batch of these on one scheduler
+         * and run it to have all of their reads in flight at once.
+         */
+        Task<TValue> get_async(TKey key, IOScheduler &scheduler)
+        {
+            // Lookups here don't fill the cache, as storage_lock isn't held
+            // from the read through to the fill.
+            TValue hot;
+            if (this->cache && !this->read_only && this->cached(key, &hot)) co_return hot;
+
+            if (this->read_only) this->refresh();
+            STAT_INC(TABLE_GET);
+            if (this->filtered(key)) {
+                STAT_INC(TABLE_MISS);
+                throw KeyNotFoundException();
+            }
+            off_t offset = get_bucket(key);
+            uint64_t now = expiry_clock();
+
+            byte bucket[bucket_bytes] = {0};
+            size_t links = 0;
+
+            while (true) {
+                co_await scheduler.read(this->storage, &this->storage_lock, bucket,
+                        bucket_bytes, offset);
+                links++;
+                for (size_t i=0; i<elements_per_bucket * element_sz; i+=element_sz) {
+                    int result = memcmp(&key, bucket + key_offset(i), sizeof(TKey));
+                    if (result == 0 && !this->is_expired(i, bucket, now)) {
+                        TValue retval;
+                        memcpy(&retval, bucket + value_offset(i), sizeof(TValue));
+                        STAT_INC(TABLE_HIT);
+                        STAT_RECORD(CHAIN_LENGTH, links);
+                        co_return retval;
+                    }
+                }
+
+                off_t next = next_bucket(bucket);
+                if (next == 0) break;
+                offset = next;
+            }
+
+            // element not in the table
+            STAT_INC(TABLE_MISS);
+            STAT_RECORD(CHAIN_LENGTH, links);
+            throw KeyNotFoundException();
+        }
+#endif
+
+
+        void remove(TKey key)
+        {
+            if (!this->try_remove(key)) throw KeyNotFoundException();
+        }
+
+
+        /*
+         * Remove key, returning false rather than throwing if it wasn't
+         * there.
+         */
+        bool try_remove(TKey key)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->read_only) throw ReadOnlyException();
+            return this->locked_remove(key);
+        }
+
+
+        size_t hash(TKey key)
+        {
+            return hash_bucket(key, this->bucket_cnt);
+        }
+
+
+        size_t get_bucket_count()
+        {
+            return this->bucket_cnt;
+        }
+
+
+        IOHandler *get_io_handler()
+        {
+            return this->storage;
+        }
+
+        /*
+         * Write a point-in-time copy of the table to path, which can later be
+         * opened as a table in its own right or handed to restore. When the
+         * storage supports copy-on-write snapshots, the copy is taken a block
+         * at a time and other operations are free to run in between; pages
+         * they modify are preserved by the storage layer until the copy is
+         * done. Otherwise the table is locked for the length of the copy.
+         */
+        void snapshot(const char *path)
+        {
+            std::lock_guard<std::mutex> one_at_a_time(this->snapshot_lock);
+            std::unique_lock<std::mutex> guard(this->storage_lock);
+
+            bool cow = this->storage->begin_snapshot();
+            off_t len = this->storage->get_flen();
+            this->storage->advise(0, len, access_t::ONCE);
+            if (cow) guard.unlock();
+
+            RawIOHandler *out = nullptr;
+            try {
+                out = new RawIOHandler(path);
+                out->truncate(0);
+
+                std::vector<byte> block(snapshot_block_bytes);
+                for (off_t offset=0; offset<len; offset+=snapshot_block_bytes) {
+                    size_t size = std::min((off_t) snapshot_block_bytes, len - offset);
+
+                    if (cow) guard.lock();
+                    this->storage->snapshot_read(block.data(), size, offset);
+                    if (cow) guard.unlock();
+
+                    out->write(block.data(), size, offset);
+                }
+            } catch (...) {
+                if (!guard.owns_lock()) guard.lock();
+                this->storage->advise(0, len, access_t::NORMAL);
+                this->storage->end_snapshot();
+                delete out;
+                throw;
+            }
+
+            if (!guard.owns_lock()) guard.lock();
+            this->storage->advise(0, len, access_t::NORMAL);
+            this->storage->end_snapshot();
+            delete out;
+        }
+
+
+        /*
+         * Replace the table file fname with a copy of the snapshot at
+         * snapshot_path, and return a table opened on it. The copy is made
+         * alongside fname and then renamed into place, so fname is never
+         * left half written. Any table already open on fname must be closed
+         * first.
+         */
+        static HashTable *restore(const char *snapshot_path, const char *fname,
+                size_t bucket_cnt)
+        {
+            std::string staging = std::string(fname) + ".restore";
+            RawIOHandler::clone_file(snapshot_path, staging.c_str());
+
+            if (rename(staging.c_str(), fname)) {
+                unlink(staging.c_str());
+                throw IOException();
+            }
+            unlink((std::string(fname) + ".bloom").c_str());
+            unlink((std::string(fname) + ".txn").c_str());
+
+            return new HashTable(fname, bucket_cnt);
+        }
+
+
+        /*
+         * Write out everything changed since the table was last persisted.
+         * Readers map the table file, so it is never written in place: it
+         * is copied alongside itself (which costs next to nothing on a
+         * filesystem with reflinks), the changed pages are written to the
+         * copy, and the copy is renamed over the original. A reader has
+         * either the old file mapped or the new one, never a mix, and keeps
+         * the old one until it next refreshes. Storage that isn't a file
+         * table's buffer pool is just flushed. The caller must hold
+         * storage_lock.
+         */
+        void persist()
+        {
+            BufferedIOHandler *pool = dynamic_cast<BufferedIOHandler *>(this->storage);
+            if (this->fname.empty() || !pool) {
+                this->storage->flush();
+                return;
+            }
+
+            std::string staging = this->fname + ".publish";
+            RawIOHandler *copy = nullptr;
+            try {
+                RawIOHandler::clone_file(this->fname.c_str(), staging.c_str());
+                copy = new RawIOHandler(staging.c_str());
+                pool->write_dirty(copy);
+                copy->flush();
+                if (rename(staging.c_str(), this->fname.c_str())) throw IOException();
+            } catch (...) {
+                delete copy;
+                unlink(staging.c_str());
+                throw;
+            }
+
+            pool->adopt(copy);
+        }
+
+
+        /*
+         * Rewrite the table with the overflow buckets of each chain packed
+         * together after the primary buckets, in primary bucket order, so
+         * that walking a chain reads one contiguous stretch of the file,
+         * and a single prefetch covers all of it. This also squeezes out
+         * the dead slots, empty overflow buckets and orphans that removes
+         * and interrupted inserts leave behind. Elements keep their order
+         * within each chain.
+         *
+         * A table stored in a file is rebuilt alongside it in fname.compact
+         * and then renamed into place, so the file is never left half
+         * rewritten; publish afterwards to move readers over to it. Any
+         * other table is rebuilt in memory and copied back over storage.
+         * The table is locked while this runs, but scans and iterators in
+         * progress may see elements twice or not at all.
+         */
+        void compact()
+        {
+            std::lock_guard<std::mutex> one_at_a_time(this->snapshot_lock);
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->read_only) throw ReadOnlyException();
+
+            std::vector<std::pair<TKey, TValue>> elements;
+            this->locked_for_each([&elements](TKey key, TValue val) {
+                elements.emplace_back(key, val);
+            });
+
+            if (!this->fname.empty()) {
+                // Readers may still have the old file mapped, so bring it up
+                // to date first, and the old storage has nothing left to
+                // write to it once it has been replaced.
+                this->persist();
+
+                std::string staging = this->fname + ".compact";
+                RawIOHandler *file = nullptr;
+                try {
+                    file = new RawIOHandler(staging.c_str());
+                    build(file, this->bucket_cnt, elements.begin(), elements.end(),
+                            default_thread_count());
+                } catch (...) {
+                    delete file;
+                    unlink(staging.c_str());
+                    throw;
+                }
+                delete file;
+
+                if (rename(staging.c_str(), this->fname.c_str())) {
+                    unlink(staging.c_str());
+                    throw IOException();
+                }
+
+                IOHandler *reopened = new BufferedIOHandler(
+                        new RawIOHandler(this->fname.c_str()), 0);
+                delete this->storage;
+                this->storage = reopened;
+            } else {
+                // MemIOHandler can't take writes from several threads, so
+                // the image is built on one.
+                MemIOHandler image(128);
+                build(&image, this->bucket_cnt, elements.begin(), elements.end(), 1);
+
+                off_t len = image.get_flen();
+                this->storage->truncate(0);
+                std::vector<byte> block(snapshot_block_bytes);
+                for (off_t offset=0; offset<len; offset+=snapshot_block_bytes) {
+                    size_t size = std::min((off_t) snapshot_block_bytes, len - offset);
+                    image.read(block.data(), size, offset);
+                    this->storage->write(block.data(), size, offset);
+                }
+            }
+
+            this->chains.clear();
+        }
+
+
+        /*
+         * Make all changes so far visible to read only tables open on the
+         * same file, in this or any other process.
+         */
+        void publish()
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->read_only) throw ReadOnlyException();
+
+            this->persist();
+            if (this->fname.empty()) return;
+
+            // The filter has to be in place before readers are told to look
+            // for changes, or they could pick up new keys without it.
+            if (this->filter) this->save_filter();
+
+            if (!this->epoch) this->epoch = new Epoch(this->fname.c_str(), true);
+            this->epoch->advance();
+        }
+
+
+        /*
+         * Pick up anything published since the table was opened, or last
+         * refreshed. Read only tables do this on their own at the start of
+         * each lookup or scan. Returns true if anything changed.
+         */
+        bool refresh()
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            return this->locked_refresh();
+        }
+
+
+        bool is_read_only()
+        {
+            return this->read_only;
+        }
+
+
+        /*
+         * Keep a Bloom filter over the table's keys in memory, so that
+         * lookups and removes of keys that aren't there can be turned away
+         * without reading any buckets. For a table stored in a file, the
+         * filter saved in fname.bloom by an earlier run (or by the writer,
+         * for a read only table) is used if there is one. Otherwise the
+         * filter is sized for expected_keys keys, or a full table if that
+         * is 0, and built by scanning the table.
+         *
+         * Removed keys stay in the filter, and so slowly make it less
+         * useful. rebuild_filter clears them out.
+         */
+        void enable_filter(size_t expected_keys=0, size_t bits_per_key=10)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->filter) return;
+
+            if (this->filter_saved || (this->read_only && !this->fname.empty())) {
+                this->filter = BloomFilter::load(this->filter_path().c_str());
+                if (this->filter) return;
+            }
+
+            if (expected_keys == 0) expected_keys = this->bucket_cnt * elements_per_bucket;
+            this->filter = new BloomFilter(expected_keys, bits_per_key);
+            this->fill_filter();
+        }
+
+
+        /*
+         * Rebuild the filter from the keys currently in the table.
+         */
+        void rebuild_filter()
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (!this->filter) return;
+
+            this->filter->clear();
+            this->fill_filter();
+        }
+
+
+        BloomFilter *get_filter()
+        {
+            return this->filter;
+        }
+
+
+        /*
+         * Cache the values of up to capacity recently looked up keys in
+         * memory (see cache.hpp), so that hot keys are served without
+         * going near the buckets. The cache is split into segment_cnt
+         * independently locked segments. This must be called before the
+         * table is shared between threads.
+         */
+        void enable_cache(size_t capacity, size_t segment_cnt=16)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->cache) return;
+
+            this->cache = new KeyCache<TKey, TValue>(capacity, segment_cnt);
+        }
+
+
+        KeyCache<TKey, TValue> *get_cache()
+        {
+            return this->cache;
+        }
+
+
+        /*
+         * Log every change made to the table from here on, keeping the
+         * newest capacity of them in memory, so that they can be shipped
+         * to replicas (see net/primary.hpp). This must be called before
+         * the table is shared between threads.
+         */
+        void enable_change_log(size_t capacity)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->read_only) throw ReadOnlyException();
+            if (this->log) return;
+
+            this->log = new ChangeLog<TKey, TValue>(capacity);
+        }
+
+
+        ChangeLog<TKey, TValue> *get_change_log()
+        {
+            return this->log;
+        }
+
+
+        /*
+         * Reclaim the expired elements in the chains of the next buckets
+         * primary buckets, carrying on from where the last sweep left off
+         * and wrapping around at the end of the table, and return how many
+         * there were. storage_lock is taken once per chain, so a sweep can
+         * run alongside other operations. Does nothing unless TValue is
+         * Expiring.
+         */
+        size_t sweep(size_t buckets)
+        {
+            if (!expiry_traits<TValue>::enabled) return 0;
+            if (this->read_only) throw ReadOnlyException();
+
+            size_t reclaimed = 0;
+            for (size_t i=0; i<std::min(buckets, this->bucket_cnt); i++) {
+                std::lock_guard<std::mutex> guard(this->storage_lock);
+                size_t bucket_no = this->sweep_cursor;
+                this->sweep_cursor = (bucket_no + 1) % this->bucket_cnt;
+                reclaimed += this->locked_sweep(bucket_no);
+            }
+
+            return reclaimed;
+        }
+
+
+        /*
+         * Sweep in the background, a few buckets every tenth of a second,
+         * at no more than buckets_per_second primary buckets a second in
+         * all. Stopped by stop_sweeper, or when the table is deleted.
+         */
+        void start_sweeper(size_t buckets_per_second)
+        {
+            if (!expiry_traits<TValue>::enabled || this->sweeper.joinable()) return;
+            if (this->read_only) throw ReadOnlyException();
+
+            this->sweeper_stopping = false;
+            this->sweeper = std::thread(&HashTable::run_sweeper, this,
+                    std::max(buckets_per_second, (size_t) 1));
+        }
+
+
+        void stop_sweeper()
+        {
+            if (!this->sweeper.joinable()) return;
+
+            {
+                std::lock_guard<std::mutex> guard(this->sweeper_lock);
+                this->sweeper_stopping = true;
+            }
+            this->sweeper_wake.notify_all();
+            this->sweeper.join();
+        }
+
+
+        ~HashTable()
+        {
+            this->stop_sweeper();
+
+            if (!this->read_only && !this->fname.empty()) {
+                try {
+                    this->persist();
+                    if (this->filter) this->save_filter();
+                } catch (IOException &) {
+                    // If the file couldn't be copied, deleting the storage
+                    // writes the changes in place rather than losing them.
+                    // Without the filter's file, the next run just rebuilds
+                    // the filter from the table.
+                }
+            }
+
+            delete this->storage;
+            delete this->epoch;
+            delete this->filter;
+            delete this->cache;
+            delete this->log;
+            delete this->txn_log;
+        }
+
+
+        /*
+         * A consistent, read only view of the table as it was when the
+         * view was pinned, by pin, however it is changed afterwards. The
+         * view holds its epoch until it is destroyed, and while it does,
+         * any element changed through the table has its earlier state kept
+         * in memory for it; so views are meant to be dropped once they are
+         * done with, as the version store grows with the number of changes
+         * made while the oldest one is pinned. With no views pinned, writes
+         * cost nothing extra.
+         *
+         * Only changes made through the same HashTable object are held
+         * back, so a view of a read only table, whose file is changed by
+         * another process, isn't stable, and neither bulk_load nor restore,
+         * which replace the contents wholesale, are held back either.
+         * Expiry is still by the clock.
+         */
+        class ReadView
+        {
+            public:
+                ReadView(ReadView &&other) : table(other.table), at(other.at)
+                {
+                    other.table = nullptr;
+                }
+
+                ReadView(const ReadView &) = delete;
+                ReadView &operator=(const ReadView &) = delete;
+
+                ~ReadView()
+                {
+                    if (this->table) this->table->unpin(this->at);
+                }
+
+                bool try_get(TKey key, TValue *val)
+                {
+                    return this->table->view_get(key, this->at, val);
+                }
+
+                TValue get(TKey key)
+                {
+                    TValue val;
+                    if (!this->try_get(key, &val)) throw KeyNotFoundException();
+
+                    return val;
+                }
+
+                bool contains(TKey key)
+                {
+                    TValue val;
+                    return this->try_get(key, &val);
+                }
+
+                /*
+                 * Call fn(key, value) for every element in the view. The
+                 * table isn't locked for the length of the scan, only one
+                 * chain at a time, and writers carry on alongside it.
+                 */
+                template <typename F>
+                void for_each(F fn)
+                {
+                    this->table->view_for_each(this->at, fn);
+                }
+
+                uint64_t get_epoch()
+                {
+                    return this->at;
+                }
+
+            private:
+                friend class HashTable;
+                ReadView(HashTable *table, uint64_t at) : table(table), at(at) {}
+
+                HashTable *table;
+                uint64_t at;
+        };
+
+
+        ReadView pin()
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            uint64_t at = this->write_epoch++;
+            this->pins.insert(at);
+
+            return ReadView(this, at);
+        }
+
+
+        /*
+         * The number of before images held for pinned views.
+         */
+        size_t get_version_count()
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            return this->image_order.size();
+        }
+
+
+        /*
+         * A group of reads and writes over any number of keys that is
+         * applied to the table whole or not at all, begun by
+         * begin_transaction. Reads go to the table as they are made, noting
+         * the version of each chain they look at, while writes are held
+         * back until commit (the transaction's own reads see them). commit
+         * checks, under storage_lock, that none of the chains read have
+         * changed since, and if so applies every write in bucket order and
+         * returns true. If one has, it returns false having changed
+         * nothing, and the transaction should be run again from the start.
+         * Nothing is locked while a transaction runs, so when keys are
+         * rarely contended, this costs little more than the operations
+         * themselves.
+         *
+         * For a table stored in a file, the writes are logged to fname.txn
+         * and synced before they are applied, and the table is flushed
+         * afterwards, so a commit survives a crash whole or not at all;
+         * opening the table finishes off one that was cut short.
+         *
+         * Versions are held in memory, so only changes made through the
+         * same HashTable object count as conflicts, and a transaction's
+         * writes reach replicas as separate changes. A Transaction is not
+         * itself safe to share between threads.
+         */
+        class Transaction
+        {
+            public:
+                bool try_get(TKey key, TValue *val)
+                {
+                    auto written = this->writes.find(key);
+                    if (written != this->writes.end()) {
+                        if (written->second.kind == change_t::REMOVE) return false;
+
+                        *val = written->second.val;
+                        return true;
+                    }
+
+                    return this->table->transaction_get(key, val, &this->reads);
+                }
+
+                TValue get(TKey key)
+                {
+                    TValue val;
+                    if (!this->try_get(key, &val)) throw KeyNotFoundException();
+
+                    return val;
+                }
+
+                bool contains(TKey key)
+                {
+                    TValue val;
+                    return this->try_get(key, &val);
+                }
+
+                /*
+                 * Set key to val on commit, whether or not it is there
+                 * already, as with upsert.
+                 */
+                void put(TKey key, TValue val)
+                {
+                    this->writes[key] = TxnWrite{change_t::PUT, val};
+                }
+
+                /*
+                 * Remove key on commit, if it is there.
+                 */
+                void remove(TKey key)
+                {
+                    this->writes[key] = TxnWrite{change_t::REMOVE, TValue()};
+                }
+
+                /*
+                 * Apply the writes if nothing read has changed, returning
+                 * whether they were. Either way, the transaction is empty
+                 * afterwards, ready to be run again.
+                 */
+                bool commit()
+                {
+                    bool committed;
+                    try {
+                        committed = this->table->commit_transaction(this->reads, this->writes);
+                    } catch (...) {
+                        this->abort();
+                        throw;
+                    }
+
+                    this->abort();
+                    return committed;
+                }
+
+                /*
+                 * Throw away everything read and written so far.
+                 */
+                void abort()
+                {
+                    this->reads.clear();
+                    this->writes.clear();
+                }
+
+            private:
+                friend class HashTable;
+                Transaction(HashTable *table) : table(table) {}
+
+                HashTable *table;
+                TxnReads reads;
+                TxnWrites writes;
+        };
+
+
+        Transaction begin_transaction()
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            if (this->versions.empty()) this->versions.assign(this->bucket_cnt, 0);
+
+            return Transaction(this);
+        }
+
+
+        /*
+         * Forward iterator over every live element in the table. Primary
+         * buckets are visited in order, and each one's overflow chain is
+         * walked before moving on to the next. Elements are yielded by value
+         * as a {key, value} pair.
+         *
+         * The iterator holds a copy of the bucket it is currently positioned
+         * on, so it is safe to use alongside other operations, but elements
+         * inserted or removed during iteration may or may not be seen.
+         */
+        class iterator
+        {
+            public:
+                typedef std::forward_iterator_tag iterator_category;
+                typedef std::pair<TKey, TValue> value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef const value_type* pointer;
+                typedef const value_type& reference;
+
+                iterator(HashTable *table, size_t bucket_no)
+                {
+                    this->table = table;
+                    this->bucket_no = bucket_no;
+                    this->slot = 0;
+
+                    if (bucket_no < table->bucket_cnt) {
+                        this->offset = table->bucket_offset(bucket_no);
+                        table->locked_read(this->bucket, bucket_bytes, this->offset);
+                        this->settle();
+                    } else {
+                        this->bucket_no = table->bucket_cnt;
+                        this->offset = 0;
+                    }
+                }
+
+                reference operator*() const
+                {
+                    return this->current;
+                }
+
+                pointer operator->() const
+                {
+                    return &this->current;
+                }
+
+                iterator& operator++()
+                {
+                    this->slot++;
+                    this->settle();
+                    return *this;
+                }
+
+                iterator operator++(int)
+                {
+                    iterator tmp = *this;
+                    ++(*this);
+                    return tmp;
+                }
+
+                bool operator==(const iterator &other) const
+                {
+                    return this->table == other.table &&
+                           this->bucket_no == other.bucket_no &&
+                           this->offset == other.offset &&
+                           this->slot == other.slot;
+                }
+
+                bool operator!=(const iterator &other) const
+                {
+                    return !(*this == other);
+                }
+
+            private:
+                HashTable *table;
+                size_t bucket_no;
+                off_t offset;
+                size_t slot;
+                byte bucket[bucket_bytes];
+                value_type current;
+
+                /*
+                 * Move forward from the current position until we land on
+                 * a live element, or run off the end of the table.
+                 */
+                void settle()
+                {
+                    uint64_t now = expiry_clock();
+                    while (this->bucket_no < this->table->bucket_cnt) {
+                        for (; this->slot < elements_per_bucket; this->slot++) {
+                            if (this->table->is_live(this->slot * element_sz, this->bucket, now)) {
+                                this->table->read_element(this->bucket, this->slot,
+                                        &this->current.first, &this->current.second);
+                                return;
+                            }
+                        }
+
+                        this->slot = 0;
+                        off_t next = this->table->next_bucket(this->bucket);
+                        if (next != 0) {
+                            this->offset = next;
+                        } else if (++this->bucket_no < this->table->bucket_cnt) {
+                            this->offset = this->table->bucket_offset(this->bucket_no);
+                        } else {
+                            this->offset = 0;
+                            return;
+                        }
+
+                        this->table->locked_read(this->bucket, bucket_bytes, this->offset);
+                    }
+                }
+        };
+
+
+        /*
+         * Walk the whole table and report on its structure. See
+         * TableAnalysis for what is measured. Like the other scans, this
+         * doesn't block other operations while it runs.
+         */
+        TableAnalysis analyze()
+        {
+            this->refresh();
+            ScanHints hints(this);
+
+            TableAnalysis result = TableAnalysis();
+            result.chain_lengths.assign(2, 0);
+            result.primary_buckets = this->bucket_cnt;
+
+            std::vector<off_t> overflow;
+            std::vector<byte> block(scan_block_buckets * bucket_bytes);
+            byte link[bucket_bytes];
+            uint64_t now = expiry_clock();
+
+            for (size_t start=0; start<this->bucket_cnt; start+=scan_block_buckets) {
+                size_t cnt = this->bucket_cnt - start;
+                if (cnt > scan_block_buckets) cnt = scan_block_buckets;
+                this->locked_read(block.data(), cnt * bucket_bytes, this->bucket_offset(start));
+
+                for (size_t i=0; i<cnt; i++) {
+                    byte *current = block.data() + i * bucket_bytes;
+                    size_t links = 0;
+
+                    while (true) {
+                        links++;
+                        off_t next = this->next_bucket(current);
+
+                        size_t live = 0;
+                        size_t last_live = 0;
+                        for (size_t j=0; j<elements_per_bucket; j++) {
+                            if (this->is_live(j * element_sz, current, now)) {
+                                live++;
+                                last_live = j + 1;
+                            }
+                        }
+
+                        result.elements += live;
+                        result.slots += elements_per_bucket;
+                        result.dead_slots += (next != 0) ? elements_per_bucket - live
+                                                         : last_live - live;
+                        if (links > 1 && live == 0) result.empty_overflow_buckets++;
+
+                        if (next == 0) break;
+
+                        overflow.push_back(next);
+                        this->locked_read(link, bucket_bytes, next);
+                        current = link;
+                    }
+
+                    if (links >= result.chain_lengths.size()) {
+                        result.chain_lengths.resize(links + 1, 0);
+                    }
+                    result.chain_lengths[links]++;
+                    result.max_chain_length = std::max(result.max_chain_length, links);
+                }
+            }
+
+            result.overflow_buckets = overflow.size();
+            result.orphaned_buckets = this->count_orphans(overflow);
+
+            if (result.slots) {
+                result.load_factor = (double) result.elements / result.slots;
+            }
+
+            if (this->bucket_cnt) {
+                result.mean_chain_length = (double) (this->bucket_cnt + result.overflow_buckets) /
+                                           this->bucket_cnt;
+            }
+
+            double per_bucket = elements_per_bucket * target_fill;
+            result.recommended_bucket_cnt = (size_t) (result.elements / per_bucket) + 1;
+
+            return result;
+        }
+
+
+        iterator begin()
+        {
+            this->refresh();
+            return iterator(this, 0);
+        }
+
+
+        iterator end()
+        {
+            return iterator(this, this->bucket_cnt);
+        }
+
+
+        /*
+         * Call fn(key, value) for every live element in the table, using
+         * thread_cnt threads. The primary buckets are split into contiguous
+         * ranges, one per thread, and each range is read scan_block_buckets
+         * at a time so that the bulk of the scan is large sequential reads.
+         * Overflow chains are followed one bucket at a time.
+         *
+         * fn is called concurrently from several threads, and so must be
+         * thread safe. Like the iterator, the scan does not block other
+         * operations, and so offers no guarantees about elements modified
+         * while it is running.
+         */
+        template <typename F>
+        void parallel_for_each(F fn, size_t thread_cnt=default_thread_count())
+        {
+            this->refresh();
+            ScanHints hints(this);
+            parallel_ranges(this->bucket_cnt, thread_cnt,
+                    [this, &fn](size_t, size_t begin, size_t end) {
+                std::vector<byte> block(scan_block_buckets * bucket_bytes);
+
+                for (size_t start=begin; start<end; start+=scan_block_buckets) {
+                    size_t cnt = end - start;
+                    if (cnt > scan_block_buckets) cnt = scan_block_buckets;
+                    this->locked_read(block.data(), cnt * bucket_bytes,
+                            this->bucket_offset(start));
+
+                    for (size_t i=0; i<cnt; i++) {
+                        this->scan_chain(block.data() + i * bucket_bytes, fn);
+                    }
+                }
+            });
+        }
+
+};
+
+#endif
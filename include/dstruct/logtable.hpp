@@ -0,0 +1,645 @@
+/*
+ * logtable.hpp
+ * A hash table that only ever appends to its files
+ *
+ * HashTable updates its buckets in place, so every insert is a random
+ * write, and a new element can take three of them (the element, the byte
+ * extending the file, and the pointer to a new link). LogHashTable is for
+ * write heavy loads where that hurts: every insert, update and remove is
+ * appended as a record to the end of a log, and an index held in memory,
+ * Bitcask style, maps each key to the record holding its current value.
+ * A lookup is a single read of that record, and writes are sequential.
+ *
+ * The log is a series of segment files, <dir>/<id>.log, each up to
+ * segment_bytes long. A record is a change_t (see changelog.hpp), then the
+ * key, then the value (which a REMOVE leaves zeroed). As in FASTER's
+ * hybrid log, the newest records are kept in a tail in memory and written
+ * to the head segment together once it fills, so appends don't cost an I/O
+ * each. flush writes the tail out and syncs it; anything appended since
+ * the last flush can be lost in a crash, although a record is never torn.
+ * Opening the table replays the segments in order to rebuild the index,
+ * dropping any partial record at the end.
+ *
+ * Records that have been overwritten or removed are dead, and the space
+ * they take is reclaimed by compaction, which works from the oldest
+ * segment forward: the records of that segment the index still points to
+ * are appended again at the head, and then the segment is deleted. As
+ * nothing is older than the oldest segment, its REMOVE records have
+ * nothing left to hide and are simply dropped. Segments are compacted
+ * while the fraction of dead records in the sealed ones (every segment
+ * but the head) is at least compact_threshold, either on request or by a
+ * background compactor. Compaction reads the segment a block at a time,
+ * and only holds the table for the length of each block, so it can run
+ * alongside other operations.
+ *
+ * Unlike HashTable, any key and value can be stored, including {0, 0}.
+ * The cost is memory: the index holds every key in the table.
+ */
+#ifndef logtab
+#define logtab
+
+#include "dstruct/changelog.hpp"
+#include "dstruct/hashtable.hpp"
+#include "io/raw.hpp"
+#include "io/exceptions.hpp"
+#include "util/stats.hpp"
+#include "kvs.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+template <typename TKey, typename TValue>
+class LogHashTable
+{
+    private:
+        static constexpr size_t const record_bytes = 1 + sizeof(TKey) + sizeof(TValue);
+
+        /*
+         * Number of records the tail holds before it is written out, and
+         * the number compaction reads per I/O (and per hold of the table).
+         */
+        static constexpr size_t const tail_records = 1024;
+        static constexpr size_t const compact_block_records = 4096;
+
+        struct Location
+        {
+            uint32_t segment;
+            off_t offset;
+        };
+
+        /*
+         * A segment file, and how many records it holds, and how many of
+         * those the index still points to.
+         */
+        struct Segment
+        {
+            RawIOHandler *file;
+            size_t records;
+            size_t live;
+        };
+
+        std::string dir;
+        size_t segment_bytes;
+        double compact_threshold;
+
+        /*
+         * Guards everything below, and every access to the segment files.
+         */
+        std::mutex storage_lock;
+
+        std::unordered_map<TKey, Location> index;
+        std::map<uint32_t, Segment> segments;
+
+        // the segment being appended to, the length of it already written
+        // out, and the records appended past that
+        uint32_t head;
+        off_t head_len;
+        std::vector<byte> tail;
+
+        /*
+         * Only one compaction runs at a time, whether asked for or done by
+         * the background compactor.
+         */
+        std::mutex compact_lock;
+
+        std::thread compactor;
+        std::mutex compactor_lock;
+        std::condition_variable compactor_wake;
+        bool compactor_stopping;
+
+        std::string segment_path(uint32_t id)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "/%010u.log", id);
+            return this->dir + name;
+        }
+
+        static void inline encode(byte *record, change_t kind, TKey key, TValue val)
+        {
+            record[0] = (byte) kind;
+            memcpy(record + 1, &key, sizeof(TKey));
+            memcpy(record + 1 + sizeof(TKey), &val, sizeof(TValue));
+        }
+
+        static void inline decode(const byte *record, TKey *key, TValue *val)
+        {
+            memcpy(key, record + 1, sizeof(TKey));
+            memcpy(val, record + 1 + sizeof(TKey), sizeof(TValue));
+        }
+
+        /*
+         * Open segment id, creating it if it doesn't exist, and add it to
+         * segments.
+         */
+        Segment &open_segment(uint32_t id)
+        {
+            Segment segment = {new RawIOHandler(this->segment_path(id).c_str()), 0, 0};
+            return this->segments[id] = segment;
+        }
+
+        /*
+         * Rebuild the index from the segments in dir, in order. A segment
+         * that ends part way through a record, or with a record that isn't
+         * one (the zeroes of a write that never made it), is cut short
+         * there.
+         */
+        void recover()
+        {
+            std::vector<uint32_t> ids;
+            DIR *listing = opendir(this->dir.c_str());
+            if (!listing) throw IOException();
+
+            while (dirent *entry = readdir(listing)) {
+                char *end;
+                unsigned long id = strtoul(entry->d_name, &end, 10);
+                if (end != entry->d_name && strcmp(end, ".log") == 0) ids.push_back(id);
+            }
+            closedir(listing);
+            std::sort(ids.begin(), ids.end());
+
+            std::vector<byte> block(compact_block_records * record_bytes);
+            for (uint32_t id : ids) {
+                Segment &segment = this->open_segment(id);
+                off_t len = segment.file->get_flen();
+                off_t good = 0;
+
+                for (off_t offset=0; offset + (off_t) record_bytes <= len; ) {
+                    size_t size = std::min((off_t) block.size(), len - offset);
+                    size -= size % record_bytes;
+                    segment.file->read(block.data(), size, offset);
+
+                    size_t i = 0;
+                    for (; i<size; i+=record_bytes) {
+                        change_t kind = (change_t) block[i];
+                        if (kind != change_t::PUT && kind != change_t::REMOVE) break;
+
+                        TKey key;
+                        TValue val;
+                        decode(block.data() + i, &key, &val);
+                        this->replay(kind, key, Location{id, offset + (off_t) i});
+                    }
+
+                    offset += i;
+                    good = offset;
+                    if (i < size) break;
+                }
+
+                if (good < len) segment.file->truncate(good);
+            }
+
+            if (ids.empty()) this->open_segment(0);
+            this->head = this->segments.rbegin()->first;
+            this->head_len = this->segments.rbegin()->second.file->get_flen();
+        }
+
+        void replay(change_t kind, TKey key, Location location)
+        {
+            this->segments[location.segment].records++;
+
+            auto found = this->index.find(key);
+            if (found != this->index.end()) {
+                this->segments[found->second.segment].live--;
+                if (kind == change_t::REMOVE) this->index.erase(found);
+            }
+
+            if (kind == change_t::PUT) {
+                this->index[key] = location;
+                this->segments[location.segment].live++;
+            }
+        }
+
+        /*
+         * Write the tail out to the head segment in a single I/O. The
+         * caller must hold storage_lock.
+         */
+        void write_tail()
+        {
+            if (this->tail.empty()) return;
+
+            this->segments[this->head].file->write(this->tail.data(), this->tail.size(),
+                    this->head_len);
+            this->head_len += this->tail.size();
+            this->tail.clear();
+        }
+
+        /*
+         * Seal the head segment and start a new one. The caller must hold
+         * storage_lock.
+         */
+        void roll()
+        {
+            this->write_tail();
+            this->segments[this->head].file->flush();
+
+            this->head++;
+            this->open_segment(this->head).file->truncate(0);
+            this->head_len = 0;
+        }
+
+        /*
+         * Append a record to the log, returning where it went. The caller
+         * must hold storage_lock.
+         */
+        Location append(change_t kind, TKey key, TValue val)
+        {
+            STAT_INC(LOG_APPEND);
+            off_t end = this->head_len + this->tail.size();
+            if (end && end + record_bytes > this->segment_bytes) {
+                this->roll();
+                end = 0;
+            }
+
+            Location location = {this->head, end};
+            this->tail.resize(this->tail.size() + record_bytes);
+            encode(this->tail.data() + this->tail.size() - record_bytes, kind, key, val);
+            this->segments[this->head].records++;
+
+            if (this->tail.size() >= tail_records * record_bytes) this->write_tail();
+            return location;
+        }
+
+        /*
+         * Read the value out of the record at location. The caller must
+         * hold storage_lock.
+         */
+        TValue read_value(Location location)
+        {
+            TValue val;
+            off_t at = location.offset + 1 + sizeof(TKey);
+
+            if (location.segment == this->head && location.offset >= this->head_len) {
+                memcpy(&val, this->tail.data() + (at - this->head_len), sizeof(TValue));
+            } else {
+                this->segments[location.segment].file->read((byte *) &val, sizeof(TValue), at);
+            }
+
+            return val;
+        }
+
+        /*
+         * Point key at a new record. The caller must hold storage_lock.
+         */
+        void locate(TKey key, Location location)
+        {
+            auto found = this->index.find(key);
+            if (found != this->index.end()) {
+                this->segments[found->second.segment].live--;
+                found->second = location;
+            } else {
+                this->index.emplace(key, location);
+            }
+            this->segments[location.segment].live++;
+        }
+
+        /*
+         * The fraction of the records in sealed segments that are dead.
+         * The caller must hold storage_lock.
+         */
+        double sealed_dead_ratio()
+        {
+            size_t records = 0;
+            size_t live = 0;
+            for (auto &entry : this->segments) {
+                if (entry.first == this->head) continue;
+                records += entry.second.records;
+                live += entry.second.live;
+            }
+
+            return (records) ? (double) (records - live) / records : 0;
+        }
+
+        /*
+         * Move the live records of the oldest segment, which mustn't be the
+         * head, to the head, and then delete it.
+         */
+        void compact_oldest()
+        {
+            uint32_t id;
+            RawIOHandler *file;
+            off_t len;
+            {
+                std::lock_guard<std::mutex> guard(this->storage_lock);
+                id = this->segments.begin()->first;
+                file = this->segments.begin()->second.file;
+                len = file->get_flen();
+                file->advise(0, len, access_t::ONCE);
+            }
+
+            std::vector<byte> block(compact_block_records * record_bytes);
+            for (off_t offset=0; offset<len; offset+=block.size()) {
+                std::lock_guard<std::mutex> guard(this->storage_lock);
+                size_t size = std::min((off_t) block.size(), len - offset);
+                file->read(block.data(), size, offset);
+
+                for (size_t i=0; i<size; i+=record_bytes) {
+                    if ((change_t) block[i] != change_t::PUT) continue;
+
+                    TKey key;
+                    TValue val;
+                    decode(block.data() + i, &key, &val);
+                    auto found = this->index.find(key);
+                    if (found == this->index.end() || found->second.segment != id ||
+                            found->second.offset != offset + (off_t) i) {
+                        continue;
+                    }
+
+                    STAT_INC(LOG_RELOCATE);
+                    this->locate(key, this->append(change_t::PUT, key, val));
+                }
+            }
+
+            // The records just moved have to be safely in the head before
+            // the only other copy of them goes.
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            this->write_tail();
+            this->segments[this->head].file->flush();
+
+            STAT_INC(LOG_RECLAIM);
+            delete file;
+            unlink(this->segment_path(id).c_str());
+            this->segments.erase(id);
+        }
+
+        void run_compactor(std::chrono::milliseconds interval)
+        {
+            std::unique_lock<std::mutex> guard(this->compactor_lock);
+            while (!this->compactor_stopping) {
+                this->compactor_wake.wait_for(guard, interval);
+                if (this->compactor_stopping) break;
+
+                guard.unlock();
+                try {
+                    this->compact();
+                } catch (std::exception &) {
+                    // Nothing has been lost; the next pass will try again.
+                }
+                guard.lock();
+            }
+        }
+
+    public:
+        /*
+         * Open the table stored in the directory dir, creating it if need
+         * be. The head segment is sealed and a new one started once it
+         * reaches segment_bytes.
+         */
+        LogHashTable(const char *dir, size_t segment_bytes=1 << 26,
+                double compact_threshold=0.5)
+        {
+            this->dir = dir;
+            this->segment_bytes = std::max(segment_bytes, (size_t) record_bytes);
+            this->compact_threshold = compact_threshold;
+            this->compactor_stopping = false;
+
+            if (mkdir(dir, 0755) == -1 && errno != EEXIST) throw IOException();
+            this->tail.reserve(tail_records * record_bytes);
+
+            try {
+                this->recover();
+            } catch (...) {
+                for (auto &entry : this->segments) delete entry.second.file;
+                throw;
+            }
+        }
+
+
+        TValue insert(TKey key, TValue val)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            STAT_INC(TABLE_INSERT);
+            auto found = this->index.find(key);
+            if (found != this->index.end()) return this->read_value(found->second);
+
+            this->locate(key, this->append(change_t::PUT, key, val));
+            return val;
+        }
+
+
+        /*
+         * Like insert, but if key is already in the table its value is
+         * replaced with val. Returns val either way.
+         */
+        TValue upsert(TKey key, TValue val)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            STAT_INC(TABLE_INSERT);
+            this->locate(key, this->append(change_t::PUT, key, val));
+            return val;
+        }
+
+
+        TValue get(TKey key)
+        {
+            TValue val;
+            if (!this->try_get(key, &val)) throw KeyNotFoundException();
+
+            return val;
+        }
+
+
+        bool try_get(TKey key, TValue *val)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            STAT_INC(TABLE_GET);
+            auto found = this->index.find(key);
+            if (found == this->index.end()) {
+                STAT_INC(TABLE_MISS);
+                return false;
+            }
+
+            STAT_INC(TABLE_HIT);
+            *val = this->read_value(found->second);
+            return true;
+        }
+
+
+        bool contains(TKey key)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            return this->index.find(key) != this->index.end();
+        }
+
+
+        void remove(TKey key)
+        {
+            if (!this->try_remove(key)) throw KeyNotFoundException();
+        }
+
+
+        bool try_remove(TKey key)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            STAT_INC(TABLE_REMOVE);
+            auto found = this->index.find(key);
+            if (found == this->index.end()) return false;
+
+            this->segments[found->second.segment].live--;
+            this->index.erase(found);
+            this->append(change_t::REMOVE, key, TValue());
+            return true;
+        }
+
+
+        /*
+         * Call fn(key, value) for every element in the table. The table is
+         * locked for the duration.
+         */
+        template <typename F>
+        void for_each(F fn)
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            for (auto &entry : this->index) {
+                fn(entry.first, this->read_value(entry.second));
+            }
+        }
+
+
+        size_t size()
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            return this->index.size();
+        }
+
+
+        /*
+         * Write out the tail and sync the head segment, so that everything
+         * appended so far survives a crash.
+         */
+        void flush()
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            this->write_tail();
+            this->segments[this->head].file->flush();
+        }
+
+
+        /*
+         * Compact segments, oldest first, until the fraction of dead
+         * records in the sealed segments is below the threshold, and
+         * return how many were reclaimed. Each segment that existed at the
+         * start is considered at most once, so records moved from an
+         * all-live segment can't keep the pass going forever.
+         */
+        size_t compact()
+        {
+            std::lock_guard<std::mutex> one_at_a_time(this->compact_lock);
+
+            uint32_t last;
+            {
+                std::lock_guard<std::mutex> guard(this->storage_lock);
+                last = this->head;
+            }
+
+            size_t reclaimed = 0;
+            while (true) {
+                {
+                    std::lock_guard<std::mutex> guard(this->storage_lock);
+                    uint32_t oldest = this->segments.begin()->first;
+                    if (oldest == this->head || oldest >= last) break;
+                    if (this->sealed_dead_ratio() < this->compact_threshold) break;
+                }
+
+                this->compact_oldest();
+                reclaimed++;
+            }
+
+            return reclaimed;
+        }
+
+
+        /*
+         * Compact in the background, checking every interval whether there
+         * is anything worth doing. Stopped by stop_compactor, or when the
+         * table is deleted.
+         */
+        void start_compactor(std::chrono::milliseconds interval=std::chrono::milliseconds(1000))
+        {
+            if (this->compactor.joinable()) return;
+
+            this->compactor_stopping = false;
+            this->compactor = std::thread(&LogHashTable::run_compactor, this, interval);
+        }
+
+
+        void stop_compactor()
+        {
+            if (!this->compactor.joinable()) return;
+
+            {
+                std::lock_guard<std::mutex> guard(this->compactor_lock);
+                this->compactor_stopping = true;
+            }
+            this->compactor_wake.notify_all();
+            this->compactor.join();
+        }
+
+
+        size_t get_segment_count()
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            return this->segments.size();
+        }
+
+
+        /*
+         * The total length of the log, including the tail, in bytes.
+         */
+        size_t get_log_bytes()
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            size_t bytes = this->tail.size();
+            for (auto &entry : this->segments) {
+                bytes += (entry.first == this->head) ? this->head_len :
+                        entry.second.file->get_flen();
+            }
+
+            return bytes;
+        }
+
+
+        /*
+         * The fraction of all records in the log, the head included, that
+         * are dead.
+         */
+        double get_dead_ratio()
+        {
+            std::lock_guard<std::mutex> guard(this->storage_lock);
+            size_t records = 0;
+            size_t live = 0;
+            for (auto &entry : this->segments) {
+                records += entry.second.records;
+                live += entry.second.live;
+            }
+
+            return (records) ? (double) (records - live) / records : 0;
+        }
+
+
+        ~LogHashTable()
+        {
+            this->stop_compactor();
+
+            try {
+                this->flush();
+            } catch (std::exception &) {}
+
+            for (auto &entry : this->segments) delete entry.second.file;
+        }
+};
+
+#endif
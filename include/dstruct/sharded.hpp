@@ -0,0 +1,346 @@
+/*
+ * sharded.hpp
+ * A front-end that spreads keys across several independent tables
+ *
+ * A single HashTable funnels everything through one file, one buffer pool
+ * and one lock. ShardedHashTable splits the key space over shard_cnt
+ * ordinary HashTables instead, each with its own file (and so its own
+ * BufferedIOHandler), so that operations on different shards never
+ * contend with each other, and the shard files can live on different
+ * devices.
+ */
+#ifndef shardtab
+#define shardtab
+
+#include "dstruct/hashtable.hpp"
+#include "util/affinity.hpp"
+#include "util/parallel.hpp"
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+template <typename TKey, typename TValue>
+class ShardedHashTable
+{
+    private:
+        typedef HashTable<TKey, TValue> table_t;
+
+        std::vector<table_t *> shards;
+
+        /*
+         * The cores that each shard's batch workers are restricted to, for
+         * those shards that have been pinned.
+         */
+        std::vector<cpu_set_t> affinity;
+        std::vector<bool> pinned;
+
+        /*
+         * Route a key to a shard using the high bits of its hash. Each shard
+         * picks buckets using the hash modulo its bucket count, which for
+         * std::hash on integers is just the low bits of the key, so the key
+         * is first run through a multiplicative mix to keep the two choices
+         * independent. The top bits of the mixed hash are then scaled into
+         * range with a multiply rather than a %.
+         */
+        static size_t inline shard_of(TKey key, size_t shard_cnt)
+        {
+            std::hash<TKey> hash_key;
+            uint64_t mixed = (uint64_t) hash_key(key) * 0x9E3779B97F4A7C15ull;
+            return (size_t) (((unsigned __int128) mixed * shard_cnt) >> 64);
+        }
+
+
+        void check_shard(size_t shard)
+        {
+            if (shard >= this->shards.size())
+                throw std::out_of_range("Bad shard number--past the number of shards.");
+        }
+
+
+        /*
+         * Run fn(shard) for every shard at once, each on its own thread,
+         * pinned to the shard's cores if it has any.
+         */
+        template <typename F>
+        void run_shards(F fn)
+        {
+            parallel_ranges(this->shards.size(), this->shards.size(),
+                    [this, &fn](size_t, size_t begin, size_t end) {
+                for (size_t s=begin; s<end; s++) {
+                    if (this->pinned[s]) pin_thread(&this->affinity[s]);
+                    fn(s);
+                }
+            });
+        }
+
+
+        void init(size_t shard_cnt)
+        {
+            if (shard_cnt == 0)
+                throw std::invalid_argument("A sharded table needs at least one shard.");
+
+            this->shards.reserve(shard_cnt);
+            this->affinity.resize(shard_cnt);
+            this->pinned.assign(shard_cnt, false);
+        }
+
+
+    public:
+        ShardedHashTable(size_t shard_cnt, size_t buckets_per_shard)
+        {
+            this->init(shard_cnt);
+            for (size_t i=0; i<shard_cnt; i++) {
+                this->shards.push_back(new table_t(buckets_per_shard));
+            }
+        }
+
+
+        /*
+         * Open a sharded table stored in files named base.0, base.1, and so
+         * on. The shard count and bucket count must match those the table
+         * was created with, as they decide where every key lives.
+         */
+        ShardedHashTable(const char *base, size_t shard_cnt, size_t buckets_per_shard,
+                open_t mode=open_t::READ_WRITE)
+        {
+            this->init(shard_cnt);
+            try {
+                for (size_t i=0; i<shard_cnt; i++) {
+                    std::string path = std::string(base) + "." + std::to_string(i);
+                    this->shards.push_back(new table_t(path.c_str(), buckets_per_shard, mode));
+                }
+            } catch (...) {
+                for (auto shard : this->shards) delete shard;
+                throw;
+            }
+        }
+
+
+        /*
+         * Open a sharded table with one shard per path, so that the shards
+         * can be spread over several devices. As above, the paths must be
+         * given in the same order every time.
+         */
+        ShardedHashTable(const std::vector<std::string> &paths, size_t buckets_per_shard,
+                open_t mode=open_t::READ_WRITE)
+        {
+            this->init(paths.size());
+            try {
+                for (auto &path : paths) {
+                    this->shards.push_back(new table_t(path.c_str(), buckets_per_shard, mode));
+                }
+            } catch (...) {
+                for (auto shard : this->shards) delete shard;
+                throw;
+            }
+        }
+
+
+        TValue insert(TKey key, TValue val)
+        {
+            return this->shards[this->shard(key)]->insert(key, val);
+        }
+
+
+        TValue get(TKey key)
+        {
+            return this->shards[this->shard(key)]->get(key);
+        }
+
+
+        bool try_get(TKey key, TValue *val)
+        {
+            return this->shards[this->shard(key)]->try_get(key, val);
+        }
+
+
+        bool contains(TKey key)
+        {
+            return this->shards[this->shard(key)]->contains(key);
+        }
+
+
+        void remove(TKey key)
+        {
+            this->shards[this->shard(key)]->remove(key);
+        }
+
+
+        bool try_remove(TKey key)
+        {
+            return this->shards[this->shard(key)]->try_remove(key);
+        }
+
+
+        /*
+         * Insert every {key, value} pair in [first, last). The elements are
+         * grouped by shard, and each shard's group is inserted by its own
+         * thread, so a large batch is applied to all of the shards in
+         * parallel. Within a shard, elements are inserted in their original
+         * order.
+         */
+        template <typename InputIt>
+        void insert_batch(InputIt first, InputIt last)
+        {
+            std::vector<std::vector<std::pair<TKey, TValue>>> work(this->shards.size());
+            for (; first != last; ++first) {
+                work[this->shard(first->first)].emplace_back(first->first, first->second);
+            }
+
+            this->run_shards([this, &work](size_t s) {
+                for (auto &element : work[s]) {
+                    this->shards[s]->insert(element.first, element.second);
+                }
+            });
+        }
+
+
+        /*
+         * Look up every key in [first, last), in parallel across the shards
+         * as with insert_batch. The value for the i'th key is stored in
+         * values[i] and found[i] is set to whether it was in the table.
+         * Returns the number of keys found.
+         */
+        template <typename InputIt>
+        size_t get_batch(InputIt first, InputIt last, TValue *values, bool *found)
+        {
+            std::vector<TKey> keys(first, last);
+            std::vector<std::vector<size_t>> work(this->shards.size());
+            for (size_t i=0; i<keys.size(); i++) {
+                work[this->shard(keys[i])].push_back(i);
+            }
+
+            std::atomic<size_t> hits(0);
+            this->run_shards([this, &work, &keys, &hits, values, found](size_t s) {
+                size_t local = 0;
+                for (auto i : work[s]) {
+                    found[i] = this->shards[s]->try_get(keys[i], &values[i]);
+                    if (found[i]) local++;
+                }
+                hits += local;
+            });
+
+            return hits;
+        }
+
+
+        /*
+         * Remove every key in [first, last) that is in the table, in
+         * parallel across the shards. Returns the number removed.
+         */
+        template <typename InputIt>
+        size_t remove_batch(InputIt first, InputIt last)
+        {
+            std::vector<std::vector<TKey>> work(this->shards.size());
+            for (; first != last; ++first) {
+                work[this->shard(*first)].push_back(*first);
+            }
+
+            std::atomic<size_t> removed(0);
+            this->run_shards([this, &work, &removed](size_t s) {
+                size_t local = 0;
+                for (auto &key : work[s]) {
+                    if (this->shards[s]->try_remove(key)) local++;
+                }
+                removed += local;
+            });
+
+            return removed;
+        }
+
+
+        /*
+         * Call fn(key, value) for every live element, scanning all of the
+         * shards at once with one thread each. As with
+         * HashTable::parallel_for_each, fn must be thread safe.
+         */
+        template <typename F>
+        void parallel_for_each(F fn)
+        {
+            this->run_shards([this, &fn](size_t s) {
+                this->shards[s]->parallel_for_each(fn, 1);
+            });
+        }
+
+
+        /*
+         * Restrict the threads that carry out batch operations and scans on
+         * shard to a single core, or to the cores of a NUMA node. Point
+         * operations always run on the calling thread. Pinning a shard to
+         * the node its device is attached to keeps its buffer pool in local
+         * memory.
+         */
+        void pin_to_cpu(size_t shard, int cpu)
+        {
+            this->check_shard(shard);
+            if (cpu < 0 || cpu >= CPU_SETSIZE)
+                throw std::invalid_argument("Bad cpu number.");
+
+            CPU_ZERO(&this->affinity[shard]);
+            CPU_SET(cpu, &this->affinity[shard]);
+            this->pinned[shard] = true;
+        }
+
+
+        void pin_to_node(size_t shard, int node)
+        {
+            this->check_shard(shard);
+            cpu_set_t set;
+            if (!node_cpus(node, &set))
+                throw std::invalid_argument("Unknown NUMA node.");
+
+            this->affinity[shard] = set;
+            this->pinned[shard] = true;
+        }
+
+
+        void unpin(size_t shard)
+        {
+            this->check_shard(shard);
+            this->pinned[shard] = false;
+        }
+
+
+        void publish()
+        {
+            for (auto shard : this->shards) shard->publish();
+        }
+
+
+        bool refresh()
+        {
+            bool changed = false;
+            for (auto shard : this->shards) changed |= shard->refresh();
+            return changed;
+        }
+
+
+        size_t shard(TKey key)
+        {
+            return shard_of(key, this->shards.size());
+        }
+
+
+        size_t get_shard_count()
+        {
+            return this->shards.size();
+        }
+
+
+        table_t *get_shard(size_t shard)
+        {
+            this->check_shard(shard);
+            return this->shards[shard];
+        }
+
+
+        ~ShardedHashTable()
+        {
+            for (auto shard : this->shards) delete shard;
+        }
+};
+
+#endif
@@ -0,0 +1,311 @@
+/*
+ * async.hpp
+ * Coroutine support for overlapping many reads on a single thread
+ *
+ * This needs C++20 (compile with -std=c++20), and is only pulled into
+ * hashtable.hpp when coroutines are available.
+ *
+ * A Task is a lazily started coroutine producing a single value. Tasks can
+ * co_await each other, and co_await IOScheduler::read to read from an
+ * IOHandler. A read that can be served from memory completes without
+ * suspending. Otherwise the task is suspended while the data is fetched
+ * from the device with POSIX AIO, and the scheduler runs other tasks in the
+ * meantime. One thread calling IOScheduler::run can so keep as many reads
+ * in flight as there are tasks waiting on them.
+ */
+#ifndef asyncio
+#define asyncio
+
+#include "kvs.hpp"
+#include "io/iohandler.hpp"
+#include "io/exceptions.hpp"
+#include <aio.h>
+#include <cerrno>
+#include <coroutine>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class Task
+{
+    public:
+        struct promise_type
+        {
+            T value;
+            std::exception_ptr error;
+            std::coroutine_handle<> continuation;
+
+            Task get_return_object()
+            {
+                return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            /*
+             * When a task finishes, pick up whoever was awaiting it
+             * straight away. A top level task has nobody waiting, and just
+             * stays suspended until it is destroyed.
+             */
+            struct final_awaiter
+            {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(
+                        std::coroutine_handle<promise_type> done) noexcept
+                {
+                    std::coroutine_handle<> next = done.promise().continuation;
+                    return (next) ? next : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+
+            final_awaiter final_suspend() noexcept { return {}; }
+            void return_value(T val) { this->value = std::move(val); }
+            void unhandled_exception() { this->error = std::current_exception(); }
+        };
+
+        Task(Task &&other) : handle(other.handle)
+        {
+            other.handle = nullptr;
+        }
+
+        Task(const Task &)=delete;
+        Task &operator=(const Task &)=delete;
+
+        bool await_ready() { return false; }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter)
+        {
+            this->handle.promise().continuation = waiter;
+            return this->handle;
+        }
+
+        T await_resume()
+        {
+            return this->result();
+        }
+
+        bool done()
+        {
+            return this->handle.done();
+        }
+
+        /*
+         * The value the task returned, or whatever it threw. Only valid
+         * once the task is done.
+         */
+        T result()
+        {
+            if (this->handle.promise().error) {
+                std::rethrow_exception(this->handle.promise().error);
+            }
+            return this->handle.promise().value;
+        }
+
+        std::coroutine_handle<> get_handle()
+        {
+            return this->handle;
+        }
+
+        ~Task()
+        {
+            if (this->handle) this->handle.destroy();
+        }
+
+    private:
+        std::coroutine_handle<promise_type> handle;
+
+        explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+};
+
+
+class IOScheduler;
+
+/*
+ * The awaitable returned by IOScheduler::read. lock guards storage, and is
+ * only held while the awaiter is looking at it, never across a suspension.
+ */
+class ReadAwaiter
+{
+    public:
+        ReadAwaiter(IOScheduler *scheduler, IOHandler *storage, std::mutex *lock,
+                byte *buffer, size_t size, off_t offset)
+            : scheduler(scheduler), storage(storage), lock(lock), buffer(buffer),
+              size(size), offset(offset), fetch_size(0), fetch_offset(0), stamp(0),
+              result(0)
+        {
+            memset(&this->cb, 0, sizeof(this->cb));
+        }
+
+        bool await_ready()
+        {
+            std::lock_guard<std::mutex> guard(*this->lock);
+            if (this->storage->read_cached(this->buffer, this->size, this->offset)) return true;
+
+            // Without a plain file underneath, there's nothing for us to
+            // read asynchronously, so just do the read here.
+            if (this->storage->get_fd() < 0) {
+                this->storage->read(this->buffer, this->size, this->offset);
+                return true;
+            }
+
+            this->stamp = this->storage->fetch_extent(this->size, this->offset,
+                    &this->fetch_size, &this->fetch_offset);
+            return false;
+        }
+
+        inline void await_suspend(std::coroutine_handle<> waiter);
+
+        void await_resume()
+        {
+            if (!this->waiter) return;
+            if (this->result < 0) throw IOException();
+
+            std::lock_guard<std::mutex> guard(*this->lock);
+            bool current = this->storage->install(this->fetched.data(), this->result,
+                    this->fetch_offset, this->stamp);
+
+            // Copy the request straight out of what we fetched, or if that
+            // falls short or isn't current, fall back on a plain read.
+            off_t skip = this->offset - this->fetch_offset;
+            if (current && skip >= 0 && skip + (off_t) this->size <= this->result) {
+                memcpy(this->buffer, this->fetched.data() + skip, this->size);
+            } else {
+                this->storage->read(this->buffer, this->size, this->offset);
+            }
+        }
+
+    private:
+        friend class IOScheduler;
+
+        IOScheduler *scheduler;
+        IOHandler *storage;
+        std::mutex *lock;
+        byte *buffer;
+        size_t size;
+        off_t offset;
+
+        size_t fetch_size;
+        off_t fetch_offset;
+        uint64_t stamp;
+        std::vector<byte> fetched;
+        struct aiocb cb;
+        ssize_t result;
+        std::coroutine_handle<> waiter;
+};
+
+
+class IOScheduler
+{
+    public:
+        IOScheduler() : peak_in_flight(0) {}
+
+        ReadAwaiter read(IOHandler *storage, std::mutex *lock, byte *buffer,
+                size_t size, off_t offset)
+        {
+            return ReadAwaiter(this, storage, lock, buffer, size, offset);
+        }
+
+        /*
+         * Queue task to be started by run. The task must outlive the call
+         * to run.
+         */
+        template <typename T>
+        void spawn(Task<T> &task)
+        {
+            this->ready.push_back(task.get_handle());
+        }
+
+        /*
+         * Run tasks until every one of them has finished, waiting on I/O
+         * only when there is nothing else left to do.
+         */
+        void run()
+        {
+            while (!this->ready.empty() || !this->in_flight.empty()) {
+                while (!this->ready.empty()) {
+                    std::coroutine_handle<> next = this->ready.front();
+                    this->ready.pop_front();
+                    next.resume();
+                }
+
+                if (!this->in_flight.empty()) this->reap();
+            }
+        }
+
+        size_t get_in_flight()
+        {
+            return this->in_flight.size();
+        }
+
+        /*
+         * The most reads that have been in flight at once.
+         */
+        size_t get_peak_in_flight()
+        {
+            return this->peak_in_flight;
+        }
+
+    private:
+        friend class ReadAwaiter;
+
+        std::deque<std::coroutine_handle<>> ready;
+        std::vector<ReadAwaiter *> in_flight;
+        size_t peak_in_flight;
+
+        void submit(ReadAwaiter *read)
+        {
+            read->fetched.resize(read->fetch_size);
+            read->cb.aio_fildes = read->storage->get_fd();
+            read->cb.aio_buf = read->fetched.data();
+            read->cb.aio_nbytes = read->fetch_size;
+            read->cb.aio_offset = read->fetch_offset;
+
+            if (aio_read(&read->cb)) throw IOException();
+
+            this->in_flight.push_back(read);
+            if (this->in_flight.size() > this->peak_in_flight) {
+                this->peak_in_flight = this->in_flight.size();
+            }
+        }
+
+        /*
+         * Wait for at least one read to complete, and make the tasks
+         * waiting on any that have ready to run.
+         */
+        void reap()
+        {
+            std::vector<const struct aiocb *> list;
+            for (auto read : this->in_flight) list.push_back(&read->cb);
+
+            while (aio_suspend(list.data(), list.size(), nullptr)) {
+                if (errno != EINTR && errno != EAGAIN) throw IOException();
+            }
+
+            for (size_t i=0; i<this->in_flight.size(); ) {
+                ReadAwaiter *read = this->in_flight[i];
+                if (aio_error(&read->cb) == EINPROGRESS) {
+                    i++;
+                    continue;
+                }
+
+                read->result = aio_return(&read->cb);
+                this->ready.push_back(read->waiter);
+                this->in_flight[i] = this->in_flight.back();
+                this->in_flight.pop_back();
+            }
+        }
+};
+
+
+void ReadAwaiter::await_suspend(std::coroutine_handle<> waiter)
+{
+    this->waiter = waiter;
+    this->scheduler->submit(this);
+}
+
+#endif
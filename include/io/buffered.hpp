@@ -8,12 +8,15 @@
 #include "kvs.hpp"
 #include "io/iohandler.hpp"
 #include <unordered_map>
+#include <unordered_set>
+#include <deque>
 #include <cstdio>
 
 class BufferedIOHandler: public IOHandler
 {
     private:
         std::unordered_map<int, byte*> *buffer_pool;
+        std::unordered_set<size_t> *dirty_pages;
         size_t buffer_size;
         off_t len;
         void new_buffer();
@@ -24,15 +27,69 @@ class BufferedIOHandler: public IOHandler
         void flush_buffer(size_t buffno);
         void evict_buffer(size_t buffno, bool override_pins);
         size_t buffer_cnt;
+
+        bool snapshot_active;
+        off_t snapshot_len;
+        std::unordered_map<size_t, byte*> *snapshot_pages;
+        void preserve_buffer(size_t buffno);
         size_t buffer_max;
         IOHandler *iodev;
 
+        /*
+         * Resident pages in the order they were faulted in, and those that
+         * have been used since they last came up for eviction. Together
+         * these make a CLOCK: make_room gives referenced pages a second
+         * chance and evicts the first one that isn't.
+         */
+        std::deque<size_t> *clock;
+        std::unordered_set<size_t> *referenced;
+        void make_room();
+
+        /*
+         * Pages faulted in under a SEQUENTIAL or ONCE hint don't join the
+         * CLOCK. They go into a small ring of their own instead, oldest
+         * out first, so that a scan recycles the same few frames rather
+         * than flushing the working set out of the pool.
+         */
+        AccessHints *hints;
+        std::deque<size_t> *ring;
+        size_t ring_max;
+        void admit(size_t buffno, byte *data);
+
+        /*
+         * Every write of a page to the device is numbered, and the most
+         * recent ones are remembered by page, so that install can tell
+         * whether an asynchronous fetch was overtaken by one. Once the
+         * record gets too long it is dropped, and fetches started before
+         * then are all taken to be stale.
+         */
+        uint64_t write_backs;
+        uint64_t forgotten;
+        std::unordered_map<size_t, uint64_t> *written_back;
+        void note_write_back(size_t buffno);
+
     public:
         BufferedIOHandler(IOHandler* iodev, size_t pool_size);
         ~BufferedIOHandler();
         int read(byte* buffer, size_t size, off_t offset) override;
         int write(byte* buffer, size_t size, off_t offset) override;
         off_t get_flen() override;
+        void truncate(off_t len) override;
         int get_fd() override;
+
+        bool begin_snapshot() override;
+        int snapshot_read(byte* buffer, size_t size, off_t offset) override;
+        void end_snapshot() override;
+        void flush() override;
+
+        void write_dirty(IOHandler *device);
+        void adopt(IOHandler *device);
+
+        bool read_cached(byte* buffer, size_t size, off_t offset) override;
+        uint64_t fetch_extent(size_t size, off_t offset, size_t *fetch_size,
+                off_t *fetch_offset) override;
+        bool install(byte* data, size_t size, off_t offset, uint64_t stamp) override;
+        void advise(off_t offset, off_t len, access_t access) override;
+        void prefetch(off_t offset, size_t size) override;
 };
 #endif
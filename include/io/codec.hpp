@@ -0,0 +1,37 @@
+/*
+ * codec.hpp
+ * Page compression
+ *
+ * Table pages are mostly zeros: empty slots, removed elements, and the
+ * unused tails of buckets. The zero-run codec here is built for exactly
+ * that, and costs next to nothing to run. A page is coded as a series of
+ * runs, each introduced by a varint holding the run length shifted left one
+ * bit, with the low bit set for a run of zeros. Zero runs are just the
+ * varint; literal runs are followed by their bytes. Runs of fewer than
+ * zero_run_min zeros are left in the literals, as coding them would cost
+ * more than it saves.
+ */
+#ifndef codecio
+#define codecio
+
+#include "kvs.hpp"
+#include <cstdlib>
+
+/*
+ * The most bytes that compressing len bytes can produce.
+ */
+size_t zrl_bound(size_t len);
+
+/*
+ * Compress len bytes from src into dst, which must have room for
+ * zrl_bound(len) bytes. Returns the compressed length.
+ */
+size_t zrl_compress(const byte *src, size_t len, byte *dst);
+
+/*
+ * Decompress clen bytes from src into dst, which must be exactly len bytes
+ * long. Throws an IOException if src is not a valid encoding of len bytes.
+ */
+void zrl_decompress(const byte *src, size_t clen, byte *dst, size_t len);
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * compressed.hpp
+ * An IOHandler that keeps pages compressed, in memory and on disk
+ *
+ * The device is split into fixed size pages, each of which is stored
+ * compressed (see codec.hpp). Recently used pages are held, still
+ * compressed, in a cache of up to cache_size bytes, so several times more
+ * of the working set fits in the same memory. Pages that fall out of the
+ * cache are written to fname as variable length records, and a page map
+ * in the fname.map sidecar records where each page's record lives. A
+ * miss then reads only the compressed bytes of the page.
+ *
+ * Put a BufferedIOHandler in front of this to keep the hottest pages
+ * uncompressed; its evictions land in the compressed cache rather than
+ * going straight to disk.
+ *
+ * The map on disk is only replaced on flush, so that a crash leaves the
+ * handler as it was at the last one: a record the saved map points to is
+ * never overwritten. Written back pages go to free space instead (or to
+ * the end of the file), and the records they leave behind only become
+ * free space once a map that doesn't point to them has been saved. A page
+ * that has already moved since then is rewritten in place, if it fits.
+ * The map itself is written alongside and renamed into place. The data
+ * file doesn't hold the device's bytes as they are, so there is no fd to
+ * read around the handler with, and get_fd returns -1.
+ */
+#ifndef compio
+#define compio
+
+#include "kvs.hpp"
+#include "io/iohandler.hpp"
+#include "io/raw.hpp"
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/*
+ * Where a page's record lives in the data file. A page with len 0 has
+ * never been written, and reads as zeros. A record len of page_size means
+ * the page didn't compress, and is stored as is.
+ */
+struct PageEntry
+{
+    uint64_t offset;
+    uint32_t len;
+    uint32_t cap;
+};
+
+class CompressedIOHandler: public IOHandler
+{
+    private:
+        RawIOHandler *data;
+        std::string map_fname;
+        std::vector<PageEntry> *page_map;
+        size_t page_size;
+        off_t len;
+        off_t data_end;
+
+        /*
+         * Pages whose records have moved since the map was last saved,
+         * runs of free space in the data file by length, and the records
+         * left behind by moves, which can't be reused until the map no
+         * longer points to them.
+         */
+        std::unordered_set<size_t> *moved;
+        std::multimap<uint64_t, uint64_t> *free_space;
+        std::vector<std::pair<uint64_t, uint64_t>> *released;
+
+        std::unordered_map<size_t, std::vector<byte>> *cache;
+        std::unordered_set<size_t> *dirty_pages;
+        std::deque<size_t> *clock;
+        std::unordered_set<size_t> *referenced;
+        size_t cache_bytes;
+        size_t cache_max;
+
+        byte *page;
+        byte *packed;
+
+        std::vector<byte> *cached_page(size_t pageno);
+        void load_page(size_t pageno, byte *dest);
+        void store_page(size_t pageno, byte *src);
+        void write_back(size_t pageno);
+        void evict_page(size_t pageno);
+        void make_room(size_t incoming, size_t keep=SIZE_MAX);
+        void allocate(size_t size, PageEntry *entry);
+        void read_map();
+        void write_map();
+
+    public:
+        CompressedIOHandler(const char *fname, size_t cache_size, size_t page_size=4096);
+        ~CompressedIOHandler();
+        int read(byte* buffer, size_t size, off_t offset) override;
+        int write(byte* buffer, size_t size, off_t offset) override;
+        off_t get_flen() override;
+        void truncate(off_t len) override;
+        int get_fd() override;
+        void flush() override;
+
+        /*
+         * The compressed bytes currently held in memory, and the bytes of
+         * live page records on disk.
+         */
+        size_t get_cached_bytes();
+        size_t get_stored_bytes();
+};
+#endif
@@ -0,0 +1,38 @@
+/*
+ *
+ */
+#ifndef epochio
+#define epochio
+
+#include "kvs.hpp"
+#include <cstdint>
+#include <string>
+
+/*
+ * A version counter shared between every process that has a given table
+ * file open. It lives in a small sidecar file next to the table (the table's
+ * file name with ".epoch" appended), which each process maps shared. A writer
+ * advances the counter after it has flushed a consistent set of changes to
+ * the table file, and readers compare it against the last value they saw to
+ * decide whether they need to pick those changes up. A reader that opens
+ * the counter before any writer has created it sees epoch 0, and attaches
+ * to the file once it appears.
+ */
+class Epoch
+{
+    private:
+        std::string fname;
+        fd_t fd;
+        uint64_t *counter;
+        void attach_writable();
+        bool attach();
+
+    public:
+        Epoch(const char *table_fname, bool writable);
+        ~Epoch();
+        uint64_t current();
+        uint64_t advance();
+
+        static std::string path(const char *table_fname);
+};
+#endif
@@ -1,9 +1,13 @@
 /*
  *
  */
+#ifndef ioexcept
+#define ioexcept
+
 #include <stdexcept>
 class IOException: public std::runtime_error
 {
     public:
         IOException() : runtime_error("IO Error") {}
 };
+#endif
@@ -5,20 +5,172 @@
 #define iohandler
 
 #include "kvs.hpp"
+#include <cstdint>
 #include <cstdlib>
+#include <vector>
 
 enum class op_t {
     READ,
     WRITE
 };
 
+/*
+ * How a range of a device is about to be used, for IOHandler::advise. These
+ * follow posix_fadvise: SEQUENTIAL is a front to back pass, ONCE is data
+ * that won't be wanted again soon (a scan that touches it once), and
+ * RANDOM is scattered point accesses.
+ */
+enum class access_t {
+    NORMAL,
+    RANDOM,
+    SEQUENTIAL,
+    ONCE
+};
+
+
+/*
+ * The hints in force on a device, for handlers that act on them. Scans are
+ * expected to advise a range, do their work, and advise the same range
+ * NORMAL afterwards, so a short list searched newest first does.
+ */
+class AccessHints
+{
+    public:
+        struct Hint
+        {
+            off_t offset;
+            off_t len;
+            access_t access;
+        };
+
+        /*
+         * Record a hint, or withdraw one given earlier for exactly the
+         * same range if access is NORMAL. Returns the hint withdrawn, or
+         * NORMAL if there wasn't one.
+         */
+        access_t advise(off_t offset, off_t len, access_t access)
+        {
+            if (access != access_t::NORMAL) {
+                this->hints.push_back({offset, len, access});
+                return access_t::NORMAL;
+            }
+
+            for (size_t i=this->hints.size(); i-- > 0; ) {
+                if (this->hints[i].offset == offset && this->hints[i].len == len) {
+                    access_t withdrawn = this->hints[i].access;
+                    this->hints.erase(this->hints.begin() + i);
+                    return withdrawn;
+                }
+            }
+
+            return access_t::NORMAL;
+        }
+
+        /*
+         * The latest hint covering offset, or nullptr if there is none.
+         */
+        const Hint *find(off_t offset)
+        {
+            for (size_t i=this->hints.size(); i-- > 0; ) {
+                const Hint &hint = this->hints[i];
+                if (offset >= hint.offset && offset < hint.offset + hint.len) return &hint;
+            }
+
+            return nullptr;
+        }
+
+        access_t lookup(off_t offset)
+        {
+            const Hint *hint = this->find(offset);
+            return (hint) ? hint->access : access_t::NORMAL;
+        }
+
+        bool empty()
+        {
+            return this->hints.empty();
+        }
+
+    private:
+        std::vector<Hint> hints;
+};
+
+
 class IOHandler
 {
     public:
         virtual int read(byte* buffer, size_t size, off_t offset)=0;
         virtual int write(byte* buffer, size_t size, off_t offset)=0;
         virtual off_t get_flen()=0;
+        virtual void truncate(off_t len)=0;
         virtual fd_t get_fd()=0;
         virtual ~IOHandler(){};
+
+        /*
+         * Point-in-time snapshot support. Once begin_snapshot has returned
+         * true, snapshot_read will return the contents of the device as they
+         * were at that moment, regardless of any writes made since, until
+         * end_snapshot is called. Handlers that keep copy-on-write page
+         * versions override these; the default reports that it can't, in
+         * which case the caller must keep writers out while it copies.
+         */
+        virtual bool begin_snapshot() { return false; }
+        virtual int snapshot_read(byte* buffer, size_t size, off_t offset)
+        {
+            return this->read(buffer, size, offset);
+        }
+        virtual void end_snapshot() {}
+
+        /*
+         * Push any writes held in memory down to the underlying device.
+         */
+        virtual void flush() {}
+
+        /*
+         * Pick up changes that another process has published to the
+         * underlying device since the last call. Returns true if there were
+         * any. Only meaningful for handlers that share their device.
+         */
+        virtual bool refresh() { return false; }
+
+        /*
+         * Hooks for readers that do their own asynchronous I/O against
+         * get_fd. read_cached completes a read only if it can be done
+         * without touching the device, and returns false otherwise. The
+         * reader should then fetch the range given by fetch_extent (by
+         * default, exactly what was asked for) from the device, and hand
+         * it back through install, along with the stamp fetch_extent
+         * returned, which lets a caching handler keep it. Between them,
+         * read_cached and install count as a single access to the range.
+         *
+         * install returns true if the fetched bytes are what a read would
+         * return. They may not be: a caching handler can hold newer copies
+         * of some of the range, or write some of it to the device while
+         * the fetch is in flight. The reader then has to read the range
+         * again, with read.
+         */
+        virtual bool read_cached(byte*, size_t, off_t) { return false; }
+        virtual uint64_t fetch_extent(size_t size, off_t offset, size_t *fetch_size,
+                off_t *fetch_offset)
+        {
+            *fetch_size = size;
+            *fetch_offset = offset;
+            return 0;
+        }
+        virtual bool install(byte*, size_t, off_t, uint64_t) { return true; }
+
+        /*
+         * Hint at how [offset, offset + len) is about to be used, in the
+         * manner of posix_fadvise. The hint stays in force until the same
+         * range is advised NORMAL. Handlers are free to ignore hints, and
+         * by default do.
+         */
+        virtual void advise(off_t, off_t, access_t) {}
+
+        /*
+         * Start bringing [offset, offset + size) in from the device in the
+         * background, ahead of it being read. Returns straight away; by
+         * default, without doing anything.
+         */
+        virtual void prefetch(off_t, size_t) {}
 };
 #endif
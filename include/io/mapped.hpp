@@ -0,0 +1,49 @@
+/*
+ *
+ */
+#ifndef mappedio
+#define mappedio
+
+#include "kvs.hpp"
+#include "io/iohandler.hpp"
+#include "io/epoch.hpp"
+#include <cstdint>
+#include <string>
+
+/*
+ * Read only access to a file through a shared mapping. Every process that
+ * maps the same file shares one copy of it in the page cache, rather than
+ * each keeping its own buffer pool. Writes are refused.
+ *
+ * A writer elsewhere makes its changes visible by flushing them to the file
+ * and advancing the file's Epoch. refresh notices the new epoch and reopens
+ * and remaps the file, which picks up any growth, as well as the file having
+ * been replaced outright (by a restore, say).
+ */
+class MappedIOHandler: public IOHandler
+{
+    private:
+        std::string fname;
+        fd_t fd;
+        byte *data;
+        off_t len;
+        Epoch *epoch;
+        uint64_t seen_epoch;
+        void map();
+        void unmap();
+
+    public:
+        MappedIOHandler(const char *filename);
+        ~MappedIOHandler();
+        int read(byte* buffer, size_t size, off_t offset) override;
+        int write(byte* buffer, size_t size, off_t offset) override;
+        off_t get_flen() override;
+        void truncate(off_t len) override;
+        int get_fd() override;
+        bool refresh() override;
+
+        uint64_t get_epoch();
+
+        bool read_cached(byte* buffer, size_t size, off_t offset) override;
+};
+#endif
@@ -21,6 +21,11 @@ class MemIOHandler: public IOHandler
         size_t buffer_num(off_t offset);
         byte *get_buffer(size_t buffno, bool create);
         size_t buffer_cnt;
+
+        bool snapshot_active;
+        off_t snapshot_len;
+        std::unordered_map<size_t, byte*> *snapshot_pages;
+        void preserve_buffer(size_t buffno);
         byte *hole;
 
     public:
@@ -29,8 +34,15 @@ class MemIOHandler: public IOHandler
         int read(byte* buffer, size_t size, off_t offset) override;
         int write(byte* buffer, size_t size, off_t offset) override;
         off_t get_flen() override;
+        void truncate(off_t len) override;
         int get_fd() override;
 
+        bool begin_snapshot() override;
+        int snapshot_read(byte* buffer, size_t size, off_t offset) override;
+        void end_snapshot() override;
+
         void dump(size_t line_size);
+
+        bool read_cached(byte* buffer, size_t size, off_t offset) override;
 };
 #endif
@@ -7,13 +7,28 @@
 #include "kvs.hpp"
 #include "io/iohandler.hpp"
 #include <cstdio>
+#include <atomic>
+#include <mutex>
 
 class RawIOHandler: public IOHandler
 {
     private:
         fd_t fd;
         size_t bs;
+        // Several threads may write through the handler at once (see
+        // HashTable::build), so changes to the file's length and
+        // preallocation are made under a lock. The length is atomic too, as
+        // every read checks it and shouldn't have to take the lock to do so.
+        // The I/O itself happens outside it.
+        std::mutex extent_lock;
+        std::atomic<off_t> flen;
+        off_t allocated;
+        bool can_preallocate;
+        AccessHints *hints;
+        off_t readahead_to;
         int perform_io(byte* buffer, size_t size, off_t offset, op_t op);
+        void preallocate(off_t end);
+        void read_ahead(off_t offset, size_t size);
 
     public:
         RawIOHandler(const char *filename);
@@ -21,6 +36,12 @@ class RawIOHandler: public IOHandler
         int read(byte* buffer, size_t size, off_t offset) override;
         int write(byte* buffer, size_t size, off_t offset) override;
         off_t get_flen() override;
+        void truncate(off_t len) override;
         int get_fd() override;
+        void flush() override;
+        void advise(off_t offset, off_t len, access_t access) override;
+        void prefetch(off_t offset, size_t size) override;
+
+        static void clone_file(const char *from, const char *to);
 };
 #endif
@@ -0,0 +1,115 @@
+/*
+ * tiered.hpp
+ * Keep the hottest pages of a device in memory, up to a fixed budget
+ *
+ * TieredIOHandler splits a device into a hot tier, held in a memory arena
+ * of a fixed number of page frames, and a cold tier, which is the device
+ * itself. Unlike BufferedIOHandler, which faults every page it touches into
+ * its pool, pages only move into the hot tier once they have shown that
+ * they are wanted: every page access is counted, and a cold page is
+ * promoted once it has been accessed promote_after times. Until then its
+ * reads and writes go straight through to the device, so a key looked up
+ * once doesn't push anything out.
+ *
+ * Hot pages keep counting their accesses, up to a cap, and demotion is a
+ * GCLOCK: the hand sweeps the frames, taking one off the count of each
+ * page it passes, and demotes the first page it finds at zero, writing it
+ * back if it is dirty. So the pages that stay are the ones used most
+ * often, not just most recently. To keep old popularity from counting
+ * forever, the counts of cold pages are halved every so often, which also
+ * forgets pages that have gone quiet and keeps the counts from growing
+ * without bound.
+ *
+ * Accesses made under a SEQUENTIAL or ONCE hint aren't counted, so scans
+ * pass through the cold tier without promoting anything.
+ *
+ * The handler takes ownership of the cold device. To use one under a
+ * table, build it on top of a RawIOHandler and hand it to
+ * HashTable(IOHandler *, size_t).
+ */
+#ifndef tieredio
+#define tieredio
+
+#include "kvs.hpp"
+#include "io/iohandler.hpp"
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+class TieredIOHandler: public IOHandler
+{
+    private:
+        struct Frame
+        {
+            size_t page;
+            uint8_t count;
+            bool used;
+            bool dirty;
+        };
+
+        /*
+         * The most accesses a page's count will hold. Higher means heavily
+         * used pages survive longer after they go quiet.
+         */
+        static constexpr uint8_t const max_count = 15;
+
+        IOHandler *cold;
+        size_t page_size;
+        size_t promote_after;
+        off_t len;
+
+        // the hot tier: frame i holds its page at arena + i * page_size
+        byte *arena;
+        std::vector<Frame> frames;
+        std::vector<size_t> free_frames;
+        std::unordered_map<size_t, size_t> hot;
+        size_t hand;
+
+        // access counts of cold pages, and the number of accesses counted
+        // since they were last halved
+        std::unordered_map<size_t, uint8_t> heat;
+        size_t accesses;
+
+        AccessHints hints;
+
+        // the number of changes made through the handler, which tells
+        // install whether an asynchronous fetch was overtaken by one
+        uint64_t changes;
+
+        size_t page_num(off_t offset);
+        off_t page_off(size_t page);
+        byte *frame_data(size_t frame);
+        byte *touch(size_t page, byte *fetched=nullptr, size_t fetched_len=0);
+        void promote(size_t page, uint8_t count, byte *fetched, size_t fetched_len);
+        size_t take_frame();
+        void demote(size_t frame);
+        void write_back(size_t frame);
+        void age();
+
+    public:
+        /*
+         * Keep up to hot_bytes of the device's pages in memory (at least one
+         * page's worth), promoting a page once it has been accessed
+         * promote_after times.
+         */
+        TieredIOHandler(IOHandler *cold, size_t hot_bytes, size_t promote_after=2);
+        ~TieredIOHandler();
+        int read(byte* buffer, size_t size, off_t offset) override;
+        int write(byte* buffer, size_t size, off_t offset) override;
+        off_t get_flen() override;
+        void truncate(off_t len) override;
+        int get_fd() override;
+        void flush() override;
+
+        bool read_cached(byte* buffer, size_t size, off_t offset) override;
+        uint64_t fetch_extent(size_t size, off_t offset, size_t *fetch_size,
+                off_t *fetch_offset) override;
+        bool install(byte* data, size_t size, off_t offset, uint64_t stamp) override;
+        void advise(off_t offset, off_t len, access_t access) override;
+        void prefetch(off_t offset, size_t size) override;
+
+        size_t get_hot_pages();
+        size_t get_hot_capacity();
+        bool is_hot(off_t offset);
+};
+#endif
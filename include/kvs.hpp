@@ -13,9 +13,12 @@ typedef char byte;
 typedef int fd_t;
 
 #define CACHELINE 64
-#define REDUCED_CACHELINE CACHELINE - sizeof(off_t)
+#define REDUCED_CACHELINE (CACHELINE - sizeof(off_t))
 #define PAGESIZE 100
 
+// Files are grown on disk in extents of this many bytes at a time
+#define PREALLOC_EXTENT (1 << 20)
+
 
 
 #endif
@@ -0,0 +1,83 @@
+/*
+ * client.hpp
+ * A blocking client for kvs-server
+ *
+ * Requests can either be made one at a time with get, put, remove and
+ * multi_get, which wait for their response, or pipelined: queue up any
+ * number of requests with the send_ methods, flush them, and then collect
+ * a response per request, in order, with receive. The one at a time calls
+ * expect every pipelined request to have had its response collected.
+ */
+#ifndef kvclient
+#define kvclient
+
+#include "kvs.hpp"
+#include "net/protocol.hpp"
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+struct Response
+{
+    status_t status;
+
+    // the count from the response header; see protocol.hpp
+    uint32_t cnt;
+
+    // for GET, the value and whether it was found, for each key
+    std::vector<uint64_t> values;
+    std::vector<bool> found;
+};
+
+class KVClient
+{
+    private:
+        fd_t fd;
+        std::vector<byte> out;
+        std::vector<byte> in;
+        size_t in_pos;
+
+        // the ops of the requests sent, or queued, without a response yet
+        std::deque<netop_t> awaiting;
+
+        void queue(netop_t op, const uint64_t *first, const uint64_t *second, size_t cnt);
+        void fill(size_t bytes);
+        void check(Response &response);
+
+    public:
+        KVClient(const char *address, uint16_t port);
+        ~KVClient();
+
+        /*
+         * Queue a request without sending it. cnt can be at most
+         * max_frame_items.
+         */
+        void send_get(const uint64_t *keys, size_t cnt);
+        void send_put(const uint64_t *keys, const uint64_t *values, size_t cnt);
+        void send_del(const uint64_t *keys, size_t cnt);
+
+        /*
+         * Send every queued request.
+         */
+        void flush();
+
+        /*
+         * Wait for the response to the oldest request that doesn't have
+         * one yet, flushing first if need be.
+         */
+        Response receive();
+
+        size_t get_outstanding();
+
+        bool get(uint64_t key, uint64_t *val);
+        void put(uint64_t key, uint64_t val);
+        bool remove(uint64_t key);
+
+        /*
+         * Look up cnt keys, of any number, storing the results as with
+         * HashTable::get_batch. Returns the number found.
+         */
+        size_t multi_get(const uint64_t *keys, size_t cnt, uint64_t *values, bool *found);
+};
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * primary.hpp
+ * Ship the changes made to a table to any number of replicas
+ *
+ * The primary listens for replicas, and gives each one its own thread,
+ * which feeds it from the table's change log (see dstruct/changelog.hpp).
+ * A replica that is new, or that has fallen further behind than the log
+ * reaches, is first sent a snapshot of the table, taken after noting the
+ * number of the next change, and then every change from that one on. As
+ * changes record the state a key was left in, replaying the few that made
+ * it into the snapshot anyway does no harm.
+ *
+ * How far behind a replica can get is bounded by the log's capacity: once
+ * it needs a change the log no longer has, it is disconnected, and starts
+ * over from a new snapshot when it reconnects. Each replica acknowledges
+ * the changes it has applied, and get_replicas reports how far behind
+ * each one is.
+ */
+#ifndef replprimary
+#define replprimary
+
+#include "kvs.hpp"
+#include "net/replication.hpp"
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ReplicaStatus
+{
+    std::string peer;
+
+    // whether the replica has its snapshot yet, and the number of the
+    // next change it has told us it needs
+    bool synced;
+    uint64_t acked;
+
+    // changes made on the primary that the replica hasn't acknowledged
+    uint64_t lag;
+};
+
+class ReplicationPrimary
+{
+    private:
+        struct Feed
+        {
+            fd_t fd;
+            std::string peer;
+            std::thread thread;
+            std::atomic<bool> synced;
+            std::atomic<uint64_t> acked;
+            std::atomic<bool> done;
+        };
+
+        ServedTable *table;
+        ServedLog *log;
+        std::string scratch;
+        fd_t listen_fd;
+        fd_t wake_fd;
+        uint16_t port;
+        std::atomic<bool> stopping;
+        uint64_t next_feed_id;
+
+        std::mutex feeds_lock;
+        std::list<Feed> feeds;
+
+        void accept_one();
+        void reap(bool all);
+        void feed(Feed *feed, uint64_t id);
+        uint64_t send_snapshot(Feed *feed, uint64_t id);
+        void read_acks(Feed *feed);
+
+    public:
+        /*
+         * Listen for replicas of table on address:port. The table must have
+         * its change log enabled, and is not owned by the primary.
+         * Snapshots for replicas are staged in files named after scratch,
+         * which should be somewhere with room for a copy of the table.
+         */
+        ReplicationPrimary(ServedTable *table, const char *scratch, uint16_t port=0,
+                const char *address="127.0.0.1");
+        ~ReplicationPrimary();
+
+        /*
+         * Accept replicas on the calling thread until stop is called.
+         */
+        void run();
+
+        /*
+         * Ask run to return, which it does once it has disconnected every
+         * replica. Safe to call from any thread, or from a signal handler.
+         */
+        void stop();
+
+        uint16_t get_port();
+        std::vector<ReplicaStatus> get_replicas();
+};
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * protocol.hpp
+ * The wire format spoken between kvs-server and its clients
+ *
+ * Everything is a frame: an 8 byte header, holding a code and an item
+ * count, followed by the items. Requests carry a netop_t as their code, and
+ * responses a status_t. A request's items are keys (GET and DEL) or {key,
+ * value} pairs (PUT), so every op is a multi-op, and a single get is just
+ * a GET of one key. Each request gets exactly one response, and responses
+ * come back in the order the requests were sent, so a client is free to
+ * pipeline as many requests as it likes before reading any responses.
+ *
+ * A GET response's items are the values, followed by a byte per key which
+ * is 1 if the key was found and 0 if not (in which case its value is 0).
+ * PUT and DEL responses have no items; their count is the number of pairs
+ * stored or keys removed. A response with any status other than OK has no
+ * items either.
+ *
+ * Keys and values are 64 bits, and all integers are little endian.
+ */
+#ifndef netproto
+#define netproto
+
+#include "kvs.hpp"
+#include <cstdint>
+#include <cstring>
+#include <endian.h>
+#include <stdexcept>
+
+enum class netop_t : uint32_t {
+    GET = 1,
+    PUT = 2,
+    DEL = 3
+};
+
+enum class status_t : uint32_t {
+    OK = 0,
+    BAD_REQUEST = 1,
+    READ_ONLY = 2,
+    FAILED = 3
+};
+
+class ProtocolException: public std::runtime_error
+{
+    public:
+        ProtocolException() : runtime_error("Malformed kvs-server frame") {}
+};
+
+struct FrameHeader
+{
+    uint32_t code;
+    uint32_t cnt;
+};
+
+/*
+ * The most items a single frame may carry. A server closes the connection
+ * on a request with more than this, rather than buffer it.
+ */
+static constexpr size_t const max_frame_items = 4096;
+
+static constexpr size_t const frame_header_bytes = sizeof(FrameHeader);
+
+
+/*
+ * The number of bytes of items that follow a request header, or 0 if the
+ * op isn't one we know.
+ */
+inline size_t request_bytes(uint32_t op, uint32_t cnt)
+{
+    switch ((netop_t) op) {
+        case netop_t::GET:
+        case netop_t::DEL:
+            return (size_t) cnt * sizeof(uint64_t);
+        case netop_t::PUT:
+            return (size_t) cnt * 2 * sizeof(uint64_t);
+    }
+
+    return 0;
+}
+
+
+inline bool valid_op(uint32_t op)
+{
+    return op >= (uint32_t) netop_t::GET && op <= (uint32_t) netop_t::DEL;
+}
+
+
+inline void put_u32(byte *out, uint32_t val)
+{
+    val = htole32(val);
+    memcpy(out, &val, sizeof(val));
+}
+
+
+inline uint32_t get_u32(const byte *in)
+{
+    uint32_t val;
+    memcpy(&val, in, sizeof(val));
+    return le32toh(val);
+}
+
+
+inline void put_u64(byte *out, uint64_t val)
+{
+    val = htole64(val);
+    memcpy(out, &val, sizeof(val));
+}
+
+
+inline uint64_t get_u64(const byte *in)
+{
+    uint64_t val;
+    memcpy(&val, in, sizeof(val));
+    return le64toh(val);
+}
+
+
+inline void put_header(byte *out, uint32_t code, uint32_t cnt)
+{
+    put_u32(out, code);
+    put_u32(out + sizeof(uint32_t), cnt);
+}
+
+
+inline FrameHeader get_header(const byte *in)
+{
+    return FrameHeader{get_u32(in), get_u32(in + sizeof(uint32_t))};
+}
+
+#endif
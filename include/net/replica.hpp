@@ -0,0 +1,95 @@
+/*
+ * replica.hpp
+ * Follow a replication primary, keeping a copy of its table in a file
+ *
+ * A replica connects to a ReplicationPrimary (see primary.hpp), is sent a
+ * snapshot of the table, which replaces the contents of its file, and then
+ * applies the primary's changes to it in order as they arrive. Changes are
+ * applied in batches, and published at most every publish_interval, so the
+ * way to read from a replica is to open read only tables on its file, in
+ * this process or any other, just as with a table kvs-server is writing.
+ * Until a replica has caught up with the point its snapshot was taken, a
+ * reader can see a key go back to an earlier value for a moment.
+ *
+ * If the connection fails, the replica reconnects and carries on from
+ * where it left off, or if the primary can no longer do that (it has
+ * restarted, or the replica fell too far behind), from a new snapshot.
+ */
+#ifndef replreplica
+#define replreplica
+
+#include "kvs.hpp"
+#include "net/replication.hpp"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+class Replica
+{
+    private:
+        std::string fname;
+        std::string address;
+        uint16_t port;
+        std::chrono::milliseconds publish_interval;
+
+        ServedTable *table;
+        uint64_t generation;
+
+        std::atomic<size_t> bucket_cnt;
+        std::atomic<uint64_t> applied;
+        std::atomic<uint64_t> head;
+        std::atomic<bool> connected;
+        std::atomic<bool> stopping;
+        std::atomic<size_t> syncs;
+
+        std::mutex fd_lock;
+        fd_t fd;
+
+        void follow();
+        void receive_snapshot(uint64_t *fields);
+        void apply(const byte *items, size_t cnt);
+
+    public:
+        /*
+         * Follow the primary at address:port into the table file fname.
+         * Nothing happens until run is called.
+         */
+        Replica(const char *fname, const char *address, uint16_t port,
+                std::chrono::milliseconds publish_interval=std::chrono::milliseconds(100));
+        ~Replica();
+
+        /*
+         * Follow the primary on the calling thread until stop is called,
+         * reconnecting whenever the connection fails.
+         */
+        void run();
+
+        /*
+         * Ask run to return. Safe to call from any thread.
+         */
+        void stop();
+
+        /*
+         * The bucket count of the table, for opening readers on fname, or
+         * 0 until the first snapshot has arrived.
+         */
+        size_t get_bucket_count();
+
+        /*
+         * The number of the next change the replica needs, and the number
+         * of changes the primary had made that it has yet to apply, as of
+         * the last word from the primary.
+         */
+        uint64_t get_applied();
+        uint64_t get_lag();
+
+        bool is_connected();
+
+        /*
+         * The number of snapshots received so far.
+         */
+        size_t get_sync_count();
+};
+
+#endif
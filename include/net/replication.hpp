@@ -0,0 +1,142 @@
+/*
+ * replication.hpp
+ * The wire format spoken between a replication primary and its replicas
+ *
+ * Frames use the same 8 byte header as protocol.hpp, with a replop_t as
+ * the code, followed by a fixed set of 64 bit fields for that op, and
+ * then cnt items.
+ *
+ * - HELLO (replica to primary, once): the generation of the change log
+ *   the replica last followed and the number of the next change it
+ *   needs, or zeroes if it has nothing.
+ * - SNAPSHOT (primary to replica): the log's generation, the number of
+ *   the first change to apply after it, the table's bucket count, and
+ *   the length of the table image, which follows the fields as raw bytes.
+ *   Sent in answer to a HELLO that the log can't carry on from.
+ * - CHANGES (primary to replica): the number of the first change in the
+ *   frame, and the number the primary's next change will get, followed by
+ *   cnt changes, each a kind byte, a key and a value. One with no changes
+ *   is sent every so often while the log is quiet, as a heartbeat.
+ * - ACK (replica to primary): the number of the next change the replica
+ *   needs, sent after applying each CHANGES frame that had any.
+ *
+ * All integers are little endian, as with protocol.hpp.
+ */
+#ifndef replproto
+#define replproto
+
+#include "kvs.hpp"
+#include "net/protocol.hpp"
+#include "net/server.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <sys/socket.h>
+
+typedef ChangeLog<uint64_t, uint64_t> ServedLog;
+typedef Change<uint64_t, uint64_t> ServedChange;
+
+enum class replop_t : uint32_t {
+    HELLO = 1,
+    SNAPSHOT = 2,
+    CHANGES = 3,
+    ACK = 4
+};
+
+/*
+ * The number of fields following the header of each op.
+ */
+inline size_t repl_fields(replop_t op)
+{
+    switch (op) {
+        case replop_t::HELLO:
+            return 2;
+        case replop_t::SNAPSHOT:
+            return 4;
+        case replop_t::CHANGES:
+            return 2;
+        case replop_t::ACK:
+            return 1;
+    }
+
+    return 0;
+}
+
+static constexpr size_t const change_bytes = 1 + 2 * sizeof(uint64_t);
+
+
+/*
+ * Send, or receive, exactly len bytes over a blocking socket, returning
+ * false if the connection fails or is closed first.
+ */
+inline bool send_all(fd_t fd, const byte *buf, size_t len)
+{
+    while (len) {
+        ssize_t cnt = send(fd, buf, len, MSG_NOSIGNAL);
+        if (cnt == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += cnt;
+        len -= cnt;
+    }
+
+    return true;
+}
+
+
+inline bool recv_all(fd_t fd, byte *buf, size_t len)
+{
+    while (len) {
+        ssize_t cnt = recv(fd, buf, len, 0);
+        if (cnt == -1 && errno == EINTR) continue;
+        if (cnt <= 0) return false;
+        buf += cnt;
+        len -= cnt;
+    }
+
+    return true;
+}
+
+
+/*
+ * Send a frame with the given fields, followed by len bytes of items.
+ */
+inline bool send_frame(fd_t fd, replop_t op, uint32_t cnt, const uint64_t *fields,
+        const byte *items=nullptr, size_t len=0)
+{
+    byte head[frame_header_bytes + 4 * sizeof(uint64_t)];
+    put_header(head, (uint32_t) op, cnt);
+
+    size_t fields_cnt = repl_fields(op);
+    for (size_t i=0; i<fields_cnt; i++) {
+        put_u64(head + frame_header_bytes + i * sizeof(uint64_t), fields[i]);
+    }
+
+    return send_all(fd, head, frame_header_bytes + fields_cnt * sizeof(uint64_t)) &&
+           send_all(fd, items, len);
+}
+
+
+/*
+ * Receive the header and fields of a frame, leaving its items unread.
+ * Returns false if the connection fails, and throws ProtocolException on
+ * an op we don't know.
+ */
+inline bool recv_frame(fd_t fd, FrameHeader *header, uint64_t *fields)
+{
+    byte head[frame_header_bytes + 4 * sizeof(uint64_t)];
+    if (!recv_all(fd, head, frame_header_bytes)) return false;
+
+    *header = get_header(head);
+    size_t fields_cnt = repl_fields((replop_t) header->code);
+    if (fields_cnt == 0) throw ProtocolException();
+
+    if (!recv_all(fd, head + frame_header_bytes, fields_cnt * sizeof(uint64_t))) return false;
+    for (size_t i=0; i<fields_cnt; i++) {
+        fields[i] = get_u64(head + frame_header_bytes + i * sizeof(uint64_t));
+    }
+
+    return true;
+}
+
+#endif
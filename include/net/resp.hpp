@@ -0,0 +1,82 @@
+/*
+ * resp.hpp
+ * Just enough of the Redis protocol (RESP2) to point load tools at kvs-server
+ *
+ * Redis keys and values are strings, and the served table holds 64 bit
+ * keys and values, so both are squeezed into fixed width words:
+ *
+ * - A key is hashed down to 64 bits. Two keys that hash alike share an
+ *   entry, which is harmless for generated load (the odds are around one
+ *   in 10^10 for a million keys), but means this isn't a way to store data
+ *   that matters.
+ * - A value of up to resp_value_bytes bytes is stored as the bytes
+ *   themselves, zero padded, under a top byte that tags the word as packed
+ *   and holds the length. It comes back out exactly as it went in. Longer
+ *   values are refused, so load tools need to be told to use small values
+ *   (redis-benchmark -d 7, memtier_benchmark --data-size=7).
+ *
+ * Commands can come as RESP arrays of bulk strings, as every client
+ * library sends them, or inline, as a line of space separated words.
+ */
+#ifndef respproto
+#define respproto
+
+#include "kvs.hpp"
+#include "net/protocol.hpp"
+#include <cstdint>
+#include <vector>
+
+struct RespArg
+{
+    const byte *data;
+    size_t len;
+};
+
+enum class parse_t {
+    DONE,
+    INCOMPLETE,
+    MALFORMED
+};
+
+static constexpr size_t const resp_value_bytes = 7;
+
+/*
+ * The longest argument, and the most arguments, accepted in a single
+ * command. Anything larger is treated as a protocol error.
+ */
+static constexpr size_t const resp_max_bulk = 1 << 20;
+static constexpr size_t const resp_max_args = max_frame_items + 1;
+
+/*
+ * Parse one command from the len bytes at buf into args, which point into
+ * buf, and set used to the number of bytes it took up. An inline command
+ * that is just a blank line parses to no arguments.
+ */
+parse_t resp_parse(const byte *buf, size_t len, std::vector<RespArg> *args, size_t *used);
+
+/*
+ * True if arg is name, ignoring case, as Redis command names are.
+ */
+bool resp_is(const RespArg &arg, const char *name);
+
+uint64_t resp_key(const RespArg &arg);
+
+/*
+ * Pack a value into a word, returning false if it is too long to fit.
+ */
+bool resp_pack_value(const RespArg &arg, uint64_t *val);
+
+/*
+ * Append a word packed by resp_pack_value to out, as a bulk string. Words
+ * that weren't packed from a string (stored over the binary protocol, say)
+ * come out as their decimal value instead, unless they happen to look like
+ * a packed one, which takes a value of at least 0xe0 << 56.
+ */
+void resp_append_value(std::vector<byte> &out, uint64_t val);
+
+void resp_append_nil(std::vector<byte> &out);
+void resp_append_int(std::vector<byte> &out, long long val);
+void resp_append_array(std::vector<byte> &out, size_t cnt);
+void resp_append_raw(std::vector<byte> &out, const char *reply);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * server.hpp
+ * Serve a HashTable over TCP, so that many processes can share one table
+ *
+ * The server runs a single epoll event loop. Each time a connection has
+ * input, all of the complete requests in it are parsed at once, and runs
+ * of consecutive requests with the same op are merged and handed to the
+ * table's batch operations, so a pipelining client pays for storage_lock
+ * (and gets bucket ordered access) once per batch rather than once per
+ * key. Responses are queued and written back in order.
+ *
+ * Keys are 64 bits, and as with the table itself, key 0 can't be stored.
+ * A server speaks either the binary protocol in protocol.hpp, or a subset
+ * of the Redis protocol (see resp.hpp) for the benefit of existing load
+ * tools. Both are parsed into the same requests, and batched the same way.
+ */
+#ifndef kvserver
+#define kvserver
+
+#include "kvs.hpp"
+#include "dstruct/hashtable.hpp"
+#include "net/protocol.hpp"
+#include "net/resp.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+typedef HashTable<uint64_t, uint64_t> ServedTable;
+
+enum class wire_t {
+    BINARY,
+    RESP
+};
+
+class KVServer
+{
+    private:
+        struct Connection
+        {
+            fd_t fd;
+            std::vector<byte> in;
+            std::vector<byte> out;
+            size_t out_sent;
+
+            // the items of RESP requests, translated into binary form
+            std::vector<byte> decoded;
+
+            // set once the peer has shut down its side, or sent something
+            // we can't parse; the connection is closed once out is drained
+            bool closing;
+            uint32_t events;
+        };
+
+        /*
+         * Which RESP command a request came from, and so how its response
+         * is worded.
+         */
+        enum class form_t : uint8_t {
+            BINARY,
+            GET,
+            MGET,
+            EXISTS,
+            SET,
+            DEL
+        };
+
+        /*
+         * A request that has been parsed out of a connection's input, and
+         * is waiting to be run as part of a batch. items are in binary
+         * form whatever the protocol, and point into the connection's
+         * input or decoded buffer. A request with a reply doesn't touch
+         * the table (errors, and RESP's PING and friends), and is just
+         * answered with reply, in turn.
+         */
+        struct Request
+        {
+            netop_t op;
+            uint32_t cnt;
+            const byte *items;
+            form_t form;
+            const char *reply;
+            size_t reply_len;
+        };
+
+        /*
+         * Most bytes read from one connection per wakeup, so that a client
+         * streaming requests can't starve the others.
+         */
+        static constexpr size_t const read_budget = 1 << 18;
+
+        /*
+         * Once this many bytes of responses are waiting to go out on a
+         * connection, no more of its input is read until the client has
+         * caught up.
+         */
+        static constexpr size_t const max_pending_output = 1 << 22;
+
+        static constexpr int const max_events = 64;
+
+        ServedTable *table;
+        wire_t protocol;
+        fd_t listen_fd;
+        fd_t epoll_fd;
+        fd_t wake_fd;
+        uint16_t port;
+        std::atomic<bool> stopping;
+        std::unordered_map<fd_t, Connection *> connections;
+
+        // scratch space for batches, kept between them to save reallocating
+        std::vector<uint64_t> keys;
+        std::vector<uint64_t> values;
+        std::vector<std::pair<uint64_t, uint64_t>> pairs;
+        std::unique_ptr<bool[]> hits;
+        size_t hits_capacity;
+
+        static Request canned(const char *reply, size_t len);
+        void accept_all();
+        bool read_input(Connection *conn);
+        void process(Connection *conn);
+        size_t parse_binary(Connection *conn, std::vector<Request> &requests);
+        size_t parse_resp(Connection *conn, std::vector<Request> &requests);
+        void parse_command(Connection *conn, std::vector<RespArg> &args,
+                std::vector<Request> &requests, std::vector<size_t> &offsets);
+        void run_batch(Connection *conn, std::vector<Request> &batch);
+        void respond(Connection *conn, Request &request, size_t item);
+        void respond_resp(Connection *conn, Request &request, size_t item);
+        void fail_batch(Connection *conn, std::vector<Request> &batch, status_t status);
+        bool write_output(Connection *conn);
+        void update_events(Connection *conn);
+        void close_connection(Connection *conn);
+        void close_all();
+
+    public:
+        /*
+         * Listen on address:port, serving table, which the server does not
+         * take ownership of; the table stays usable directly alongside the
+         * server, and by other servers. A port of 0 picks a free one, which
+         * get_port reports.
+         */
+        KVServer(ServedTable *table, uint16_t port=0, const char *address="127.0.0.1",
+                wire_t protocol=wire_t::BINARY);
+        ~KVServer();
+
+        /*
+         * Run the event loop on the calling thread until stop is called.
+         */
+        void run();
+
+        /*
+         * Ask run to return. Safe to call from any thread, or from a
+         * signal handler.
+         */
+        void stop();
+
+        uint16_t get_port();
+};
+
+#endif
@@ -0,0 +1,26 @@
+/*
+ * affinity.hpp
+ * Helpers for pinning threads to cores and NUMA nodes
+ *
+ * These are thin wrappers over sched.h and sysfs, so that we don't need to
+ * drag in libnuma just to find out which cores belong to which node.
+ */
+#ifndef affinityutil
+#define affinityutil
+
+#include <sched.h>
+
+/*
+ * Fill set with the cores belonging to NUMA node node, as listed in
+ * /sys/devices/system/node. Returns false if the node doesn't exist (or the
+ * kernel wasn't built with NUMA support), in which case set is left empty.
+ */
+bool node_cpus(int node, cpu_set_t *set);
+
+/*
+ * Restrict the calling thread to the cores in set. Returns false if the
+ * kernel refused, for instance because none of them are online.
+ */
+bool pin_thread(const cpu_set_t *set);
+
+#endif
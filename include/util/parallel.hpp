@@ -0,0 +1,67 @@
+/*
+ * parallel.hpp
+ * Helpers for splitting work over a set of threads
+ *
+ */
+#ifndef parallelutil
+#define parallelutil
+
+#include <cstdlib>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Pick a sane default worker count. hardware_concurrency is allowed to
+ * return 0 if it can't tell, in which case we just run on one thread.
+ */
+inline size_t default_thread_count()
+{
+    size_t cnt = std::thread::hardware_concurrency();
+    return (cnt) ? cnt : 1;
+}
+
+
+/*
+ * Split the range [0, count) into thread_cnt contiguous partitions and run
+ * fn(part, begin, end) for each one on its own thread. Partitions are as
+ * even as possible, and no more threads are started than there are items.
+ * If any worker throws, the first exception is rethrown on the calling
+ * thread once all of the workers have been joined.
+ */
+template <typename F>
+void parallel_ranges(size_t count, size_t thread_cnt, F fn)
+{
+    if (thread_cnt == 0) thread_cnt = 1;
+    if (thread_cnt > count) thread_cnt = (count) ? count : 1;
+
+    std::exception_ptr error = nullptr;
+    std::mutex error_lock;
+    std::vector<std::thread> workers;
+
+    size_t per_part = count / thread_cnt;
+    size_t extra = count % thread_cnt;
+    size_t begin = 0;
+
+    for (size_t i=0; i<thread_cnt; i++) {
+        size_t end = begin + per_part + ((i < extra) ? 1 : 0);
+        workers.emplace_back([&, i, begin, end]() {
+            try {
+                fn(i, begin, end);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if (!error) error = std::current_exception();
+            }
+        });
+        begin = end;
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    if (error) std::rethrow_exception(error);
+}
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * ring.hpp
+ * A bounded, lock-free, multi-producer single-consumer ring buffer
+ *
+ * This is Dmitry Vyukov's bounded queue with the consumer side simplified
+ * for a single reader. Every slot carries a sequence number that tells
+ * producers and the consumer whose turn it is to use the slot, so the only
+ * contended write is the CAS that producers use to claim a position, and
+ * the consumer never writes to anything a producer spins on other than
+ * the slot it has just emptied.
+ */
+#ifndef ringutil
+#define ringutil
+
+#include "kvs.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <utility>
+
+template <typename T>
+class Ring
+{
+    private:
+        struct Slot
+        {
+            std::atomic<size_t> seq;
+            T item;
+        };
+
+        Slot *slots;
+        size_t mask;
+
+        /*
+         * The producers' and consumer's positions are kept on their own
+         * cachelines so that claiming a slot doesn't bounce the line the
+         * consumer is reading from.
+         */
+        alignas(CACHELINE) std::atomic<size_t> head;
+        alignas(CACHELINE) size_t tail;
+
+    public:
+        /*
+         * Capacity is rounded up to the next power of two.
+         */
+        Ring(size_t capacity)
+        {
+            size_t size = 1;
+            while (size < capacity) size <<= 1;
+
+            this->slots = new Slot[size];
+            this->mask = size - 1;
+            for (size_t i=0; i<size; i++) {
+                this->slots[i].seq.store(i, std::memory_order_relaxed);
+            }
+
+            this->head.store(0, std::memory_order_relaxed);
+            this->tail = 0;
+        }
+
+
+        /*
+         * Add item to the ring. Safe to call from any number of threads at
+         * once. Returns false, leaving item untouched, if the ring is full.
+         */
+        bool push(T &item)
+        {
+            size_t pos = this->head.load(std::memory_order_relaxed);
+            Slot *slot;
+
+            while (true) {
+                slot = &this->slots[pos & this->mask];
+                size_t seq = slot->seq.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+                if (diff == 0) {
+                    if (this->head.compare_exchange_weak(pos, pos + 1,
+                                std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = this->head.load(std::memory_order_relaxed);
+                }
+            }
+
+            slot->item = std::move(item);
+            slot->seq.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+
+        /*
+         * Take the oldest item off of the ring. Must only ever be called
+         * from one thread at a time. Returns false if the ring is empty.
+         */
+        bool pop(T *item)
+        {
+            Slot *slot = &this->slots[this->tail & this->mask];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+
+            if ((intptr_t) seq - (intptr_t) (this->tail + 1) < 0) return false;
+
+            *item = std::move(slot->item);
+            slot->seq.store(this->tail + this->mask + 1, std::memory_order_release);
+            this->tail++;
+            return true;
+        }
+
+
+        /*
+         * Only meaningful on the consumer's thread; producers may add items
+         * at any moment.
+         */
+        bool empty()
+        {
+            Slot *slot = &this->slots[this->tail & this->mask];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            return (intptr_t) seq - (intptr_t) (this->tail + 1) < 0;
+        }
+
+
+        size_t capacity()
+        {
+            return this->mask + 1;
+        }
+
+
+        ~Ring()
+        {
+            delete[] this->slots;
+        }
+};
+
+#endif
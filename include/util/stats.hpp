@@ -0,0 +1,178 @@
+/*
+ * stats.hpp
+ * Opt-in operation counters and latency histograms
+ *
+ * Instrumentation is compiled in only when KVS_STATS is defined (for
+ * instance, make OPTFLAGS=-DKVS_STATS). It must be defined, or not, for the
+ * library and everything that includes hashtable.hpp alike. Without it, the
+ * STAT_* macros expand to nothing, and the snapshot below simply reports
+ * zeroes.
+ *
+ * Each thread counts into its own block, which only that thread ever writes,
+ * so recording is a plain relaxed load and store with no locking and no
+ * shared cachelines. Blocks are summed when a snapshot is taken, and a
+ * thread's totals are folded into a process-wide block when it exits.
+ */
+#ifndef statsutil
+#define statsutil
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+
+enum class stat_t {
+    TABLE_INSERT,
+    TABLE_GET,
+    TABLE_REMOVE,
+    TABLE_HIT,
+    TABLE_MISS,
+    TABLE_FILTERED,
+    TABLE_EXPIRED,
+    TXN_COMMIT,
+    TXN_CONFLICT,
+    VERSION_SAVE,
+    VERSION_RECLAIM,
+    CACHE_HIT,
+    CACHE_MISS,
+    POOL_HIT,
+    POOL_MISS,
+    POOL_EVICT,
+    POOL_FLUSH,
+    COMPRESSED_HIT,
+    COMPRESSED_MISS,
+    COMPRESSED_EVICT,
+    TIER_HIT,
+    TIER_MISS,
+    TIER_PROMOTE,
+    TIER_DEMOTE,
+    LOG_APPEND,
+    LOG_RELOCATE,
+    LOG_RECLAIM,
+    RAW_READS,
+    RAW_WRITES,
+    RAW_READ_BYTES,
+    RAW_WRITE_BYTES,
+    STAT_CNT
+};
+
+enum class hist_t {
+    CHAIN_LENGTH,
+    RAW_READ_NS,
+    RAW_WRITE_NS,
+    HIST_CNT
+};
+
+constexpr size_t const stat_cnt = (size_t) stat_t::STAT_CNT;
+constexpr size_t const hist_cnt = (size_t) hist_t::HIST_CNT;
+
+/*
+ * Histogram buckets are log-linear, in the style of HDR histograms: values
+ * below 8 are counted exactly, and each power of two above that is split
+ * into 8 linear sub-buckets, for a worst case error of 12.5% over the full
+ * 64-bit range.
+ */
+constexpr size_t const hist_sub_buckets = 8;
+constexpr size_t const hist_buckets = 62 * hist_sub_buckets;
+
+struct StatBlock
+{
+    std::atomic<uint64_t> counters[stat_cnt];
+    std::atomic<uint64_t> hists[hist_cnt][hist_buckets];
+};
+
+
+struct HistogramSnapshot
+{
+    uint64_t buckets[hist_buckets];
+
+    uint64_t count();
+    uint64_t max();
+    uint64_t percentile(double pct);
+};
+
+
+struct StatsSnapshot
+{
+    uint64_t counters[stat_cnt];
+    HistogramSnapshot hists[hist_cnt];
+
+    uint64_t get(stat_t stat);
+    HistogramSnapshot &get(hist_t hist);
+};
+
+
+class Stats
+{
+    private:
+        static StatBlock *register_thread();
+        static void retire_thread(StatBlock *block);
+
+        /*
+         * Retires the calling thread's block when the thread exits.
+         */
+        struct ThreadBlock
+        {
+            StatBlock *block;
+            ThreadBlock() : block(Stats::register_thread()) {}
+            ~ThreadBlock() { Stats::retire_thread(block); }
+        };
+
+        static StatBlock *local()
+        {
+            thread_local ThreadBlock handle;
+            return handle.block;
+        }
+
+        static void bump(std::atomic<uint64_t> &counter, uint64_t n)
+        {
+            // Only the owning thread writes to its block, so there's no
+            // need for an atomic read-modify-write here.
+            counter.store(counter.load(std::memory_order_relaxed) + n,
+                    std::memory_order_relaxed);
+        }
+
+    public:
+        static void add(stat_t stat, uint64_t n)
+        {
+            bump(local()->counters[(size_t) stat], n);
+        }
+
+        static void record(hist_t hist, uint64_t value)
+        {
+            bump(local()->hists[(size_t) hist][hist_bucket(value)], 1);
+        }
+
+        static uint64_t now()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        static size_t hist_bucket(uint64_t value);
+        static uint64_t hist_value(size_t bucket);
+
+        static StatsSnapshot snapshot();
+        static void reset();
+        static void dump(FILE *out);
+
+        static const char *name(stat_t stat);
+        static const char *name(hist_t hist);
+};
+
+
+#ifdef KVS_STATS
+#define STAT_ADD(stat, n) Stats::add(stat_t::stat, n)
+#define STAT_INC(stat) Stats::add(stat_t::stat, 1)
+#define STAT_RECORD(hist, value) Stats::record(hist_t::hist, value)
+#define STAT_TIMER_START(timer) uint64_t timer = Stats::now()
+#define STAT_TIMER_RECORD(hist, timer) Stats::record(hist_t::hist, Stats::now() - timer)
+#else
+#define STAT_ADD(stat, n)
+#define STAT_INC(stat)
+#define STAT_RECORD(hist, value)
+#define STAT_TIMER_START(timer)
+#define STAT_TIMER_RECORD(hist, timer)
+#endif
+
+#endif
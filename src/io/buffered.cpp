@@ -1,8 +1,21 @@
 #include "io/buffered.hpp"
 #include "io/exceptions.hpp"
+#include "util/stats.hpp"
 #include <unordered_map>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <vector>
+
+/*
+ * The number of frames in the ring that scans are confined to.
+ */
+static const size_t scan_ring_frames = 16;
+
+/*
+ * The most write-backs remembered page by page for install.
+ */
+static const size_t write_back_history = 4096;
 
 
 BufferedIOHandler::BufferedIOHandler(IOHandler* iodev, size_t pool_size)
@@ -10,20 +23,41 @@ BufferedIOHandler::BufferedIOHandler(IOHandler* iodev, size_t pool_size)
     this->buffer_cnt = 0;
     this->len = 0;
     this->buffer_pool = new std::unordered_map<int, byte*>();
+    this->dirty_pages = new std::unordered_set<size_t>();
     this->iodev = iodev;
     this->buffer_max = pool_size;
     this->buffer_size = PAGESIZE;
+    this->snapshot_active = false;
+    this->snapshot_len = 0;
+    this->snapshot_pages = new std::unordered_map<size_t, byte*>();
+    this->clock = new std::deque<size_t>();
+    this->referenced = new std::unordered_set<size_t>();
+    this->hints = new AccessHints();
+    this->ring = new std::deque<size_t>();
+    this->ring_max = scan_ring_frames;
+    this->write_backs = 0;
+    this->forgotten = 0;
+    this->written_back = new std::unordered_map<size_t, uint64_t>();
 }
 
 
 BufferedIOHandler::~BufferedIOHandler()
 {
-    for (auto x: *buffer_pool) {
-        this->evict_buffer(x.first, true);
+    this->end_snapshot();
+    delete this->snapshot_pages;
+
+    // evict_buffer erases from the pool, so we can't range-for over it here.
+    while (!buffer_pool->empty()) {
+        this->evict_buffer(buffer_pool->begin()->first, true);
     }
 
-    buffer_pool->clear();
     delete buffer_pool;
+    delete this->dirty_pages;
+    delete this->clock;
+    delete this->referenced;
+    delete this->hints;
+    delete this->ring;
+    delete this->written_back;
     delete this->iodev;
 }
 
@@ -53,7 +87,9 @@ int BufferedIOHandler::write(byte* buffer, size_t size, off_t offset)
 {
     int cur_buffno = buffer_num(offset);
     off_t buff_offset = offset - (cur_buffno * this->buffer_size);
+    this->preserve_buffer(cur_buffno);
     byte *cur_buff = this->get_buffer(cur_buffno);
+    this->dirty_pages->insert(cur_buffno);
     off_t write_offset = 0;
     size_t remaining = size;
 
@@ -63,7 +99,11 @@ int BufferedIOHandler::write(byte* buffer, size_t size, off_t offset)
         buff_offset = 0;
         write_offset += tomove;
         remaining -= tomove;
-        if (remaining) cur_buff = this->get_buffer(++cur_buffno);
+        if (remaining) {
+            this->preserve_buffer(++cur_buffno);
+            cur_buff = this->get_buffer(cur_buffno);
+            this->dirty_pages->insert(cur_buffno);
+        }
     } while (remaining);
 
     if (offset + size > (size_t) this->len) {
@@ -80,12 +120,285 @@ off_t BufferedIOHandler::get_flen()
 }
 
 
+/*
+ * Drop any pages that lie wholly past the new end of the file, and zero the
+ * tail of the one that it falls in, so that extending the file again reads
+ * back zeros.
+ */
+void BufferedIOHandler::truncate(off_t len)
+{
+    std::vector<size_t> doomed;
+    for (auto &x : *this->buffer_pool) {
+        if (buffer_off(x.first) >= len) doomed.push_back(x.first);
+    }
+
+    for (auto buffno : doomed) {
+        // The device is about to lose these pages' contents, which an
+        // in-flight fetch may still have.
+        this->note_write_back(buffno);
+        delete[] this->buffer_pool->at(buffno);
+        this->buffer_pool->erase(buffno);
+        this->dirty_pages->erase(buffno);
+        this->referenced->erase(buffno);
+        this->buffer_cnt--;
+    }
+
+    if (!doomed.empty()) {
+        for (auto order : {&this->clock, &this->ring}) {
+            std::deque<size_t> *kept = new std::deque<size_t>();
+            for (auto buffno : **order) {
+                if (buffer_off(buffno) < len) kept->push_back(buffno);
+            }
+            delete *order;
+            *order = kept;
+        }
+    }
+
+    size_t last = buffer_num(len);
+    auto partial = this->buffer_pool->find(last);
+    if (partial != this->buffer_pool->end()) {
+        off_t keep = len - buffer_off(last);
+        memset(partial->second + keep, 0, this->buffer_size - keep);
+    }
+
+    this->len = len;
+    this->iodev->truncate(len);
+}
+
+
 int BufferedIOHandler::get_fd()
 {
     return this->iodev->get_fd();
 }
 
 
+void BufferedIOHandler::flush()
+{
+    // flush_buffer erases from dirty_pages as it goes.
+    std::vector<size_t> dirty(this->dirty_pages->begin(), this->dirty_pages->end());
+    for (auto buffno : dirty) {
+        this->flush_buffer(buffno);
+    }
+
+    this->iodev->flush();
+}
+
+
+/*
+ * Write every dirty page to device, which is to stand in for the pool's own
+ * device (see adopt), rather than to the pool's own. The pages stay dirty.
+ */
+void BufferedIOHandler::write_dirty(IOHandler *device)
+{
+    for (auto buffno : *this->dirty_pages) {
+        STAT_INC(POOL_FLUSH);
+        int written = device->write(this->buffer_pool->at(buffno), this->buffer_size,
+                buffer_off(buffno));
+        if (written != PAGESIZE) throw IOException();
+    }
+}
+
+
+/*
+ * Make device the pool's underlying device in place of the current one,
+ * which is deleted without anything more being written to it. device must
+ * already hold everything that the pool does, dirty pages included (see
+ * write_dirty), and so afterwards every page is clean.
+ */
+void BufferedIOHandler::adopt(IOHandler *device)
+{
+    for (auto buffno : *this->dirty_pages) {
+        this->note_write_back(buffno);
+    }
+    this->dirty_pages->clear();
+
+    delete this->iodev;
+    this->iodev = device;
+}
+
+
+bool BufferedIOHandler::read_cached(byte* buffer, size_t size, off_t offset)
+{
+    size_t last = buffer_num(offset + size - 1);
+    for (size_t buffno=buffer_num(offset); buffno<=last; buffno++) {
+        if (this->buffer_pool->find(buffno) == this->buffer_pool->end()) return false;
+    }
+
+    this->read(buffer, size, offset);
+    return true;
+}
+
+
+/*
+ * Misses are filled a whole page at a time, and only from the part of the
+ * file that actually exists on the device. The stamp is the number of
+ * write-backs so far.
+ */
+uint64_t BufferedIOHandler::fetch_extent(size_t size, off_t offset, size_t *fetch_size,
+        off_t *fetch_offset)
+{
+    off_t start = buffer_off(buffer_num(offset));
+    off_t end = buffer_off(buffer_num(offset + size - 1) + 1);
+    end = std::max(start, std::min(end, this->iodev->get_flen()));
+
+    *fetch_offset = start;
+    *fetch_size = end - start;
+    return this->write_backs;
+}
+
+
+/*
+ * Add the pages covered by data, which was read from the device starting at
+ * the page aligned offset, to the pool. Pages that are already resident are
+ * left alone, as they may hold writes that data doesn't, and so are pages
+ * written back since the fetch began: a page can be dirtied and evicted
+ * while its fetch is in flight, and the device then has newer data than
+ * the fetch does. Returns false if either happened to any page.
+ */
+bool BufferedIOHandler::install(byte* data, size_t size, off_t offset, uint64_t stamp)
+{
+    if (stamp < this->forgotten) return false;
+
+    bool current = true;
+    for (size_t done=0; done<size; done+=this->buffer_size) {
+        size_t buffno = buffer_num(offset + done);
+
+        auto written = this->written_back->find(buffno);
+        if (written != this->written_back->end() && written->second > stamp) {
+            current = false;
+            continue;
+        }
+        if (this->buffer_pool->find(buffno) != this->buffer_pool->end()) {
+            current = false;
+            continue;
+        }
+
+        byte *page = new byte[this->buffer_size]();
+        memcpy(page, data + done, std::min(this->buffer_size, size - done));
+        this->admit(buffno, page);
+    }
+
+    return current;
+}
+
+
+/*
+ * Pass runs of pages that aren't resident down to the device, which can
+ * then have them ready by the time they are faulted in.
+ */
+void BufferedIOHandler::prefetch(off_t offset, size_t size)
+{
+    if (size == 0) return;
+
+    size_t last = buffer_num(offset + size - 1);
+    size_t run_start = 0;
+    size_t run_len = 0;
+
+    for (size_t buffno=buffer_num(offset); buffno<=last + 1; buffno++) {
+        bool missing = buffno <= last &&
+                       this->buffer_pool->find(buffno) == this->buffer_pool->end();
+        if (missing) {
+            if (run_len == 0) run_start = buffno;
+            run_len++;
+        } else if (run_len) {
+            this->iodev->prefetch(buffer_off(run_start), run_len * this->buffer_size);
+            run_len = 0;
+        }
+    }
+}
+
+
+void BufferedIOHandler::advise(off_t offset, off_t len, access_t access)
+{
+    this->hints->advise(offset, len, access);
+    this->iodev->advise(offset, len, access);
+}
+
+
+bool BufferedIOHandler::begin_snapshot()
+{
+    this->end_snapshot();
+    this->snapshot_active = true;
+    this->snapshot_len = this->get_flen();
+
+    return true;
+}
+
+
+int BufferedIOHandler::snapshot_read(byte* buffer, size_t size, off_t offset)
+{
+    if (!this->snapshot_active) return this->read(buffer, size, offset);
+
+    size_t cur_buffno = buffer_num(offset);
+    off_t buff_offset = offset - buffer_off(cur_buffno);
+    off_t read_offset = 0;
+    size_t remaining = size;
+    byte *page = new byte[this->buffer_size];
+
+    do {
+        // A preserved copy is the page as of the start of the snapshot. If
+        // there isn't one, then the page hasn't been written since, and so
+        // either the pool or the device has the right version. Pages that
+        // aren't resident are read around the pool, so that copying out the
+        // snapshot doesn't fill it with pages nobody asked for.
+        byte *src;
+        auto preserved = this->snapshot_pages->find(cur_buffno);
+        auto resident = this->buffer_pool->find(cur_buffno);
+
+        if (preserved != this->snapshot_pages->end()) {
+            src = preserved->second;
+        } else if (resident != this->buffer_pool->end()) {
+            src = resident->second;
+        } else {
+            memset(page, 0, this->buffer_size);
+            off_t boff = buffer_off(cur_buffno);
+            off_t flen = this->iodev->get_flen();
+            if (boff < flen) {
+                size_t avail = std::min((size_t) (flen - boff), this->buffer_size);
+                this->iodev->read(page, avail, boff);
+            }
+            src = page;
+        }
+
+        size_t tomove = std::min(this->buffer_size - buff_offset, remaining);
+        memmove(buffer + read_offset, src + buff_offset, tomove);
+        buff_offset = 0;
+        read_offset += tomove;
+        remaining -= tomove;
+        cur_buffno++;
+    } while (remaining);
+
+    delete[] page;
+    return size;
+}
+
+
+void BufferedIOHandler::end_snapshot()
+{
+    for (auto &x : *this->snapshot_pages) {
+        delete[] x.second;
+    }
+
+    this->snapshot_pages->clear();
+    this->snapshot_active = false;
+}
+
+
+void BufferedIOHandler::preserve_buffer(size_t buffno)
+{
+    // Only the first write to a page that was part of the snapshot needs
+    // to keep a copy of it.
+    if (!this->snapshot_active || buffer_off(buffno) >= this->snapshot_len ||
+            this->snapshot_pages->find(buffno) != this->snapshot_pages->end()) {
+        return;
+    }
+
+    byte *copy = new byte[this->buffer_size];
+    memcpy(copy, this->get_buffer(buffno), this->buffer_size);
+    this->snapshot_pages->insert({buffno, copy});
+}
+
+
 
 void BufferedIOHandler::new_buffer()
 {
@@ -98,17 +411,67 @@ void BufferedIOHandler::new_buffer()
 void BufferedIOHandler::new_buffer(size_t buffno)
 {
     if (this->buffer_pool->find(buffno) == this->buffer_pool->end()) {
-        // TODO: Find a buffer to evict
-
         byte *data = new byte[buffer_size]();
         off_t boff = this->buffer_off(buffno);
 
-        if (boff < this->iodev->get_flen()) {
-            this->iodev->read(data, this->buffer_size, boff);
+        // The underlying file need not be a whole number of pages long
+        // (a bulk loaded table, for instance), so only read what is there.
+        off_t flen = this->iodev->get_flen();
+        if (boff < flen) {
+            size_t avail = std::min((size_t) (flen - boff), this->buffer_size);
+            this->iodev->read(data, avail, boff);
         }
 
-        this->buffer_pool->insert({buffno, data});
-        this->buffer_cnt++;
+        this->admit(buffno, data);
+    }
+}
+
+
+/*
+ * Add a freshly read page to the pool, making room for it in the CLOCK or
+ * the scan ring as its hint dictates. An unbounded pool never evicts
+ * anything, so has no use for the ring.
+ */
+void BufferedIOHandler::admit(size_t buffno, byte *data)
+{
+    access_t access = (this->hints->empty()) ? access_t::NORMAL
+                                             : this->hints->lookup(buffer_off(buffno));
+
+    if (this->buffer_max && (access == access_t::SEQUENTIAL || access == access_t::ONCE)) {
+        while (this->ring->size() >= this->ring_max) {
+            size_t victim = this->ring->front();
+            this->ring->pop_front();
+            this->evict_buffer(victim, false);
+        }
+        this->ring->push_back(buffno);
+    } else {
+        this->make_room();
+        this->clock->push_back(buffno);
+    }
+
+    this->buffer_pool->insert({buffno, data});
+    this->buffer_cnt++;
+}
+
+
+/*
+ * Evict pages until there is room in the pool for one more. A pool size of
+ * 0 means the pool is unbounded. Frames in the scan ring don't count
+ * against the pool size.
+ */
+void BufferedIOHandler::make_room()
+{
+    if (this->buffer_max == 0) return;
+
+    while (this->buffer_cnt - this->ring->size() >= this->buffer_max && !this->clock->empty()) {
+        size_t buffno = this->clock->front();
+        this->clock->pop_front();
+
+        if (this->referenced->erase(buffno)) {
+            this->clock->push_back(buffno);
+        } else {
+            this->evict_buffer(buffno, false);
+        }
     }
 }
 
@@ -119,35 +482,53 @@ size_t BufferedIOHandler::buffer_num(off_t offset)
 }
 
 
+/*
+ * A page that isn't in the pool is an everyday event, so look it up with
+ * find rather than paying for an exception on every miss.
+ */
 byte *BufferedIOHandler::get_buffer(size_t buffno)
 {
-    byte *buffer;
-
-    try {
-        buffer = this->buffer_pool->at(buffno);
-    } catch (std::out_of_range& except) {
-        new_buffer(buffno);
-        buffer = this->buffer_pool->at(buffno);
+    auto pooled = this->buffer_pool->find(buffno);
+    if (pooled != this->buffer_pool->end()) {
+        this->referenced->insert(buffno);
+        STAT_INC(POOL_HIT);
+        return pooled->second;
     }
 
-    return buffer;
+    STAT_INC(POOL_MISS);
+    new_buffer(buffno);
+    return this->buffer_pool->find(buffno)->second;
 }
 
 
 void BufferedIOHandler::flush_buffer(size_t buffno)
 {
-    byte *buff = nullptr;
-    try {
-        buff = this->buffer_pool->at(buffno);
-    } catch (std::out_of_range& except) {
+    auto pooled = this->buffer_pool->find(buffno);
+    if (pooled == this->buffer_pool->end()) {
         // attempt to flush a page that isn't in memory. Just silently return.
         // I may switch this over to raising an exception.
         return;
     }
+    byte *buff = pooled->second;
 
+    STAT_INC(POOL_FLUSH);
+    this->note_write_back(buffno);
     int written = this->iodev->write(buff, this->buffer_size, buffer_off(buffno));
     if (written != PAGESIZE)
         throw IOException();
+
+    this->dirty_pages->erase(buffno);
+}
+
+
+void BufferedIOHandler::note_write_back(size_t buffno)
+{
+    if (this->written_back->size() >= write_back_history) {
+        this->written_back->clear();
+        this->forgotten = this->write_backs;
+    }
+
+    (*this->written_back)[buffno] = ++this->write_backs;
 }
 
 
@@ -157,8 +538,11 @@ void BufferedIOHandler::evict_buffer(size_t buffno, bool override_pins=false)
     //      isn't pinned before doing any of this.
     bool buff_pinned = false;
     if (!override_pins || !buff_pinned) {
-        this->flush_buffer(buffno);
+        STAT_INC(POOL_EVICT);
+        if (this->dirty_pages->count(buffno)) this->flush_buffer(buffno);
+        delete[] this->buffer_pool->at(buffno);
         this->buffer_pool->erase(buffno);
+        this->referenced->erase(buffno);
         this->buffer_cnt--;
     }
 }
@@ -0,0 +1,110 @@
+/*
+ *
+ */
+#include "io/codec.hpp"
+#include "io/exceptions.hpp"
+#include <cstring>
+
+static const size_t zero_run_min = 8;
+
+
+static size_t put_varint(byte *dst, size_t val)
+{
+    size_t n = 0;
+    while (val >= 0x80) {
+        dst[n++] = (byte) (val | 0x80);
+        val >>= 7;
+    }
+    dst[n++] = (byte) val;
+    return n;
+}
+
+
+static size_t get_varint(const byte *src, size_t avail, size_t *val)
+{
+    size_t result = 0;
+    for (size_t n=0; n<avail && n<10; n++) {
+        result |= (size_t) (src[n] & 0x7f) << (7 * n);
+        if (!(src[n] & 0x80)) {
+            *val = result;
+            return n + 1;
+        }
+    }
+
+    throw IOException();
+}
+
+
+size_t zrl_bound(size_t len)
+{
+    // Every literal run but the last is followed by a zero run of at least
+    // zero_run_min bytes, and no run header is longer than a varint.
+    return len + 10 * (2 * (len / zero_run_min) + 2);
+}
+
+
+size_t zrl_compress(const byte *src, size_t len, byte *dst)
+{
+    size_t out = 0;
+    size_t literal_start = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        if (src[i] != 0) {
+            i++;
+            continue;
+        }
+
+        size_t run = 0;
+        while (i + run < len && src[i + run] == 0) run++;
+
+        if (run < zero_run_min) {
+            i += run;
+            continue;
+        }
+
+        if (i > literal_start) {
+            out += put_varint(dst + out, (i - literal_start) << 1);
+            memcpy(dst + out, src + literal_start, i - literal_start);
+            out += i - literal_start;
+        }
+
+        out += put_varint(dst + out, (run << 1) | 1);
+        i += run;
+        literal_start = i;
+    }
+
+    if (len > literal_start) {
+        out += put_varint(dst + out, (len - literal_start) << 1);
+        memcpy(dst + out, src + literal_start, len - literal_start);
+        out += len - literal_start;
+    }
+
+    return out;
+}
+
+
+void zrl_decompress(const byte *src, size_t clen, byte *dst, size_t len)
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < clen) {
+        size_t header;
+        in += get_varint(src + in, clen - in, &header);
+        size_t run = header >> 1;
+
+        if (run > len - out) throw IOException();
+
+        if (header & 1) {
+            memset(dst + out, 0, run);
+        } else {
+            if (run > clen - in) throw IOException();
+            memcpy(dst + out, src + in, run);
+            in += run;
+        }
+        out += run;
+    }
+
+    if (out != len) throw IOException();
+}
@@ -0,0 +1,465 @@
+/*
+ *
+ */
+#include "io/compressed.hpp"
+#include "io/codec.hpp"
+#include "io/exceptions.hpp"
+#include "util/stats.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+/*
+ * The page map sidecar starts with this header, followed by page_cnt
+ * PageEntry records.
+ */
+struct MapHeader
+{
+    uint64_t len;
+    uint64_t data_end;
+    uint64_t page_size;
+    uint64_t page_cnt;
+};
+
+/*
+ * Records are given a little room to grow, so that a page that compresses
+ * slightly worse after a write can usually be rewritten in place.
+ */
+static const size_t record_align = 64;
+
+
+CompressedIOHandler::CompressedIOHandler(const char *fname, size_t cache_size,
+        size_t page_size)
+{
+    if (page_size == 0) throw IOException();
+
+    this->data = new RawIOHandler(fname);
+    this->map_fname = std::string(fname) + ".map";
+
+    this->page_map = new std::vector<PageEntry>();
+    this->page_size = page_size;
+    this->len = 0;
+    this->data_end = 0;
+    this->moved = new std::unordered_set<size_t>();
+    this->free_space = new std::multimap<uint64_t, uint64_t>();
+    this->released = new std::vector<std::pair<uint64_t, uint64_t>>();
+
+    this->cache = new std::unordered_map<size_t, std::vector<byte>>();
+    this->dirty_pages = new std::unordered_set<size_t>();
+    this->clock = new std::deque<size_t>();
+    this->referenced = new std::unordered_set<size_t>();
+    this->cache_bytes = 0;
+    this->cache_max = cache_size;
+
+    this->page = new byte[page_size];
+    this->packed = new byte[zrl_bound(page_size)];
+
+    try {
+        this->read_map();
+    } catch (...) {
+        delete[] this->page;
+        delete[] this->packed;
+        delete this->cache;
+        delete this->dirty_pages;
+        delete this->clock;
+        delete this->referenced;
+        delete this->moved;
+        delete this->free_space;
+        delete this->released;
+        delete this->page_map;
+        delete this->data;
+        throw;
+    }
+}
+
+
+CompressedIOHandler::~CompressedIOHandler()
+{
+    this->flush();
+
+    delete[] this->page;
+    delete[] this->packed;
+    delete this->cache;
+    delete this->dirty_pages;
+    delete this->clock;
+    delete this->referenced;
+    delete this->moved;
+    delete this->free_space;
+    delete this->released;
+    delete this->page_map;
+    delete this->data;
+}
+
+
+int CompressedIOHandler::read(byte* buffer, size_t size, off_t offset)
+{
+    if (offset + (off_t) size > this->len) throw IOException();
+
+    size_t done = 0;
+    while (done < size) {
+        size_t pageno = (offset + done) / this->page_size;
+        size_t page_offset = (offset + done) % this->page_size;
+        size_t tomove = std::min(this->page_size - page_offset, size - done);
+
+        this->load_page(pageno, this->page);
+        memcpy(buffer + done, this->page + page_offset, tomove);
+        done += tomove;
+    }
+
+    return size;
+}
+
+
+int CompressedIOHandler::write(byte* buffer, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        size_t pageno = (offset + done) / this->page_size;
+        size_t page_offset = (offset + done) % this->page_size;
+        size_t tomove = std::min(this->page_size - page_offset, size - done);
+
+        // Whole page writes don't need the old contents.
+        if (tomove != this->page_size) this->load_page(pageno, this->page);
+        memcpy(this->page + page_offset, buffer + done, tomove);
+        this->store_page(pageno, this->page);
+        done += tomove;
+    }
+
+    if (offset + (off_t) size > this->len) {
+        this->len = offset + size;
+    }
+
+    return size;
+}
+
+
+off_t CompressedIOHandler::get_flen()
+{
+    return this->len;
+}
+
+
+/*
+ * Pages wholly past the new end are forgotten, and the tail of the page
+ * that it falls in is zeroed. Their records stay theirs, as the saved map
+ * may still point to them.
+ */
+void CompressedIOHandler::truncate(off_t len)
+{
+    size_t first_dropped = (len + this->page_size - 1) / this->page_size;
+
+    std::vector<size_t> doomed;
+    for (auto &x : *this->cache) {
+        if (x.first >= first_dropped) doomed.push_back(x.first);
+    }
+
+    for (auto pageno : doomed) {
+        this->cache_bytes -= this->cache->at(pageno).size();
+        this->cache->erase(pageno);
+        this->dirty_pages->erase(pageno);
+        this->referenced->erase(pageno);
+    }
+
+    if (!doomed.empty()) {
+        std::deque<size_t> *kept = new std::deque<size_t>();
+        for (auto pageno : *this->clock) {
+            if (pageno < first_dropped) kept->push_back(pageno);
+        }
+        delete this->clock;
+        this->clock = kept;
+    }
+
+    for (size_t pageno=first_dropped; pageno<this->page_map->size(); pageno++) {
+        (*this->page_map)[pageno].len = 0;
+    }
+
+    size_t keep = len % this->page_size;
+    if (keep && len < this->len) {
+        size_t pageno = len / this->page_size;
+        this->load_page(pageno, this->page);
+        memset(this->page + keep, 0, this->page_size - keep);
+        this->store_page(pageno, this->page);
+    }
+
+    this->len = len;
+}
+
+
+int CompressedIOHandler::get_fd()
+{
+    return -1;
+}
+
+
+void CompressedIOHandler::flush()
+{
+    // write_back erases from dirty_pages as it goes.
+    std::vector<size_t> dirty(this->dirty_pages->begin(), this->dirty_pages->end());
+    for (auto pageno : dirty) {
+        this->write_back(pageno);
+    }
+
+    // The records have to be on disk before a map that points to them is,
+    // and only once the map is can the records it replaced be reused.
+    this->data->flush();
+    this->write_map();
+
+    this->moved->clear();
+    for (auto &run : *this->released) {
+        this->free_space->insert(run);
+    }
+    this->released->clear();
+}
+
+
+size_t CompressedIOHandler::get_cached_bytes()
+{
+    return this->cache_bytes;
+}
+
+
+size_t CompressedIOHandler::get_stored_bytes()
+{
+    size_t stored = 0;
+    for (auto &entry : *this->page_map) {
+        stored += entry.len;
+    }
+
+    return stored;
+}
+
+
+/*
+ * Find the compressed copy of a page, reading it into the cache if it
+ * isn't there already. Returns nullptr for a page that has never been
+ * written.
+ */
+std::vector<byte> *CompressedIOHandler::cached_page(size_t pageno)
+{
+    auto cached = this->cache->find(pageno);
+    if (cached != this->cache->end()) {
+        STAT_INC(COMPRESSED_HIT);
+        this->referenced->insert(pageno);
+        return &cached->second;
+    }
+
+    if (pageno >= this->page_map->size() || (*this->page_map)[pageno].len == 0) {
+        return nullptr;
+    }
+
+    // Making room can write back pages past the end of the map, which
+    // grows it, so the entry is copied out first.
+    STAT_INC(COMPRESSED_MISS);
+    PageEntry entry = (*this->page_map)[pageno];
+    this->make_room(entry.len);
+
+    std::vector<byte> record(entry.len);
+    this->data->read(record.data(), entry.len, entry.offset);
+
+    this->cache_bytes += record.size();
+    this->clock->push_back(pageno);
+    return &this->cache->insert({pageno, std::move(record)}).first->second;
+}
+
+
+void CompressedIOHandler::load_page(size_t pageno, byte *dest)
+{
+    std::vector<byte> *record = this->cached_page(pageno);
+
+    if (!record) {
+        memset(dest, 0, this->page_size);
+    } else if (record->size() == this->page_size) {
+        memcpy(dest, record->data(), this->page_size);
+    } else {
+        zrl_decompress(record->data(), record->size(), dest, this->page_size);
+    }
+}
+
+
+void CompressedIOHandler::store_page(size_t pageno, byte *src)
+{
+    size_t clen = zrl_compress(src, this->page_size, this->packed);
+    byte *record = this->packed;
+    if (clen >= this->page_size) {
+        clen = this->page_size;
+        record = src;
+    }
+
+    auto cached = this->cache->find(pageno);
+    if (cached != this->cache->end()) {
+        size_t old_len = cached->second.size();
+        if (clen > old_len) this->make_room(clen - old_len, pageno);
+
+        this->cache_bytes -= old_len;
+        cached->second.assign(record, record + clen);
+        this->referenced->insert(pageno);
+    } else {
+        this->make_room(clen);
+        this->cache->insert({pageno, std::vector<byte>(record, record + clen)});
+        this->clock->push_back(pageno);
+    }
+
+    this->cache_bytes += clen;
+    this->dirty_pages->insert(pageno);
+}
+
+
+/*
+ * Write a page's record out. The record the saved map points to has to
+ * survive until the next map is saved, so only a record written since
+ * then is overwritten, and only if the page still fits in it. Otherwise the
+ * page moves, and the space it leaves is free again either straight away
+ * or, if the saved map points to it, after the next flush.
+ */
+void CompressedIOHandler::write_back(size_t pageno)
+{
+    std::vector<byte> &record = this->cache->at(pageno);
+
+    if (pageno >= this->page_map->size()) {
+        this->page_map->resize(pageno + 1, PageEntry{0, 0, 0});
+    }
+
+    PageEntry &entry = (*this->page_map)[pageno];
+    bool has_moved = this->moved->count(pageno);
+    if (!has_moved || record.size() > entry.cap) {
+        if (entry.cap && has_moved) {
+            this->free_space->insert({entry.cap, entry.offset});
+        } else if (entry.cap) {
+            this->released->emplace_back(entry.cap, entry.offset);
+        }
+
+        this->allocate(record.size(), &entry);
+        this->moved->insert(pageno);
+    }
+
+    this->data->write(record.data(), record.size(), entry.offset);
+    entry.len = record.size();
+    this->dirty_pages->erase(pageno);
+}
+
+
+/*
+ * Find room for a record of size bytes, with a little to spare, in the
+ * smallest run of free space that will take it, or else at the end of the
+ * file.
+ */
+void CompressedIOHandler::allocate(size_t size, PageEntry *entry)
+{
+    uint64_t cap = (size + record_align - 1) / record_align * record_align;
+
+    auto run = this->free_space->lower_bound(cap);
+    if (run == this->free_space->end()) {
+        entry->offset = this->data_end;
+        this->data_end += cap;
+    } else {
+        entry->offset = run->second;
+        if (run->first > cap) {
+            this->free_space->insert({run->first - cap, run->second + cap});
+        }
+        this->free_space->erase(run);
+    }
+
+    entry->cap = cap;
+}
+
+
+void CompressedIOHandler::evict_page(size_t pageno)
+{
+    STAT_INC(COMPRESSED_EVICT);
+    if (this->dirty_pages->count(pageno)) this->write_back(pageno);
+
+    this->cache_bytes -= this->cache->at(pageno).size();
+    this->cache->erase(pageno);
+    this->referenced->erase(pageno);
+}
+
+
+/*
+ * Evict pages, CLOCK fashion, until incoming more bytes will fit in the
+ * cache. The page keep, which is growing, stays, even if that means the
+ * cache ends up over its size for a while.
+ */
+void CompressedIOHandler::make_room(size_t incoming, size_t keep)
+{
+    while (this->cache_bytes + incoming > this->cache_max && !this->clock->empty()) {
+        size_t pageno = this->clock->front();
+        if (pageno == keep && this->clock->size() == 1) break;
+        this->clock->pop_front();
+
+        if (pageno == keep || this->referenced->erase(pageno)) {
+            this->clock->push_back(pageno);
+        } else {
+            this->evict_page(pageno);
+        }
+    }
+}
+
+
+/*
+ * Load the saved map, if there is one, and work out where the free space
+ * in the data file is from the gaps between the records it points to.
+ */
+void CompressedIOHandler::read_map()
+{
+    RawIOHandler map_file(this->map_fname.c_str());
+    if (map_file.get_flen() == 0) return;
+
+    MapHeader header;
+    map_file.read((byte *) &header, sizeof(header), 0);
+    if (header.page_size != this->page_size) throw IOException();
+
+    this->len = header.len;
+    this->data_end = header.data_end;
+    this->page_map->resize(header.page_cnt);
+    if (header.page_cnt) {
+        map_file.read((byte *) this->page_map->data(),
+                header.page_cnt * sizeof(PageEntry), sizeof(header));
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> records;
+    for (auto &entry : *this->page_map) {
+        if (entry.cap) records.emplace_back(entry.offset, entry.cap);
+    }
+    std::sort(records.begin(), records.end());
+
+    uint64_t end = 0;
+    for (auto &record : records) {
+        if (record.first > end) this->free_space->insert({record.first - end, end});
+        end = std::max(end, record.first + record.second);
+    }
+    if ((uint64_t) this->data_end > end) {
+        this->free_space->insert({this->data_end - end, end});
+    }
+}
+
+
+/*
+ * Save the map under a temporary name and rename it into place, so that
+ * there is always a whole map on disk, be it the old one or the new.
+ */
+void CompressedIOHandler::write_map()
+{
+    MapHeader header = {(uint64_t) this->len, (uint64_t) this->data_end,
+                        this->page_size, this->page_map->size()};
+
+    std::string staging = this->map_fname + ".new";
+    try {
+        RawIOHandler map_file(staging.c_str());
+        map_file.truncate(0);
+        map_file.write((byte *) &header, sizeof(header), 0);
+        if (!this->page_map->empty()) {
+            map_file.write((byte *) this->page_map->data(),
+                    this->page_map->size() * sizeof(PageEntry), sizeof(header));
+        }
+        map_file.flush();
+    } catch (...) {
+        unlink(staging.c_str());
+        throw;
+    }
+
+    if (rename(staging.c_str(), this->map_fname.c_str())) {
+        unlink(staging.c_str());
+        throw IOException();
+    }
+}
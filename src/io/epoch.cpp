@@ -0,0 +1,109 @@
+/*
+ *
+ */
+#include "io/epoch.hpp"
+#include "io/exceptions.hpp"
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+Epoch::Epoch(const char *table_fname, bool writable)
+{
+    this->fname = Epoch::path(table_fname);
+    this->fd = -1;
+    this->counter = nullptr;
+
+    if (writable) {
+        this->attach_writable();
+    } else {
+        this->attach();
+    }
+}
+
+
+/*
+ * The writer creates the sidecar, if it isn't there yet, and maps it for
+ * writing.
+ */
+void Epoch::attach_writable()
+{
+    this->fd = open(this->fname.c_str(), O_CREAT | O_RDWR, 0644);
+    if (this->fd == -1) throw IOException();
+
+    struct stat statbuff;
+    if (fstat(this->fd, &statbuff) == -1 ||
+            ((size_t) statbuff.st_size < sizeof(uint64_t) &&
+             ftruncate(this->fd, sizeof(uint64_t)) == -1)) {
+        close(this->fd);
+        throw IOException();
+    }
+
+    void *map = mmap(nullptr, sizeof(uint64_t), PROT_READ | PROT_WRITE,
+            MAP_SHARED, this->fd, 0);
+    if (map == MAP_FAILED) {
+        close(this->fd);
+        throw IOException();
+    }
+
+    this->counter = (uint64_t *) map;
+}
+
+
+/*
+ * Readers never create or extend the sidecar, since they may not be allowed
+ * to and shouldn't leave files behind for a table nobody has published. Until
+ * a writer has made it there is nothing to map, and the table is at epoch 0.
+ * Returns whether the counter is mapped.
+ */
+bool Epoch::attach()
+{
+    if (this->counter) return true;
+
+    if (this->fd == -1) {
+        this->fd = open(this->fname.c_str(), O_RDONLY);
+        if (this->fd == -1) {
+            if (errno == ENOENT) return false;
+            throw IOException();
+        }
+    }
+
+    struct stat statbuff;
+    if (fstat(this->fd, &statbuff) == -1) throw IOException();
+
+    // a writer is still setting the file up
+    if ((size_t) statbuff.st_size < sizeof(uint64_t)) return false;
+
+    void *map = mmap(nullptr, sizeof(uint64_t), PROT_READ, MAP_SHARED, this->fd, 0);
+    if (map == MAP_FAILED) throw IOException();
+
+    this->counter = (uint64_t *) map;
+    return true;
+}
+
+
+Epoch::~Epoch()
+{
+    if (this->counter) munmap(this->counter, sizeof(uint64_t));
+    if (this->fd != -1) close(this->fd);
+}
+
+
+uint64_t Epoch::current()
+{
+    if (!this->attach()) return 0;
+    return __atomic_load_n(this->counter, __ATOMIC_ACQUIRE);
+}
+
+
+uint64_t Epoch::advance()
+{
+    return __atomic_add_fetch(this->counter, 1, __ATOMIC_ACQ_REL);
+}
+
+
+std::string Epoch::path(const char *table_fname)
+{
+    return std::string(table_fname) + ".epoch";
+}
@@ -0,0 +1,141 @@
+/*
+ *
+ */
+#include "io/mapped.hpp"
+#include "io/exceptions.hpp"
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+MappedIOHandler::MappedIOHandler(const char *filename)
+{
+    this->fname = filename;
+    this->fd = -1;
+    this->data = nullptr;
+    this->len = 0;
+
+    this->epoch = new Epoch(filename, false);
+    this->seen_epoch = this->epoch->current();
+
+    try {
+        this->map();
+    } catch (IOException& e) {
+        delete this->epoch;
+        throw;
+    }
+}
+
+
+MappedIOHandler::~MappedIOHandler()
+{
+    this->unmap();
+    delete this->epoch;
+}
+
+
+/*
+ * (Re)open the file by name and map the whole of it. The new mapping is
+ * only swapped in once it has been set up, so a failure leaves the old one
+ * in place.
+ */
+void MappedIOHandler::map()
+{
+    fd_t new_fd = open(this->fname.c_str(), O_RDONLY);
+    if (new_fd == -1) throw IOException();
+
+    struct stat statbuff;
+    if (fstat(new_fd, &statbuff) == -1 || !S_ISREG(statbuff.st_mode)) {
+        close(new_fd);
+        throw IOException();
+    }
+
+    byte *new_data = nullptr;
+    if (statbuff.st_size > 0) {
+        void *map = mmap(nullptr, statbuff.st_size, PROT_READ, MAP_SHARED, new_fd, 0);
+        if (map == MAP_FAILED) {
+            close(new_fd);
+            throw IOException();
+        }
+
+        new_data = (byte *) map;
+    }
+
+    this->unmap();
+    this->fd = new_fd;
+    this->data = new_data;
+    this->len = statbuff.st_size;
+}
+
+
+void MappedIOHandler::unmap()
+{
+    if (this->data) munmap(this->data, this->len);
+    if (this->fd != -1) close(this->fd);
+
+    this->data = nullptr;
+    this->fd = -1;
+    this->len = 0;
+}
+
+
+int MappedIOHandler::read(byte* buffer, size_t size, off_t offset)
+{
+    if (offset < 0 || offset + (off_t) size > this->len) throw IOException();
+
+    memcpy(buffer, this->data + offset, size);
+    return size;
+}
+
+
+int MappedIOHandler::write(byte*, size_t, off_t)
+{
+    throw IOException();
+}
+
+
+off_t MappedIOHandler::get_flen()
+{
+    return this->len;
+}
+
+
+void MappedIOHandler::truncate(off_t)
+{
+    throw IOException();
+}
+
+
+/*
+ * A page fault on the mapping blocks, but that is as close as we can get
+ * to telling whether it would.
+ */
+bool MappedIOHandler::read_cached(byte* buffer, size_t size, off_t offset)
+{
+    this->read(buffer, size, offset);
+    return true;
+}
+
+
+int MappedIOHandler::get_fd()
+{
+    return this->fd;
+}
+
+
+bool MappedIOHandler::refresh()
+{
+    uint64_t current = this->epoch->current();
+    if (current == this->seen_epoch) return false;
+
+    this->map();
+    this->seen_epoch = current;
+    return true;
+}
+
+
+uint64_t MappedIOHandler::get_epoch()
+{
+    return this->seen_epoch;
+}
@@ -8,6 +8,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <unordered_map>
+#include <vector>
 
 MemIOHandler::MemIOHandler(size_t initial_size)
 {
@@ -16,6 +17,9 @@ MemIOHandler::MemIOHandler(size_t initial_size)
     this->len = 0;
     this->buffer_cnt = 0;
     this->hole = new byte[buffer_size]();
+    this->snapshot_active = false;
+    this->snapshot_len = 0;
+    this->snapshot_pages = new std::unordered_map<size_t, byte*>();
 
     this->new_buffer();
 }
@@ -23,6 +27,9 @@ MemIOHandler::MemIOHandler(size_t initial_size)
 
 MemIOHandler::~MemIOHandler()
 {
+    this->end_snapshot();
+    delete this->snapshot_pages;
+
     buffer_pool->clear();
     delete buffer_pool;
 }
@@ -52,20 +59,12 @@ size_t MemIOHandler::buffer_num(off_t offset)
 
 byte *MemIOHandler::get_buffer(size_t buffno, bool create)
 {
-    byte *buffer;
-
-    try {
-        buffer = this->buffer_pool->at(buffno);
-    } catch (std::out_of_range& except) {
-        if (create) {
-        new_buffer(buffno);
-        buffer = this->buffer_pool->at(buffno);
-        } else {
-            buffer = this->hole;
-        }
-    }
+    auto pooled = this->buffer_pool->find(buffno);
+    if (pooled != this->buffer_pool->end()) return pooled->second;
+    if (!create) return this->hole;
 
-    return buffer;
+    new_buffer(buffno);
+    return this->buffer_pool->find(buffno)->second;
 }
 
 
@@ -94,6 +93,7 @@ int MemIOHandler::write(byte *buffer, size_t size, off_t offset)
 {
     int cur_buffno = buffer_num(offset);
     off_t buff_offset = offset - (cur_buffno * this->buffer_size);
+    this->preserve_buffer(cur_buffno);
     byte *cur_buff = this->get_buffer(cur_buffno, true);
     off_t write_offset = 0;
     size_t remaining = size;
@@ -104,7 +104,10 @@ int MemIOHandler::write(byte *buffer, size_t size, off_t offset)
         buff_offset = 0;
         write_offset += tomove;
         remaining -= tomove;
-        if (remaining) cur_buff = this->get_buffer(++cur_buffno, true);
+        if (remaining) {
+            this->preserve_buffer(++cur_buffno);
+            cur_buff = this->get_buffer(cur_buffno, true);
+        }
     } while (remaining);
 
     if (offset + size > (size_t) this->len) {
@@ -127,6 +130,106 @@ off_t MemIOHandler::get_flen()
 }
 
 
+bool MemIOHandler::begin_snapshot()
+{
+    this->end_snapshot();
+    this->snapshot_active = true;
+    this->snapshot_len = this->len;
+
+    return true;
+}
+
+
+int MemIOHandler::snapshot_read(byte *buffer, size_t size, off_t offset)
+{
+    if (!this->snapshot_active) return this->read(buffer, size, offset);
+
+    size_t cur_buffno = buffer_num(offset);
+    off_t buff_offset = offset - (cur_buffno * this->buffer_size);
+    off_t read_offset = 0;
+    size_t remaining = size;
+
+    do {
+        byte *src;
+        auto preserved = this->snapshot_pages->find(cur_buffno);
+        if (preserved != this->snapshot_pages->end()) {
+            src = preserved->second;
+        } else {
+            src = this->get_buffer(cur_buffno, false);
+        }
+
+        size_t tomove = std::min(this->buffer_size - buff_offset, remaining);
+        memmove(buffer + read_offset, src + buff_offset, tomove);
+        buff_offset = 0;
+        read_offset += tomove;
+        remaining -= tomove;
+        cur_buffno++;
+    } while (remaining);
+
+    return size;
+}
+
+
+void MemIOHandler::end_snapshot()
+{
+    for (auto &x : *this->snapshot_pages) {
+        delete[] x.second;
+    }
+
+    this->snapshot_pages->clear();
+    this->snapshot_active = false;
+}
+
+
+void MemIOHandler::preserve_buffer(size_t buffno)
+{
+    if (!this->snapshot_active || (off_t) (buffno * this->buffer_size) >= this->snapshot_len ||
+            this->snapshot_pages->find(buffno) != this->snapshot_pages->end()) {
+        return;
+    }
+
+    // A page that doesn't exist yet reads as the hole, so that is what
+    // gets preserved for it.
+    byte *copy = new byte[this->buffer_size];
+    memcpy(copy, this->get_buffer(buffno, false), this->buffer_size);
+    this->snapshot_pages->insert({buffno, copy});
+}
+
+
+void MemIOHandler::truncate(off_t len)
+{
+    std::vector<size_t> doomed;
+    for (auto &x : *this->buffer_pool) {
+        if ((off_t) (x.first * this->buffer_size) >= len) doomed.push_back(x.first);
+    }
+
+    for (auto buffno : doomed) {
+        delete[] this->buffer_pool->at(buffno);
+        this->buffer_pool->erase(buffno);
+        this->buffer_cnt--;
+    }
+
+    size_t last = buffer_num(len);
+    auto partial = this->buffer_pool->find(last);
+    if (partial != this->buffer_pool->end()) {
+        off_t keep = len - last * this->buffer_size;
+        memset(partial->second + keep, 0, this->buffer_size - keep);
+    }
+
+    this->len = len;
+}
+
+
+/*
+ * Everything is already in memory, so there is never anything to fetch.
+ */
+bool MemIOHandler::read_cached(byte *buffer, size_t size, off_t offset)
+{
+    this->read(buffer, size, offset);
+    return true;
+}
+
+
 void MemIOHandler::dump(size_t line_size)
 {
     for (auto& buff: *this->buffer_pool){
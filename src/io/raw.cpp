@@ -4,14 +4,24 @@
 #include "kvs.hpp"
 #include "io/raw.hpp"
 #include "io/exceptions.hpp"
+#include "util/stats.hpp"
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <cerrno>
+#include <algorithm>
+
+/*
+ * How far ahead of a sequential reader readahead is kept going.
+ */
+static const off_t readahead_window = 1 << 20;
 
 RawIOHandler::RawIOHandler(const char *filename)
 {
-    this->fd = open(filename, O_CREAT | O_RDWR);
+    this->fd = open(filename, O_CREAT | O_RDWR, 0644);
     if (this->fd == -1) throw IOException();
 
     // Verify that this->fd refers to a regular file. If not, then it cannot
@@ -23,6 +33,14 @@ RawIOHandler::RawIOHandler(const char *filename)
 
     if (!S_ISREG(statbuff.st_mode)) throw IOException();
 
+    // From here on the length of the file is tracked in process, rather
+    // than asking the kernel every time. This assumes nobody else is
+    // changing the file's length behind our backs.
+    this->flen = statbuff.st_size;
+    this->allocated = statbuff.st_size;
+    this->can_preallocate = true;
+    this->hints = new AccessHints();
+    this->readahead_to = 0;
 }
 
 
@@ -30,6 +48,7 @@ RawIOHandler::~RawIOHandler()
 {
     fsync(this->fd);
     close(this->fd);
+    delete this->hints;
 }
 
 
@@ -44,15 +63,27 @@ int RawIOHandler::perform_io(byte* buffer, size_t size, off_t offset, op_t op)
     ssize_t progress;
 
     do {
-        if (op == op_t::READ)
+        STAT_TIMER_START(start);
+        if (op == op_t::READ) {
             progress = pread(this->fd, buffer + total_progress,
                     size - total_progress, offset + total_progress);
-        else if (op == op_t::WRITE)
+            STAT_TIMER_RECORD(RAW_READ_NS, start);
+            STAT_INC(RAW_READS);
+        } else if (op == op_t::WRITE) {
             progress = pwrite(this->fd, buffer + total_progress,
                     size - total_progress, offset + total_progress);
+            STAT_TIMER_RECORD(RAW_WRITE_NS, start);
+            STAT_INC(RAW_WRITES);
+        }
 
         if (progress == -1) throw IOException();
 
+        if (op == op_t::READ) {
+            STAT_ADD(RAW_READ_BYTES, progress);
+        } else {
+            STAT_ADD(RAW_WRITE_BYTES, progress);
+        }
+
         total_progress += progress;
 
     } while (total_progress != size);
@@ -64,22 +95,192 @@ int RawIOHandler::perform_io(byte* buffer, size_t size, off_t offset, op_t op)
 int RawIOHandler::read(byte* buffer, size_t size, off_t offset)
 {
     if (offset + (off_t) size > this->get_flen()) throw IOException();
+    if (!this->hints->empty()) this->read_ahead(offset, size);
     return this->perform_io(buffer, size, offset, op_t::READ);
 }
 
 
+/*
+ * Within a range advised SEQUENTIAL, keep the kernel reading up to a window
+ * ahead of the reader, topping it up each time the reader gets half way
+ * there. The kernel's own readahead ramps up far more slowly, and gives up
+ * altogether on reads that come in through several threads.
+ */
+void RawIOHandler::read_ahead(off_t offset, size_t size)
+{
+    const AccessHints::Hint *hint = this->hints->find(offset);
+    if (!hint || hint->access != access_t::SEQUENTIAL) return;
+
+    off_t end = offset + size;
+    if (this->readahead_to >= end + readahead_window / 2) return;
+
+    off_t start = std::max(this->readahead_to, end);
+    off_t stop = std::min(end + readahead_window, hint->offset + hint->len);
+    if (start < stop) readahead(this->fd, start, stop - start);
+    this->readahead_to = stop;
+}
+
+
 
 int RawIOHandler::write(byte* buffer, size_t size, off_t offset)
 {
-    return this->perform_io(buffer, size, offset, op_t::WRITE);
+    off_t end = offset + size;
+    {
+        std::lock_guard<std::mutex> guard(this->extent_lock);
+        if (end > this->allocated) this->preallocate(end);
+    }
+
+    int written = this->perform_io(buffer, size, offset, op_t::WRITE);
+
+    std::lock_guard<std::mutex> guard(this->extent_lock);
+    if (end > this->flen.load()) this->flen.store(end);
+
+    return written;
+}
+
+
+/*
+ * Reserve space on disk out to at least end, rounded up to a whole number of
+ * extents, so that a file growing a bucket at a time is laid out in large
+ * contiguous pieces rather than being extended by every write. The file's
+ * apparent size is left alone. Filesystems that can't do this just don't
+ * get it, and neither does a file whose last attempt failed for any other
+ * reason (a full disk, say), so that the failing call isn't repeated on
+ * every write after it. The caller must hold extent_lock.
+ */
+void RawIOHandler::preallocate(off_t end)
+{
+    off_t target = ((end + PREALLOC_EXTENT - 1) / PREALLOC_EXTENT) * PREALLOC_EXTENT;
+
+    if (this->can_preallocate &&
+            fallocate(this->fd, FALLOC_FL_KEEP_SIZE, this->allocated,
+                      target - this->allocated) == -1) {
+        this->can_preallocate = false;
+        return;
+    }
+
+    this->allocated = target;
+}
+
+
+void RawIOHandler::truncate(off_t len)
+{
+    std::lock_guard<std::mutex> guard(this->extent_lock);
+    if (ftruncate(this->fd, len) == -1) throw IOException();
+
+    // shrinking the file releases any space preallocated past its end
+    this->flen.store(len);
+    if (len < this->allocated) this->allocated = len;
+}
+
+
+
+/*
+ * Hints are passed on to the kernel with posix_fadvise, which is only ever
+ * advice, so failures are ignored. Withdrawing a ONCE hint drops the range
+ * from the page cache, as nobody is expected to want it again.
+ */
+void RawIOHandler::advise(off_t offset, off_t len, access_t access)
+{
+    access_t withdrawn = this->hints->advise(offset, len, access);
+
+    int advice = POSIX_FADV_NORMAL;
+    switch (access) {
+        case access_t::RANDOM:
+            advice = POSIX_FADV_RANDOM;
+            break;
+        case access_t::SEQUENTIAL:
+            advice = POSIX_FADV_SEQUENTIAL;
+            this->readahead_to = offset;
+            break;
+        case access_t::ONCE:
+            advice = POSIX_FADV_NOREUSE;
+            break;
+        case access_t::NORMAL:
+            if (withdrawn == access_t::ONCE) advice = POSIX_FADV_DONTNEED;
+            break;
+    }
+
+    posix_fadvise(this->fd, offset, len, advice);
 }
 
 
+void RawIOHandler::prefetch(off_t offset, size_t size)
+{
+    posix_fadvise(this->fd, offset, size, POSIX_FADV_WILLNEED);
+}
+
+
+void RawIOHandler::flush()
+{
+    if (fdatasync(this->fd) == -1) throw IOException();
+}
+
 
 off_t RawIOHandler::get_flen()
 {
-    off_t end = lseek(this->fd, 0, SEEK_END);
-    if (end == -1) throw IOException();
+    return this->flen.load();
+}
+
+
+
+/*
+ * Make the file at to an exact copy of the one at from, as cheaply as the
+ * filesystem allows. If both files are on a filesystem with reflink support
+ * then the copy shares extents with the original and costs next to nothing.
+ * Otherwise we fall back to copy_file_range, which at least keeps the data
+ * in the kernel, and finally to a plain read/write loop.
+ */
+void RawIOHandler::clone_file(const char *from, const char *to)
+{
+    fd_t src = open(from, O_RDONLY);
+    if (src == -1) throw IOException();
+
+    fd_t dst = open(to, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (dst == -1) {
+        close(src);
+        throw IOException();
+    }
+
+    struct stat statbuff;
+    bool failed = fstat(src, &statbuff) == -1;
+
+    if (!failed && ioctl(dst, FICLONE, src) == -1) {
+        off_t remaining = statbuff.st_size;
+        bool kernel_copy = true;
+        off_t offset = 0;
+        byte buffer[1 << 16];
+
+        while (remaining > 0 && !failed) {
+            ssize_t progress = -1;
+            if (kernel_copy) {
+                progress = copy_file_range(src, nullptr, dst, nullptr, remaining, 0);
+                if (progress == -1 && (errno == EXDEV || errno == ENOSYS ||
+                            errno == EOPNOTSUPP || errno == EINVAL)) {
+                    // copy_file_range advances the file offsets, but the
+                    // fallback uses explicit offsets so that's no matter.
+                    kernel_copy = false;
+                    continue;
+                }
+            } else {
+                progress = pread(src, buffer, std::min((off_t) sizeof(buffer), remaining), offset);
+                if (progress > 0 && pwrite(dst, buffer, progress, offset) != progress) {
+                    progress = -1;
+                }
+            }
+
+            if (progress <= 0) {
+                failed = true;
+            } else {
+                remaining -= progress;
+                offset += progress;
+            }
+        }
+    }
+
+    failed = failed || fsync(dst) == -1;
+    close(src);
+    close(dst);
 
-    return end;
+    if (failed) throw IOException();
 }
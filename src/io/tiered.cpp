@@ -0,0 +1,440 @@
+#include "io/tiered.hpp"
+#include "io/exceptions.hpp"
+#include "util/stats.hpp"
+#include <algorithm>
+#include <cstring>
+
+/*
+ * Cold page counts are halved once this many accesses per hot frame have
+ * been counted since the last time.
+ */
+static const size_t age_period = 8;
+
+
+TieredIOHandler::TieredIOHandler(IOHandler *cold, size_t hot_bytes, size_t promote_after)
+{
+    this->cold = cold;
+    this->page_size = PAGESIZE;
+    this->promote_after = std::max(promote_after, (size_t) 1);
+    this->len = cold->get_flen();
+    this->hand = 0;
+    this->accesses = 0;
+    this->changes = 0;
+
+    size_t frame_cnt = std::max(hot_bytes / this->page_size, (size_t) 1);
+    this->arena = new byte[frame_cnt * this->page_size]();
+    this->frames.resize(frame_cnt, Frame{0, 0, false, false});
+    for (size_t i=frame_cnt; i-- > 0; ) {
+        this->free_frames.push_back(i);
+    }
+}
+
+
+TieredIOHandler::~TieredIOHandler()
+{
+    for (size_t i=0; i<this->frames.size(); i++) {
+        if (this->frames[i].used && this->frames[i].dirty) this->write_back(i);
+    }
+
+    delete[] this->arena;
+    delete this->cold;
+}
+
+
+int TieredIOHandler::read(byte* buffer, size_t size, off_t offset)
+{
+    off_t cold_len = this->cold->get_flen();
+
+    // Runs of neighbouring cold pages are read with a single I/O.
+    off_t run_start = offset;
+    size_t run_len = 0;
+    auto read_run = [&]() {
+        if (run_len == 0) return;
+
+        byte *dest = buffer + (run_start - offset);
+        size_t avail = (run_start < cold_len) ?
+                std::min((off_t) run_len, cold_len - run_start) : 0;
+        if (avail) this->cold->read(dest, avail, run_start);
+        memset(dest + avail, 0, run_len - avail);
+        run_len = 0;
+    };
+
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        size_t page = page_num(pos);
+        size_t in_page = pos - page_off(page);
+        size_t tomove = std::min(this->page_size - in_page, size - done);
+
+        byte *data = this->touch(page);
+        if (data) {
+            read_run();
+            memcpy(buffer + done, data + in_page, tomove);
+        } else {
+            if (run_len == 0) run_start = pos;
+            run_len += tomove;
+        }
+        done += tomove;
+    }
+    read_run();
+
+    return size;
+}
+
+
+int TieredIOHandler::write(byte* buffer, size_t size, off_t offset)
+{
+    // Extend the file first, as promoting one of the pages can demote
+    // another that this write has already filled in.
+    if (offset + (off_t) size > this->len) this->len = offset + size;
+    this->changes++;
+
+    off_t run_start = offset;
+    size_t run_len = 0;
+    auto write_run = [&]() {
+        if (run_len) this->cold->write(buffer + (run_start - offset), run_len, run_start);
+        run_len = 0;
+    };
+
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        size_t page = page_num(pos);
+        size_t in_page = pos - page_off(page);
+        size_t tomove = std::min(this->page_size - in_page, size - done);
+
+        byte *data = this->touch(page);
+        if (data) {
+            write_run();
+            memcpy(data + in_page, buffer + done, tomove);
+            this->frames[this->hot[page]].dirty = true;
+        } else {
+            if (run_len == 0) run_start = pos;
+            run_len += tomove;
+        }
+        done += tomove;
+    }
+    write_run();
+
+    return size;
+}
+
+
+off_t TieredIOHandler::get_flen()
+{
+    return std::max(this->cold->get_flen(), this->len);
+}
+
+
+/*
+ * Hot pages wholly past the new end are dropped without being written
+ * back, and the tail of the one it falls in is zeroed, so that extending
+ * the file again reads back zeros.
+ */
+void TieredIOHandler::truncate(off_t len)
+{
+    this->changes++;
+    for (size_t i=0; i<this->frames.size(); i++) {
+        Frame &frame = this->frames[i];
+        if (!frame.used) continue;
+
+        off_t start = page_off(frame.page);
+        if (start >= len) {
+            this->hot.erase(frame.page);
+            frame.used = false;
+            this->free_frames.push_back(i);
+        } else if (start + (off_t) this->page_size > len) {
+            off_t keep = len - start;
+            memset(frame_data(i) + keep, 0, this->page_size - keep);
+        }
+    }
+
+    for (auto entry = this->heat.begin(); entry != this->heat.end(); ) {
+        if (page_off(entry->first) >= len) {
+            entry = this->heat.erase(entry);
+        } else {
+            ++entry;
+        }
+    }
+
+    this->len = len;
+    this->cold->truncate(len);
+}
+
+
+int TieredIOHandler::get_fd()
+{
+    return this->cold->get_fd();
+}
+
+
+void TieredIOHandler::flush()
+{
+    for (size_t i=0; i<this->frames.size(); i++) {
+        if (this->frames[i].used && this->frames[i].dirty) this->write_back(i);
+    }
+
+    this->cold->flush();
+}
+
+
+/*
+ * Only a read wholly within the hot tier is done here. Anything else is
+ * left to the reader's fetch without counting it, as install will, so that
+ * a probe neither counts twice nor promotes a page with a synchronous read.
+ */
+bool TieredIOHandler::read_cached(byte* buffer, size_t size, off_t offset)
+{
+    if (size == 0) return true;
+
+    size_t last = page_num(offset + size - 1);
+    for (size_t page=page_num(offset); page<=last; page++) {
+        if (this->hot.find(page) == this->hot.end()) return false;
+    }
+
+    this->read(buffer, size, offset);
+    return true;
+}
+
+
+/*
+ * Misses are fetched a whole page at a time, so that install can promote
+ * pages from what was fetched, and only from the part of the file that
+ * exists on the device. The stamp is the number of changes so far.
+ */
+uint64_t TieredIOHandler::fetch_extent(size_t size, off_t offset, size_t *fetch_size,
+        off_t *fetch_offset)
+{
+    off_t start = page_off(page_num(offset));
+    off_t end = page_off(page_num(offset + size - 1) + 1);
+    end = std::max(start, std::min(end, this->cold->get_flen()));
+
+    *fetch_offset = start;
+    *fetch_size = end - start;
+    return this->changes;
+}
+
+
+/*
+ * Count the access to a range that read_cached turned away. The fetched
+ * bytes are only current if nothing has been written through the handler
+ * since, and none of the range has been promoted in the meantime; if they
+ * aren't, the access is left for the reader's read to count.
+ */
+bool TieredIOHandler::install(byte* data, size_t size, off_t offset, uint64_t stamp)
+{
+    if (size == 0) return true;
+    if (stamp != this->changes) return false;
+
+    size_t last = page_num(offset + size - 1);
+    for (size_t page=page_num(offset); page<=last; page++) {
+        if (this->hot.find(page) != this->hot.end()) return false;
+    }
+
+    for (size_t done=0; done<size; done+=this->page_size) {
+        this->touch(page_num(offset + done), data + done, size - done);
+    }
+
+    return true;
+}
+
+
+void TieredIOHandler::advise(off_t offset, off_t len, access_t access)
+{
+    this->hints.advise(offset, len, access);
+    this->cold->advise(offset, len, access);
+}
+
+
+/*
+ * Pass runs of cold pages down to the device.
+ */
+void TieredIOHandler::prefetch(off_t offset, size_t size)
+{
+    if (size == 0) return;
+
+    size_t last = page_num(offset + size - 1);
+    size_t run_start = 0;
+    size_t run_len = 0;
+
+    for (size_t page=page_num(offset); page<=last + 1; page++) {
+        bool missing = page <= last && this->hot.find(page) == this->hot.end();
+        if (missing) {
+            if (run_len == 0) run_start = page;
+            run_len++;
+        } else if (run_len) {
+            this->cold->prefetch(page_off(run_start), run_len * this->page_size);
+            run_len = 0;
+        }
+    }
+}
+
+
+size_t TieredIOHandler::get_hot_pages()
+{
+    return this->hot.size();
+}
+
+
+size_t TieredIOHandler::get_hot_capacity()
+{
+    return this->frames.size();
+}
+
+
+bool TieredIOHandler::is_hot(off_t offset)
+{
+    return this->hot.find(page_num(offset)) != this->hot.end();
+}
+
+
+size_t TieredIOHandler::page_num(off_t offset)
+{
+    return (size_t) (offset / this->page_size);
+}
+
+
+off_t TieredIOHandler::page_off(size_t page)
+{
+    return (off_t) page * this->page_size;
+}
+
+
+byte *TieredIOHandler::frame_data(size_t frame)
+{
+    return this->arena + frame * this->page_size;
+}
+
+
+/*
+ * Count an access to page, unless it falls under a scan hint, promoting it
+ * if that makes it hot enough. A page being promoted is copied from
+ * fetched, if the caller already has its contents, and read from the
+ * device otherwise. Returns the page's data if it is hot, and nullptr if it
+ * is to be accessed on the device.
+ */
+byte *TieredIOHandler::touch(size_t page, byte *fetched, size_t fetched_len)
+{
+    bool counted = true;
+    if (!this->hints.empty()) {
+        access_t access = this->hints.lookup(page_off(page));
+        counted = access != access_t::SEQUENTIAL && access != access_t::ONCE;
+    }
+
+    auto found = this->hot.find(page);
+    if (found != this->hot.end()) {
+        STAT_INC(TIER_HIT);
+        Frame &frame = this->frames[found->second];
+        if (counted && frame.count < max_count) frame.count++;
+        return frame_data(found->second);
+    }
+
+    STAT_INC(TIER_MISS);
+    if (!counted) return nullptr;
+
+    uint8_t &count = this->heat[page];
+    if (count < max_count) count++;
+    uint8_t seen = count;
+
+    if (seen >= this->promote_after) {
+        this->heat.erase(page);
+        this->promote(page, seen, fetched, fetched_len);
+    }
+
+    if (++this->accesses >= age_period * this->frames.size()) this->age();
+
+    found = this->hot.find(page);
+    return (found != this->hot.end()) ? frame_data(found->second) : nullptr;
+}
+
+
+void TieredIOHandler::promote(size_t page, uint8_t count, byte *fetched, size_t fetched_len)
+{
+    size_t frame = this->take_frame();
+    byte *data = frame_data(frame);
+
+    size_t avail;
+    if (fetched) {
+        avail = std::min(this->page_size, fetched_len);
+        memcpy(data, fetched, avail);
+    } else {
+        off_t start = page_off(page);
+        off_t cold_len = this->cold->get_flen();
+        avail = (start < cold_len) ? std::min((off_t) this->page_size, cold_len - start) : 0;
+        if (avail) this->cold->read(data, avail, start);
+    }
+    memset(data + avail, 0, this->page_size - avail);
+
+    STAT_INC(TIER_PROMOTE);
+    this->frames[frame] = Frame{page, count, true, false};
+    this->hot[page] = frame;
+}
+
+
+/*
+ * A free frame, demoting a page to make one if there aren't any.
+ */
+size_t TieredIOHandler::take_frame()
+{
+    while (this->free_frames.empty()) {
+        size_t victim = this->hand;
+        this->hand = (this->hand + 1) % this->frames.size();
+
+        Frame &frame = this->frames[victim];
+        if (frame.count == 0) {
+            this->demote(victim);
+        } else {
+            frame.count--;
+        }
+    }
+
+    size_t frame = this->free_frames.back();
+    this->free_frames.pop_back();
+    return frame;
+}
+
+
+void TieredIOHandler::demote(size_t frame)
+{
+    STAT_INC(TIER_DEMOTE);
+    if (this->frames[frame].dirty) this->write_back(frame);
+
+    this->hot.erase(this->frames[frame].page);
+    this->frames[frame].used = false;
+    this->free_frames.push_back(frame);
+}
+
+
+/*
+ * Write a hot page's data to the device, stopping at the end of the file
+ * so that the device doesn't grow to a whole number of pages.
+ */
+void TieredIOHandler::write_back(size_t frame)
+{
+    Frame &f = this->frames[frame];
+    off_t start = page_off(f.page);
+    size_t size = (start < this->len) ?
+            std::min((off_t) this->page_size, this->len - start) : 0;
+
+    if (size) this->cold->write(frame_data(frame), size, start);
+    f.dirty = false;
+    this->changes++;
+}
+
+
+/*
+ * Halve the count of every cold page, forgetting those that reach zero.
+ */
+void TieredIOHandler::age()
+{
+    for (auto entry = this->heat.begin(); entry != this->heat.end(); ) {
+        entry->second /= 2;
+        if (entry->second == 0) {
+            entry = this->heat.erase(entry);
+        } else {
+            ++entry;
+        }
+    }
+
+    this->accesses = 0;
+}
@@ -0,0 +1,234 @@
+/*
+ *
+ */
+#include "net/client.hpp"
+#include "dstruct/hashtable.hpp"
+#include "io/exceptions.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+
+KVClient::KVClient(const char *address, uint16_t port)
+{
+    this->in_pos = 0;
+
+    sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) throw IOException();
+
+    this->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (this->fd == -1) throw IOException();
+
+    int on = 1;
+    setsockopt(this->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(this->fd, (sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(this->fd);
+        throw IOException();
+    }
+}
+
+
+KVClient::~KVClient()
+{
+    close(this->fd);
+}
+
+
+void KVClient::queue(netop_t op, const uint64_t *first, const uint64_t *second, size_t cnt)
+{
+    if (cnt > max_frame_items)
+        throw std::invalid_argument("Too many items for a single request.");
+
+    size_t used = this->out.size();
+    this->out.resize(used + frame_header_bytes + request_bytes((uint32_t) op, cnt));
+    byte *frame = this->out.data() + used;
+
+    put_header(frame, (uint32_t) op, cnt);
+    byte *item = frame + frame_header_bytes;
+    for (size_t i=0; i<cnt; i++) {
+        put_u64(item, first[i]);
+        item += sizeof(uint64_t);
+        if (second) {
+            put_u64(item, second[i]);
+            item += sizeof(uint64_t);
+        }
+    }
+
+    this->awaiting.push_back(op);
+}
+
+
+void KVClient::send_get(const uint64_t *keys, size_t cnt)
+{
+    this->queue(netop_t::GET, keys, nullptr, cnt);
+}
+
+
+void KVClient::send_put(const uint64_t *keys, const uint64_t *values, size_t cnt)
+{
+    this->queue(netop_t::PUT, keys, values, cnt);
+}
+
+
+void KVClient::send_del(const uint64_t *keys, size_t cnt)
+{
+    this->queue(netop_t::DEL, keys, nullptr, cnt);
+}
+
+
+void KVClient::flush()
+{
+    size_t sent = 0;
+    while (sent < this->out.size()) {
+        ssize_t cnt = send(this->fd, this->out.data() + sent, this->out.size() - sent,
+                MSG_NOSIGNAL);
+        if (cnt == -1) {
+            if (errno == EINTR) continue;
+            throw IOException();
+        }
+        sent += cnt;
+    }
+
+    this->out.clear();
+}
+
+
+/*
+ * Read until there are at least bytes unparsed bytes of input.
+ */
+void KVClient::fill(size_t bytes)
+{
+    if (this->in_pos && this->in.size() - this->in_pos < bytes) {
+        this->in.erase(this->in.begin(), this->in.begin() + this->in_pos);
+        this->in_pos = 0;
+    }
+
+    while (this->in.size() - this->in_pos < bytes) {
+        size_t used = this->in.size();
+        size_t want = std::max(bytes - (used - this->in_pos), (size_t) 1 << 16);
+        this->in.resize(used + want);
+
+        ssize_t got = recv(this->fd, this->in.data() + used, want, 0);
+        this->in.resize(used + ((got > 0) ? got : 0));
+
+        if (got == 0) throw IOException();
+        if (got == -1 && errno != EINTR) throw IOException();
+    }
+}
+
+
+Response KVClient::receive()
+{
+    if (this->awaiting.empty())
+        throw std::logic_error("No requests are awaiting a response.");
+    if (!this->out.empty()) this->flush();
+
+    netop_t op = this->awaiting.front();
+    this->awaiting.pop_front();
+
+    this->fill(frame_header_bytes);
+    FrameHeader header = get_header(this->in.data() + this->in_pos);
+    this->in_pos += frame_header_bytes;
+
+    Response response;
+    response.status = (status_t) header.code;
+    response.cnt = header.cnt;
+
+    if (response.status == status_t::OK && op == netop_t::GET) {
+        if (header.cnt > max_frame_items) throw ProtocolException();
+
+        size_t cnt = header.cnt;
+        this->fill(cnt * (sizeof(uint64_t) + 1));
+        const byte *values = this->in.data() + this->in_pos;
+        const byte *flags = values + cnt * sizeof(uint64_t);
+
+        response.values.resize(cnt);
+        response.found.resize(cnt);
+        for (size_t i=0; i<cnt; i++) {
+            response.values[i] = get_u64(values + i * sizeof(uint64_t));
+            response.found[i] = flags[i];
+        }
+        this->in_pos += cnt * (sizeof(uint64_t) + 1);
+    }
+
+    return response;
+}
+
+
+size_t KVClient::get_outstanding()
+{
+    return this->awaiting.size();
+}
+
+
+/*
+ * Turn a failed response into the exception the table itself would have
+ * thrown.
+ */
+void KVClient::check(Response &response)
+{
+    switch (response.status) {
+        case status_t::OK:
+            return;
+        case status_t::READ_ONLY:
+            throw ReadOnlyException();
+        case status_t::BAD_REQUEST:
+            throw ProtocolException();
+        default:
+            throw IOException();
+    }
+}
+
+
+bool KVClient::get(uint64_t key, uint64_t *val)
+{
+    bool found;
+    return this->multi_get(&key, 1, val, &found) == 1;
+}
+
+
+void KVClient::put(uint64_t key, uint64_t val)
+{
+    this->send_put(&key, &val, 1);
+    Response response = this->receive();
+    this->check(response);
+}
+
+
+bool KVClient::remove(uint64_t key)
+{
+    this->send_del(&key, 1);
+    Response response = this->receive();
+    this->check(response);
+    return response.cnt == 1;
+}
+
+
+size_t KVClient::multi_get(const uint64_t *keys, size_t cnt, uint64_t *values, bool *found)
+{
+    // Send every frame before reading any responses, so the server can
+    // take the whole lot as one batch.
+    for (size_t start=0; start<cnt; start+=max_frame_items) {
+        this->send_get(keys + start, std::min(cnt - start, max_frame_items));
+    }
+
+    size_t hits = 0;
+    for (size_t start=0; start<cnt; start+=max_frame_items) {
+        Response response = this->receive();
+        this->check(response);
+
+        for (size_t i=0; i<response.values.size(); i++) {
+            values[start + i] = response.values[i];
+            found[start + i] = response.found[i];
+            if (found[start + i]) hits++;
+        }
+    }
+
+    return hits;
+}
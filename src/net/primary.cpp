@@ -0,0 +1,317 @@
+/*
+ *
+ */
+#include "net/primary.hpp"
+#include "io/exceptions.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <iterator>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Bytes of the snapshot file sent per read.
+ */
+static constexpr size_t const snapshot_block_bytes = 1 << 16;
+
+/*
+ * How long a feed waits for a change before sending a heartbeat, and how
+ * long a send to a replica may block before giving up on it.
+ */
+static constexpr unsigned const heartbeat_ms = 100;
+static constexpr unsigned const send_timeout_ms = 5000;
+
+
+ReplicationPrimary::ReplicationPrimary(ServedTable *table, const char *scratch, uint16_t port,
+        const char *address)
+{
+    if (!table->get_change_log())
+        throw std::invalid_argument("Replicated tables need their change log enabled.");
+
+    this->table = table;
+    this->log = table->get_change_log();
+    this->scratch = scratch;
+    this->next_feed_id = 0;
+    this->stopping.store(false);
+    this->listen_fd = -1;
+    this->wake_fd = -1;
+
+    sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) throw IOException();
+
+    try {
+        this->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (this->listen_fd == -1) throw IOException();
+
+        int on = 1;
+        setsockopt(this->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(this->listen_fd, (sockaddr *) &addr, sizeof(addr)) == -1 ||
+                listen(this->listen_fd, SOMAXCONN) == -1) {
+            throw IOException();
+        }
+
+        socklen_t len = sizeof(addr);
+        if (getsockname(this->listen_fd, (sockaddr *) &addr, &len) == -1) throw IOException();
+        this->port = ntohs(addr.sin_port);
+
+        this->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (this->wake_fd == -1) throw IOException();
+    } catch (IOException &) {
+        if (this->listen_fd != -1) close(this->listen_fd);
+        throw;
+    }
+}
+
+
+ReplicationPrimary::~ReplicationPrimary()
+{
+    this->reap(true);
+    close(this->listen_fd);
+    close(this->wake_fd);
+}
+
+
+void ReplicationPrimary::run()
+{
+    pollfd fds[2];
+    fds[0].fd = this->listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = this->wake_fd;
+    fds[1].events = POLLIN;
+
+    while (!this->stopping.load()) {
+        // wake now and then to clear away feeds whose replica has gone
+        int cnt = poll(fds, 2, 1000);
+        if (cnt == -1) {
+            if (errno == EINTR) continue;
+            throw IOException();
+        }
+
+        if (fds[1].revents) {
+            uint64_t drained;
+            while (read(this->wake_fd, &drained, sizeof(drained)) > 0) {}
+        }
+
+        if (fds[0].revents && !this->stopping.load()) this->accept_one();
+        this->reap(false);
+    }
+
+    this->reap(true);
+    this->stopping.store(false);
+}
+
+
+void ReplicationPrimary::stop()
+{
+    this->stopping.store(true);
+    uint64_t one = 1;
+    ssize_t ignored = write(this->wake_fd, &one, sizeof(one));
+    (void) ignored;
+}
+
+
+uint16_t ReplicationPrimary::get_port()
+{
+    return this->port;
+}
+
+
+std::vector<ReplicaStatus> ReplicationPrimary::get_replicas()
+{
+    std::lock_guard<std::mutex> guard(this->feeds_lock);
+    uint64_t head = this->log->get_next_seq();
+
+    std::vector<ReplicaStatus> replicas;
+    for (auto &feed : this->feeds) {
+        if (feed.done.load()) continue;
+
+        ReplicaStatus status;
+        status.peer = feed.peer;
+        status.synced = feed.synced.load();
+        status.acked = feed.acked.load();
+        status.lag = (status.synced && status.acked < head) ? head - status.acked : 0;
+        replicas.push_back(status);
+    }
+
+    return replicas;
+}
+
+
+void ReplicationPrimary::accept_one()
+{
+    sockaddr_in addr = sockaddr_in();
+    socklen_t len = sizeof(addr);
+    fd_t fd = accept4(this->listen_fd, (sockaddr *) &addr, &len, SOCK_CLOEXEC);
+    if (fd == -1) return;
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    timeval timeout = timeval();
+    timeout.tv_sec = send_timeout_ms / 1000;
+    timeout.tv_usec = (send_timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char host[INET_ADDRSTRLEN] = "?";
+    inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+
+    std::lock_guard<std::mutex> guard(this->feeds_lock);
+    this->feeds.emplace_back();
+    Feed *feed = &this->feeds.back();
+    feed->fd = fd;
+    feed->peer = std::string(host) + ":" + std::to_string(ntohs(addr.sin_port));
+    feed->synced.store(false);
+    feed->acked.store(0);
+    feed->done.store(false);
+
+    uint64_t id = this->next_feed_id++;
+    feed->thread = std::thread([this, feed, id]() { this->feed(feed, id); });
+}
+
+
+/*
+ * Join and clean up after the feeds that have finished, or with all set,
+ * disconnect every replica and clean up after all of them.
+ */
+void ReplicationPrimary::reap(bool all)
+{
+    std::list<Feed> finished;
+    {
+        std::lock_guard<std::mutex> guard(this->feeds_lock);
+        for (auto feed = this->feeds.begin(); feed != this->feeds.end(); ) {
+            if (all) shutdown(feed->fd, SHUT_RDWR);
+
+            auto next = std::next(feed);
+            if (all || feed->done.load()) {
+                finished.splice(finished.end(), this->feeds, feed);
+            }
+            feed = next;
+        }
+    }
+
+    for (auto &feed : finished) {
+        feed.thread.join();
+        close(feed.fd);
+    }
+}
+
+
+void ReplicationPrimary::feed(Feed *feed, uint64_t id)
+{
+    try {
+        FrameHeader header;
+        uint64_t hello[2];
+        if (!recv_frame(feed->fd, &header, hello) ||
+                header.code != (uint32_t) replop_t::HELLO) {
+            feed->done.store(true);
+            return;
+        }
+
+        uint64_t next;
+        if (hello[0] == this->log->get_generation() && this->log->retains(hello[1])) {
+            next = hello[1];
+        } else {
+            next = this->send_snapshot(feed, id);
+        }
+        feed->acked.store(next);
+        feed->synced.store(true);
+
+        std::vector<ServedChange> changes;
+        std::vector<byte> items;
+        while (!this->stopping.load()) {
+            changes.clear();
+
+            // the replica needs a change the log has already dropped
+            if (!this->log->read(next, max_frame_items, changes,
+                        std::chrono::milliseconds(heartbeat_ms))) {
+                break;
+            }
+
+            items.resize(changes.size() * change_bytes);
+            byte *item = items.data();
+            for (auto &change : changes) {
+                item[0] = (byte) change.kind;
+                put_u64(item + 1, change.key);
+                put_u64(item + 1 + sizeof(uint64_t), change.val);
+                item += change_bytes;
+            }
+
+            uint64_t fields[2] = {next, this->log->get_next_seq()};
+            if (!send_frame(feed->fd, replop_t::CHANGES, changes.size(), fields,
+                        items.data(), items.size())) {
+                break;
+            }
+
+            next += changes.size();
+            this->read_acks(feed);
+        }
+    } catch (std::exception &) {
+        // The replica is disconnected, and can reconnect to try again.
+    }
+
+    feed->done.store(true);
+}
+
+
+/*
+ * Send feed a snapshot of the table, returning the number of the first
+ * change it needs after it.
+ */
+uint64_t ReplicationPrimary::send_snapshot(Feed *feed, uint64_t id)
+{
+    std::string path = this->scratch + ".sync." + std::to_string(id);
+    uint64_t next = this->log->get_next_seq();
+
+    RawIOHandler *file = nullptr;
+    try {
+        this->table->snapshot(path.c_str());
+        file = new RawIOHandler(path.c_str());
+
+        uint64_t len = file->get_flen();
+        uint64_t fields[4] = {this->log->get_generation(), next,
+                              this->table->get_bucket_count(), len};
+        if (!send_frame(feed->fd, replop_t::SNAPSHOT, 0, fields)) throw IOException();
+
+        std::vector<byte> block(snapshot_block_bytes);
+        for (uint64_t offset=0; offset<len; offset+=snapshot_block_bytes) {
+            size_t size = std::min((uint64_t) snapshot_block_bytes, len - offset);
+            file->read(block.data(), size, offset);
+            if (!send_all(feed->fd, block.data(), size)) throw IOException();
+        }
+    } catch (...) {
+        delete file;
+        unlink(path.c_str());
+        throw;
+    }
+
+    delete file;
+    unlink(path.c_str());
+    return next;
+}
+
+
+/*
+ * Take in whatever acknowledgements the replica has sent, without
+ * waiting for any.
+ */
+void ReplicationPrimary::read_acks(Feed *feed)
+{
+    byte frame[frame_header_bytes + sizeof(uint64_t)];
+    while (true) {
+        ssize_t cnt = recv(feed->fd, frame, sizeof(frame), MSG_DONTWAIT | MSG_PEEK);
+        if (cnt < (ssize_t) sizeof(frame)) return;
+
+        if (!recv_all(feed->fd, frame, sizeof(frame))) throw IOException();
+        FrameHeader header = get_header(frame);
+        if (header.code != (uint32_t) replop_t::ACK) throw ProtocolException();
+        feed->acked.store(get_u64(frame + frame_header_bytes));
+    }
+}
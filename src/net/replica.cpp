@@ -0,0 +1,292 @@
+/*
+ *
+ */
+#include "net/replica.hpp"
+#include "io/exceptions.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+/*
+ * How long to wait before reconnecting after a failure, and how long the
+ * primary may be silent (it sends heartbeats when it has nothing else to
+ * say) before the connection is given up on.
+ */
+static constexpr unsigned const retry_ms = 500;
+static constexpr unsigned const silence_ms = 5000;
+
+Replica::Replica(const char *fname, const char *address, uint16_t port,
+        std::chrono::milliseconds publish_interval)
+{
+    this->fname = fname;
+    this->address = address;
+    this->port = port;
+    this->publish_interval = publish_interval;
+    this->table = nullptr;
+    this->generation = 0;
+    this->fd = -1;
+
+    this->bucket_cnt.store(0);
+    this->applied.store(0);
+    this->head.store(0);
+    this->connected.store(false);
+    this->stopping.store(false);
+    this->syncs.store(0);
+}
+
+
+Replica::~Replica()
+{
+    delete this->table;
+}
+
+
+void Replica::run()
+{
+    while (!this->stopping.load()) {
+        try {
+            this->follow();
+        } catch (std::exception &) {
+            // Whatever went wrong, the fix is to reconnect and try again.
+        }
+
+        // make sure readers have everything applied before the break
+        try {
+            if (this->table) this->table->publish();
+        } catch (std::exception &) {}
+
+        {
+            std::lock_guard<std::mutex> guard(this->fd_lock);
+            if (this->fd != -1) close(this->fd);
+            this->fd = -1;
+        }
+        this->connected.store(false);
+
+        auto retry = std::chrono::steady_clock::now() + std::chrono::milliseconds(retry_ms);
+        while (!this->stopping.load() && std::chrono::steady_clock::now() < retry) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    this->stopping.store(false);
+}
+
+
+void Replica::stop()
+{
+    this->stopping.store(true);
+
+    std::lock_guard<std::mutex> guard(this->fd_lock);
+    if (this->fd != -1) shutdown(this->fd, SHUT_RDWR);
+}
+
+
+size_t Replica::get_bucket_count()
+{
+    return this->bucket_cnt.load();
+}
+
+
+uint64_t Replica::get_applied()
+{
+    return this->applied.load();
+}
+
+
+uint64_t Replica::get_lag()
+{
+    uint64_t head = this->head.load();
+    uint64_t applied = this->applied.load();
+    return (head > applied) ? head - applied : 0;
+}
+
+
+bool Replica::is_connected()
+{
+    return this->connected.load();
+}
+
+
+size_t Replica::get_sync_count()
+{
+    return this->syncs.load();
+}
+
+
+/*
+ * Connect to the primary and apply what it sends until the connection
+ * fails, or stop is called.
+ */
+void Replica::follow()
+{
+    sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(this->port);
+    if (inet_pton(AF_INET, this->address.c_str(), &addr.sin_addr) != 1) throw IOException();
+
+    {
+        std::lock_guard<std::mutex> guard(this->fd_lock);
+        if (this->stopping.load()) return;
+        this->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (this->fd == -1) throw IOException();
+    }
+
+    int on = 1;
+    setsockopt(this->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    timeval timeout = timeval();
+    timeout.tv_sec = silence_ms / 1000;
+    timeout.tv_usec = (silence_ms % 1000) * 1000;
+    setsockopt(this->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(this->fd, (sockaddr *) &addr, sizeof(addr)) == -1) throw IOException();
+
+    uint64_t hello[2] = {0, 0};
+    if (this->table) {
+        hello[0] = this->generation;
+        hello[1] = this->applied.load();
+    }
+    if (!send_frame(this->fd, replop_t::HELLO, 0, hello)) throw IOException();
+    this->connected.store(true);
+
+    auto published = std::chrono::steady_clock::now();
+    bool dirty = false;
+    std::vector<byte> items;
+
+    while (!this->stopping.load()) {
+        FrameHeader header;
+        uint64_t fields[4];
+        if (!recv_frame(this->fd, &header, fields)) throw IOException();
+
+        if (header.code == (uint32_t) replop_t::SNAPSHOT) {
+            this->receive_snapshot(fields);
+            published = std::chrono::steady_clock::now();
+            dirty = false;
+            continue;
+        }
+
+        // A snapshot always comes first, and the changes after it must
+        // carry on exactly where the replica is.
+        if (header.code != (uint32_t) replop_t::CHANGES || !this->table ||
+                header.cnt > max_frame_items || fields[0] != this->applied.load()) {
+            throw ProtocolException();
+        }
+
+        items.resize(header.cnt * change_bytes);
+        if (!recv_all(this->fd, items.data(), items.size())) throw IOException();
+        this->apply(items.data(), header.cnt);
+        if (header.cnt) dirty = true;
+
+        auto now = std::chrono::steady_clock::now();
+        if (dirty && now - published >= this->publish_interval) {
+            this->table->publish();
+            published = now;
+            dirty = false;
+        }
+
+        this->head.store(fields[1]);
+        this->applied.store(fields[0] + header.cnt);
+
+        if (header.cnt) {
+            uint64_t ack = this->applied.load();
+            if (!send_frame(this->fd, replop_t::ACK, 0, &ack)) throw IOException();
+        }
+    }
+}
+
+
+/*
+ * Receive the table image following a SNAPSHOT frame with the given
+ * fields, and replace the table with it.
+ */
+void Replica::receive_snapshot(uint64_t *fields)
+{
+    uint64_t generation = fields[0];
+    uint64_t next = fields[1];
+    size_t bucket_cnt = fields[2];
+    uint64_t len = fields[3];
+    if (bucket_cnt == 0) throw ProtocolException();
+
+    std::string staging = this->fname + ".sync";
+    RawIOHandler *file = nullptr;
+    try {
+        file = new RawIOHandler(staging.c_str());
+        file->truncate(0);
+
+        std::vector<byte> block(1 << 16);
+        for (uint64_t offset=0; offset<len; offset+=block.size()) {
+            size_t size = std::min((uint64_t) block.size(), len - offset);
+            if (!recv_all(this->fd, block.data(), size)) throw IOException();
+            file->write(block.data(), size, offset);
+        }
+        file->flush();
+    } catch (...) {
+        delete file;
+        unlink(staging.c_str());
+        throw;
+    }
+    delete file;
+
+    // restore wants the old table closed first
+    delete this->table;
+    this->table = nullptr;
+    this->bucket_cnt.store(0);
+
+    try {
+        this->table = ServedTable::restore(staging.c_str(), this->fname.c_str(), bucket_cnt);
+    } catch (...) {
+        unlink(staging.c_str());
+        throw;
+    }
+    unlink(staging.c_str());
+    this->table->publish();
+
+    this->generation = generation;
+    this->head.store(next);
+    this->applied.store(next);
+    this->bucket_cnt.store(bucket_cnt);
+    this->syncs++;
+}
+
+
+/*
+ * Apply the cnt changes in items, in order. Runs of puts and of removes
+ * each go to the table as a single batch.
+ */
+void Replica::apply(const byte *items, size_t cnt)
+{
+    std::vector<std::pair<uint64_t, uint64_t>> puts;
+    std::vector<uint64_t> removes;
+
+    size_t start = 0;
+    while (start < cnt) {
+        change_t kind = (change_t) items[start * change_bytes];
+        size_t end = start;
+        puts.clear();
+        removes.clear();
+
+        for (; end < cnt && (change_t) items[end * change_bytes] == kind; end++) {
+            const byte *item = items + end * change_bytes;
+            uint64_t key = get_u64(item + 1);
+            if (kind == change_t::PUT) {
+                puts.emplace_back(key, get_u64(item + 1 + sizeof(uint64_t)));
+            } else if (kind == change_t::REMOVE) {
+                removes.push_back(key);
+            } else {
+                throw ProtocolException();
+            }
+        }
+
+        if (kind == change_t::PUT) {
+            this->table->upsert_batch(puts.begin(), puts.end());
+        } else {
+            this->table->remove_batch(removes.begin(), removes.end());
+        }
+        start = end;
+    }
+}
@@ -0,0 +1,217 @@
+/*
+ *
+ */
+#include "net/resp.hpp"
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+/*
+ * Find the \r\n ending the line starting at buf, returning the length of
+ * the line without it, or -1 if it isn't all there yet.
+ */
+static long line_length(const byte *buf, size_t len)
+{
+    const byte *end = (const byte *) memchr(buf, '\n', len);
+    if (!end) return -1;
+    if (end == buf || end[-1] != '\r') return end - buf;
+
+    return end - buf - 1;
+}
+
+
+/*
+ * Parse the decimal number in [buf, buf + len), which may be negative.
+ */
+static bool parse_number(const byte *buf, size_t len, long long *val)
+{
+    if (len == 0 || len > 18) return false;
+
+    bool negative = buf[0] == '-';
+    size_t i = negative ? 1 : 0;
+    if (i == len) return false;
+
+    long long result = 0;
+    for (; i<len; i++) {
+        if (buf[i] < '0' || buf[i] > '9') return false;
+        result = result * 10 + (buf[i] - '0');
+    }
+
+    *val = negative ? -result : result;
+    return true;
+}
+
+
+static parse_t parse_inline(const byte *buf, size_t len, std::vector<RespArg> *args,
+        size_t *used)
+{
+    long line = line_length(buf, len);
+    if (line == -1) {
+        return (len > resp_max_bulk) ? parse_t::MALFORMED : parse_t::INCOMPLETE;
+    }
+
+    size_t i = 0;
+    while (i < (size_t) line) {
+        while (i < (size_t) line && buf[i] == ' ') i++;
+        size_t start = i;
+        while (i < (size_t) line && buf[i] != ' ') i++;
+        if (i > start) args->push_back(RespArg{buf + start, i - start});
+    }
+
+    *used = (const byte *) memchr(buf, '\n', len) - buf + 1;
+    return (args->size() > resp_max_args) ? parse_t::MALFORMED : parse_t::DONE;
+}
+
+
+parse_t resp_parse(const byte *buf, size_t len, std::vector<RespArg> *args, size_t *used)
+{
+    args->clear();
+    if (len == 0) return parse_t::INCOMPLETE;
+    if (buf[0] != '*') return parse_inline(buf, len, args, used);
+
+    long line = line_length(buf, len);
+    if (line == -1) return parse_t::INCOMPLETE;
+
+    long long cnt;
+    if (!parse_number(buf + 1, line - 1, &cnt) || cnt < 0 || cnt > (long long) resp_max_args) {
+        return parse_t::MALFORMED;
+    }
+
+    size_t pos = line + 2;
+    for (long long i=0; i<cnt; i++) {
+        if (pos >= len) return parse_t::INCOMPLETE;
+        if (buf[pos] != '$') return parse_t::MALFORMED;
+
+        line = line_length(buf + pos, len - pos);
+        if (line == -1) return parse_t::INCOMPLETE;
+
+        long long bulk;
+        if (!parse_number(buf + pos + 1, line - 1, &bulk) || bulk < 0 ||
+                bulk > (long long) resp_max_bulk) {
+            return parse_t::MALFORMED;
+        }
+
+        pos += line + 2;
+        if (len - pos < (size_t) bulk + 2) return parse_t::INCOMPLETE;
+        if (buf[pos + bulk] != '\r' || buf[pos + bulk + 1] != '\n') return parse_t::MALFORMED;
+
+        args->push_back(RespArg{buf + pos, (size_t) bulk});
+        pos += bulk + 2;
+    }
+
+    *used = pos;
+    return parse_t::DONE;
+}
+
+
+bool resp_is(const RespArg &arg, const char *name)
+{
+    size_t len = strlen(name);
+    if (arg.len != len) return false;
+
+    for (size_t i=0; i<len; i++) {
+        if (toupper((unsigned char) arg.data[i]) != name[i]) return false;
+    }
+
+    return true;
+}
+
+
+/*
+ * FNV-1a, followed by a finalizer to spread the bits about, as the table
+ * takes buckets from the low bits. Key 0 can't be stored, so it is moved.
+ */
+uint64_t resp_key(const RespArg &arg)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i=0; i<arg.len; i++) {
+        hash ^= (unsigned char) arg.data[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+
+    return (hash) ? hash : 1;
+}
+
+
+/*
+ * The top byte of a packed value, with the length in its low three bits.
+ * A word read back with anything else there wasn't packed from a string.
+ */
+static const unsigned char resp_value_tag = 0xe0;
+static const unsigned char resp_tag_mask = 0xf8;
+
+
+bool resp_pack_value(const RespArg &arg, uint64_t *val)
+{
+    if (arg.len > resp_value_bytes) return false;
+
+    byte packed[sizeof(uint64_t)] = {0};
+    memcpy(packed, arg.data, arg.len);
+    packed[resp_value_bytes] = resp_value_tag | arg.len;
+    *val = get_u64(packed);
+    return true;
+}
+
+
+static void append(std::vector<byte> &out, const char *data, size_t len)
+{
+    out.insert(out.end(), data, data + len);
+}
+
+
+void resp_append_value(std::vector<byte> &out, uint64_t val)
+{
+    byte packed[sizeof(uint64_t)];
+    put_u64(packed, val);
+
+    // A packed value has its tag, and nothing but zeros after its bytes.
+    unsigned char tag = packed[resp_value_bytes];
+    size_t len = tag & ~resp_tag_mask;
+    bool is_string = (tag & resp_tag_mask) == resp_value_tag;
+    for (size_t i=len; is_string && i<resp_value_bytes; i++) {
+        if (packed[i]) is_string = false;
+    }
+
+    char header[32];
+    if (is_string) {
+        append(out, header, snprintf(header, sizeof(header), "$%zu\r\n", len));
+        append(out, packed, len);
+    } else {
+        char digits[24];
+        int cnt = snprintf(digits, sizeof(digits), "%llu", (unsigned long long) val);
+        append(out, header, snprintf(header, sizeof(header), "$%d\r\n", cnt));
+        append(out, digits, cnt);
+    }
+
+    append(out, "\r\n", 2);
+}
+
+
+void resp_append_nil(std::vector<byte> &out)
+{
+    append(out, "$-1\r\n", 5);
+}
+
+
+void resp_append_int(std::vector<byte> &out, long long val)
+{
+    char reply[32];
+    append(out, reply, snprintf(reply, sizeof(reply), ":%lld\r\n", val));
+}
+
+
+void resp_append_array(std::vector<byte> &out, size_t cnt)
+{
+    char reply[32];
+    append(out, reply, snprintf(reply, sizeof(reply), "*%zu\r\n", cnt));
+}
+
+
+void resp_append_raw(std::vector<byte> &out, const char *reply)
+{
+    append(out, reply, strlen(reply));
+}
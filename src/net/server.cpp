@@ -0,0 +1,590 @@
+/*
+ *
+ */
+#include "net/server.hpp"
+#include "io/exceptions.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * The canned replies. The binary protocol has no way of telling where the
+ * next frame starts after a bad one, so BAD_REQUEST is always followed by
+ * hanging up.
+ */
+static const byte bad_frame[frame_header_bytes] = {(byte) status_t::BAD_REQUEST};
+static const char resp_pong[] = "+PONG\r\n";
+static const char resp_ok[] = "+OK\r\n";
+static const char resp_empty[] = "*0\r\n";
+static const char resp_protocol_error[] = "-ERR Protocol error\r\n";
+static const char resp_unknown[] = "-ERR unknown command\r\n";
+static const char resp_arity[] = "-ERR wrong number of arguments\r\n";
+static const char resp_syntax[] = "-ERR syntax error\r\n";
+static const char resp_too_long[] = "-ERR value longer than 7 bytes\r\n";
+static const char resp_read_only[] = "-READONLY table is read only\r\n";
+static const char resp_failed[] = "-ERR storage failure\r\n";
+
+
+KVServer::KVServer(ServedTable *table, uint16_t port, const char *address, wire_t protocol)
+{
+    this->table = table;
+    this->protocol = protocol;
+    this->hits_capacity = 0;
+    this->stopping.store(false);
+    this->listen_fd = -1;
+    this->epoll_fd = -1;
+    this->wake_fd = -1;
+
+    sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) throw IOException();
+
+    try {
+        this->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (this->listen_fd == -1) throw IOException();
+
+        int on = 1;
+        setsockopt(this->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(this->listen_fd, (sockaddr *) &addr, sizeof(addr)) == -1 ||
+                listen(this->listen_fd, SOMAXCONN) == -1) {
+            throw IOException();
+        }
+
+        socklen_t len = sizeof(addr);
+        if (getsockname(this->listen_fd, (sockaddr *) &addr, &len) == -1) throw IOException();
+        this->port = ntohs(addr.sin_port);
+
+        this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        this->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (this->epoll_fd == -1 || this->wake_fd == -1) throw IOException();
+
+        for (fd_t fd : {this->listen_fd, this->wake_fd}) {
+            epoll_event event = epoll_event();
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) throw IOException();
+        }
+    } catch (IOException &) {
+        for (fd_t fd : {this->listen_fd, this->epoll_fd, this->wake_fd}) {
+            if (fd != -1) close(fd);
+        }
+        throw;
+    }
+}
+
+
+KVServer::~KVServer()
+{
+    this->close_all();
+    close(this->listen_fd);
+    close(this->epoll_fd);
+    close(this->wake_fd);
+}
+
+
+void KVServer::run()
+{
+    epoll_event events[max_events];
+
+    while (!this->stopping.load()) {
+        int cnt = epoll_wait(this->epoll_fd, events, max_events, -1);
+        if (cnt == -1) {
+            if (errno == EINTR) continue;
+            throw IOException();
+        }
+
+        for (int i=0; i<cnt; i++) {
+            fd_t fd = events[i].data.fd;
+            if (fd == this->listen_fd) {
+                this->accept_all();
+                continue;
+            }
+
+            if (fd == this->wake_fd) {
+                uint64_t drained;
+                while (read(this->wake_fd, &drained, sizeof(drained)) > 0) {}
+                continue;
+            }
+
+            auto found = this->connections.find(fd);
+            if (found == this->connections.end()) continue;
+            Connection *conn = found->second;
+
+            bool ok = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ok = this->read_input(conn);
+                if (ok) this->process(conn);
+            }
+
+            if (ok) ok = this->write_output(conn);
+
+            if (!ok || (conn->closing && conn->out.empty())) {
+                this->close_connection(conn);
+            } else {
+                this->update_events(conn);
+            }
+        }
+    }
+
+    this->stopping.store(false);
+}
+
+
+void KVServer::stop()
+{
+    this->stopping.store(true);
+    uint64_t one = 1;
+    if (write(this->wake_fd, &one, sizeof(one)) == -1) {
+        // the counter can only be full if it has been woken already
+    }
+}
+
+
+uint16_t KVServer::get_port()
+{
+    return this->port;
+}
+
+
+void KVServer::accept_all()
+{
+    while (true) {
+        fd_t fd = accept4(this->listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) return;
+
+        // Responses are written a whole batch at a time, so there is
+        // nothing to gain from Nagle, and a lot of latency to lose.
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        Connection *conn = new Connection();
+        conn->fd = fd;
+        conn->out_sent = 0;
+        conn->closing = false;
+        conn->events = EPOLLIN;
+
+        epoll_event event = epoll_event();
+        event.events = conn->events;
+        event.data.fd = fd;
+        if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            close(fd);
+            delete conn;
+            continue;
+        }
+
+        this->connections[fd] = conn;
+    }
+}
+
+
+/*
+ * Read whatever the peer has sent, up to read_budget. Returns false if the
+ * connection has failed and should be dropped.
+ */
+bool KVServer::read_input(Connection *conn)
+{
+    size_t total = 0;
+    while (total < read_budget && !conn->closing) {
+        size_t used = conn->in.size();
+        conn->in.resize(used + (1 << 16));
+
+        ssize_t got = recv(conn->fd, conn->in.data() + used, 1 << 16, 0);
+        conn->in.resize(used + ((got > 0) ? got : 0));
+
+        if (got > 0) {
+            total += got;
+        } else if (got == 0) {
+            conn->closing = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+ * Parse every complete request in conn's input and run them, merging runs
+ * of requests with the same op into a single batch.
+ */
+void KVServer::process(Connection *conn)
+{
+    std::vector<Request> requests;
+    size_t used = (this->protocol == wire_t::RESP) ? this->parse_resp(conn, requests)
+                                                   : this->parse_binary(conn, requests);
+
+    std::vector<Request> batch;
+    for (auto &request : requests) {
+        if (!batch.empty() && (request.reply || batch.back().op != request.op)) {
+            this->run_batch(conn, batch);
+        }
+
+        if (request.reply) {
+            conn->out.insert(conn->out.end(), request.reply, request.reply + request.reply_len);
+        } else {
+            batch.push_back(request);
+        }
+    }
+    this->run_batch(conn, batch);
+
+    conn->in.erase(conn->in.begin(), conn->in.begin() + used);
+}
+
+
+KVServer::Request KVServer::canned(const char *reply, size_t len)
+{
+    return Request{netop_t::GET, 0, nullptr, form_t::BINARY, reply, len};
+}
+
+
+/*
+ * Pick out the complete frames at the start of conn's input, returning the
+ * number of bytes they take up.
+ */
+size_t KVServer::parse_binary(Connection *conn, std::vector<Request> &requests)
+{
+    size_t pos = 0;
+
+    while (conn->in.size() - pos >= frame_header_bytes) {
+        FrameHeader header = get_header(conn->in.data() + pos);
+        if (!valid_op(header.code) || header.cnt > max_frame_items) {
+            requests.push_back(canned(bad_frame, sizeof(bad_frame)));
+            conn->closing = true;
+            return conn->in.size();
+        }
+
+        size_t len = frame_header_bytes + request_bytes(header.code, header.cnt);
+        if (conn->in.size() - pos < len) break;
+
+        requests.push_back(Request{(netop_t) header.code, header.cnt,
+                conn->in.data() + pos + frame_header_bytes, form_t::BINARY, nullptr, 0});
+        pos += len;
+    }
+
+    return pos;
+}
+
+
+/*
+ * Parse the complete RESP commands at the start of conn's input, and
+ * translate them into requests, returning the number of bytes they take
+ * up.
+ */
+size_t KVServer::parse_resp(Connection *conn, std::vector<Request> &requests)
+{
+    conn->decoded.clear();
+    std::vector<size_t> offsets;
+    std::vector<RespArg> args;
+    size_t pos = 0;
+
+    while (pos < conn->in.size() && !conn->closing) {
+        size_t used;
+        parse_t result = resp_parse(conn->in.data() + pos, conn->in.size() - pos, &args, &used);
+        if (result == parse_t::INCOMPLETE) break;
+
+        if (result == parse_t::MALFORMED) {
+            requests.push_back(canned(resp_protocol_error, sizeof(resp_protocol_error) - 1));
+            offsets.push_back(0);
+            conn->closing = true;
+            pos = conn->in.size();
+            break;
+        }
+
+        pos += used;
+        if (!args.empty()) this->parse_command(conn, args, requests, offsets);
+    }
+
+    // decoded has stopped growing, so its items can be pointed to now
+    for (size_t i=0; i<requests.size(); i++) {
+        if (!requests[i].reply) requests[i].items = conn->decoded.data() + offsets[i];
+    }
+
+    return pos;
+}
+
+
+/*
+ * Translate a single RESP command into a request, adding its keys (and
+ * values) to conn's decoded buffer, at the offset pushed onto offsets.
+ */
+void KVServer::parse_command(Connection *conn, std::vector<RespArg> &args,
+        std::vector<Request> &requests, std::vector<size_t> &offsets)
+{
+    RespArg &name = args[0];
+    size_t argc = args.size();
+    size_t offset = conn->decoded.size();
+    offsets.push_back(offset);
+
+    auto reply = [&requests](const char *text, size_t len) {
+        requests.push_back(canned(text, len));
+    };
+
+    auto keys = [&](netop_t op, form_t form, size_t first) {
+        for (size_t i=first; i<argc; i++) {
+            conn->decoded.resize(conn->decoded.size() + sizeof(uint64_t));
+            put_u64(conn->decoded.data() + conn->decoded.size() - sizeof(uint64_t),
+                    resp_key(args[i]));
+        }
+        requests.push_back(Request{op, (uint32_t) (argc - first), nullptr, form, nullptr, 0});
+    };
+
+    if (resp_is(name, "GET")) {
+        if (argc != 2) return reply(resp_arity, sizeof(resp_arity) - 1);
+        keys(netop_t::GET, form_t::GET, 1);
+    } else if (resp_is(name, "MGET") || resp_is(name, "EXISTS") || resp_is(name, "DEL")) {
+        if (argc < 2) return reply(resp_arity, sizeof(resp_arity) - 1);
+
+        if (resp_is(name, "DEL")) {
+            keys(netop_t::DEL, form_t::DEL, 1);
+        } else {
+            keys(netop_t::GET, resp_is(name, "MGET") ? form_t::MGET : form_t::EXISTS, 1);
+        }
+    } else if (resp_is(name, "SET")) {
+        // No expiry or conditional sets; there's nothing to map them to.
+        if (argc < 3) return reply(resp_arity, sizeof(resp_arity) - 1);
+        if (argc > 3) return reply(resp_syntax, sizeof(resp_syntax) - 1);
+
+        uint64_t val;
+        if (!resp_pack_value(args[2], &val)) return reply(resp_too_long, sizeof(resp_too_long) - 1);
+
+        conn->decoded.resize(offset + 2 * sizeof(uint64_t));
+        put_u64(conn->decoded.data() + offset, resp_key(args[1]));
+        put_u64(conn->decoded.data() + offset + sizeof(uint64_t), val);
+        requests.push_back(Request{netop_t::PUT, 1, nullptr, form_t::SET, nullptr, 0});
+    } else if (resp_is(name, "PING")) {
+        reply(resp_pong, sizeof(resp_pong) - 1);
+    } else if (resp_is(name, "QUIT")) {
+        reply(resp_ok, sizeof(resp_ok) - 1);
+        conn->closing = true;
+    } else if (resp_is(name, "SELECT")) {
+        reply(resp_ok, sizeof(resp_ok) - 1);
+    } else if (resp_is(name, "COMMAND") || resp_is(name, "CONFIG")) {
+        // Asked by redis-cli and redis-benchmark on connecting; an empty
+        // answer satisfies both.
+        reply(resp_empty, sizeof(resp_empty) - 1);
+    } else {
+        reply(resp_unknown, sizeof(resp_unknown) - 1);
+    }
+}
+
+
+/*
+ * Run a batch of requests that all share an op against the table as a
+ * single batch operation, and queue up a response to each of them.
+ */
+void KVServer::run_batch(Connection *conn, std::vector<Request> &batch)
+{
+    if (batch.empty()) return;
+
+    netop_t op = batch[0].op;
+    this->keys.clear();
+    this->pairs.clear();
+
+    for (auto &request : batch) {
+        for (uint32_t i=0; i<request.cnt; i++) {
+            if (op == netop_t::PUT) {
+                const byte *pair = request.items + i * 2 * sizeof(uint64_t);
+                this->pairs.emplace_back(get_u64(pair), get_u64(pair + sizeof(uint64_t)));
+            } else {
+                this->keys.push_back(get_u64(request.items + i * sizeof(uint64_t)));
+            }
+        }
+    }
+
+    if (this->keys.size() > this->hits_capacity) {
+        this->hits_capacity = this->keys.size();
+        this->hits.reset(new bool[this->hits_capacity]);
+    }
+
+    try {
+        if (op == netop_t::GET) {
+            this->values.resize(this->keys.size());
+            this->table->get_batch(this->keys.begin(), this->keys.end(),
+                    this->values.data(), this->hits.get());
+        } else if (op == netop_t::DEL) {
+            this->table->remove_batch(this->keys.begin(), this->keys.end(), this->hits.get());
+        } else {
+            this->table->upsert_batch(this->pairs.begin(), this->pairs.end());
+        }
+    } catch (ReadOnlyException &) {
+        this->fail_batch(conn, batch, status_t::READ_ONLY);
+        return;
+    } catch (std::exception &) {
+        this->fail_batch(conn, batch, status_t::FAILED);
+        return;
+    }
+
+    size_t item = 0;
+    for (auto &request : batch) {
+        this->respond(conn, request, item);
+        if (op != netop_t::PUT) item += request.cnt;
+    }
+
+    batch.clear();
+}
+
+
+/*
+ * Queue the response to a request whose batch has run, and whose results
+ * start at position item of the batch's results.
+ */
+void KVServer::respond(Connection *conn, Request &request, size_t item)
+{
+    if (request.form != form_t::BINARY) return this->respond_resp(conn, request, item);
+
+    size_t used = conn->out.size();
+    uint32_t cnt = request.cnt;
+
+    if (request.op == netop_t::GET) {
+        conn->out.resize(used + frame_header_bytes + cnt * (sizeof(uint64_t) + 1));
+        byte *values = conn->out.data() + used + frame_header_bytes;
+        byte *flags = values + cnt * sizeof(uint64_t);
+
+        put_header(conn->out.data() + used, (uint32_t) status_t::OK, cnt);
+        for (uint32_t i=0; i<cnt; i++) {
+            bool hit = this->hits[item + i];
+            put_u64(values + i * sizeof(uint64_t), hit ? this->values[item + i] : 0);
+            flags[i] = hit;
+        }
+        return;
+    }
+
+    if (request.op == netop_t::DEL) {
+        uint32_t removed = 0;
+        for (uint32_t i=0; i<request.cnt; i++) {
+            if (this->hits[item + i]) removed++;
+        }
+        cnt = removed;
+    }
+
+    conn->out.resize(used + frame_header_bytes);
+    put_header(conn->out.data() + used, (uint32_t) status_t::OK, cnt);
+}
+
+
+void KVServer::respond_resp(Connection *conn, Request &request, size_t item)
+{
+    size_t found = 0;
+    for (uint32_t i=0; request.op != netop_t::PUT && i<request.cnt; i++) {
+        if (this->hits[item + i]) found++;
+    }
+
+    switch (request.form) {
+        case form_t::MGET:
+            resp_append_array(conn->out, request.cnt);
+            // fall through
+        case form_t::GET:
+            for (uint32_t i=0; i<request.cnt; i++) {
+                if (this->hits[item + i]) {
+                    resp_append_value(conn->out, this->values[item + i]);
+                } else {
+                    resp_append_nil(conn->out);
+                }
+            }
+            break;
+        case form_t::EXISTS:
+        case form_t::DEL:
+            resp_append_int(conn->out, found);
+            break;
+        default:
+            resp_append_raw(conn->out, resp_ok);
+            break;
+    }
+}
+
+
+void KVServer::fail_batch(Connection *conn, std::vector<Request> &batch, status_t status)
+{
+    for (auto &request : batch) {
+        if (request.form != form_t::BINARY) {
+            resp_append_raw(conn->out, (status == status_t::READ_ONLY) ? resp_read_only
+                                                                       : resp_failed);
+            continue;
+        }
+
+        size_t used = conn->out.size();
+        conn->out.resize(used + frame_header_bytes);
+        put_header(conn->out.data() + used, (uint32_t) status, 0);
+    }
+
+    batch.clear();
+}
+
+
+/*
+ * Send as much of conn's queued output as the socket will take. Returns
+ * false if the connection has failed.
+ */
+bool KVServer::write_output(Connection *conn)
+{
+    while (conn->out_sent < conn->out.size()) {
+        ssize_t sent = send(conn->fd, conn->out.data() + conn->out_sent,
+                conn->out.size() - conn->out_sent, MSG_NOSIGNAL);
+        if (sent >= 0) {
+            conn->out_sent += sent;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    if (conn->out_sent == conn->out.size()) {
+        conn->out.clear();
+        conn->out_sent = 0;
+    } else if (conn->out_sent > conn->out.size() / 2) {
+        conn->out.erase(conn->out.begin(), conn->out.begin() + conn->out_sent);
+        conn->out_sent = 0;
+    }
+
+    return true;
+}
+
+
+/*
+ * Watch for input unless the connection is on its way out, or the client
+ * has fallen too far behind on reading responses, and for room to write
+ * if there are responses still waiting to go.
+ */
+void KVServer::update_events(Connection *conn)
+{
+    size_t pending = conn->out.size() - conn->out_sent;
+    uint32_t events = 0;
+    if (!conn->closing && pending < max_pending_output) events |= EPOLLIN;
+    if (pending) events |= EPOLLOUT;
+
+    if (events == conn->events) return;
+
+    epoll_event event = epoll_event();
+    event.events = events;
+    event.data.fd = conn->fd;
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+    conn->events = events;
+}
+
+
+void KVServer::close_connection(Connection *conn)
+{
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    close(conn->fd);
+    this->connections.erase(conn->fd);
+    delete conn;
+}
+
+
+void KVServer::close_all()
+{
+    while (!this->connections.empty()) {
+        this->close_connection(this->connections.begin()->second);
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ *
+ */
+#include "util/affinity.hpp"
+#include <pthread.h>
+#include <cstdio>
+
+bool node_cpus(int node, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *list = fopen(path, "r");
+    if (!list) return false;
+
+    // The list is a comma separated set of ranges, like 0-3,8-11,16
+    int first, last;
+    bool found = false;
+    while (fscanf(list, "%d", &first) == 1) {
+        last = first;
+        int c = fgetc(list);
+        if (c == '-') {
+            if (fscanf(list, "%d", &last) != 1) break;
+            c = fgetc(list);
+        }
+
+        for (int cpu=first; cpu<=last && cpu<CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+            found = true;
+        }
+
+        if (c != ',') break;
+    }
+
+    fclose(list);
+    return found;
+}
+
+
+bool pin_thread(const cpu_set_t *set)
+{
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set) == 0;
+}
@@ -0,0 +1,288 @@
+/*
+ *
+ */
+#include "util/stats.hpp"
+#include <mutex>
+#include <vector>
+#include <cstring>
+
+/*
+ * The set of live per-thread blocks, plus the totals of every thread that
+ * has since exited. This is heap allocated and never freed so that threads
+ * still exiting during static destruction have somewhere to retire to.
+ */
+struct StatRegistry
+{
+    std::mutex lock;
+    std::vector<StatBlock *> live;
+    StatBlock *retired;
+};
+
+
+static StatRegistry *registry()
+{
+    static StatRegistry *reg = new StatRegistry{{}, {}, new StatBlock()};
+    return reg;
+}
+
+
+static void fold(StatBlock *into, StatBlock *from)
+{
+    for (size_t i=0; i<stat_cnt; i++) {
+        into->counters[i].fetch_add(from->counters[i].load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+    }
+
+    for (size_t i=0; i<hist_cnt; i++) {
+        for (size_t j=0; j<hist_buckets; j++) {
+            into->hists[i][j].fetch_add(from->hists[i][j].load(std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+        }
+    }
+}
+
+
+StatBlock *Stats::register_thread()
+{
+    StatBlock *block = new StatBlock();
+    StatRegistry *reg = registry();
+
+    std::lock_guard<std::mutex> guard(reg->lock);
+    reg->live.push_back(block);
+
+    return block;
+}
+
+
+void Stats::retire_thread(StatBlock *block)
+{
+    StatRegistry *reg = registry();
+
+    std::lock_guard<std::mutex> guard(reg->lock);
+    fold(reg->retired, block);
+
+    for (size_t i=0; i<reg->live.size(); i++) {
+        if (reg->live[i] == block) {
+            reg->live[i] = reg->live.back();
+            reg->live.pop_back();
+            break;
+        }
+    }
+
+    delete block;
+}
+
+
+size_t Stats::hist_bucket(uint64_t value)
+{
+    if (value < hist_sub_buckets) return value;
+
+    size_t exp = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (exp - 3)) & (hist_sub_buckets - 1);
+    return (exp - 2) * hist_sub_buckets + sub;
+}
+
+
+/*
+ * The smallest value that lands in a given bucket.
+ */
+uint64_t Stats::hist_value(size_t bucket)
+{
+    if (bucket < hist_sub_buckets) return bucket;
+
+    size_t exp = bucket / hist_sub_buckets + 2;
+    uint64_t sub = bucket % hist_sub_buckets;
+    return (hist_sub_buckets + sub) << (exp - 3);
+}
+
+
+StatsSnapshot Stats::snapshot()
+{
+    StatsSnapshot snap;
+    memset(&snap, 0, sizeof(snap));
+
+    StatBlock total;
+    for (size_t i=0; i<stat_cnt; i++) total.counters[i].store(0);
+    for (size_t i=0; i<hist_cnt; i++) {
+        for (size_t j=0; j<hist_buckets; j++) total.hists[i][j].store(0);
+    }
+
+    StatRegistry *reg = registry();
+    {
+        std::lock_guard<std::mutex> guard(reg->lock);
+        fold(&total, reg->retired);
+        for (auto block : reg->live) {
+            fold(&total, block);
+        }
+    }
+
+    for (size_t i=0; i<stat_cnt; i++) {
+        snap.counters[i] = total.counters[i].load();
+    }
+
+    for (size_t i=0; i<hist_cnt; i++) {
+        for (size_t j=0; j<hist_buckets; j++) {
+            snap.hists[i].buckets[j] = total.hists[i][j].load();
+        }
+    }
+
+    return snap;
+}
+
+
+/*
+ * Zero every counter. Threads that are recording while this runs may have
+ * an increment or two lost or kept.
+ */
+void Stats::reset()
+{
+    StatRegistry *reg = registry();
+    std::lock_guard<std::mutex> guard(reg->lock);
+
+    std::vector<StatBlock *> blocks(reg->live);
+    blocks.push_back(reg->retired);
+
+    for (auto block : blocks) {
+        for (size_t i=0; i<stat_cnt; i++) {
+            block->counters[i].store(0, std::memory_order_relaxed);
+        }
+
+        for (size_t i=0; i<hist_cnt; i++) {
+            for (size_t j=0; j<hist_buckets; j++) {
+                block->hists[i][j].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+
+/*
+ * Write out every counter, and a summary of every histogram, one per line
+ * as "name value" or "name key=value ..." pairs.
+ */
+void Stats::dump(FILE *out)
+{
+    StatsSnapshot snap = Stats::snapshot();
+
+    for (size_t i=0; i<stat_cnt; i++) {
+        fprintf(out, "%s %lu\n", Stats::name((stat_t) i),
+                (unsigned long) snap.counters[i]);
+    }
+
+    for (size_t i=0; i<hist_cnt; i++) {
+        HistogramSnapshot &hist = snap.hists[i];
+        fprintf(out, "%s count=%lu p50=%lu p90=%lu p99=%lu p999=%lu max=%lu\n",
+                Stats::name((hist_t) i), (unsigned long) hist.count(),
+                (unsigned long) hist.percentile(50), (unsigned long) hist.percentile(90),
+                (unsigned long) hist.percentile(99), (unsigned long) hist.percentile(99.9),
+                (unsigned long) hist.max());
+    }
+}
+
+
+const char *Stats::name(stat_t stat)
+{
+    static const char *names[] = {
+        "table_insert",
+        "table_get",
+        "table_remove",
+        "table_hit",
+        "table_miss",
+        "table_filtered",
+        "table_expired",
+        "txn_commit",
+        "txn_conflict",
+        "version_save",
+        "version_reclaim",
+        "cache_hit",
+        "cache_miss",
+        "pool_hit",
+        "pool_miss",
+        "pool_evict",
+        "pool_flush",
+        "compressed_hit",
+        "compressed_miss",
+        "compressed_evict",
+        "tier_hit",
+        "tier_miss",
+        "tier_promote",
+        "tier_demote",
+        "log_append",
+        "log_relocate",
+        "log_reclaim",
+        "raw_reads",
+        "raw_writes",
+        "raw_read_bytes",
+        "raw_write_bytes"
+    };
+
+    static_assert(sizeof(names) / sizeof(names[0]) == stat_cnt, "missing stat name");
+    return names[(size_t) stat];
+}
+
+
+const char *Stats::name(hist_t hist)
+{
+    static const char *names[] = {
+        "chain_length",
+        "raw_read_ns",
+        "raw_write_ns"
+    };
+
+    static_assert(sizeof(names) / sizeof(names[0]) == hist_cnt, "missing histogram name");
+    return names[(size_t) hist];
+}
+
+
+uint64_t StatsSnapshot::get(stat_t stat)
+{
+    return this->counters[(size_t) stat];
+}
+
+
+HistogramSnapshot &StatsSnapshot::get(hist_t hist)
+{
+    return this->hists[(size_t) hist];
+}
+
+
+uint64_t HistogramSnapshot::count()
+{
+    uint64_t total = 0;
+    for (size_t i=0; i<hist_buckets; i++) {
+        total += this->buckets[i];
+    }
+
+    return total;
+}
+
+
+uint64_t HistogramSnapshot::max()
+{
+    for (size_t i=hist_buckets; i>0; i--) {
+        if (this->buckets[i - 1]) return Stats::hist_value(i - 1);
+    }
+
+    return 0;
+}
+
+
+/*
+ * The lower bound of the bucket holding the pct'th percentile value.
+ */
+uint64_t HistogramSnapshot::percentile(double pct)
+{
+    uint64_t total = this->count();
+    if (total == 0) return 0;
+
+    uint64_t target = (uint64_t) (total * pct / 100.0);
+    if (target >= total) target = total - 1;
+
+    uint64_t seen = 0;
+    for (size_t i=0; i<hist_buckets; i++) {
+        seen += this->buckets[i];
+        if (seen > target) return Stats::hist_value(i);
+    }
+
+    return this->max();
+}
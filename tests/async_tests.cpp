@@ -0,0 +1,192 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+#include "dstruct/hashtable.hpp"
+
+// Built with -std=c++20, where byte would clash with std::byte, so no
+// using namespace std here.
+
+const char *async_fname = "./tests/data/async.store";
+
+
+START_TEST(mem_get)
+{
+    auto test = new HashTable<int32_t, int32_t>(10);
+    IOScheduler scheduler;
+
+    for (int32_t i=1; i<=100; i++) {
+        test->insert(i, i * 5);
+    }
+
+    auto hit = test->get_async(7, scheduler);
+    auto miss = test->get_async(1000, scheduler);
+    scheduler.spawn(hit);
+    scheduler.spawn(miss);
+    scheduler.run();
+
+    ck_assert_int_eq(hit.done(), true);
+    ck_assert_int_eq(hit.result(), 35);
+
+    // everything is in memory already, so nothing ever waits on I/O
+    ck_assert_int_eq(scheduler.get_peak_in_flight(), 0);
+
+    bool error = false;
+    try {
+        miss.result();
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(disk_get)
+{
+    auto test = new HashTable<int32_t, int32_t>(async_fname, 50);
+    std::map<int32_t, int32_t> inserted;
+    srand(0);
+
+    size_t n = 2000;
+    for (size_t i=0; i<n; i++) {
+        int32_t key = rand() % 1000000 + 1;
+        int32_t val = rand();
+        test->insert(key, val);
+        inserted.insert({key, val});
+    }
+    delete test;
+
+    // reopen with an empty (and unbounded) buffer pool, so the lookups
+    // have to go to disk, and whatever they fetch stays resident
+    test = new HashTable<int32_t, int32_t>(
+            new BufferedIOHandler(new RawIOHandler(async_fname), 0), 50);
+    IOScheduler scheduler;
+
+    std::vector<int32_t> keys;
+    std::vector<Task<int32_t>> lookups;
+    for (auto &element : inserted) {
+        keys.push_back(element.first);
+        lookups.push_back(test->get_async(element.first, scheduler));
+    }
+    lookups.push_back(test->get_async(-5, scheduler));
+
+    for (auto &lookup : lookups) scheduler.spawn(lookup);
+    scheduler.run();
+
+    size_t bad = 0;
+    for (size_t i=0; i<keys.size(); i++) {
+        if (!lookups[i].done() || lookups[i].result() != inserted[keys[i]]) bad++;
+    }
+    ck_assert_int_eq(bad, 0);
+
+    bool error = false;
+    try {
+        lookups.back().result();
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    // the first read of every lookup missed, and they were all issued
+    // before any of them was waited on
+    ck_assert_int_gt(scheduler.get_peak_in_flight(), 1);
+    ck_assert_int_eq(scheduler.get_in_flight(), 0);
+
+    // and the pages they fetched were kept, so it's all cached now
+    IOScheduler second;
+    auto again = test->get_async(keys[0], second);
+    second.spawn(again);
+    second.run();
+    ck_assert_int_eq(again.result(), inserted[keys[0]]);
+    ck_assert_int_eq(second.get_peak_in_flight(), 0);
+
+    delete test;
+}
+END_TEST
+
+
+Task<int32_t> sum_of(HashTable<int32_t, int32_t> *table, IOScheduler &scheduler,
+        int32_t a, int32_t b)
+{
+    int32_t first = co_await table->get_async(a, scheduler);
+    int32_t second = co_await table->get_async(b, scheduler);
+    co_return first + second;
+}
+
+
+START_TEST(nested)
+{
+    auto test = new HashTable<int32_t, int32_t>(async_fname, 50);
+    test->insert(11, 100);
+    test->insert(12, 23);
+    delete test;
+
+    test = new HashTable<int32_t, int32_t>(async_fname, 50);
+    IOScheduler scheduler;
+
+    auto sum = sum_of(test, scheduler, 11, 12);
+    auto failed = sum_of(test, scheduler, 11, -1);
+    scheduler.spawn(sum);
+    scheduler.spawn(failed);
+    scheduler.run();
+
+    ck_assert_int_eq(sum.result(), 123);
+
+    bool error = false;
+    try {
+        failed.result();
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    delete test;
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("Async HashTable Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, mem_get);
+    tcase_add_test(basic, disk_get);
+    tcase_add_test(basic, nested);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
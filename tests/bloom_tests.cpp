@@ -0,0 +1,122 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "dstruct/bloom.hpp"
+
+using namespace std;
+
+const char *fname = "./tests/data/filter.bloom";
+
+
+START_TEST(no_false_negatives)
+{
+    BloomFilter filter(10000);
+
+    for (uint64_t i=0; i<10000; i++) {
+        filter.add(i * 7919);
+    }
+    ck_assert_int_eq(filter.get_key_count(), 10000);
+
+    for (uint64_t i=0; i<10000; i++) {
+        ck_assert_int_eq(filter.may_contain(i * 7919), true);
+    }
+
+    filter.clear();
+    ck_assert_int_eq(filter.get_key_count(), 0);
+    ck_assert_int_eq(filter.may_contain(0), false);
+}
+END_TEST
+
+
+START_TEST(false_positive_rate)
+{
+    BloomFilter filter(10000, 10);
+    ck_assert_int_eq(filter.get_bytes() % CACHELINE, 0);
+    ck_assert_int_ge(filter.get_bytes() * 8, 10000 * 10);
+
+    for (uint64_t i=0; i<10000; i++) {
+        filter.add(i);
+    }
+
+    // at 10 bits per key, expect around 1%
+    size_t positives = 0;
+    for (uint64_t i=10000; i<110000; i++) {
+        if (filter.may_contain(i)) positives++;
+    }
+    ck_assert_int_lt(positives, 2500);
+}
+END_TEST
+
+
+START_TEST(save_load)
+{
+    unlink(fname);
+    ck_assert_int_eq(BloomFilter::load(fname) == nullptr, true);
+
+    BloomFilter filter(1000);
+    for (uint64_t i=0; i<1000; i++) {
+        filter.add(i * 3);
+    }
+    filter.save(fname);
+
+    BloomFilter *loaded = BloomFilter::load(fname);
+    ck_assert_int_eq(loaded != nullptr, true);
+    ck_assert_int_eq(loaded->get_bytes(), filter.get_bytes());
+    ck_assert_int_eq(loaded->get_key_count(), 1000);
+
+    for (uint64_t i=0; i<3000; i++) {
+        ck_assert_int_eq(loaded->may_contain(i), filter.may_contain(i));
+    }
+    delete loaded;
+
+    // anything else in the file is ignored
+    FILE *junk = fopen(fname, "wb");
+    fputs("not a filter", junk);
+    fclose(junk);
+    ck_assert_int_eq(BloomFilter::load(fname) == nullptr, true);
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("Bloom Filter Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, no_false_negatives);
+    tcase_add_test(basic, false_positive_rate);
+    tcase_add_test(basic, save_load);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
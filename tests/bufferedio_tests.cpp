@@ -2,11 +2,13 @@
 #include <cstdio>
 #include <cstdlib>
 #include <string>
+#include <cstring>
 #include "io/raw.hpp"
 #include "io/buffered.hpp"
 #include "io/exceptions.hpp"
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 
 // TODO: Figure out how to force pread/pwrite to return only a partial
@@ -98,7 +100,7 @@ START_TEST(write_test)
     const int buffsize = 45;
 
     test = new BufferedIOHandler(new RawIOHandler(test_file), 10);
-    ftruncate(test->get_fd(), 0);
+    test->truncate(0);
 
     char *test_data = new char[buffsize];
     strncpy(test_data, "hello world 1 2 3 4 5", buffsize);
@@ -128,7 +130,7 @@ START_TEST(write_hole)
     const int buffsize = 45;
 
     test = new BufferedIOHandler(new RawIOHandler(test_file), 10);
-    ftruncate(test->get_fd(), 0);
+    test->truncate(0);
 
     ck_assert_int_eq(test->get_flen(), 0);
     char *test_data = new char[buffsize];
@@ -191,7 +193,7 @@ START_TEST(write_read)
     const int buffsize = 45;
 
     test = new BufferedIOHandler(new RawIOHandler(test_file), 10);
-    ftruncate(test->get_fd(), 0);
+    test->truncate(0);
 
     char *write_buffer = new char[buffsize];
     strncpy(write_buffer, "hello world 1 2 3 4 5", buffsize);
@@ -227,6 +229,192 @@ START_TEST(write_read)
 END_TEST
 
 
+START_TEST(snapshot_read)
+{
+    IOHandler *test;
+    const int buffsize = 300;
+
+    test = new BufferedIOHandler(new RawIOHandler(test_file), 10);
+    test->truncate(0);
+    char *old_data = new char[buffsize];
+    char *new_data = new char[buffsize];
+    memset(old_data, 'a', buffsize);
+    memset(new_data, 'b', buffsize);
+
+    test->write(old_data, buffsize, 0);
+    ck_assert_int_eq(test->begin_snapshot(), true);
+
+    // overwrite part of the snapshotted region, and extend past it
+    test->write(new_data, buffsize, 150);
+
+    byte *read_buffer = new byte[buffsize];
+
+    test->snapshot_read(read_buffer, buffsize, 0);
+    ck_assert_int_eq(memcmp(read_buffer, old_data, buffsize), 0);
+
+    test->read(read_buffer, buffsize, 150);
+    ck_assert_int_eq(memcmp(read_buffer, new_data, buffsize), 0);
+
+    // once the snapshot is over, snapshot_read sees the current data
+    test->end_snapshot();
+    test->snapshot_read(read_buffer, buffsize, 150);
+    ck_assert_int_eq(memcmp(read_buffer, new_data, buffsize), 0);
+
+    delete test;
+    delete[] old_data;
+    delete[] new_data;
+    delete[] read_buffer;
+}
+END_TEST
+
+
+START_TEST(eviction)
+{
+    IOHandler *test;
+    const int pages = 20;
+
+    test = new BufferedIOHandler(new RawIOHandler(test_file), 3);
+    test->truncate(0);
+
+    // write far more pages than the pool holds, so that most of them have
+    // to be evicted (and flushed) to make room
+    byte *page = new byte[PAGESIZE];
+    for (int i=0; i<pages; i++) {
+        memset(page, 'a' + i, PAGESIZE);
+        test->write(page, PAGESIZE, i * PAGESIZE);
+    }
+
+    struct stat buf;
+    fstat(test->get_fd(), &buf);
+    ck_assert_int_ge(buf.st_size, (pages - 3) * PAGESIZE);
+
+    for (int i=0; i<pages; i++) {
+        test->read(page, PAGESIZE, i * PAGESIZE);
+        ck_assert_int_eq(page[0], 'a' + i);
+        ck_assert_int_eq(page[PAGESIZE - 1], 'a' + i);
+    }
+
+    delete test;
+    delete[] page;
+}
+END_TEST
+
+
+START_TEST(scan_ring)
+{
+    IOHandler *test;
+    const int pool = 8;
+    const int pages = 200;
+
+    test = new BufferedIOHandler(new RawIOHandler(test_file), pool);
+    test->truncate(0);
+
+    byte *page = new byte[PAGESIZE];
+    for (int i=0; i<pages; i++) {
+        memset(page, 'a' + i % 26, PAGESIZE);
+        test->write(page, PAGESIZE, i * PAGESIZE);
+    }
+
+    // warm the pool up on the first few pages
+    for (int i=0; i<pool; i++) {
+        test->read(page, PAGESIZE, i * PAGESIZE);
+    }
+
+    // a scan of the rest runs through the ring, and leaves them be
+    test->advise(pool * PAGESIZE, (pages - pool) * PAGESIZE, access_t::SEQUENTIAL);
+    for (int i=pool; i<pages; i++) {
+        test->read(page, PAGESIZE, i * PAGESIZE);
+        ck_assert_int_eq(page[0], 'a' + i % 26);
+    }
+    test->advise(pool * PAGESIZE, (pages - pool) * PAGESIZE, access_t::NORMAL);
+
+    for (int i=0; i<pool; i++) {
+        ck_assert_int_eq(test->read_cached(page, PAGESIZE, i * PAGESIZE), true);
+        ck_assert_int_eq(page[0], 'a' + i % 26);
+    }
+
+    // without the hint, the same scan pushes them out
+    for (int i=pool; i<pages; i++) {
+        test->read(page, PAGESIZE, i * PAGESIZE);
+    }
+    ck_assert_int_eq(test->read_cached(page, PAGESIZE, 0), false);
+
+    // writes made through the ring still reach the file
+    test->advise(0, pages * PAGESIZE, access_t::ONCE);
+    memset(page, 'z', PAGESIZE);
+    for (int i=0; i<pages; i++) {
+        test->write(page, PAGESIZE, i * PAGESIZE);
+    }
+    test->advise(0, pages * PAGESIZE, access_t::NORMAL);
+    delete test;
+
+    test = new RawIOHandler(test_file);
+    for (int i=0; i<pages; i++) {
+        test->read(page, PAGESIZE, i * PAGESIZE);
+        ck_assert_int_eq(page[PAGESIZE - 1], 'z');
+    }
+
+    delete test;
+    delete[] page;
+}
+END_TEST
+
+
+START_TEST(stale_install)
+{
+    IOHandler *test;
+    byte *page = new byte[PAGESIZE];
+
+    test = new BufferedIOHandler(new RawIOHandler(test_file), 2);
+    test->truncate(0);
+    for (int i=0; i<4; i++) {
+        memset(page, 'a', PAGESIZE);
+        test->write(page, PAGESIZE, i * PAGESIZE);
+    }
+    delete test;
+
+    test = new BufferedIOHandler(new RawIOHandler(test_file), 2);
+
+    // an asynchronous read of page 0 fetches it from the file...
+    size_t fetch_size;
+    off_t fetch_offset;
+    uint64_t stamp = test->fetch_extent(1, 0, &fetch_size, &fetch_offset);
+    byte *fetched = new byte[fetch_size];
+    pread(test->get_fd(), fetched, fetch_size, fetch_offset);
+
+    // ...while it is written, and evicted, in the meantime
+    memset(page, 'b', PAGESIZE);
+    test->write(page, PAGESIZE, 0);
+    test->read(page, PAGESIZE, PAGESIZE);
+    test->read(page, PAGESIZE, 2 * PAGESIZE);
+    ck_assert_int_eq(test->read_cached(page, PAGESIZE, 0), false);
+
+    // so what was fetched mustn't be installed
+    ck_assert_int_eq(test->install(fetched, fetch_size, fetch_offset, stamp), false);
+    test->read(page, PAGESIZE, 0);
+    ck_assert_int_eq(page[0], 'b');
+
+    memset(page, 'c', PAGESIZE);
+    test->write(page, PAGESIZE, 3 * PAGESIZE);
+    test->flush();
+    pread(test->get_fd(), page, PAGESIZE, 0);
+    ck_assert_int_eq(page[0], 'b');
+
+    // a fetch nothing overtook is taken, but not over a resident page
+    ck_assert_int_eq(test->read_cached(page, PAGESIZE, PAGESIZE), false);
+    stamp = test->fetch_extent(1, PAGESIZE, &fetch_size, &fetch_offset);
+    pread(test->get_fd(), fetched, fetch_size, fetch_offset);
+    ck_assert_int_eq(test->install(fetched, fetch_size, fetch_offset, stamp), true);
+    ck_assert_int_eq(test->read_cached(page, PAGESIZE, PAGESIZE), true);
+    ck_assert_int_eq(test->install(fetched, fetch_size, fetch_offset, stamp), false);
+
+    delete test;
+    delete[] fetched;
+    delete[] page;
+}
+END_TEST
+
+
 Suite *test_suite()
 {
     Suite *suite = suite_create("RawIO Tests");
@@ -240,6 +428,10 @@ Suite *test_suite()
     tcase_add_test(basic, write_hole);
     tcase_add_test(basic, read_test);
     tcase_add_test(basic, write_read);
+    tcase_add_test(basic, snapshot_read);
+    tcase_add_test(basic, eviction);
+    tcase_add_test(basic, scan_ring);
+    tcase_add_test(basic, stale_install);
     tcase_add_test(basic, destroy);
 
     // TODO: Add stress testing
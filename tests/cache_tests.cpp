@@ -0,0 +1,176 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "dstruct/cache.hpp"
+
+using namespace std;
+
+
+START_TEST(put_get)
+{
+    S3FifoCache<int, int> cache(100);
+
+    int val;
+    ck_assert_int_eq(cache.get(1, &val), false);
+
+    for (int i=0; i<50; i++) {
+        cache.put(i, i * 2);
+    }
+    ck_assert_int_eq(cache.size(), 50);
+
+    for (int i=0; i<50; i++) {
+        ck_assert_int_eq(cache.get(i, &val), true);
+        ck_assert_int_eq(val, i * 2);
+    }
+
+    cache.put(1, 5);
+    ck_assert_int_eq(cache.get(1, &val), true);
+    ck_assert_int_eq(val, 5);
+
+    cache.update(1, 6);
+    cache.update(100, 6);
+    ck_assert_int_eq(cache.get(1, &val), true);
+    ck_assert_int_eq(val, 6);
+    ck_assert_int_eq(cache.get(100, &val), false);
+
+    cache.erase(1);
+    ck_assert_int_eq(cache.get(1, &val), false);
+    ck_assert_int_eq(cache.size(), 49);
+
+    cache.clear();
+    ck_assert_int_eq(cache.size(), 0);
+    ck_assert_int_eq(cache.get(2, &val), false);
+}
+END_TEST
+
+
+START_TEST(scan_resistance)
+{
+    S3FifoCache<int, int> cache(100);
+    int val;
+
+    // a hot set, hit often enough to make it into main
+    for (int round=0; round<3; round++) {
+        for (int i=0; i<50; i++) {
+            if (!cache.get(i, &val)) cache.put(i, i);
+        }
+    }
+
+    // followed by a long scan of keys that are only ever seen once
+    for (int i=1000; i<11000; i++) {
+        if (!cache.get(i, &val)) cache.put(i, i);
+    }
+    ck_assert_int_le(cache.size(), 100);
+
+    size_t hot = 0;
+    for (int i=0; i<50; i++) {
+        if (cache.get(i, &val)) hot++;
+    }
+    ck_assert_int_eq(hot, 50);
+}
+END_TEST
+
+
+START_TEST(churn)
+{
+    // keys that come and go without ever filling the cache
+    S3FifoCache<int, int> cache(10);
+    int val;
+
+    for (int i=0; i<100000; i++) {
+        cache.put(i % 5, i);
+        cache.erase(i % 5);
+    }
+    ck_assert_int_eq(cache.size(), 0);
+
+    for (int i=0; i<1000; i++) {
+        cache.put(i, i);
+    }
+    ck_assert_int_le(cache.size(), 10);
+    ck_assert_int_eq(cache.get(999, &val), true);
+}
+END_TEST
+
+
+START_TEST(segmented)
+{
+    KeyCache<int, int> cache(1000, 8);
+
+    atomic<size_t> wrong(0);
+    vector<thread> threads;
+    for (int t=0; t<4; t++) {
+        threads.emplace_back([&cache, &wrong, t]() {
+            int val;
+            for (int i=0; i<10000; i++) {
+                int key = t * 100 + i % 100;
+                if (!cache.get(key, &val)) {
+                    cache.put(key, key);
+                } else if (val != key) {
+                    wrong++;
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    ck_assert_int_eq(wrong, 0);
+    ck_assert_int_le(cache.size(), 1000);
+
+    int val;
+    cache.put(7, 7);
+    cache.erase(7);
+    ck_assert_int_eq(cache.get(7, &val), false);
+
+    cache.clear();
+    ck_assert_int_eq(cache.size(), 0);
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("Key Cache Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, put_get);
+    tcase_add_test(basic, scan_resistance);
+    tcase_add_test(basic, churn);
+    tcase_add_test(basic, segmented);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
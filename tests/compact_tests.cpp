@@ -0,0 +1,221 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <map>
+#include <random>
+
+#include "dstruct/compact.hpp"
+
+using namespace std;
+
+const char *compact_fname = "./tests/data/compact.store";
+
+
+START_TEST(insert_get_remove)
+{
+    auto test = new CompactHashTable(10);
+
+    for (uint64_t i=0; i<100; i++) {
+        ck_assert_int_eq(test->insert(i, i * 7), i * 7);
+    }
+
+    // duplicate inserts return the value already there
+    ck_assert_int_eq(test->insert(5, 1), 35);
+
+    for (uint64_t i=0; i<100; i++) {
+        ck_assert_int_eq(test->get(i), i * 7);
+    }
+
+    // unlike HashTable, {0, 0} can be stored
+    test->remove(0);
+    test->insert(0, 0);
+    ck_assert_int_eq(test->get(0), 0);
+
+    test->remove(50);
+    bool error = false;
+    try {
+        test->get(50);
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    error = false;
+    try {
+        test->remove(50);
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(capacity)
+{
+    ck_assert_int_eq(CompactHashTable::capacity(64, 64), 2);
+    ck_assert_int_eq(CompactHashTable::capacity(8, 8), 18);
+    ck_assert_int_eq(CompactHashTable::capacity(0, 0), 255);
+}
+END_TEST
+
+
+START_TEST(dense)
+{
+    // Nearby IDs with small counters: ten elements per bucket, which would
+    // take four cacheline buckets per chain in a HashTable<uint64_t,
+    // uint64_t>, all fit in the primary buckets.
+    size_t bucket_cnt = 100;
+    auto test = new CompactHashTable(bucket_cnt);
+
+    uint64_t first_id = 1000000000000ull;
+    for (uint64_t i=0; i<1000; i++) {
+        test->insert(first_id + i, i * 2);
+    }
+
+    ck_assert_int_eq(test->get_io_handler()->get_flen(), bucket_cnt * CACHELINE);
+
+    for (uint64_t i=0; i<1000; i++) {
+        ck_assert_int_eq(test->get(first_id + i), i * 2);
+    }
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(wide)
+{
+    // Keys and values spread over the whole 64 bit range pack badly, and
+    // spill into overflow buckets, but still work.
+    auto test = new CompactHashTable(8);
+    std::mt19937_64 rng(0);
+    std::map<uint64_t, uint64_t> inserted;
+
+    for (size_t i=0; i<500; i++) {
+        uint64_t key = rng();
+        uint64_t val = rng();
+        test->insert(key, val);
+        inserted.insert({key, val});
+    }
+
+    ck_assert_int_gt(test->get_io_handler()->get_flen(), 8 * CACHELINE);
+
+    size_t bad = 0;
+    for (auto &element : inserted) {
+        if (test->get(element.first) != element.second) bad++;
+    }
+    ck_assert_int_eq(bad, 0);
+
+    // removing from the middle of a chain leaves the rest reachable
+    size_t n = 0;
+    for (auto &element : inserted) {
+        if (n++ % 2) test->remove(element.first);
+    }
+
+    n = 0;
+    bad = 0;
+    for (auto &element : inserted) {
+        bool present = true;
+        try {
+            if (test->get(element.first) != element.second) bad++;
+        } catch (KeyNotFoundException &e) {
+            present = false;
+        }
+        if (present != (n++ % 2 == 0)) bad++;
+    }
+    ck_assert_int_eq(bad, 0);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(for_each)
+{
+    auto test = new CompactHashTable(16);
+    std::map<uint64_t, uint64_t> inserted;
+
+    for (uint64_t i=1; i<=300; i++) {
+        test->insert(i * 37, i);
+        inserted.insert({i * 37, i});
+    }
+
+    std::map<uint64_t, uint64_t> scanned;
+    test->for_each([&](uint64_t key, uint64_t val) {
+        scanned.insert({key, val});
+    });
+
+    ck_assert_int_eq(scanned == inserted, true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(disk)
+{
+    auto test = new CompactHashTable(compact_fname, 50);
+    for (uint64_t i=0; i<2000; i++) {
+        test->insert(i << 20, i);
+    }
+    delete test;
+
+    test = new CompactHashTable(compact_fname, 50);
+    size_t bad = 0;
+    for (uint64_t i=0; i<2000; i++) {
+        if (test->get(i << 20) != i) bad++;
+    }
+    ck_assert_int_eq(bad, 0);
+
+    delete test;
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("Compact HashTable Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, insert_get_remove);
+    tcase_add_test(basic, capacity);
+    tcase_add_test(basic, dense);
+    tcase_add_test(basic, wide);
+    tcase_add_test(basic, for_each);
+    tcase_add_test(basic, disk);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,429 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <cstring>
+#include <map>
+#include <vector>
+#include "io/codec.hpp"
+#include "io/compressed.hpp"
+#include "io/buffered.hpp"
+#include "io/exceptions.hpp"
+#include "dstruct/hashtable.hpp"
+#include <unistd.h>
+
+using namespace std;
+
+const char *comp_file = "./tests/data/compressed.store";
+const char *reopen_file = "./tests/data/compressed_reopen.store";
+const char *trunc_file = "./tests/data/compressed_trunc.store";
+const char *table_file = "./tests/data/compressed_table.store";
+const char *grow_file = "./tests/data/compressed_grow.store";
+const char *crash_file = "./tests/data/compressed_crash.store";
+const char *crash_copy = "./tests/data/compressed_crash_copy.store";
+
+
+static bool round_trip(byte *data, size_t len)
+{
+    byte *packed = new byte[zrl_bound(len)];
+    byte *unpacked = new byte[len];
+
+    size_t clen = zrl_compress(data, len, packed);
+    zrl_decompress(packed, clen, unpacked, len);
+    bool match = memcmp(data, unpacked, len) == 0;
+
+    delete[] packed;
+    delete[] unpacked;
+    return match;
+}
+
+
+START_TEST(codec_round_trip)
+{
+    const size_t len = 4096;
+    byte *data = new byte[len]();
+    byte *packed = new byte[zrl_bound(len)];
+
+    // all zeros collapses to a single run
+    ck_assert_int_eq(round_trip(data, len), true);
+    ck_assert_int_lt(zrl_compress(data, len, packed), 4);
+
+    // sparse, with short runs of zeros mixed into the literals
+    srand(0);
+    for (size_t i=0; i<len; i+=64) {
+        data[i] = rand() % 255 + 1;
+        data[i + 5] = rand() % 255 + 1;
+    }
+    ck_assert_int_eq(round_trip(data, len), true);
+    ck_assert_int_lt(zrl_compress(data, len, packed), len / 4);
+
+    // incompressible data stays within the bound
+    for (size_t i=0; i<len; i++) data[i] = rand() % 255 + 1;
+    ck_assert_int_eq(round_trip(data, len), true);
+    ck_assert_int_le(zrl_compress(data, len, packed), zrl_bound(len));
+
+    delete[] data;
+    delete[] packed;
+}
+END_TEST
+
+
+START_TEST(codec_corrupt)
+{
+    const size_t len = 100;
+    byte data[len] = {0};
+    byte out[len];
+    byte packed[256];
+    data[50] = 7;
+
+    size_t clen = zrl_compress(data, len, packed);
+
+    // truncated input decodes to too few bytes
+    bool error = false;
+    try {
+        zrl_decompress(packed, clen - 1, out, len);
+    } catch (IOException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    // as does asking for more than was encoded
+    error = false;
+    try {
+        zrl_decompress(packed, clen, out, len - 1);
+    } catch (IOException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+}
+END_TEST
+
+
+START_TEST(write_read)
+{
+    IOHandler *test = new CompressedIOHandler(comp_file, 1 << 20, 256);
+
+    ck_assert_int_eq(test->get_fd(), -1);
+    ck_assert_int_eq(test->get_flen(), 0);
+
+    const char *message = "hello world 1 2 3 4 5";
+    size_t msglen = strlen(message);
+    test->write((byte *) message, msglen, 250);
+    ck_assert_int_eq(test->get_flen(), 250 + msglen);
+
+    byte *read_buffer = new byte[300];
+    test->read(read_buffer, msglen, 250);
+    ck_assert_int_eq(memcmp(read_buffer, message, msglen), 0);
+
+    // the hole before the write reads back as zeros
+    test->read(read_buffer, 250, 0);
+    for (size_t i=0; i<250; i++) ck_assert_int_eq(read_buffer[i], 0);
+
+    bool error = false;
+    try {
+        test->read(read_buffer, 10, 250 + msglen);
+    } catch (IOException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    delete test;
+    delete[] read_buffer;
+}
+END_TEST
+
+
+START_TEST(cold_pages)
+{
+    // A cache far too small to hold everything, so pages are evicted to
+    // disk and read back compressed.
+    CompressedIOHandler *test = new CompressedIOHandler(reopen_file, 512, 256);
+    const size_t pages = 200;
+    byte page[256];
+
+    for (size_t i=0; i<pages; i++) {
+        memset(page, 0, sizeof(page));
+        memcpy(page + 17, &i, sizeof(i));
+        test->write(page, sizeof(page), i * sizeof(page));
+    }
+    ck_assert_int_le(test->get_cached_bytes(), 512);
+
+    for (size_t i=0; i<pages; i++) {
+        size_t val = 0;
+        test->read((byte *) &val, sizeof(val), i * sizeof(page) + 17);
+        ck_assert_int_eq(val, i);
+    }
+    delete test;
+
+    // everything survives a reopen, and the sparse pages take up a small
+    // fraction of their uncompressed size on disk
+    test = new CompressedIOHandler(reopen_file, 512, 256);
+    ck_assert_int_eq(test->get_flen(), pages * sizeof(page));
+    ck_assert_int_lt(test->get_stored_bytes(), pages * sizeof(page) / 4);
+
+    for (size_t i=0; i<pages; i++) {
+        size_t val = 0;
+        test->read((byte *) &val, sizeof(val), i * sizeof(page) + 17);
+        ck_assert_int_eq(val, i);
+    }
+
+    // a page that stops compressing well has to move, and still reads back
+    for (size_t i=0; i<sizeof(page); i++) page[i] = i + 1;
+    test->write(page, sizeof(page), 0);
+    test->flush();
+
+    byte check[256];
+    test->read(check, sizeof(check), 0);
+    ck_assert_int_eq(memcmp(check, page, sizeof(page)), 0);
+
+    delete test;
+
+    // the map refuses to be opened with a different page size
+    bool error = false;
+    try {
+        new CompressedIOHandler(reopen_file, 512, 128);
+    } catch (IOException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+}
+END_TEST
+
+
+START_TEST(map_growth)
+{
+    byte page[256];
+    memset(page, 0, sizeof(page));
+    page[3] = 'a';
+
+    CompressedIOHandler *test = new CompressedIOHandler(grow_file, 512, 256);
+    test->truncate(0);
+    test->write(page, sizeof(page), 0);
+    delete test;
+
+    // After a reopen the page map holds exactly one entry. Two pages that
+    // don't compress, far past it, fill the cache, so reading page 0 back
+    // in has to write them out, growing the map under the read.
+    test = new CompressedIOHandler(grow_file, 512, 256);
+    byte noise[256];
+    srand(0);
+    for (size_t i=0; i<sizeof(noise); i++) noise[i] = rand() % 255 + 1;
+    test->write(noise, sizeof(noise), 100 * sizeof(page));
+    test->write(noise, sizeof(noise), 200 * sizeof(page));
+
+    byte check[256];
+    test->read(check, sizeof(check), 0);
+    ck_assert_int_eq(memcmp(check, page, sizeof(page)), 0);
+
+    test->read(check, sizeof(check), 200 * sizeof(page));
+    ck_assert_int_eq(memcmp(check, noise, sizeof(noise)), 0);
+
+    delete test;
+}
+END_TEST
+
+START_TEST(crash_recovery)
+{
+    CompressedIOHandler *test = new CompressedIOHandler(crash_file, 512, 256);
+    test->truncate(0);
+    const size_t pages = 50;
+    byte page[256];
+
+    for (size_t i=0; i<pages; i++) {
+        memset(page, 0, sizeof(page));
+        memset(page, i + 1, 100);
+        test->write(page, sizeof(page), i * sizeof(page));
+    }
+    test->flush();
+
+    // Rewrite every page, each of which still fits in its old record, and
+    // evict them all to disk, but don't flush. The files as they stand are
+    // what a crash would leave behind.
+    for (size_t i=0; i<pages; i++) {
+        memset(page, 0, sizeof(page));
+        memset(page, i + 101, 100);
+        test->write(page, sizeof(page), i * sizeof(page));
+    }
+    byte check[256];
+    for (size_t i=0; i<pages; i++) {
+        test->read(check, sizeof(check), i * sizeof(page));
+    }
+
+    RawIOHandler::clone_file(crash_file, crash_copy);
+    RawIOHandler::clone_file((string(crash_file) + ".map").c_str(),
+            (string(crash_copy) + ".map").c_str());
+
+    // the copy opens as of the flush
+    CompressedIOHandler *recovered = new CompressedIOHandler(crash_copy, 512, 256);
+    ck_assert_int_eq(recovered->get_flen(), pages * sizeof(page));
+    for (size_t i=0; i<pages; i++) {
+        memset(page, 0, sizeof(page));
+        memset(page, i + 1, 100);
+        recovered->read(check, sizeof(check), i * sizeof(page));
+        ck_assert_int_eq(memcmp(check, page, sizeof(page)), 0);
+    }
+    delete recovered;
+
+    // and the original has everything once it is flushed, reusing the
+    // space the flush freed rather than growing without end
+    test->flush();
+    size_t stored = test->get_stored_bytes();
+    for (size_t round=0; round<10; round++) {
+        for (size_t i=0; i<pages; i++) {
+            memset(page, 0, sizeof(page));
+            memset(page, i + round + 1, 100);
+            test->write(page, sizeof(page), i * sizeof(page));
+        }
+        test->flush();
+    }
+    ck_assert_int_eq(test->get_stored_bytes(), stored);
+    delete test;
+
+    test = new CompressedIOHandler(crash_file, 512, 256);
+    for (size_t i=0; i<pages; i++) {
+        memset(page, 0, sizeof(page));
+        memset(page, i + 10, 100);
+        test->read(check, sizeof(check), i * sizeof(page));
+        ck_assert_int_eq(memcmp(check, page, sizeof(page)), 0);
+    }
+    delete test;
+}
+END_TEST
+
+
+START_TEST(cache_bound)
+{
+    CompressedIOHandler *test = new CompressedIOHandler(grow_file, 512, 256);
+    test->truncate(0);
+
+    byte page[256];
+    memset(page, 0, sizeof(page));
+    for (size_t i=0; i<4; i++) {
+        page[3] = i + 1;
+        test->write(page, sizeof(page), i * sizeof(page));
+    }
+
+    // pages already in the cache that stop compressing make room for
+    // themselves like any other
+    byte noise[256];
+    srand(0);
+    for (size_t i=0; i<sizeof(noise); i++) noise[i] = rand() % 255 + 1;
+    test->write(noise, sizeof(noise), 0);
+    ck_assert_int_le(test->get_cached_bytes(), 512);
+    test->write(noise, sizeof(noise), sizeof(page));
+    ck_assert_int_le(test->get_cached_bytes(), 512);
+
+    byte check[256];
+    for (size_t i=0; i<2; i++) {
+        test->read(check, sizeof(check), i * sizeof(page));
+        ck_assert_int_eq(memcmp(check, noise, sizeof(noise)), 0);
+    }
+    page[3] = 4;
+    test->read(check, sizeof(check), 3 * sizeof(page));
+    ck_assert_int_eq(memcmp(check, page, sizeof(page)), 0);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(truncate_test)
+{
+    IOHandler *test = new CompressedIOHandler(trunc_file, 1 << 20, 64);
+    test->truncate(0);
+
+    byte data[200];
+    memset(data, 'x', sizeof(data));
+    test->write(data, sizeof(data), 0);
+
+    test->truncate(100);
+    ck_assert_int_eq(test->get_flen(), 100);
+
+    // growing it again reads back zeros past the old end
+    byte zero = 0;
+    test->write(&zero, 1, 199);
+    test->read(data, sizeof(data), 0);
+    ck_assert_int_eq(data[99], 'x');
+    ck_assert_int_eq(data[100], 0);
+    ck_assert_int_eq(data[150], 0);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(table)
+{
+    auto storage = new BufferedIOHandler(new CompressedIOHandler(table_file, 4096, 1024), 10);
+    auto test = new HashTable<int32_t, int32_t>(storage, 500);
+    std::map<int32_t, int32_t> inserted;
+    srand(0);
+
+    for (size_t i=0; i<2000; i++) {
+        int32_t key = rand() % 1000000 + 1;
+        int32_t val = rand();
+        test->insert(key, val);
+        inserted.insert({key, val});
+    }
+    delete test;
+
+    storage = new BufferedIOHandler(new CompressedIOHandler(table_file, 4096, 1024), 10);
+    test = new HashTable<int32_t, int32_t>(storage, 500);
+
+    size_t bad = 0;
+    for (auto &element : inserted) {
+        if (test->get(element.first) != element.second) bad++;
+    }
+    ck_assert_int_eq(bad, 0);
+
+    delete test;
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("CompressedIO Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, codec_round_trip);
+    tcase_add_test(basic, codec_corrupt);
+    tcase_add_test(basic, write_read);
+    tcase_add_test(basic, cold_pages);
+    tcase_add_test(basic, map_growth);
+    tcase_add_test(basic, crash_recovery);
+    tcase_add_test(basic, cache_bound);
+    tcase_add_test(basic, truncate_test);
+    tcase_add_test(basic, table);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
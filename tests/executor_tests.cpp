@@ -0,0 +1,229 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <thread>
+#include <vector>
+
+#include "dstruct/executor.hpp"
+
+using namespace std;
+
+const char *exec_base = "./tests/data/executor.store";
+
+
+START_TEST(create)
+{
+    auto test = new ShardExecutor<int32_t, int32_t>(
+            new ShardedHashTable<int32_t, int32_t>(4, 10), 2);
+
+    ck_assert_int_eq(test->get_worker_count(), 2);
+    delete test;
+
+    // no more workers than shards
+    test = new ShardExecutor<int32_t, int32_t>(
+            new ShardedHashTable<int32_t, int32_t>(2, 10), 8);
+    ck_assert_int_eq(test->get_worker_count(), 2);
+    delete test;
+}
+END_TEST
+
+
+START_TEST(insert_get)
+{
+    auto test = new ShardExecutor<int32_t, int32_t>(
+            new ShardedHashTable<int32_t, int32_t>(exec_base, 4, 10), 2);
+
+    std::vector<std::future<int32_t>> inserted;
+    for (int32_t i=1; i<=1000; i++) {
+        inserted.push_back(test->insert(i, i * 2));
+    }
+    for (int32_t i=1; i<=1000; i++) {
+        ck_assert_int_eq(inserted[i - 1].get(), i * 2);
+    }
+
+    std::vector<std::future<int32_t>> found;
+    for (int32_t i=1; i<=1000; i++) {
+        found.push_back(test->get(i));
+    }
+    for (int32_t i=1; i<=1000; i++) {
+        ck_assert_int_eq(found[i - 1].get(), i * 2);
+    }
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(miss_and_remove)
+{
+    auto test = new ShardExecutor<int32_t, int32_t>(
+            new ShardedHashTable<int32_t, int32_t>(4, 10), 4);
+
+    bool error = false;
+    auto missing = test->get(55);
+    try {
+        missing.get();
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    test->insert(55, 5).get();
+    ck_assert_int_eq(test->get(55).get(), 5);
+    test->remove(55).get();
+
+    error = false;
+    auto removed = test->remove(55);
+    try {
+        removed.get();
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(many_submitters)
+{
+    auto test = new ShardExecutor<int32_t, int32_t>(
+            new ShardedHashTable<int32_t, int32_t>(8, 64), 4, true);
+
+    size_t thread_cnt = 8;
+    int32_t per_thread = 2000;
+    std::vector<std::thread> submitters;
+    for (size_t t=0; t<thread_cnt; t++) {
+        submitters.emplace_back([test, t, per_thread]() {
+            std::vector<std::future<int32_t>> pending;
+            for (int32_t i=1; i<=per_thread; i++) {
+                int32_t key = t * per_thread + i;
+                pending.push_back(test->insert(key, -key));
+            }
+            for (auto &f : pending) f.get();
+        });
+    }
+    for (auto &submitter : submitters) submitter.join();
+
+    size_t bad = 0;
+    for (int32_t key=1; key<=(int32_t) thread_cnt * per_thread; key++) {
+        if (test->get(key).get() != -key) bad++;
+    }
+    ck_assert_int_eq(bad, 0);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(tasks)
+{
+    auto test = new ShardExecutor<int32_t, int32_t>(
+            new ShardedHashTable<int32_t, int32_t>(4, 10), 2);
+
+    // a task runs against the shard's own table, on its owning worker
+    std::vector<std::future<void>> batches;
+    for (size_t s=0; s<4; s++) {
+        batches.push_back(test->execute(s, [s](HashTable<int32_t, int32_t> *shard) {
+            for (int32_t i=1; i<=100; i++) {
+                shard->insert(i * 4 + s, i);
+            }
+        }));
+    }
+    for (auto &batch : batches) batch.get();
+
+    // the elements are stored wherever the task put them, so look them up
+    // the same way
+    auto counted = test->execute(2, [](HashTable<int32_t, int32_t> *shard) {
+        ck_assert_int_eq(shard->get(4 + 2), 1);
+    });
+    counted.get();
+
+    bool error = false;
+    try {
+        test->execute(4, [](HashTable<int32_t, int32_t> *) {});
+    } catch (std::out_of_range &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    auto failing = test->execute(0, [](HashTable<int32_t, int32_t> *shard) {
+        shard->get(-1);
+    });
+    error = false;
+    try {
+        failing.get();
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(drain_on_destroy)
+{
+    auto table = new ShardedHashTable<int32_t, int32_t>(2, 10);
+    auto test = new ShardExecutor<int32_t, int32_t>(table, 2);
+
+    std::vector<std::future<int32_t>> pending;
+    for (int32_t i=1; i<=500; i++) {
+        pending.push_back(test->insert(i, i));
+    }
+
+    // everything submitted before the executor is destroyed still runs
+    delete test;
+    for (auto &f : pending) {
+        ck_assert_int_eq(f.wait_for(std::chrono::seconds(0)) == std::future_status::ready, true);
+    }
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("Shard Executor Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, create);
+    tcase_add_test(basic, insert_get);
+    tcase_add_test(basic, miss_and_remove);
+    tcase_add_test(basic, many_submitters);
+    tcase_add_test(basic, tasks);
+    tcase_add_test(basic, drain_on_destroy);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
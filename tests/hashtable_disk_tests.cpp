@@ -1,17 +1,27 @@
 #include <check.h>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <string>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <climits>
 #include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
 
 #include "dstruct/hashtable.hpp"
 
 using namespace std;
 
 const char *fname = "./tests/data/table.store";
+const char *snapshot_fname = "./tests/data/snapshot.store";
+const char *restore_fname = "./tests/data/restore.store";
+const char *filter_fname = "./tests/data/filtered.store";
+const char *txn_fname = "./tests/data/txn.store";
 
 
 START_TEST(create)
@@ -207,6 +217,611 @@ START_TEST(remove_miss)
 END_TEST
 
 
+START_TEST(iterate_test)
+{
+    truncate(fname, 0);
+    auto test = new HashTable<int32_t, int32_t>(fname, 10);
+    auto inserted = new std::map<int32_t, int32_t>();
+    srand(0);
+
+    size_t n = 1000;
+    for (size_t i=0; i<n; i++) {
+        int32_t key = rand();
+        int32_t val = rand();
+
+        test->insert(key, val);
+        inserted->insert({key, val});
+    }
+
+    // punch a few holes in the chains, to make sure they are skipped
+    for (size_t i=0; i<50; i++) {
+        auto victim = inserted->begin();
+        test->remove(victim->first);
+        inserted->erase(victim);
+    }
+
+    size_t seen = 0;
+    for (auto it = test->begin(); it != test->end(); it++) {
+        auto match = inserted->find(it->first);
+        ck_assert_int_eq(match != inserted->end(), true);
+        ck_assert_int_eq(match->second, it->second);
+        seen++;
+    }
+
+    ck_assert_int_eq(seen, inserted->size());
+
+    delete test;
+    delete inserted;
+}
+END_TEST
+
+
+START_TEST(iterate_empty)
+{
+    truncate(fname, 0);
+    auto test = new HashTable<int32_t, int32_t>(fname, 10);
+
+    ck_assert_int_eq(test->begin() == test->end(), true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(parallel_scan)
+{
+    truncate(fname, 0);
+    auto test = new HashTable<int32_t, int32_t>(fname, 10);
+    auto inserted = new std::map<int32_t, int32_t>();
+    srand(0);
+
+    size_t n = 1000;
+    for (size_t i=0; i<n; i++) {
+        int32_t key = rand();
+        int32_t val = rand();
+
+        test->insert(key, val);
+        inserted->insert({key, val});
+    }
+
+    std::mutex lock;
+    auto scanned = new std::map<int32_t, int32_t>();
+    test->parallel_for_each([&](int32_t key, int32_t val) {
+        std::lock_guard<std::mutex> guard(lock);
+        scanned->insert({key, val});
+    }, 4);
+
+    ck_assert_int_eq(scanned->size(), inserted->size());
+    ck_assert_int_eq(*scanned == *inserted, true);
+
+    delete test;
+    delete inserted;
+    delete scanned;
+}
+END_TEST
+
+
+START_TEST(bulk_load)
+{
+    auto input = new std::vector<std::pair<int32_t, int32_t>>();
+    auto expected = new std::map<int32_t, int32_t>();
+    srand(0);
+
+    size_t n = 10000;
+    for (size_t i=0; i<n; i++) {
+        // a narrow key range, so that there are plenty of duplicates
+        int32_t key = rand() % 5000 + 1;
+        int32_t val = rand();
+
+        input->push_back({key, val});
+        expected->insert({key, val});
+    }
+
+    auto test = HashTable<int32_t, int32_t>::bulk_load(fname, 100, input->begin(),
+            input->end(), 4);
+
+    ck_assert_int_eq(test->get_bucket_count(), 100);
+
+    for (auto &element : *expected) {
+        ck_assert_int_eq(test->get(element.first), element.second);
+    }
+
+    size_t seen = 0;
+    for (auto it = test->begin(); it != test->end(); it++) {
+        seen++;
+    }
+    ck_assert_int_eq(seen, expected->size());
+
+    // the loaded table should be usable as normal afterwards
+    ck_assert_int_eq(test->insert(10000, 5), 5);
+    ck_assert_int_eq(test->get(10000), 5);
+    test->remove(10000);
+
+    delete test;
+
+    // and should survive being closed and reopened
+    test = new HashTable<int32_t, int32_t>(fname, 100);
+    for (auto &element : *expected) {
+        ck_assert_int_eq(test->get(element.first), element.second);
+    }
+
+    delete test;
+    delete input;
+    delete expected;
+}
+END_TEST
+
+
+START_TEST(bulk_load_empty)
+{
+    auto input = new std::vector<std::pair<int32_t, int32_t>>();
+
+    auto test = HashTable<int32_t, int32_t>::bulk_load(fname, 10, input->begin(),
+            input->end(), 4);
+
+    ck_assert_int_eq(test->begin() == test->end(), true);
+    ck_assert_int_eq(test->insert(5, 5), 5);
+
+    delete test;
+    delete input;
+}
+END_TEST
+
+
+START_TEST(snapshot_test)
+{
+    truncate(fname, 0);
+    auto test = new HashTable<int32_t, int32_t>(fname, 10);
+    auto inserted = new std::map<int32_t, int32_t>();
+    srand(0);
+
+    for (size_t i=0; i<1000; i++) {
+        int32_t key = rand();
+        int32_t val = rand();
+
+        test->insert(key, val);
+        inserted->insert({key, val});
+    }
+
+    test->snapshot(snapshot_fname);
+
+    // changes made after the snapshot shouldn't show up in it
+    test->remove(inserted->begin()->first);
+    test->insert(12345, 678);
+
+    auto snap = new HashTable<int32_t, int32_t>(snapshot_fname, 10);
+    size_t seen = 0;
+    for (auto it = snap->begin(); it != snap->end(); it++) {
+        ck_assert_int_eq(inserted->at(it->first), it->second);
+        seen++;
+    }
+    ck_assert_int_eq(seen, inserted->size());
+
+    delete snap;
+    delete test;
+    delete inserted;
+}
+END_TEST
+
+
+START_TEST(snapshot_concurrent)
+{
+    truncate(fname, 0);
+    auto test = new HashTable<int32_t, int32_t>(fname, 100);
+    auto inserted = new std::map<int32_t, int32_t>();
+    srand(0);
+
+    for (size_t i=0; i<5000; i++) {
+        int32_t key = rand();
+        int32_t val = rand();
+
+        test->insert(key, val);
+        inserted->insert({key, val});
+    }
+
+    // Hammer the table while the snapshot is being taken. The snapshot
+    // should still hold exactly what was in the table when it started.
+    std::thread writer([&]() {
+        for (int32_t i=1; i<=5000; i++) {
+            test->insert(-i, i);
+            if (i % 5 == 0) test->remove(-(i - 1));
+        }
+    });
+
+    test->snapshot(snapshot_fname);
+    writer.join();
+
+    auto snap = new HashTable<int32_t, int32_t>(snapshot_fname, 100);
+    size_t seen = 0;
+    for (auto it = snap->begin(); it != snap->end(); it++) {
+        if (it->first < 0) continue;
+        ck_assert_int_eq(inserted->at(it->first), it->second);
+        seen++;
+    }
+    ck_assert_int_eq(seen, inserted->size());
+
+    delete snap;
+    delete test;
+    delete inserted;
+}
+END_TEST
+
+
+START_TEST(restore_test)
+{
+    truncate(fname, 0);
+    auto test = new HashTable<int32_t, int32_t>(fname, 10);
+
+    for (int32_t i=1; i<=500; i++) {
+        test->insert(i, i * 2);
+    }
+
+    test->snapshot(snapshot_fname);
+
+    for (int32_t i=1; i<=500; i++) {
+        test->remove(i);
+    }
+
+    delete test;
+
+    test = HashTable<int32_t, int32_t>::restore(snapshot_fname, restore_fname, 10);
+    for (int32_t i=1; i<=500; i++) {
+        ck_assert_int_eq(test->get(i), i * 2);
+    }
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(read_only)
+{
+    truncate(fname, 0);
+    auto writer = new HashTable<int32_t, int32_t>(fname, 10);
+
+    for (int32_t i=1; i<=500; i++) {
+        writer->insert(i, i * 2);
+    }
+    writer->publish();
+
+    auto reader = new HashTable<int32_t, int32_t>(fname, 10, open_t::READ_ONLY);
+    ck_assert_int_eq(reader->is_read_only(), true);
+
+    for (int32_t i=1; i<=500; i++) {
+        ck_assert_int_eq(reader->get(i), i * 2);
+    }
+
+    bool error = false;
+    try {
+        reader->insert(1000, 1);
+    } catch (ReadOnlyException& e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    error = false;
+    try {
+        reader->remove(1);
+    } catch (ReadOnlyException& e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    // enough new keys to grow the overflow chains, and so the file
+    for (int32_t i=501; i<=1000; i++) {
+        writer->insert(i, i * 2);
+    }
+    writer->remove(1);
+    writer->publish();
+
+    for (int32_t i=501; i<=1000; i++) {
+        ck_assert_int_eq(reader->get(i), i * 2);
+    }
+
+    error = false;
+    try {
+        reader->get(1);
+    } catch (KeyNotFoundException& e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    delete reader;
+    delete writer;
+}
+END_TEST
+
+
+START_TEST(filter_persist)
+{
+    string sidecar = string(filter_fname) + ".bloom";
+    unlink(filter_fname);
+    unlink(sidecar.c_str());
+
+    auto test = new HashTable<int32_t, int32_t>(filter_fname, 10);
+    test->enable_filter(1000);
+    for (int32_t i=1; i<=500; i++) {
+        test->insert(i, i * 2);
+    }
+    delete test;
+    ck_assert_int_eq(access(sidecar.c_str(), F_OK), 0);
+
+    // the next run picks the saved filter up rather than scanning
+    test = new HashTable<int32_t, int32_t>(filter_fname, 10);
+    test->enable_filter();
+    ck_assert_int_eq(test->get_filter()->get_key_count(), 500);
+    for (int32_t i=1; i<=500; i++) {
+        ck_assert_int_eq(test->get(i), i * 2);
+    }
+    delete test;
+
+    // modifying the table without its filter drops the saved one
+    test = new HashTable<int32_t, int32_t>(filter_fname, 10);
+    test->insert(501, 1002);
+    ck_assert_int_ne(access(sidecar.c_str(), F_OK), 0);
+    test->enable_filter();
+    ck_assert_int_eq(test->get(501), 1002);
+    test->publish();
+    ck_assert_int_eq(access(sidecar.c_str(), F_OK), 0);
+
+    // readers use whatever filter the writer last published
+    auto reader = new HashTable<int32_t, int32_t>(filter_fname, 10, open_t::READ_ONLY);
+    reader->enable_filter();
+    ck_assert_int_eq(reader->get(501), 1002);
+
+    test->insert(502, 1004);
+    test->publish();
+    ck_assert_int_eq(reader->get(502), 1004);
+
+    bool error = false;
+    try {
+        reader->get(503);
+    } catch (KeyNotFoundException& e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    delete reader;
+    delete test;
+}
+END_TEST
+
+
+START_TEST(read_only_shared)
+{
+    truncate(fname, 0);
+    auto writer = new HashTable<int32_t, int32_t>(fname, 10);
+
+    for (int32_t i=1; i<=500; i++) {
+        writer->insert(i, i * 2);
+    }
+    writer->publish();
+
+    // a reader in another process should see the published version too
+    pid_t child = fork();
+    if (child == 0) {
+        auto reader = new HashTable<int32_t, int32_t>(fname, 10, open_t::READ_ONLY);
+        int failed = 0;
+        for (int32_t i=1; i<=500; i++) {
+            if (reader->get(i) != i * 2) failed++;
+        }
+        delete reader;
+        _exit(failed);
+    }
+
+    int status;
+    waitpid(child, &status, 0);
+    ck_assert_int_eq(WIFEXITED(status), true);
+    ck_assert_int_eq(WEXITSTATUS(status), 0);
+
+    delete writer;
+}
+END_TEST
+
+
+START_TEST(publish_atomic)
+{
+    truncate(fname, 0);
+    auto writer = new HashTable<int32_t, int32_t>(fname, 10);
+
+    for (int32_t i=1; i<=500; i++) {
+        writer->insert(i, i * 2);
+    }
+    writer->publish();
+
+    auto reader = new MappedIOHandler(fname);
+    off_t len = reader->get_flen();
+    std::vector<byte> before(len);
+    reader->read(before.data(), len, 0);
+
+    // publishing changes, growth included, never touches the file a
+    // reader has mapped, so it sees none of them until it refreshes
+    for (int32_t i=501; i<=1000; i++) {
+        writer->insert(i, i * 2);
+    }
+    writer->remove(1);
+    writer->publish();
+    delete writer;
+
+    std::vector<byte> after(len);
+    ck_assert_int_eq(reader->get_flen(), len);
+    reader->read(after.data(), len, 0);
+    ck_assert_int_eq(memcmp(before.data(), after.data(), len), 0);
+
+    ck_assert_int_eq(reader->refresh(), true);
+    ck_assert_int_gt(reader->get_flen(), len);
+    reader->read(after.data(), len, 0);
+    ck_assert_int_ne(memcmp(before.data(), after.data(), len), 0);
+
+    delete reader;
+}
+END_TEST
+
+
+START_TEST(analyze_orphans)
+{
+    auto input = new std::vector<std::pair<int32_t, int32_t>>();
+    for (int32_t i=1; i<=1000; i++) {
+        input->push_back({i, i});
+    }
+
+    auto test = HashTable<int32_t, int32_t>::bulk_load(fname, 10, input->begin(),
+            input->end(), 2);
+
+    auto clean = test->analyze();
+    ck_assert_int_eq(clean.elements, 1000);
+    ck_assert_int_eq(clean.orphaned_buckets, 0);
+    delete test;
+
+    // tack a bucket onto the end of the file that no chain points to, as
+    // an insert interrupted before it could link in its new bucket would
+    IOHandler *raw = new RawIOHandler(fname);
+    int32_t element[2] = {5000, 5000};
+    raw->write((byte *) element, sizeof(element), raw->get_flen());
+    int32_t pad[14] = {0};
+    raw->write((byte *) pad, sizeof(pad), raw->get_flen());
+    delete raw;
+
+    test = new HashTable<int32_t, int32_t>(fname, 10, open_t::READ_ONLY);
+    auto orphaned = test->analyze();
+    ck_assert_int_eq(orphaned.elements, 1000);
+    ck_assert_int_eq(orphaned.orphaned_buckets, 1);
+    ck_assert_int_eq(orphaned.overflow_buckets, clean.overflow_buckets);
+
+    delete test;
+    delete input;
+}
+END_TEST
+
+
+START_TEST(compact_test)
+{
+    truncate(fname, 0);
+    auto test = new HashTable<int32_t, int32_t>(fname, 10);
+
+    // interleave the chains, and leave holes all through them
+    for (int32_t i=1; i<=1000; i++) {
+        test->insert(i, i * 2);
+    }
+    for (int32_t i=3; i<=1000; i+=3) {
+        test->remove(i);
+    }
+
+    auto before = test->analyze();
+    ck_assert_int_eq(before.dead_slots > 0, true);
+
+    test->compact();
+
+    auto after = test->analyze();
+    ck_assert_int_eq(after.elements, before.elements);
+    ck_assert_int_eq(after.dead_slots, 0);
+    ck_assert_int_eq(after.empty_overflow_buckets, 0);
+    ck_assert_int_eq(after.orphaned_buckets, 0);
+    ck_assert_int_eq(after.overflow_buckets < before.overflow_buckets, true);
+
+    for (int32_t i=1; i<=1000; i++) {
+        ck_assert_int_eq(test->contains(i), i % 3 != 0);
+        if (i % 3) ck_assert_int_eq(test->get(i), i * 2);
+    }
+
+    // the table carries on as normal afterwards, and the file on disk is
+    // the compacted one
+    test->insert(3, 6);
+    delete test;
+
+    test = new HashTable<int32_t, int32_t>(fname, 10);
+    ck_assert_int_eq(test->get(3), 6);
+    ck_assert_int_eq(test->get(1000), 2000);
+    ck_assert_int_eq(access((std::string(fname) + ".compact").c_str(), F_OK), -1);
+    delete test;
+}
+END_TEST
+
+
+/*
+ * A transaction log record of the given writes, laid out as a commit
+ * writes it: the count, each write as a change_t and an element, and an
+ * FNV-1a checksum of all that.
+ */
+static std::vector<byte> txn_record(std::vector<std::pair<int64_t, int64_t>> puts, int64_t removed)
+{
+    std::vector<byte> record;
+    auto append = [&record](const void *data, size_t size) {
+        record.insert(record.end(), (const byte *) data, (const byte *) data + size);
+    };
+
+    uint64_t cnt = puts.size() + 1;
+    append(&cnt, sizeof(cnt));
+    for (auto &put : puts) {
+        record.push_back((byte) change_t::PUT);
+        append(&put.first, sizeof(put.first));
+        append(&put.second, sizeof(put.second));
+    }
+    int64_t zero = 0;
+    record.push_back((byte) change_t::REMOVE);
+    append(&removed, sizeof(removed));
+    append(&zero, sizeof(zero));
+
+    uint64_t sum = 14695981039346656037ull;
+    for (byte b : record) {
+        sum = (sum ^ (uint8_t) b) * 1099511628211ull;
+    }
+    append(&sum, sizeof(sum));
+    return record;
+}
+
+
+START_TEST(transaction_log)
+{
+    std::string log_fname = std::string(txn_fname) + ".txn";
+    truncate(txn_fname, 0);
+    unlink(log_fname.c_str());
+
+    auto test = new HashTable<int64_t, int64_t>(txn_fname, 10);
+    test->insert(1, 100);
+    test->insert(2, 100);
+    test->insert(3, 100);
+
+    auto txn = test->begin_transaction();
+    txn.put(1, txn.get(1) - 10);
+    txn.put(2, txn.get(2) + 10);
+    ck_assert_int_eq(txn.commit(), true);
+
+    // nothing is left in the log once a commit is done
+    struct stat buf;
+    ck_assert_int_eq(stat(log_fname.c_str(), &buf), 0);
+    ck_assert_int_eq(buf.st_size, 0);
+    delete test;
+
+    // A commit cut short after logging its writes is finished off when
+    // the table is next opened...
+    std::vector<byte> record = txn_record({{1, 50}, {2, 150}}, 3);
+    FILE *log = fopen(log_fname.c_str(), "w");
+    fwrite(record.data(), 1, record.size(), log);
+    fclose(log);
+
+    test = new HashTable<int64_t, int64_t>(txn_fname, 10);
+    ck_assert_int_eq(test->get(1), 50);
+    ck_assert_int_eq(test->get(2), 150);
+    ck_assert_int_eq(test->contains(3), false);
+    stat(log_fname.c_str(), &buf);
+    ck_assert_int_eq(buf.st_size, 0);
+    delete test;
+
+    // ...but one whose log didn't make it out whole never happened.
+    record = txn_record({{1, 1}, {2, 1}}, 1);
+    log = fopen(log_fname.c_str(), "w");
+    fwrite(record.data(), 1, record.size() - 1, log);
+    fclose(log);
+
+    test = new HashTable<int64_t, int64_t>(txn_fname, 10);
+    ck_assert_int_eq(test->get(1), 50);
+    ck_assert_int_eq(test->get(2), 150);
+    delete test;
+}
+END_TEST
+
+
 Suite *test_suite()
 {
     Suite *suite = suite_create("Disk HashTable Tests");
@@ -221,6 +836,21 @@ Suite *test_suite()
     tcase_add_test(basic, read_test);
     tcase_add_test(basic, remove_test);
     tcase_add_test(basic, remove_miss);
+    tcase_add_test(basic, iterate_test);
+    tcase_add_test(basic, iterate_empty);
+    tcase_add_test(basic, parallel_scan);
+    tcase_add_test(basic, bulk_load);
+    tcase_add_test(basic, bulk_load_empty);
+    tcase_add_test(basic, snapshot_test);
+    tcase_add_test(basic, snapshot_concurrent);
+    tcase_add_test(basic, restore_test);
+    tcase_add_test(basic, read_only);
+    tcase_add_test(basic, read_only_shared);
+    tcase_add_test(basic, publish_atomic);
+    tcase_add_test(basic, filter_persist);
+    tcase_add_test(basic, analyze_orphans);
+    tcase_add_test(basic, compact_test);
+    tcase_add_test(basic, transaction_log);
 
     tcase_add_test(basic, destroy);
 
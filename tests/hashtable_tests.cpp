@@ -6,6 +6,10 @@
 #include <unistd.h>
 #include <climits>
 #include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
 
 #include "dstruct/hashtable.hpp"
 
@@ -205,6 +209,682 @@ START_TEST(remove_miss)
 END_TEST
 
 
+START_TEST(iterate_test)
+{
+    auto test = new HashTable<int32_t, int32_t>(10);
+    auto inserted = new std::map<int32_t, int32_t>();
+    srand(0);
+
+    size_t n = 1000;
+    for (size_t i=0; i<n; i++) {
+        int32_t key = rand();
+        int32_t val = rand();
+
+        test->insert(key, val);
+        inserted->insert({key, val});
+    }
+
+    // punch a few holes in the chains, to make sure they are skipped
+    for (size_t i=0; i<50; i++) {
+        auto victim = inserted->begin();
+        test->remove(victim->first);
+        inserted->erase(victim);
+    }
+
+    size_t seen = 0;
+    for (auto it = test->begin(); it != test->end(); it++) {
+        auto match = inserted->find(it->first);
+        ck_assert_int_eq(match != inserted->end(), true);
+        ck_assert_int_eq(match->second, it->second);
+        seen++;
+    }
+
+    ck_assert_int_eq(seen, inserted->size());
+
+    delete test;
+    delete inserted;
+}
+END_TEST
+
+
+START_TEST(iterate_empty)
+{
+    auto test = new HashTable<int32_t, int32_t>(10);
+
+    ck_assert_int_eq(test->begin() == test->end(), true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(parallel_scan)
+{
+    auto test = new HashTable<int32_t, int32_t>(10);
+    auto inserted = new std::map<int32_t, int32_t>();
+    srand(0);
+
+    size_t n = 1000;
+    for (size_t i=0; i<n; i++) {
+        int32_t key = rand();
+        int32_t val = rand();
+
+        test->insert(key, val);
+        inserted->insert({key, val});
+    }
+
+    std::mutex lock;
+    auto scanned = new std::map<int32_t, int32_t>();
+    test->parallel_for_each([&](int32_t key, int32_t val) {
+        std::lock_guard<std::mutex> guard(lock);
+        scanned->insert({key, val});
+    }, 4);
+
+    ck_assert_int_eq(scanned->size(), inserted->size());
+    ck_assert_int_eq(*scanned == *inserted, true);
+
+    delete test;
+    delete inserted;
+    delete scanned;
+}
+END_TEST
+
+
+START_TEST(snapshot_test)
+{
+    auto test = new HashTable<int32_t, int32_t>(10);
+
+    for (int32_t i=1; i<=500; i++) {
+        test->insert(i, i * 2);
+    }
+
+    test->snapshot("./tests/data/snapshot.store");
+    test->insert(1000, 1);
+
+    auto snap = new HashTable<int32_t, int32_t>("./tests/data/snapshot.store", 10);
+    size_t seen = 0;
+    for (auto it = snap->begin(); it != snap->end(); it++) {
+        ck_assert_int_eq(it->second, it->first * 2);
+        seen++;
+    }
+    ck_assert_int_eq(seen, 500);
+
+    delete snap;
+    delete test;
+}
+END_TEST
+
+
+START_TEST(try_get_test)
+{
+    auto test = new HashTable<int32_t, int32_t>(10);
+    for (int32_t i=1; i<=100; i++) {
+        test->insert(i, i * 2);
+    }
+
+    int32_t val = -1;
+    for (int32_t i=1; i<=100; i++) {
+        ck_assert_int_eq(test->try_get(i, &val), true);
+        ck_assert_int_eq(val, i * 2);
+        ck_assert_int_eq(test->contains(i), true);
+    }
+
+    val = -1;
+    ck_assert_int_eq(test->try_get(101, &val), false);
+    ck_assert_int_eq(val, -1);
+    ck_assert_int_eq(test->contains(101), false);
+
+    ck_assert_int_eq(test->try_remove(50), true);
+    ck_assert_int_eq(test->try_remove(50), false);
+    ck_assert_int_eq(test->contains(50), false);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(upsert_test)
+{
+    auto test = new HashTable<int32_t, int32_t>(10);
+    for (int32_t i=1; i<=100; i++) {
+        test->insert(i, i);
+    }
+
+    // insert leaves existing values alone, and upsert replaces them
+    ck_assert_int_eq(test->insert(5, 50), 5);
+    ck_assert_int_eq(test->upsert(5, 50), 50);
+    ck_assert_int_eq(test->get(5), 50);
+
+    ck_assert_int_eq(test->upsert(101, 1010), 1010);
+    ck_assert_int_eq(test->get(101), 1010);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(cache_test)
+{
+    auto test = new HashTable<int32_t, int32_t>(10);
+    test->enable_cache(50, 4);
+    for (int32_t i=1; i<=100; i++) {
+        test->insert(i, i);
+    }
+
+    for (int32_t round=0; round<3; round++) {
+        for (int32_t i=1; i<=100; i++) {
+            ck_assert_int_eq(test->get(i), i);
+        }
+    }
+    ck_assert_int_gt(test->get_cache()->size(), 0);
+    ck_assert_int_le(test->get_cache()->size(), 52);
+
+    // updates and removes reach cached keys
+    for (int32_t i=1; i<=100; i++) {
+        test->upsert(i, i * 3);
+    }
+    test->remove(7);
+
+    for (int32_t i=1; i<=100; i++) {
+        int32_t val;
+        ck_assert_int_eq(test->try_get(i, &val), i != 7);
+        if (i != 7) ck_assert_int_eq(val, i * 3);
+    }
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(filter_test)
+{
+    auto test = new HashTable<int32_t, int32_t>(10);
+    for (int32_t i=1; i<=100; i++) {
+        test->insert(i, i * 2);
+    }
+
+    // the filter is built from what is already there, and kept up to date
+    test->enable_filter(1000);
+    ck_assert_int_eq(test->get_filter()->get_key_count(), 100);
+    for (int32_t i=101; i<=200; i++) {
+        test->insert(i, i * 2);
+    }
+
+    for (int32_t i=1; i<=200; i++) {
+        ck_assert_int_eq(test->get(i), i * 2);
+    }
+
+    size_t misses = 0;
+    for (int32_t i=201; i<=1200; i++) {
+        try {
+            test->get(i);
+        } catch (KeyNotFoundException& e) {
+            misses++;
+        }
+    }
+    ck_assert_int_eq(misses, 1000);
+
+    test->remove(50);
+    bool error = false;
+    try {
+        test->get(50);
+    } catch (KeyNotFoundException& e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    test->rebuild_filter();
+    ck_assert_int_eq(test->get_filter()->get_key_count(), 199);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(analyze_test)
+{
+    auto test = new HashTable<int32_t, int32_t>(10);
+
+    auto empty = test->analyze();
+    ck_assert_int_eq(empty.primary_buckets, 10);
+    ck_assert_int_eq(empty.overflow_buckets, 0);
+    ck_assert_int_eq(empty.elements, 0);
+    ck_assert_int_eq(empty.chain_lengths[1], 10);
+
+    // 7 elements fit in a bucket, so 1000 over 10 buckets means long chains
+    for (int32_t i=1; i<=1000; i++) {
+        test->insert(i, i);
+    }
+
+    auto full = test->analyze();
+    ck_assert_int_eq(full.elements, 1000);
+    ck_assert_int_eq(full.dead_slots, 0);
+    ck_assert_int_eq(full.orphaned_buckets, 0);
+    ck_assert_int_eq(full.overflow_buckets > 0, true);
+    ck_assert_int_eq(full.slots, 7 * (10 + full.overflow_buckets));
+    ck_assert_int_eq(full.max_chain_length >= 15, true);
+    ck_assert_int_eq(full.recommended_bucket_cnt, 1000 / (7 * 0.75) + 1);
+
+    size_t chains = 0;
+    for (auto cnt : full.chain_lengths) chains += cnt;
+    ck_assert_int_eq(chains, 10);
+
+    // removing elements leaves holes behind in the chains
+    for (int32_t i=1; i<=500; i++) {
+        test->remove(i);
+    }
+
+    auto holes = test->analyze();
+    ck_assert_int_eq(holes.elements, 500);
+    ck_assert_int_eq(holes.overflow_buckets, full.overflow_buckets);
+    ck_assert_int_eq(holes.dead_slots >= 400, true);
+    ck_assert_int_eq(holes.load_factor < full.load_factor, true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(compact_test)
+{
+    auto test = new HashTable<int32_t, int32_t>(10);
+
+    for (int32_t i=1; i<=1000; i++) {
+        test->insert(i, i);
+    }
+    for (int32_t i=1; i<=500; i++) {
+        test->remove(i);
+    }
+
+    test->compact();
+
+    // 500 elements over 10 buckets of 7 need at least 80 overflow buckets,
+    // and a compacted table should need no more than that, give or take
+    // the odd partly filled last link
+    auto compacted = test->analyze();
+    ck_assert_int_eq(compacted.elements, 500);
+    ck_assert_int_eq(compacted.dead_slots, 0);
+    ck_assert_int_eq(compacted.orphaned_buckets, 0);
+    ck_assert_int_eq(compacted.overflow_buckets <= 80, true);
+
+    for (int32_t i=1; i<=1000; i++) {
+        ck_assert_int_eq(test->contains(i), i > 500);
+    }
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(batch_test)
+{
+    auto test = new HashTable<int32_t, int32_t>(10);
+
+    std::vector<std::pair<int32_t, int32_t>> input;
+    for (int32_t i=1; i<=500; i++) {
+        input.push_back({i, i});
+    }
+    // a later pair for the same key wins
+    input.push_back({7, 70});
+    test->upsert_batch(input.begin(), input.end());
+
+    std::vector<int32_t> keys;
+    for (int32_t i=1; i<=1000; i++) {
+        keys.push_back(i);
+    }
+
+    std::vector<int32_t> values(keys.size());
+    bool *found = new bool[keys.size()];
+    ck_assert_int_eq(test->get_batch(keys.begin(), keys.end(), values.data(), found), 500);
+    for (size_t i=0; i<keys.size(); i++) {
+        ck_assert_int_eq(found[i], keys[i] <= 500);
+        if (found[i]) ck_assert_int_eq(values[i], (keys[i] == 7) ? 70 : keys[i]);
+    }
+
+    bool *removed = new bool[keys.size()];
+    ck_assert_int_eq(test->remove_batch(keys.begin() + 250, keys.end(), removed), 250);
+    ck_assert_int_eq(removed[0], true);
+    ck_assert_int_eq(removed[500], false);
+    ck_assert_int_eq(test->contains(250), true);
+    ck_assert_int_eq(test->contains(251), false);
+
+    delete[] found;
+    delete[] removed;
+    delete test;
+}
+END_TEST
+
+
+START_TEST(wide_elements)
+{
+    // with 16 byte elements, a bucket's slots don't fill it exactly
+    auto test = new HashTable<int64_t, int64_t>(10);
+
+    for (int64_t i=1; i<=500; i++) {
+        test->insert(i << 33, i);
+    }
+    for (int64_t i=1; i<=500; i++) {
+        ck_assert_int_eq(test->get(i << 33), i);
+    }
+    ck_assert_int_eq(test->contains(1), false);
+    test->remove(1l << 33);
+    ck_assert_int_eq(test->contains(1l << 33), false);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(expiry_test)
+{
+    typedef Expiring<int64_t> timed;
+
+    // two elements to a bucket, so a single bucket makes a long chain
+    auto test = new HashTable<int64_t, timed>(1);
+
+    // odd keys expire almost straight away
+    for (int64_t i=1; i<=10; i++) {
+        test->insert(i, (i % 2) ? timed::after(i, std::chrono::milliseconds(50))
+                                : timed::never(i));
+    }
+    ck_assert_int_eq(test->contains(1), true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    for (int64_t i=1; i<=10; i++) {
+        timed val;
+        ck_assert_int_eq(test->try_get(i, &val), i % 2 == 0);
+        if (i % 2 == 0) ck_assert_int_eq(val.value, i);
+    }
+
+    bool error = false;
+    try {
+        test->get(1);
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    size_t cnt = 0;
+    for (auto element : *test) {
+        ck_assert_int_eq(element.first % 2, 0);
+        cnt++;
+    }
+    ck_assert_int_eq(cnt, 5);
+    ck_assert_int_eq(test->analyze().elements, 5);
+
+    // an insert treats an expired key as absent...
+    ck_assert_int_eq(test->insert(1, timed::never(100)).value, 100);
+    ck_assert_int_eq(test->get(1).value, 100);
+
+    // ...and reuses expired slots rather than growing the chain
+    off_t len = test->get_io_handler()->get_flen();
+    test->insert(11, timed::never(11));
+    test->insert(12, timed::never(12));
+    ck_assert_int_eq(test->get_io_handler()->get_flen(), len);
+    ck_assert_int_eq(test->get(11).value, 11);
+
+    // removing an expired key reports that it wasn't there
+    ck_assert_int_eq(test->try_remove(9), false);
+
+    // an expiry time can be pushed back by replacing the value
+    test->upsert(13, timed::after(13, std::chrono::milliseconds(50)));
+    test->upsert(13, timed::after(13, std::chrono::hours(1)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ck_assert_int_eq(test->get(13).value, 13);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(sweep_test)
+{
+    typedef Expiring<int64_t> timed;
+    auto test = new HashTable<int64_t, timed>(10);
+    test->enable_cache(100);
+
+    for (int64_t i=1; i<=1000; i++) {
+        test->insert(i, (i % 2) ? timed::after(i, std::chrono::milliseconds(50))
+                                : timed::never(i));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // the two halves of the table, then nothing left to find
+    size_t reclaimed = test->sweep(5);
+    ck_assert_int_gt(reclaimed, 0);
+    ck_assert_int_lt(reclaimed, 500);
+    ck_assert_int_eq(reclaimed + test->sweep(5), 500);
+    ck_assert_int_eq(test->sweep(100), 0);
+
+    for (int64_t i=2; i<=1000; i+=2) {
+        ck_assert_int_eq(test->get(i).value, i);
+    }
+
+    for (int64_t i=1001; i<=1500; i++) {
+        test->insert(i, timed::after(i, std::chrono::milliseconds(50)));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    test->start_sweeper(1000);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    test->stop_sweeper();
+    ck_assert_int_eq(test->sweep(10), 0);
+
+    delete test;
+
+    // tables that don't expire have nothing to sweep
+    auto plain = new HashTable<int64_t, int64_t>(10);
+    plain->insert(1, 1);
+    plain->start_sweeper(1000);
+    ck_assert_int_eq(plain->sweep(10), 0);
+    ck_assert_int_eq(plain->get(1), 1);
+    delete plain;
+}
+END_TEST
+
+
+START_TEST(transaction_test)
+{
+    auto test = new HashTable<int64_t, int64_t>(10);
+    for (int64_t i=1; i<=10; i++) {
+        test->insert(i, 100);
+    }
+
+    auto txn = test->begin_transaction();
+    txn.put(1, txn.get(1) - 30);
+    txn.put(2, txn.get(2) + 30);
+    txn.remove(3);
+    txn.put(11, 5);
+
+    // the transaction sees its own writes, and nobody else does yet
+    ck_assert_int_eq(txn.get(1), 70);
+    ck_assert_int_eq(txn.contains(3), false);
+    ck_assert_int_eq(test->get(1), 100);
+    ck_assert_int_eq(test->contains(11), false);
+
+    ck_assert_int_eq(txn.commit(), true);
+    ck_assert_int_eq(test->get(1), 70);
+    ck_assert_int_eq(test->get(2), 130);
+    ck_assert_int_eq(test->contains(3), false);
+    ck_assert_int_eq(test->get(11), 5);
+
+    // a change to something read makes the commit fail, changing nothing
+    txn.put(4, txn.get(5) + 1);
+    test->upsert(5, 0);
+    ck_assert_int_eq(txn.commit(), false);
+    ck_assert_int_eq(test->get(4), 100);
+
+    // and so does adding a key that was read as missing
+    ck_assert_int_eq(txn.contains(12), false);
+    txn.put(4, 1);
+    test->insert(12, 12);
+    ck_assert_int_eq(txn.commit(), false);
+    ck_assert_int_eq(test->get(4), 100);
+
+    // but writes alone never conflict
+    txn.put(4, 1);
+    test->upsert(4, 2);
+    ck_assert_int_eq(txn.commit(), true);
+    ck_assert_int_eq(test->get(4), 1);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(transaction_concurrent)
+{
+    // transfers between accounts never create or destroy money
+    const int64_t accounts = 8;
+    auto test = new HashTable<int64_t, int64_t>(4);
+    for (int64_t i=1; i<=accounts; i++) {
+        test->insert(i, 1000);
+    }
+
+    std::vector<std::thread> workers;
+    for (int t=0; t<4; t++) {
+        workers.emplace_back([test, t]() {
+            unsigned seed = t;
+            for (int i=0; i<2000; i++) {
+                int64_t from = 1 + rand_r(&seed) % accounts;
+                int64_t to = 1 + rand_r(&seed) % accounts;
+                if (from == to) continue;
+
+                auto txn = test->begin_transaction();
+                do {
+                    txn.put(from, txn.get(from) - 1);
+                    txn.put(to, txn.get(to) + 1);
+                } while (!txn.commit());
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    int64_t total = 0;
+    for (int64_t i=1; i<=accounts; i++) {
+        total += test->get(i);
+    }
+    ck_assert_int_eq(total, accounts * 1000);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(mvcc_test)
+{
+    auto test = new HashTable<int64_t, int64_t>(4);
+    for (int64_t i=1; i<=100; i++) {
+        test->insert(i, i);
+    }
+
+    {
+        auto view = test->pin();
+        ck_assert_int_eq(test->get_version_count(), 0);
+
+        test->upsert(1, 101);
+        test->upsert(1, 201);
+        test->remove(2);
+        test->insert(101, 101);
+        test->insert(3, 3);
+
+        // the view still sees the table as it was when it was pinned
+        ck_assert_int_eq(view.get(1), 1);
+        ck_assert_int_eq(view.get(2), 2);
+        ck_assert_int_eq(view.contains(101), false);
+        ck_assert_int_eq(view.get(50), 50);
+        ck_assert_int_eq(test->get(1), 201);
+        ck_assert_int_eq(test->contains(2), false);
+
+        // only the first change to a key in an epoch is kept
+        ck_assert_int_eq(test->get_version_count(), 3);
+
+        std::vector<int> seen(102, 0);
+        view.for_each([&seen](int64_t key, int64_t val) {
+            ck_assert_int_eq(key, val);
+            seen[key]++;
+        });
+        for (int64_t i=1; i<=100; i++) {
+            ck_assert_int_eq(seen[i], 1);
+        }
+        ck_assert_int_eq(seen[101], 0);
+
+        {
+            // a later view sees the later state, and its own changes
+            auto later = test->pin();
+            ck_assert_int_gt(later.get_epoch(), view.get_epoch());
+            ck_assert_int_eq(later.get(1), 201);
+            ck_assert_int_eq(later.contains(2), false);
+
+            test->upsert(1, 301);
+            ck_assert_int_eq(later.get(1), 201);
+            ck_assert_int_eq(view.get(1), 1);
+            ck_assert_int_eq(test->get_version_count(), 4);
+        }
+
+        // the image made for the later view outlives it, as the first one
+        // still needs the images before it
+        ck_assert_int_eq(test->get_version_count(), 4);
+        ck_assert_int_eq(view.get(1), 1);
+    }
+
+    ck_assert_int_eq(test->get_version_count(), 0);
+
+    // with nothing pinned, nothing is kept
+    test->upsert(1, 1);
+    ck_assert_int_eq(test->get_version_count(), 0);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(mvcc_concurrent)
+{
+    // a scan never sees a transfer half done
+    const int64_t accounts = 64;
+    auto test = new HashTable<int64_t, int64_t>(4);
+    for (int64_t i=1; i<=accounts; i++) {
+        test->insert(i, 1000);
+    }
+
+    std::atomic<bool> done(false);
+    std::thread writer([test, &done]() {
+        unsigned seed = 1;
+        while (!done.load()) {
+            int64_t from = 1 + rand_r(&seed) % accounts;
+            int64_t to = 1 + rand_r(&seed) % accounts;
+            if (from == to) continue;
+
+            auto txn = test->begin_transaction();
+            do {
+                txn.put(from, txn.get(from) - 1);
+                txn.put(to, txn.get(to) + 1);
+            } while (!txn.commit());
+        }
+    });
+
+    for (int i=0; i<200; i++) {
+        auto view = test->pin();
+        int64_t total = 0;
+        int64_t count = 0;
+        view.for_each([&total, &count](int64_t, int64_t val) {
+            total += val;
+            count++;
+        });
+        ck_assert_int_eq(count, accounts);
+        ck_assert_int_eq(total, accounts * 1000);
+    }
+
+    done.store(true);
+    writer.join();
+    ck_assert_int_eq(test->get_version_count(), 0);
+
+    delete test;
+}
+END_TEST
+
 Suite *test_suite()
 {
     Suite *suite = suite_create("HashTable Tests");
@@ -219,6 +899,24 @@ Suite *test_suite()
     tcase_add_test(basic, read_test);
     tcase_add_test(basic, remove_test);
     tcase_add_test(basic, remove_miss);
+    tcase_add_test(basic, iterate_test);
+    tcase_add_test(basic, iterate_empty);
+    tcase_add_test(basic, parallel_scan);
+    tcase_add_test(basic, snapshot_test);
+    tcase_add_test(basic, analyze_test);
+    tcase_add_test(basic, try_get_test);
+    tcase_add_test(basic, filter_test);
+    tcase_add_test(basic, upsert_test);
+    tcase_add_test(basic, cache_test);
+    tcase_add_test(basic, compact_test);
+    tcase_add_test(basic, batch_test);
+    tcase_add_test(basic, wide_elements);
+    tcase_add_test(basic, expiry_test);
+    tcase_add_test(basic, sweep_test);
+    tcase_add_test(basic, transaction_test);
+    tcase_add_test(basic, transaction_concurrent);
+    tcase_add_test(basic, mvcc_test);
+    tcase_add_test(basic, mvcc_concurrent);
 
     tcase_add_test(basic, destroy);
 
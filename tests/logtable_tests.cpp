@@ -0,0 +1,307 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <map>
+#include <random>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dstruct/logtable.hpp"
+
+using namespace std;
+
+const char *log_dir = "./tests/data/logtable";
+
+// 100 records of <uint64_t, uint64_t> to a segment
+const size_t record_bytes = 1 + 2 * sizeof(uint64_t);
+const size_t segment_bytes = 100 * record_bytes;
+
+
+static void clear_log()
+{
+    DIR *listing = opendir(log_dir);
+    if (!listing) return;
+
+    while (dirent *entry = readdir(listing)) {
+        if (entry->d_name[0] == '.') continue;
+        unlink((string(log_dir) + "/" + entry->d_name).c_str());
+    }
+    closedir(listing);
+}
+
+
+static off_t file_size(string path)
+{
+    struct stat buf;
+    if (stat(path.c_str(), &buf) == -1) return -1;
+    return buf.st_size;
+}
+
+
+START_TEST(insert_get_remove)
+{
+    clear_log();
+    auto test = new LogHashTable<uint64_t, uint64_t>(log_dir);
+
+    for (uint64_t i=0; i<100; i++) {
+        ck_assert_int_eq(test->insert(i, i * 7), i * 7);
+    }
+
+    // duplicate inserts return the value already there, upserts replace it
+    ck_assert_int_eq(test->insert(5, 1), 35);
+    ck_assert_int_eq(test->upsert(6, 1), 1);
+    ck_assert_int_eq(test->get(6), 1);
+
+    for (uint64_t i=0; i<100; i++) {
+        if (i != 6) ck_assert_int_eq(test->get(i), i * 7);
+    }
+    ck_assert_int_eq(test->size(), 100);
+
+    // unlike HashTable, {0, 0} can be stored
+    ck_assert_int_eq(test->contains(0), true);
+    ck_assert_int_eq(test->get(0), 0);
+
+    test->remove(50);
+    ck_assert_int_eq(test->contains(50), false);
+    ck_assert_int_eq(test->try_remove(50), false);
+    bool error = false;
+    try {
+        test->get(50);
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    error = false;
+    try {
+        test->remove(50);
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    // 100 inserts, an upsert and a remove
+    ck_assert_int_eq(test->get_log_bytes(), 102 * record_bytes);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(recovery)
+{
+    clear_log();
+    auto test = new LogHashTable<uint64_t, uint64_t>(log_dir, segment_bytes);
+
+    std::map<uint64_t, uint64_t> expected;
+    std::mt19937 rng(11);
+    size_t records = 0;
+    for (int i=0; records<5000; i++) {
+        uint64_t key = rng() % 500;
+        records++;
+        if (rng() % 4 == 0) {
+            // removing a key that isn't there doesn't need a record
+            if (!test->try_remove(key)) records--;
+            expected.erase(key);
+        } else {
+            test->upsert(key, i);
+            expected[key] = i;
+        }
+    }
+
+    // every segment but the head is full, and none of it was rewritten
+    ck_assert_int_eq(test->get_segment_count(), 50);
+    ck_assert_int_eq(test->get_log_bytes(), 5000 * record_bytes);
+    delete test;
+
+    test = new LogHashTable<uint64_t, uint64_t>(log_dir, segment_bytes);
+    ck_assert_int_eq(test->size(), expected.size());
+    for (auto &element : expected) {
+        ck_assert_int_eq(test->get(element.first), element.second);
+    }
+
+    // and it carries on where it left off
+    test->upsert(1000, 1);
+    delete test;
+
+    test = new LogHashTable<uint64_t, uint64_t>(log_dir, segment_bytes);
+    ck_assert_int_eq(test->get(1000), 1);
+    ck_assert_int_eq(test->get_segment_count(), 51);
+    delete test;
+}
+END_TEST
+
+
+START_TEST(torn_tail)
+{
+    clear_log();
+    auto test = new LogHashTable<uint64_t, uint64_t>(log_dir, segment_bytes);
+    for (uint64_t i=0; i<150; i++) {
+        test->insert(i, i);
+    }
+    delete test;
+
+    // half of a record, as though a crash cut it short
+    string head = string(log_dir) + "/0000000001.log";
+    ck_assert_int_eq(file_size(head), 50 * record_bytes);
+    byte partial[record_bytes / 2];
+    memset(partial, 1, sizeof(partial));
+    int fd = open(head.c_str(), O_WRONLY | O_APPEND);
+    write(fd, partial, sizeof(partial));
+    close(fd);
+
+    test = new LogHashTable<uint64_t, uint64_t>(log_dir, segment_bytes);
+    ck_assert_int_eq(test->size(), 150);
+    ck_assert_int_eq(file_size(head), 50 * record_bytes);
+    test->insert(150, 150);
+    delete test;
+
+    // and a zeroed one, as the file grew but the write never landed
+    byte zeroes[2 * record_bytes] = {0};
+    fd = open(head.c_str(), O_WRONLY | O_APPEND);
+    write(fd, zeroes, sizeof(zeroes));
+    close(fd);
+
+    test = new LogHashTable<uint64_t, uint64_t>(log_dir, segment_bytes);
+    ck_assert_int_eq(test->size(), 151);
+    ck_assert_int_eq(file_size(head), 51 * record_bytes);
+    for (uint64_t i=0; i<=150; i++) {
+        ck_assert_int_eq(test->get(i), i);
+    }
+    delete test;
+}
+END_TEST
+
+
+START_TEST(compaction)
+{
+    clear_log();
+    auto test = new LogHashTable<uint64_t, uint64_t>(log_dir, segment_bytes, 0.5);
+
+    // a few keys that never change, then a lot of churn on a few others
+    for (uint64_t i=0; i<20; i++) {
+        test->insert(1000 + i, i);
+    }
+    for (uint64_t i=0; i<2000; i++) {
+        test->upsert(i % 50, i);
+    }
+    for (uint64_t i=0; i<50; i+=2) {
+        test->remove(i);
+    }
+
+    size_t before = test->get_segment_count();
+    ck_assert_int_eq(test->get_dead_ratio() > 0.9, true);
+
+    size_t reclaimed = test->compact();
+    ck_assert_int_gt(reclaimed, 0);
+    ck_assert_int_eq(test->get_segment_count(), before - reclaimed);
+    ck_assert_int_lt(test->get_log_bytes(), 200 * record_bytes);
+
+    // nothing left that is worth compacting
+    ck_assert_int_eq(test->compact(), 0);
+
+    auto check = [](LogHashTable<uint64_t, uint64_t> *table) {
+        ck_assert_int_eq(table->size(), 45);
+        for (uint64_t i=0; i<20; i++) {
+            ck_assert_int_eq(table->get(1000 + i), i);
+        }
+        for (uint64_t i=0; i<50; i++) {
+            if (i % 2) {
+                ck_assert_int_eq(table->get(i), 1950 + i);
+            } else {
+                ck_assert_int_eq(table->contains(i), false);
+            }
+        }
+    };
+
+    check(test);
+    delete test;
+
+    // the removes stay removed, although their records are gone
+    test = new LogHashTable<uint64_t, uint64_t>(log_dir, segment_bytes, 0.5);
+    check(test);
+    delete test;
+}
+END_TEST
+
+
+START_TEST(background)
+{
+    clear_log();
+    auto test = new LogHashTable<uint64_t, uint64_t>(log_dir, segment_bytes, 0.5);
+    test->start_compactor(std::chrono::milliseconds(1));
+
+    for (uint64_t i=0; i<50000; i++) {
+        test->upsert(i % 100, i);
+    }
+
+    // give the compactor a chance to catch up
+    for (int i=0; i<500 && test->get_segment_count() > 5; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ck_assert_int_le(test->get_segment_count(), 5);
+
+    for (uint64_t i=0; i<100; i++) {
+        ck_assert_int_eq(test->get(i), 49900 + i);
+    }
+
+    test->stop_compactor();
+    delete test;
+
+    test = new LogHashTable<uint64_t, uint64_t>(log_dir, segment_bytes, 0.5);
+    for (uint64_t i=0; i<100; i++) {
+        ck_assert_int_eq(test->get(i), 49900 + i);
+    }
+    delete test;
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("Log HashTable Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, insert_get_remove);
+    tcase_add_test(basic, recovery);
+    tcase_add_test(basic, torn_tail);
+    tcase_add_test(basic, compaction);
+    tcase_add_test(basic, background);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
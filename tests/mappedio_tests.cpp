@@ -0,0 +1,279 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "io/mapped.hpp"
+#include "io/raw.hpp"
+#include "io/epoch.hpp"
+#include "io/exceptions.hpp"
+#include "dstruct/hashtable.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+const char *test_file = "./tests/data/testfile_mapped.store";
+const char *missing_file = "./tests/data/missing_mapped.store";
+const char *fail_dir = "./tests/data/faildir";
+const char *read_file = "./tests/data/readtest_mapped.store";
+const char *table_file = "./tests/data/table_mapped.store";
+
+
+START_TEST(create_succeed)
+{
+    IOHandler *test;
+    bool error = false;
+
+    try {
+        test = new MappedIOHandler(read_file);
+    } catch (IOException& e) {
+        error = true;
+    }
+
+    ck_assert_int_eq(error, false);
+    ck_assert_int_ne(test->get_fd(), 0);
+    ck_assert_int_eq(test->get_flen(), 108);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(create_fail)
+{
+    bool error = false;
+
+    try {
+        new MappedIOHandler(missing_file);
+    } catch (IOException& e) {
+        error = true;
+    }
+
+    ck_assert_int_eq(error, true);
+}
+END_TEST
+
+
+START_TEST(create_fail_nonnorm)
+{
+    bool error = false;
+
+    try {
+        new MappedIOHandler(fail_dir);
+    } catch (IOException& e) {
+        error = true;
+    }
+
+    ck_assert_int_eq(error, true);
+}
+END_TEST
+
+
+START_TEST(read_test)
+{
+    IOHandler *test;
+    bool error = false;
+    int count = 0;
+    const int buffsize = 19;
+
+    test = new MappedIOHandler(read_file);
+
+    byte *read_buffer = new byte[buffsize];
+    const char *ground_truth = "1 2 3 4 5 6 7 8 9 0";
+
+    try {
+        count = test->read(read_buffer, buffsize, 28);
+    } catch (IOException& e) {
+        error = true;
+    }
+
+    ck_assert_int_eq(error, false);
+    ck_assert_int_eq(count, buffsize);
+    ck_assert_int_eq(memcmp(ground_truth, read_buffer, buffsize), 0);
+
+    delete test;
+    delete[] read_buffer;
+}
+END_TEST
+
+
+START_TEST(read_past_end)
+{
+    IOHandler *test;
+    bool error = false;
+    byte read_buffer[10];
+
+    test = new MappedIOHandler(read_file);
+
+    try {
+        test->read(read_buffer, 10, 100);
+    } catch (IOException& e) {
+        error = true;
+    }
+
+    ck_assert_int_eq(error, true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(write_fail)
+{
+    IOHandler *test;
+    bool error = false;
+    char write_buffer[] = "nope";
+
+    test = new MappedIOHandler(read_file);
+
+    try {
+        test->write(write_buffer, 4, 0);
+    } catch (IOException& e) {
+        error = true;
+    }
+
+    ck_assert_int_eq(error, true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(refresh_test)
+{
+    IOHandler *writer = new RawIOHandler(test_file);
+    writer->truncate(0);
+
+    char first[] = "first version";
+    writer->write(first, sizeof(first), 0);
+
+    IOHandler *test = new MappedIOHandler(test_file);
+    ck_assert_int_eq(test->get_flen(), sizeof(first));
+
+    // nothing has been published, so there's nothing to pick up
+    ck_assert_int_eq(test->refresh(), false);
+
+    char second[] = "and a second, longer, one";
+    writer->write(second, sizeof(second), sizeof(first));
+
+    Epoch *epoch = new Epoch(test_file, true);
+    epoch->advance();
+
+    ck_assert_int_eq(test->refresh(), true);
+    ck_assert_int_eq(test->get_flen(), sizeof(first) + sizeof(second));
+
+    byte read_buffer[sizeof(second)];
+    test->read(read_buffer, sizeof(second), sizeof(first));
+    ck_assert_int_eq(memcmp(read_buffer, second, sizeof(second)), 0);
+
+    ck_assert_int_eq(test->refresh(), false);
+
+    delete epoch;
+    delete test;
+    delete writer;
+}
+END_TEST
+
+
+START_TEST(unpublished)
+{
+    unlink(table_file);
+    auto writer = new HashTable<int32_t, int32_t>(table_file, 16);
+    writer->publish();
+    auto reader = new HashTable<int32_t, int32_t>(table_file, 16, open_t::READ_ONLY);
+
+    // far more than fits in the primary buckets, so the writer grows the
+    // file, but none of it is published
+    size_t visible = 0;
+    size_t errors = 0;
+    for (int32_t i=1; i<=5000; i++) {
+        writer->insert(i, i);
+
+        try {
+            reader->get(i);
+            visible++;
+        } catch (KeyNotFoundException &e) {
+            // not published yet, as it should be
+        } catch (IOException &e) {
+            errors++;
+        }
+    }
+    ck_assert_int_eq(visible, 0);
+    ck_assert_int_eq(errors, 0);
+
+    writer->publish();
+    for (int32_t i=1; i<=5000; i++) {
+        ck_assert_int_eq(reader->get(i), i);
+    }
+
+    delete reader;
+    delete writer;
+}
+END_TEST
+
+
+START_TEST(destroy)
+{
+    IOHandler *test;
+
+    test = new MappedIOHandler(read_file);
+
+    fd_t fd = test->get_fd();
+
+    delete test;
+
+    // verify that fd is no longer valid
+    int valid = fcntl(fd, F_GETFD);
+    ck_assert_int_eq(valid, -1);
+    ck_assert_int_eq(errno, EBADF);
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("MappedIO Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, create_succeed);
+    tcase_add_test(basic, create_fail);
+    tcase_add_test(basic, create_fail_nonnorm);
+    tcase_add_test(basic, read_test);
+    tcase_add_test(basic, read_past_end);
+    tcase_add_test(basic, write_fail);
+    tcase_add_test(basic, refresh_test);
+    tcase_add_test(basic, unpublished);
+    tcase_add_test(basic, destroy);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -2,6 +2,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <string>
+#include <cstring>
 #include "io/mem.hpp"
 #include "io/exceptions.hpp"
 #include <fcntl.h>
@@ -196,6 +197,44 @@ START_TEST(bulk_write)
 END_TEST
 
 
+START_TEST(snapshot_read)
+{
+    IOHandler *test;
+    const int buffsize = 300;
+
+    test = new MemIOHandler(64);
+    char *old_data = new char[buffsize];
+    char *new_data = new char[buffsize];
+    memset(old_data, 'a', buffsize);
+    memset(new_data, 'b', buffsize);
+
+    test->write(old_data, buffsize, 0);
+    ck_assert_int_eq(test->begin_snapshot(), true);
+
+    // overwrite part of the snapshotted region, and extend past it
+    test->write(new_data, buffsize, 150);
+
+    byte *read_buffer = new byte[buffsize];
+
+    test->snapshot_read(read_buffer, buffsize, 0);
+    ck_assert_int_eq(memcmp(read_buffer, old_data, buffsize), 0);
+
+    test->read(read_buffer, buffsize, 150);
+    ck_assert_int_eq(memcmp(read_buffer, new_data, buffsize), 0);
+
+    // once the snapshot is over, snapshot_read sees the current data
+    test->end_snapshot();
+    test->snapshot_read(read_buffer, buffsize, 150);
+    ck_assert_int_eq(memcmp(read_buffer, new_data, buffsize), 0);
+
+    delete test;
+    delete[] old_data;
+    delete[] new_data;
+    delete[] read_buffer;
+}
+END_TEST
+
+
 Suite *test_suite()
 {
     Suite *suite = suite_create("RawIO Tests");
@@ -209,6 +248,7 @@ Suite *test_suite()
     tcase_add_test(basic, write_hole);
     tcase_add_test(basic, read_hole);
     tcase_add_test(basic, write_read);
+    tcase_add_test(basic, snapshot_read);
     tcase_add_test(basic, bulk_write);
     tcase_set_timeout(basic, 10000);
 
@@ -6,6 +6,7 @@
 #include "io/exceptions.hpp"
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 
 // TODO: Figure out how to force pread/pwrite to return only a partial
@@ -97,7 +98,7 @@ START_TEST(write_test)
     const int buffsize = 45;
 
     test = new RawIOHandler(test_file);
-    ftruncate(test->get_fd(), 0);
+    test->truncate(0);
 
     char *test_data = new char[buffsize];
     strncpy(test_data, "hello world 1 2 3 4 5", buffsize);
@@ -125,7 +126,7 @@ START_TEST(write_hole)
     const int buffsize = 45;
 
     test = new RawIOHandler(test_file);
-    ftruncate(test->get_fd(), 0);
+    test->truncate(0);
 
     ck_assert_int_eq(test->get_flen(), 0);
     char *test_data = new char[buffsize];
@@ -184,7 +185,7 @@ START_TEST(write_read)
     const int buffsize = 45;
 
     test = new RawIOHandler(test_file);
-    ftruncate(test->get_fd(), 0);
+    test->truncate(0);
 
     char *write_buffer = new char[buffsize];
     strncpy(write_buffer, "hello world 1 2 3 4 5", buffsize);
@@ -218,6 +219,78 @@ START_TEST(write_read)
 END_TEST
 
 
+START_TEST(length_tracking)
+{
+    RawIOHandler *test;
+    const int buffsize = 45;
+    struct stat buf;
+
+    test = new RawIOHandler(test_file);
+    test->truncate(0);
+
+    char *test_data = new char[buffsize];
+    memset(test_data, 'x', buffsize);
+
+    // the length is tracked in process, and preallocation runs ahead of it
+    // without changing the size of the file as seen by anyone else
+    test->write(test_data, buffsize, 1000);
+    ck_assert_int_eq(test->get_flen(), 1000 + buffsize);
+    fstat(test->get_fd(), &buf);
+    ck_assert_int_eq(buf.st_size, 1000 + buffsize);
+
+    test->truncate(10);
+    ck_assert_int_eq(test->get_flen(), 10);
+    fstat(test->get_fd(), &buf);
+    ck_assert_int_eq(buf.st_size, 10);
+
+    // reads past the new end should fail
+    bool error = false;
+    try {
+        test->read(test_data, buffsize, 0);
+    } catch (IOException& e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    delete test;
+    delete[] test_data;
+}
+END_TEST
+
+
+START_TEST(advise_test)
+{
+    RawIOHandler *test;
+    const size_t len = 4 << 20;
+
+    test = new RawIOHandler(test_file);
+    test->truncate(0);
+
+    byte *data = new byte[len];
+    for (size_t i=0; i<len; i++) {
+        data[i] = i % 251;
+    }
+    test->write(data, len, 0);
+
+    // hints change how the file is cached, never what is read from it
+    access_t hints[] = {access_t::SEQUENTIAL, access_t::ONCE, access_t::RANDOM};
+    byte *block = new byte[4096];
+    for (auto hint : hints) {
+        test->advise(0, len, hint);
+        for (size_t offset=0; offset<len; offset+=4096) {
+            test->read(block, 4096, offset);
+            ck_assert_int_eq(memcmp(block, data + offset, 4096), 0);
+        }
+        test->advise(0, len, access_t::NORMAL);
+    }
+
+    delete test;
+    delete[] block;
+    delete[] data;
+}
+END_TEST
+
+
 Suite *test_suite()
 {
     Suite *suite = suite_create("RawIO Tests");
@@ -231,6 +304,8 @@ Suite *test_suite()
     tcase_add_test(basic, write_hole);
     tcase_add_test(basic, read_test);
     tcase_add_test(basic, write_read);
+    tcase_add_test(basic, length_tracking);
+    tcase_add_test(basic, advise_test);
     tcase_add_test(basic, destroy);
 
     // TODO: Add stress testing
@@ -0,0 +1,298 @@
+#include <check.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "net/primary.hpp"
+#include "net/replica.hpp"
+
+using namespace std;
+
+const char *replica_fname = "./tests/data/replica.store";
+const char *scratch = "./tests/data/primary";
+
+
+/*
+ * A primary and a replica of table, each running on its own thread for
+ * as long as the fixture is alive.
+ */
+struct Replicating
+{
+    ReplicationPrimary *primary;
+    Replica *replica;
+    std::thread primary_thread;
+    std::thread replica_thread;
+
+    Replicating(ServedTable *table)
+    {
+        this->primary = new ReplicationPrimary(table, scratch);
+        this->replica = new Replica(replica_fname, "127.0.0.1", this->primary->get_port(),
+                std::chrono::milliseconds(0));
+        this->primary_thread = std::thread([this]() { this->primary->run(); });
+        this->start_replica();
+    }
+
+    void start_replica()
+    {
+        this->replica_thread = std::thread([this]() { this->replica->run(); });
+    }
+
+    void stop_replica()
+    {
+        this->replica->stop();
+        this->replica_thread.join();
+    }
+
+    ~Replicating()
+    {
+        this->stop_replica();
+        this->primary->stop();
+        this->primary_thread.join();
+        delete this->replica;
+        delete this->primary;
+    }
+};
+
+
+/*
+ * Wait up to 10 seconds for done to be true.
+ */
+static bool wait_for(std::function<bool()> done)
+{
+    auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!done()) {
+        if (std::chrono::steady_clock::now() > give_up) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    return true;
+}
+
+
+static bool caught_up(ServedTable *table, Replica *replica)
+{
+    return wait_for([table, replica]() {
+        return replica->get_bucket_count() &&
+               replica->get_applied() == table->get_change_log()->get_next_seq();
+    });
+}
+
+
+START_TEST(change_log)
+{
+    auto table = new ServedTable(100);
+    table->enable_change_log(4);
+    auto log = table->get_change_log();
+    ck_assert_int_eq(log->get_next_seq(), 1);
+
+    table->insert(1, 2);
+    table->insert(1, 3);
+    table->upsert(1, 5);
+    table->remove(1);
+    ck_assert_int_eq(table->try_remove(1), false);
+
+    // only the calls that changed something are logged, with the value the
+    // key was left with
+    std::vector<ServedChange> changes;
+    ck_assert_int_eq(log->read(1, 10, changes, std::chrono::milliseconds(0)), true);
+    ck_assert_int_eq(changes.size(), 3);
+    ck_assert_int_eq(changes[0].kind == change_t::PUT, true);
+    ck_assert_int_eq(changes[0].val, 2);
+    ck_assert_int_eq(changes[1].kind == change_t::PUT, true);
+    ck_assert_int_eq(changes[1].val, 5);
+    ck_assert_int_eq(changes[2].kind == change_t::REMOVE, true);
+    ck_assert_int_eq(changes[2].key, 1);
+
+    // reading from the end waits, and then finds nothing
+    changes.clear();
+    ck_assert_int_eq(log->read(4, 10, changes, std::chrono::milliseconds(10)), true);
+    ck_assert_int_eq(changes.size(), 0);
+
+    // the oldest changes are dropped past capacity
+    table->insert(2, 1);
+    table->insert(3, 1);
+    ck_assert_int_eq(log->retains(1), false);
+    ck_assert_int_eq(log->read(1, 10, changes, std::chrono::milliseconds(0)), false);
+    ck_assert_int_eq(log->retains(3), true);
+    ck_assert_int_eq(log->retains(log->get_next_seq()), true);
+    ck_assert_int_eq(log->retains(log->get_next_seq() + 1), false);
+
+    delete table;
+}
+END_TEST
+
+
+START_TEST(needs_log)
+{
+    auto table = new ServedTable(100);
+
+    bool thrown = false;
+    try {
+        ReplicationPrimary primary(table, scratch);
+    } catch (std::invalid_argument &) {
+        thrown = true;
+    }
+    ck_assert_int_eq(thrown, true);
+
+    delete table;
+}
+END_TEST
+
+
+START_TEST(initial_sync)
+{
+    auto table = new ServedTable(100);
+    table->enable_change_log(1000);
+    for (uint64_t i=1; i<=2000; i++) table->insert(i, i * 3);
+
+    auto replicating = new Replicating(table);
+    auto replica = replicating->replica;
+    ck_assert_int_eq(caught_up(table, replica), true);
+    ck_assert_int_eq(replica->get_bucket_count(), 100);
+    ck_assert_int_eq(replica->get_sync_count(), 1);
+    ck_assert_int_eq(replica->get_lag(), 0);
+
+    // readers of the replica's file, here or in any other process, see the
+    // whole table
+    auto reader = new ServedTable(replica_fname, 100, open_t::READ_ONLY);
+    for (uint64_t i=1; i<=2000; i++) {
+        uint64_t val;
+        ck_assert_int_eq(reader->try_get(i, &val), true);
+        ck_assert_int_eq(val, i * 3);
+    }
+
+    delete reader;
+    delete replicating;
+    delete table;
+}
+END_TEST
+
+
+START_TEST(streaming)
+{
+    auto table = new ServedTable(100);
+    table->enable_change_log(1 << 16);
+    for (uint64_t i=1; i<=100; i++) table->insert(i, i);
+
+    auto replicating = new Replicating(table);
+    auto replica = replicating->replica;
+    ck_assert_int_eq(caught_up(table, replica), true);
+    auto reader = new ServedTable(replica_fname, 100, open_t::READ_ONLY);
+
+    for (uint64_t i=1; i<=100; i+=2) table->remove(i);
+    for (uint64_t i=1; i<=1000; i++) table->upsert(i + 50, i * 7);
+    std::vector<std::pair<uint64_t, uint64_t>> batch;
+    for (uint64_t i=2000; i<2100; i++) batch.emplace_back(i, 1);
+    table->upsert_batch(batch.begin(), batch.end());
+
+    ck_assert_int_eq(caught_up(table, replica), true);
+    ck_assert_int_eq(replica->get_sync_count(), 1);
+
+    size_t cnt = 0;
+    for (auto element : *table) {
+        uint64_t val;
+        ck_assert_int_eq(reader->try_get(element.first, &val), true);
+        ck_assert_int_eq(val, element.second);
+        cnt++;
+    }
+    ck_assert_int_eq(cnt, 25 + 1000 + 100);
+    for (uint64_t i=1; i<50; i+=2) ck_assert_int_eq(reader->contains(i), false);
+
+    // the primary hears about it too
+    ck_assert_int_eq(wait_for([replicating]() {
+        auto replicas = replicating->primary->get_replicas();
+        return replicas.size() == 1 && replicas[0].synced && replicas[0].lag == 0;
+    }), true);
+
+    delete reader;
+    delete replicating;
+    delete table;
+}
+END_TEST
+
+
+START_TEST(reconnect)
+{
+    auto table = new ServedTable(100);
+    table->enable_change_log(100);
+    for (uint64_t i=1; i<=50; i++) table->insert(i, i);
+
+    auto replicating = new Replicating(table);
+    auto replica = replicating->replica;
+    ck_assert_int_eq(caught_up(table, replica), true);
+
+    // a replica that misses a few changes picks up where it left off
+    replicating->stop_replica();
+    for (uint64_t i=1; i<=50; i++) table->upsert(i, i + 1);
+    replicating->start_replica();
+    ck_assert_int_eq(caught_up(table, replica), true);
+    ck_assert_int_eq(replica->get_sync_count(), 1);
+
+    // but one that misses more than the log holds has to start over
+    replicating->stop_replica();
+    for (uint64_t i=1; i<=500; i++) table->upsert(i, i + 2);
+    replicating->start_replica();
+    ck_assert_int_eq(caught_up(table, replica), true);
+    ck_assert_int_eq(replica->get_sync_count(), 2);
+
+    auto reader = new ServedTable(replica_fname, 100, open_t::READ_ONLY);
+    for (uint64_t i=1; i<=500; i++) {
+        uint64_t val;
+        ck_assert_int_eq(reader->try_get(i, &val), true);
+        ck_assert_int_eq(val, i + 2);
+    }
+
+    delete reader;
+    delete replicating;
+    delete table;
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("Replication Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, change_log);
+    tcase_add_test(basic, needs_log);
+    tcase_add_test(basic, initial_sync);
+    tcase_add_test(basic, streaming);
+    tcase_add_test(basic, reconnect);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,139 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "util/ring.hpp"
+
+using namespace std;
+
+
+START_TEST(push_pop)
+{
+    Ring<int> ring(10);
+    ck_assert_int_eq(ring.capacity(), 16);
+    ck_assert_int_eq(ring.empty(), true);
+
+    for (int i=0; i<10; i++) {
+        ck_assert_int_eq(ring.push(i), true);
+    }
+    ck_assert_int_eq(ring.empty(), false);
+
+    int item;
+    for (int i=0; i<10; i++) {
+        ck_assert_int_eq(ring.pop(&item), true);
+        ck_assert_int_eq(item, i);
+    }
+
+    ck_assert_int_eq(ring.pop(&item), false);
+    ck_assert_int_eq(ring.empty(), true);
+}
+END_TEST
+
+
+START_TEST(full)
+{
+    Ring<int> ring(4);
+    int item = 0;
+
+    for (int i=0; i<4; i++) {
+        ck_assert_int_eq(ring.push(i), true);
+    }
+    ck_assert_int_eq(ring.push(item), false);
+
+    // freeing a slot makes room for exactly one more, and the ring wraps
+    ck_assert_int_eq(ring.pop(&item), true);
+    item = 4;
+    ck_assert_int_eq(ring.push(item), true);
+    ck_assert_int_eq(ring.push(item), false);
+
+    for (int i=1; i<=4; i++) {
+        ck_assert_int_eq(ring.pop(&item), true);
+        ck_assert_int_eq(item, i);
+    }
+}
+END_TEST
+
+
+START_TEST(multi_producer)
+{
+    Ring<size_t> ring(64);
+    size_t producer_cnt = 4;
+    size_t per_producer = 20000;
+
+    std::vector<std::thread> producers;
+    for (size_t p=0; p<producer_cnt; p++) {
+        producers.emplace_back([&ring, p, per_producer]() {
+            for (size_t i=0; i<per_producer; i++) {
+                size_t item = p * per_producer + i;
+                while (!ring.push(item)) std::this_thread::yield();
+            }
+        });
+    }
+
+    // every item arrives exactly once, and each producer's items arrive in
+    // the order they were pushed
+    std::vector<size_t> next(producer_cnt, 0);
+    size_t received = 0;
+    size_t out_of_order = 0;
+    size_t item;
+    while (received < producer_cnt * per_producer) {
+        if (!ring.pop(&item)) {
+            std::this_thread::yield();
+            continue;
+        }
+        size_t p = item / per_producer;
+        if (item % per_producer != next[p]) out_of_order++;
+        next[p] = item % per_producer + 1;
+        received++;
+    }
+
+    for (auto &producer : producers) producer.join();
+
+    ck_assert_int_eq(out_of_order, 0);
+    ck_assert_int_eq(ring.empty(), true);
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("Ring Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, push_pop);
+    tcase_add_test(basic, full);
+    tcase_add_test(basic, multi_producer);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,421 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "net/server.hpp"
+#include "net/client.hpp"
+
+using namespace std;
+
+const char *server_fname = "./tests/data/server.store";
+
+
+/*
+ * A server over table, running on its own thread for as long as the
+ * fixture is alive.
+ */
+struct Running
+{
+    KVServer *server;
+    std::thread thread;
+
+    Running(ServedTable *table)
+    {
+        this->server = new KVServer(table);
+        this->thread = std::thread([this]() { this->server->run(); });
+    }
+
+    Running(ServedTable *table, wire_t protocol)
+    {
+        this->server = new KVServer(table, 0, "127.0.0.1", protocol);
+        this->thread = std::thread([this]() { this->server->run(); });
+    }
+
+    ~Running()
+    {
+        this->server->stop();
+        this->thread.join();
+        delete this->server;
+    }
+};
+
+
+static int connect_to(uint16_t port)
+{
+    sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+/*
+ * Send request, and check that exactly expected comes back.
+ */
+static bool exchange(int fd, std::string request, std::string expected)
+{
+    if (send(fd, request.data(), request.size(), 0) != (ssize_t) request.size()) return false;
+    if (expected.empty()) return true;
+
+    std::string reply(expected.size(), '\0');
+    ssize_t got = recv(fd, &reply[0], reply.size(), MSG_WAITALL);
+    return got == (ssize_t) expected.size() && reply == expected;
+}
+
+
+START_TEST(create)
+{
+    auto table = new ServedTable(100);
+    auto test = new KVServer(table);
+
+    ck_assert_int_eq(test->get_port() != 0, true);
+
+    delete test;
+    delete table;
+}
+END_TEST
+
+
+START_TEST(get_put_remove)
+{
+    auto table = new ServedTable(100);
+    auto running = new Running(table);
+    auto client = new KVClient("127.0.0.1", running->server->get_port());
+
+    uint64_t val;
+    ck_assert_int_eq(client->get(5, &val), false);
+
+    client->put(5, 10);
+    ck_assert_int_eq(client->get(5, &val), true);
+    ck_assert_int_eq(val, 10);
+
+    // puts replace
+    client->put(5, 11);
+    ck_assert_int_eq(client->get(5, &val), true);
+    ck_assert_int_eq(val, 11);
+
+    // the table is still usable directly, and sees the same data
+    ck_assert_int_eq(table->get(5), 11);
+    table->insert(6, 12);
+    ck_assert_int_eq(client->get(6, &val), true);
+    ck_assert_int_eq(val, 12);
+
+    ck_assert_int_eq(client->remove(5), true);
+    ck_assert_int_eq(client->remove(5), false);
+    ck_assert_int_eq(client->get(5, &val), false);
+
+    delete client;
+    delete running;
+    delete table;
+}
+END_TEST
+
+
+START_TEST(pipelined)
+{
+    auto table = new ServedTable(100);
+    auto running = new Running(table);
+    auto client = new KVClient("127.0.0.1", running->server->get_port());
+
+    // full 64 bit keys and values make it through intact
+    const uint64_t high = (uint64_t) 1 << 40;
+
+    for (uint64_t i=1; i<=500; i++) {
+        uint64_t key = high + i;
+        uint64_t val = high * 2 + i;
+        client->send_put(&key, &val, 1);
+    }
+    for (uint64_t i=1; i<=600; i++) {
+        uint64_t key = high + i;
+        client->send_get(&key, 1);
+    }
+    for (uint64_t i=1; i<=1000; i+=2) {
+        uint64_t key = high + i;
+        client->send_del(&key, 1);
+    }
+    ck_assert_int_eq(client->get_outstanding(), 1600);
+    client->flush();
+
+    // responses come back one per request, in order
+    for (size_t i=1; i<=500; i++) {
+        Response response = client->receive();
+        ck_assert_int_eq((int) response.status, (int) status_t::OK);
+        ck_assert_int_eq(response.cnt, 1);
+    }
+    for (uint64_t i=1; i<=600; i++) {
+        Response response = client->receive();
+        ck_assert_int_eq((int) response.status, (int) status_t::OK);
+        ck_assert_int_eq(response.found[0], i <= 500);
+        if (i <= 500) ck_assert_int_eq(response.values[0] == high * 2 + i, true);
+    }
+    for (uint64_t i=1; i<=1000; i+=2) {
+        Response response = client->receive();
+        ck_assert_int_eq(response.cnt, i <= 500);
+    }
+    ck_assert_int_eq(client->get_outstanding(), 0);
+
+    delete client;
+    delete running;
+    delete table;
+}
+END_TEST
+
+
+START_TEST(multi_get)
+{
+    auto table = new ServedTable(1000);
+    auto running = new Running(table);
+    auto client = new KVClient("127.0.0.1", running->server->get_port());
+
+    // more keys than fit in one frame
+    size_t cnt = max_frame_items * 2 + 100;
+    std::vector<uint64_t> keys(cnt);
+    std::vector<uint64_t> values(cnt);
+    for (size_t i=0; i<cnt; i++) {
+        keys[i] = i + 1;
+        values[i] = (i + 1) * 3;
+    }
+
+    for (size_t start=0; start<cnt; start+=max_frame_items) {
+        size_t part = std::min(cnt - start, max_frame_items);
+        client->send_put(keys.data() + start, values.data() + start, part);
+    }
+    while (client->get_outstanding()) {
+        ck_assert_int_eq((int) client->receive().status, (int) status_t::OK);
+    }
+
+    // ask for every other key, along with as many that aren't there
+    std::vector<uint64_t> wanted;
+    for (size_t i=0; i<2 * cnt; i+=2) {
+        wanted.push_back(i + 1);
+    }
+
+    std::vector<uint64_t> found_values(wanted.size());
+    bool *found = new bool[wanted.size()];
+    size_t hits = client->multi_get(wanted.data(), wanted.size(), found_values.data(), found);
+
+    ck_assert_int_eq(hits, (cnt + 1) / 2);
+    for (size_t i=0; i<wanted.size(); i++) {
+        ck_assert_int_eq(found[i], wanted[i] <= cnt);
+        if (found[i]) ck_assert_int_eq(found_values[i], wanted[i] * 3);
+    }
+
+    delete[] found;
+    delete client;
+    delete running;
+    delete table;
+}
+END_TEST
+
+
+START_TEST(read_only)
+{
+    auto writer = new ServedTable(server_fname, 100);
+    writer->insert(1, 2);
+    writer->publish();
+
+    auto table = new ServedTable(server_fname, 100, open_t::READ_ONLY);
+    auto running = new Running(table);
+    auto client = new KVClient("127.0.0.1", running->server->get_port());
+
+    uint64_t val;
+    ck_assert_int_eq(client->get(1, &val), true);
+    ck_assert_int_eq(val, 2);
+
+    bool refused = false;
+    try {
+        client->put(3, 4);
+    } catch (ReadOnlyException &) {
+        refused = true;
+    }
+    ck_assert_int_eq(refused, true);
+
+    // the connection carries on after a refusal
+    ck_assert_int_eq(client->get(1, &val), true);
+
+    delete client;
+    delete running;
+    delete table;
+    delete writer;
+}
+END_TEST
+
+
+START_TEST(bad_request)
+{
+    auto table = new ServedTable(100);
+    auto running = new Running(table);
+
+    int fd = connect_to(running->server->get_port());
+    ck_assert_int_eq(fd != -1, true);
+
+    byte frame[frame_header_bytes];
+    put_header(frame, 99, 1);
+    ck_assert_int_eq(send(fd, frame, sizeof(frame), 0), sizeof(frame));
+
+    // the server answers with an error, and hangs up
+    byte response[frame_header_bytes];
+    ck_assert_int_eq(recv(fd, response, sizeof(response), MSG_WAITALL), sizeof(response));
+    ck_assert_int_eq(get_header(response).code, (uint32_t) status_t::BAD_REQUEST);
+    ck_assert_int_eq(recv(fd, response, sizeof(response), 0), 0);
+    close(fd);
+
+    // and other clients are unaffected
+    auto client = new KVClient("127.0.0.1", running->server->get_port());
+    client->put(1, 1);
+
+    delete client;
+    delete running;
+    delete table;
+}
+END_TEST
+
+
+START_TEST(resp_commands)
+{
+    auto table = new ServedTable(100);
+    auto running = new Running(table, wire_t::RESP);
+    int fd = connect_to(running->server->get_port());
+    ck_assert_int_eq(fd != -1, true);
+
+    ck_assert_int_eq(exchange(fd, "*1\r\n$4\r\nPING\r\n", "+PONG\r\n"), true);
+    ck_assert_int_eq(exchange(fd, "*2\r\n$3\r\nGET\r\n$3\r\nfoo\r\n", "$-1\r\n"), true);
+    ck_assert_int_eq(exchange(fd, "*3\r\n$3\r\nSET\r\n$3\r\nfoo\r\n$3\r\nbar\r\n",
+            "+OK\r\n"), true);
+    ck_assert_int_eq(exchange(fd, "*2\r\n$3\r\nget\r\n$3\r\nfoo\r\n", "$3\r\nbar\r\n"),
+            true);
+
+    // values of any bytes, up to 7 of them, come back as they went in,
+    // empty ones included
+    std::string set_k("*3\r\n$3\r\nSET\r\n$1\r\nk\r\n$7\r\na\r\n\0b c\r\n", 33);
+    std::string mget_reply("*3\r\n$7\r\na\r\n\0b c\r\n$-1\r\n$0\r\n\r\n", 28);
+    ck_assert_int_eq(exchange(fd, set_k, "+OK\r\n"), true);
+    ck_assert_int_eq(exchange(fd, "*3\r\n$3\r\nSET\r\n$1\r\ne\r\n$0\r\n\r\n", "+OK\r\n"),
+            true);
+    ck_assert_int_eq(exchange(fd, "*4\r\n$4\r\nMGET\r\n$1\r\nk\r\n$1\r\nx\r\n$1\r\ne\r\n",
+            mget_reply), true);
+    ck_assert_int_eq(exchange(fd, "*3\r\n$3\r\nSET\r\n$1\r\nk\r\n$8\r\n12345678\r\n",
+            "-ERR value longer than 7 bytes\r\n"), true);
+
+    // values that weren't set as strings come back as numbers, however
+    // small their low byte
+    const byte name[] = "n";
+    table->insert(resp_key(RespArg{name, 1}), 261);
+    ck_assert_int_eq(exchange(fd, "*2\r\n$3\r\nGET\r\n$1\r\nn\r\n", "$3\r\n261\r\n"),
+            true);
+
+    ck_assert_int_eq(exchange(fd, "*4\r\n$6\r\nEXISTS\r\n$3\r\nfoo\r\n$1\r\nx\r\n$1\r\nk\r\n",
+            ":2\r\n"), true);
+    ck_assert_int_eq(exchange(fd, "*3\r\n$3\r\nDEL\r\n$3\r\nfoo\r\n$1\r\nx\r\n", ":1\r\n"),
+            true);
+    ck_assert_int_eq(exchange(fd, "*2\r\n$3\r\nGET\r\n$3\r\nfoo\r\n", "$-1\r\n"), true);
+
+    // inline commands, as typed into telnet
+    ck_assert_int_eq(exchange(fd, "SET a 1\r\nGET a\r\n", "+OK\r\n$1\r\n1\r\n"), true);
+
+    ck_assert_int_eq(exchange(fd, "*1\r\n$5\r\nFLUSH\r\n", "-ERR unknown command\r\n"), true);
+
+    // a command split across writes waits for the rest of it
+    ck_assert_int_eq(exchange(fd, "*2\r\n$3\r\nGET\r\n$3\r\n", ""), true);
+    ck_assert_int_eq(exchange(fd, "foo\r\n*1\r\n$4\r\nPING\r\n", "$-1\r\n+PONG\r\n"),
+            true);
+
+    close(fd);
+    delete running;
+    delete table;
+}
+END_TEST
+
+
+START_TEST(resp_pipelined)
+{
+    auto table = new ServedTable(100);
+    auto running = new Running(table, wire_t::RESP);
+    int fd = connect_to(running->server->get_port());
+    ck_assert_int_eq(fd != -1, true);
+
+    std::string request;
+    std::string expected;
+    for (int i=0; i<300; i++) {
+        std::string key = "key:" + std::to_string(i);
+        std::string val = std::to_string(i);
+        request += "*3\r\n$3\r\nSET\r\n$" + std::to_string(key.size()) + "\r\n" + key +
+                   "\r\n$" + std::to_string(val.size()) + "\r\n" + val + "\r\n";
+        request += "*2\r\n$3\r\nGET\r\n$" + std::to_string(key.size()) + "\r\n" + key + "\r\n";
+        expected += "+OK\r\n$" + std::to_string(val.size()) + "\r\n" + val + "\r\n";
+    }
+    ck_assert_int_eq(exchange(fd, request, expected), true);
+
+    // a malformed command gets an error, and the connection is closed
+    ck_assert_int_eq(exchange(fd, "*1\r\n#4\r\nPING\r\n", "-ERR Protocol error\r\n"), true);
+    char rest;
+    ck_assert_int_eq(recv(fd, &rest, 1, 0), 0);
+
+    close(fd);
+    delete running;
+    delete table;
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("Server Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, create);
+    tcase_add_test(basic, get_put_remove);
+    tcase_add_test(basic, pipelined);
+    tcase_add_test(basic, multi_get);
+    tcase_add_test(basic, read_only);
+    tcase_add_test(basic, bad_request);
+    tcase_add_test(basic, resp_commands);
+    tcase_add_test(basic, resp_pipelined);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
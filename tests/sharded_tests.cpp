@@ -0,0 +1,301 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <climits>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include "dstruct/sharded.hpp"
+
+using namespace std;
+
+const char *shard_base = "./tests/data/sharded.store";
+const char *batch_base = "./tests/data/sharded_batch.store";
+
+
+START_TEST(create)
+{
+    auto test = new ShardedHashTable<int32_t, int32_t>(4, 10);
+
+    ck_assert_int_eq(test->get_shard_count(), 4);
+    ck_assert_int_eq(test->get_shard(3)->get_bucket_count(), 10);
+
+    bool error = false;
+    try {
+        test->get_shard(4);
+    } catch (std::out_of_range &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(create_no_shards)
+{
+    bool error = false;
+
+    try {
+        new ShardedHashTable<int32_t, int32_t>(0, 10);
+    } catch (std::invalid_argument &e) {
+        error = true;
+    }
+
+    ck_assert_int_eq(error, true);
+}
+END_TEST
+
+
+START_TEST(insert_get)
+{
+    auto test = new ShardedHashTable<int32_t, int32_t>(4, 10);
+
+    size_t n = 1000;
+    for (size_t i=0; i<n; i++) {
+        test->insert(i, i * 3);
+    }
+
+    for (size_t i=0; i<n; i++) {
+        ck_assert_int_eq(test->get(i), i * 3);
+        // each key lives only in the shard it routes to
+        ck_assert_int_eq(test->get_shard(test->shard(i))->get(i), i * 3);
+    }
+
+    bool error = false;
+    try {
+        test->get(n + 1);
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    test->remove(10);
+    error = false;
+    try {
+        test->get(10);
+    } catch (KeyNotFoundException &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(distribution)
+{
+    auto test = new ShardedHashTable<int32_t, int32_t>(8, 10);
+
+    // sequential keys should spread evenly over the shards, even though
+    // they all share their high bits
+    size_t n = 8000;
+    std::vector<size_t> counts(8, 0);
+    for (size_t i=0; i<n; i++) {
+        counts[test->shard(i)]++;
+    }
+
+    for (auto cnt : counts) {
+        ck_assert_int_gt(cnt, n / 8 / 2);
+        ck_assert_int_lt(cnt, n / 8 * 2);
+    }
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(shard_files)
+{
+    auto test = new ShardedHashTable<int32_t, int32_t>(shard_base, 3, 10);
+
+    for (size_t i=1; i<=100; i++) {
+        test->insert(i, i + 7);
+    }
+    delete test;
+
+    struct stat buf;
+    for (size_t i=0; i<3; i++) {
+        std::string path = std::string(shard_base) + "." + std::to_string(i);
+        ck_assert_int_eq(stat(path.c_str(), &buf), 0);
+    }
+
+    // reopening picks up where we left off
+    test = new ShardedHashTable<int32_t, int32_t>(shard_base, 3, 10);
+    for (size_t i=1; i<=100; i++) {
+        ck_assert_int_eq(test->get(i), i + 7);
+    }
+    delete test;
+}
+END_TEST
+
+
+START_TEST(batch_ops)
+{
+    std::vector<std::string> paths;
+    for (size_t i=0; i<4; i++) {
+        paths.push_back(std::string(batch_base) + "." + std::to_string(i));
+    }
+    auto test = new ShardedHashTable<int32_t, int32_t>(paths, 16);
+
+    srand(0);
+    std::vector<std::pair<int32_t, int32_t>> input;
+    std::map<int32_t, int32_t> expected;
+    size_t n = 5000;
+    for (size_t i=0; i<n; i++) {
+        int32_t key = rand() % INT_MAX + 1;
+        int32_t val = rand();
+        input.push_back({key, val});
+        expected.insert({key, val});
+    }
+    test->insert_batch(input.begin(), input.end());
+
+    std::vector<int32_t> keys;
+    for (auto &element : expected) keys.push_back(element.first);
+    keys.push_back(-1);
+
+    std::vector<int32_t> values(keys.size());
+    bool *found = new bool[keys.size()];
+    size_t hits = test->get_batch(keys.begin(), keys.end(), values.data(), found);
+
+    ck_assert_int_eq(hits, expected.size());
+    for (size_t i=0; i<expected.size(); i++) {
+        ck_assert_int_eq(found[i], true);
+        ck_assert_int_eq(values[i], expected[keys[i]]);
+    }
+    ck_assert_int_eq(found[keys.size() - 1], false);
+
+    size_t removed = test->remove_batch(keys.begin(), keys.begin() + 100);
+    ck_assert_int_eq(removed, 100);
+    hits = test->get_batch(keys.begin(), keys.end(), values.data(), found);
+    ck_assert_int_eq(hits, expected.size() - 100);
+
+    delete test;
+    delete[] found;
+}
+END_TEST
+
+
+START_TEST(parallel_scan)
+{
+    auto test = new ShardedHashTable<int32_t, int32_t>(4, 10);
+    std::map<int32_t, int32_t> inserted;
+    srand(0);
+
+    size_t n = 1000;
+    for (size_t i=0; i<n; i++) {
+        int32_t key = rand();
+        int32_t val = rand();
+        test->insert(key, val);
+        inserted.insert({key, val});
+    }
+
+    std::mutex lock;
+    std::map<int32_t, int32_t> scanned;
+    test->parallel_for_each([&](int32_t key, int32_t val) {
+        std::lock_guard<std::mutex> guard(lock);
+        scanned.insert({key, val});
+    });
+
+    ck_assert_int_eq(scanned == inserted, true);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(pinned)
+{
+    auto test = new ShardedHashTable<int32_t, int32_t>(2, 10);
+
+    test->pin_to_cpu(0, 0);
+
+    // node 0 might not be listed on machines without NUMA support
+    try {
+        test->pin_to_node(1, 0);
+    } catch (std::invalid_argument &e) {
+        test->pin_to_cpu(1, 0);
+    }
+
+    bool error = false;
+    try {
+        test->pin_to_cpu(2, 0);
+    } catch (std::out_of_range &e) {
+        error = true;
+    }
+    ck_assert_int_eq(error, true);
+
+    std::vector<std::pair<int32_t, int32_t>> input;
+    for (int32_t i=1; i<=500; i++) input.push_back({i, -i});
+    test->insert_batch(input.begin(), input.end());
+
+    std::mutex lock;
+    size_t cnt = 0;
+    size_t bad = 0;
+    test->parallel_for_each([&](int32_t key, int32_t val) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (key != -val) bad++;
+        cnt++;
+    });
+    ck_assert_int_eq(cnt, 500);
+    ck_assert_int_eq(bad, 0);
+
+    test->unpin(0);
+    test->unpin(1);
+
+    delete test;
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("Sharded HashTable Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, create);
+    tcase_add_test(basic, create_no_shards);
+    tcase_add_test(basic, insert_get);
+    tcase_add_test(basic, distribution);
+    tcase_add_test(basic, shard_files);
+    tcase_add_test(basic, batch_ops);
+    tcase_add_test(basic, parallel_scan);
+    tcase_add_test(basic, pinned);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,207 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/stats.hpp"
+#include "dstruct/hashtable.hpp"
+
+using namespace std;
+
+
+START_TEST(counters)
+{
+    Stats::reset();
+
+    Stats::add(stat_t::TABLE_GET, 1);
+    Stats::add(stat_t::TABLE_GET, 2);
+    Stats::add(stat_t::POOL_MISS, 5);
+
+    StatsSnapshot snap = Stats::snapshot();
+    ck_assert_int_eq(snap.get(stat_t::TABLE_GET), 3);
+    ck_assert_int_eq(snap.get(stat_t::POOL_MISS), 5);
+    ck_assert_int_eq(snap.get(stat_t::POOL_HIT), 0);
+}
+END_TEST
+
+
+START_TEST(threaded_counters)
+{
+    Stats::reset();
+
+    // half the threads are still alive when the snapshot is taken, and half
+    // have exited and been folded into the retired totals.
+    std::vector<std::thread> workers;
+    for (int i=0; i<8; i++) {
+        workers.emplace_back([]() {
+            for (int j=0; j<1000; j++) {
+                Stats::add(stat_t::TABLE_INSERT, 1);
+            }
+        });
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    Stats::add(stat_t::TABLE_INSERT, 1);
+
+    StatsSnapshot snap = Stats::snapshot();
+    ck_assert_int_eq(snap.get(stat_t::TABLE_INSERT), 8001);
+}
+END_TEST
+
+
+START_TEST(reset_test)
+{
+    Stats::add(stat_t::RAW_READS, 10);
+    Stats::record(hist_t::RAW_READ_NS, 100);
+    Stats::reset();
+
+    StatsSnapshot snap = Stats::snapshot();
+    ck_assert_int_eq(snap.get(stat_t::RAW_READS), 0);
+    ck_assert_int_eq(snap.get(hist_t::RAW_READ_NS).count(), 0);
+}
+END_TEST
+
+
+START_TEST(histogram_buckets)
+{
+    // small values are exact
+    for (uint64_t i=0; i<8; i++) {
+        ck_assert_int_eq(Stats::hist_value(Stats::hist_bucket(i)), i);
+    }
+
+    // and larger ones are within 12.5%, rounding down
+    uint64_t values[] = {8, 9, 15, 16, 100, 1000, 12345, 1ull << 40, ~0ull};
+    for (auto value : values) {
+        uint64_t low = Stats::hist_value(Stats::hist_bucket(value));
+        ck_assert_int_eq(low <= value, true);
+        ck_assert_int_eq(value - low <= value / 8, true);
+    }
+
+    ck_assert_int_eq(Stats::hist_bucket(~0ull) < hist_buckets, true);
+}
+END_TEST
+
+
+START_TEST(percentiles)
+{
+    Stats::reset();
+
+    for (uint64_t i=1; i<=100; i++) {
+        Stats::record(hist_t::CHAIN_LENGTH, (i <= 90) ? 1 : 5);
+    }
+
+    StatsSnapshot snap = Stats::snapshot();
+    HistogramSnapshot &hist = snap.get(hist_t::CHAIN_LENGTH);
+
+    ck_assert_int_eq(hist.count(), 100);
+    ck_assert_int_eq(hist.percentile(50), 1);
+    ck_assert_int_eq(hist.percentile(95), 5);
+    ck_assert_int_eq(hist.max(), 5);
+}
+END_TEST
+
+
+START_TEST(dump_test)
+{
+    Stats::reset();
+    Stats::add(stat_t::TABLE_HIT, 42);
+
+    FILE *out = tmpfile();
+    Stats::dump(out);
+    rewind(out);
+
+    char line[256];
+    bool found = false;
+    size_t lines = 0;
+    while (fgets(line, sizeof(line), out)) {
+        if (!strcmp(line, "table_hit 42\n")) found = true;
+        lines++;
+    }
+    fclose(out);
+
+    ck_assert_int_eq(found, true);
+    ck_assert_int_eq(lines, stat_cnt + hist_cnt);
+}
+END_TEST
+
+
+START_TEST(table_instrumentation)
+{
+    Stats::reset();
+
+    auto test = new HashTable<int32_t, int32_t>(10);
+    for (int32_t i=1; i<=100; i++) {
+        test->insert(i, i);
+    }
+
+    for (int32_t i=1; i<=150; i++) {
+        try {
+            test->get(i);
+        } catch (KeyNotFoundException& e) {}
+    }
+
+    StatsSnapshot snap = Stats::snapshot();
+
+#ifdef KVS_STATS
+    ck_assert_int_eq(snap.get(stat_t::TABLE_INSERT), 100);
+    ck_assert_int_eq(snap.get(stat_t::TABLE_GET), 150);
+    ck_assert_int_eq(snap.get(stat_t::TABLE_HIT), 100);
+    ck_assert_int_eq(snap.get(stat_t::TABLE_MISS), 50);
+    ck_assert_int_eq(snap.get(hist_t::CHAIN_LENGTH).count(), 150);
+#else
+    // compiled out, so nothing should have been counted
+    ck_assert_int_eq(snap.get(stat_t::TABLE_INSERT), 0);
+    ck_assert_int_eq(snap.get(hist_t::CHAIN_LENGTH).count(), 0);
+#endif
+
+    delete test;
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("Stats Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, counters);
+    tcase_add_test(basic, threaded_counters);
+    tcase_add_test(basic, reset_test);
+    tcase_add_test(basic, histogram_buckets);
+    tcase_add_test(basic, percentiles);
+    tcase_add_test(basic, dump_test);
+    tcase_add_test(basic, table_instrumentation);
+
+    suite_add_tcase(suite, basic);
+
+    return suite;
+}
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,345 @@
+#include <check.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include "io/raw.hpp"
+#include "io/tiered.hpp"
+#include "io/exceptions.hpp"
+#include "dstruct/hashtable.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+const char *test_file = "./tests/data/testfile_tiered.store";
+const char *table_file = "./tests/data/table_tiered.store";
+
+
+START_TEST(create)
+{
+    auto test = new TieredIOHandler(new RawIOHandler(test_file), 10 * PAGESIZE);
+    test->truncate(0);
+
+    ck_assert_int_ne(test->get_fd(), 0);
+    ck_assert_int_eq(test->get_flen(), 0);
+    ck_assert_int_eq(test->get_hot_capacity(), 10);
+    ck_assert_int_eq(test->get_hot_pages(), 0);
+
+    fd_t fd = test->get_fd();
+    delete test;
+
+    // the device goes with it
+    ck_assert_int_eq(fcntl(fd, F_GETFD), -1);
+
+    // the budget is at least one page
+    test = new TieredIOHandler(new RawIOHandler(test_file), 0);
+    ck_assert_int_eq(test->get_hot_capacity(), 1);
+    delete test;
+}
+END_TEST
+
+
+START_TEST(promotion)
+{
+    auto test = new TieredIOHandler(new RawIOHandler(test_file), 10 * PAGESIZE, 3);
+    test->truncate(0);
+
+    byte page[PAGESIZE];
+    memset(page, 'a', PAGESIZE);
+    test->write(page, PAGESIZE, 0);
+    ck_assert_int_eq(test->is_hot(0), false);
+
+    // cold writes go straight to the device
+    struct stat buf;
+    fstat(test->get_fd(), &buf);
+    ck_assert_int_eq(buf.st_size, PAGESIZE);
+
+    test->read(page, PAGESIZE, 0);
+    ck_assert_int_eq(test->is_hot(0), false);
+    test->read(page, PAGESIZE, 0);
+    ck_assert_int_eq(test->is_hot(0), true);
+    ck_assert_int_eq(page[0], 'a');
+
+    // a hot page's writes stay in memory until it is flushed
+    memset(page, 'b', PAGESIZE);
+    test->write(page, PAGESIZE, 0);
+    byte direct[PAGESIZE];
+    pread(test->get_fd(), direct, PAGESIZE, 0);
+    ck_assert_int_eq(direct[0], 'a');
+
+    test->flush();
+    pread(test->get_fd(), direct, PAGESIZE, 0);
+    ck_assert_int_eq(direct[0], 'b');
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(write_read)
+{
+    // a small hot tier, so that pages are promoted and demoted throughout
+    const int pages = 200;
+    auto test = new TieredIOHandler(new RawIOHandler(test_file), 8 * PAGESIZE);
+    test->truncate(0);
+
+    std::vector<byte> image(pages * PAGESIZE);
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> pick(0, pages * PAGESIZE - 64);
+
+    for (int i=0; i<5000; i++) {
+        byte data[64];
+        off_t offset = pick(rng);
+        size_t size = 1 + rng() % 64;
+
+        if (rng() % 2) {
+            memset(data, 'a' + i % 26, size);
+            test->write(data, size, offset);
+            memcpy(image.data() + offset, data, size);
+        } else if (offset + (off_t) size <= test->get_flen()) {
+            test->read(data, size, offset);
+            ck_assert_int_eq(memcmp(data, image.data() + offset, size), 0);
+        }
+        ck_assert_int_le(test->get_hot_pages(), 8);
+    }
+
+    off_t len = test->get_flen();
+    delete test;
+
+    test = new TieredIOHandler(new RawIOHandler(test_file), 8 * PAGESIZE);
+    ck_assert_int_eq(test->get_flen(), len);
+    std::vector<byte> back(len);
+    test->read(back.data(), len, 0);
+    ck_assert_int_eq(memcmp(back.data(), image.data(), len), 0);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(frequency)
+{
+    const int hot_pages = 4;
+    auto test = new TieredIOHandler(new RawIOHandler(test_file), hot_pages * PAGESIZE);
+    test->truncate(0);
+
+    byte page[PAGESIZE] = {0};
+    for (int i=0; i<100; i++) {
+        test->write(page, PAGESIZE, i * PAGESIZE);
+    }
+
+    // a few pages that are used all the time
+    for (int round=0; round<10; round++) {
+        for (int i=0; i<hot_pages; i++) {
+            test->read(page, PAGESIZE, i * PAGESIZE);
+        }
+    }
+
+    // a stream of pages that are each used once promotes nothing, so
+    // it can't push the busy pages out
+    for (int i=hot_pages; i<100; i++) {
+        test->read(page, PAGESIZE, i * PAGESIZE);
+    }
+
+    for (int i=0; i<hot_pages; i++) {
+        ck_assert_int_eq(test->is_hot(i * PAGESIZE), true);
+    }
+    ck_assert_int_eq(test->get_hot_pages(), hot_pages);
+
+    // but one that becomes popular gets in
+    for (int i=0; i<5; i++) {
+        test->read(page, PAGESIZE, 50 * PAGESIZE);
+    }
+    ck_assert_int_eq(test->is_hot(50 * PAGESIZE), true);
+    ck_assert_int_eq(test->get_hot_pages(), hot_pages);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(scan_hint)
+{
+    auto test = new TieredIOHandler(new RawIOHandler(test_file), 10 * PAGESIZE);
+    test->truncate(0);
+
+    byte page[PAGESIZE];
+    for (int i=0; i<50; i++) {
+        memset(page, 'a' + i % 26, PAGESIZE);
+        test->write(page, PAGESIZE, i * PAGESIZE);
+    }
+
+    test->advise(0, 50 * PAGESIZE, access_t::SEQUENTIAL);
+    for (int pass=0; pass<3; pass++) {
+        for (int i=0; i<50; i++) {
+            test->read(page, PAGESIZE, i * PAGESIZE);
+            ck_assert_int_eq(page[0], 'a' + i % 26);
+        }
+    }
+    test->advise(0, 50 * PAGESIZE, access_t::NORMAL);
+    ck_assert_int_eq(test->get_hot_pages(), 0);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(async_hooks)
+{
+    IOHandler *raw = new RawIOHandler(test_file);
+    raw->truncate(0);
+    byte page[PAGESIZE];
+    for (int i=0; i<3; i++) {
+        memset(page, 'a' + i, PAGESIZE);
+        raw->write(page, PAGESIZE, i * PAGESIZE);
+    }
+    delete raw;
+
+    auto test = new TieredIOHandler(new RawIOHandler(test_file), 10 * PAGESIZE, 2);
+    byte *fetched = new byte[PAGESIZE];
+    size_t fetch_size;
+    off_t fetch_offset;
+
+    // probing a cold page neither counts nor promotes it
+    for (int i=0; i<5; i++) {
+        ck_assert_int_eq(test->read_cached(page, 10, 5), false);
+    }
+    ck_assert_int_eq(test->is_hot(0), false);
+
+    // each fetched read counts once, and the second promotes the page from
+    // what was fetched
+    for (int i=0; i<2; i++) {
+        ck_assert_int_eq(test->is_hot(0), false);
+        ck_assert_int_eq(test->read_cached(page, 10, 5), false);
+        uint64_t stamp = test->fetch_extent(10, 5, &fetch_size, &fetch_offset);
+        ck_assert_int_eq(fetch_offset, 0);
+        ck_assert_int_eq(fetch_size, PAGESIZE);
+        pread(test->get_fd(), fetched, fetch_size, fetch_offset);
+        ck_assert_int_eq(test->install(fetched, fetch_size, fetch_offset, stamp), true);
+    }
+    ck_assert_int_eq(test->is_hot(0), true);
+    ck_assert_int_eq(test->read_cached(page, 10, 5), true);
+    ck_assert_int_eq(page[0], 'a');
+
+    // a fetch overtaken by a write isn't current, and isn't counted
+    uint64_t stamp = test->fetch_extent(10, PAGESIZE, &fetch_size, &fetch_offset);
+    pread(test->get_fd(), fetched, fetch_size, fetch_offset);
+    memset(page, 'z', PAGESIZE);
+    test->write(page, PAGESIZE, PAGESIZE);
+    ck_assert_int_eq(test->install(fetched, fetch_size, fetch_offset, stamp), false);
+    ck_assert_int_eq(test->is_hot(PAGESIZE), false);
+
+    delete test;
+    delete[] fetched;
+}
+END_TEST
+
+
+START_TEST(truncate_test)
+{
+    auto test = new TieredIOHandler(new RawIOHandler(test_file), 10 * PAGESIZE, 1);
+    test->truncate(0);
+
+    byte page[PAGESIZE];
+    memset(page, 'x', PAGESIZE);
+    for (int i=0; i<5; i++) {
+        test->write(page, PAGESIZE, i * PAGESIZE);
+    }
+    ck_assert_int_eq(test->get_hot_pages(), 5);
+
+    test->truncate(PAGESIZE + 10);
+    ck_assert_int_eq(test->get_flen(), PAGESIZE + 10);
+    ck_assert_int_eq(test->get_hot_pages(), 2);
+
+    // growing the file again reads back zeros past the old end
+    byte zero = 0;
+    test->write(&zero, 1, 3 * PAGESIZE);
+    test->read(page, PAGESIZE, PAGESIZE);
+    ck_assert_int_eq(page[9], 'x');
+    ck_assert_int_eq(page[10], 0);
+    ck_assert_int_eq(page[PAGESIZE - 1], 0);
+
+    delete test;
+}
+END_TEST
+
+
+START_TEST(tiered_table)
+{
+    auto storage = new TieredIOHandler(new RawIOHandler(table_file), 16 * PAGESIZE);
+    storage->truncate(0);
+    auto table = new HashTable<int64_t, int64_t>(storage, 500);
+
+    std::map<int64_t, int64_t> expected;
+    std::mt19937 rng(3);
+    for (int i=0; i<20000; i++) {
+        int64_t key = 1 + rng() % 3000;
+        if (rng() % 4 == 0) {
+            table->try_remove(key);
+            expected.erase(key);
+        } else {
+            table->upsert(key, i);
+            expected[key] = i;
+        }
+    }
+
+    for (auto &element : expected) {
+        ck_assert_int_eq(table->get(element.first), element.second);
+    }
+    ck_assert_int_le(storage->get_hot_pages(), 16);
+
+    delete table;
+}
+END_TEST
+
+
+Suite *test_suite()
+{
+    Suite *suite = suite_create("TieredIO Tests");
+
+    // Test the basic functionality
+    TCase *basic = tcase_create("basic");
+    tcase_add_test(basic, create);
+    tcase_add_test(basic, promotion);
+    tcase_add_test(basic, write_read);
+    tcase_add_test(basic, frequency);
+    tcase_add_test(basic, scan_hint);
+    tcase_add_test(basic, async_hooks);
+    tcase_add_test(basic, truncate_test);
+    tcase_add_test(basic, tiered_table);
+
+    // TODO: Add stress testing
+    TCase *stress = tcase_create("stress");
+
+    suite_add_tcase(suite, basic);
+    suite_add_tcase(suite, stress);
+
+    return suite;
+}
+
+
+
+
+int run_test_suite()
+{
+    int failed = 0;
+    Suite *suite = test_suite();
+    SRunner *runner = srunner_create(suite);
+
+    srunner_run_all(runner, CK_VERBOSE);
+    failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int failed = run_test_suite();
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -6,11 +6,16 @@ touch ./tests/data/testfile.store
 touch ./tests/data/failfile.store
 touch ./tests/data/readtest.store
 touch ./tests/data/table.store
+touch ./tests/data/snapshot.store
+touch ./tests/data/restore.store
 
 touch ./tests/data/testfile_buff.store
 touch ./tests/data/failfile_buff.store
 touch ./tests/data/readtest_buff.store
 
+touch ./tests/data/testfile_mapped.store
+touch ./tests/data/readtest_mapped.store
+
 echo "This is a load of test data" >> ./tests/data/readtest.store
 echo "1 2 3 4 5 6 7 8 9 0" >> ./tests/data/readtest.store
 echo "And some more data to read..." >> ./tests/data/readtest.store
@@ -24,6 +29,11 @@ echo "And some more data to read..." >> ./tests/data/readtest_buff.store
 echo "11 12 13 14 15 16 17 18 19 20" >> ./tests/data/readtest_buff.store
 chmod 000 ./tests/data/failfile_buff.store
 
+echo "This is a load of test data" >> ./tests/data/readtest_mapped.store
+echo "1 2 3 4 5 6 7 8 9 0" >> ./tests/data/readtest_mapped.store
+echo "And some more data to read..." >> ./tests/data/readtest_mapped.store
+echo "11 12 13 14 15 16 17 18 19 20" >> ./tests/data/readtest_mapped.store
+
 
 echo "Running unit tests:"
 
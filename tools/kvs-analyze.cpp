@@ -0,0 +1,66 @@
+/*
+ * kvs-analyze.cpp
+ * Print a health report for a table file
+ *
+ * The layout of a table file depends only on the sizes of its keys and
+ * values, not on their types, so this supports any table with 4 or 8 byte
+ * keys and values. The table is opened read only, and so can be analyzed
+ * while a writer has it open.
+ */
+#include "dstruct/hashtable.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+
+template <typename TKey, typename TValue>
+static int analyze(const char *fname, size_t bucket_cnt)
+{
+    auto table = new HashTable<TKey, TValue>(fname, bucket_cnt, open_t::READ_ONLY);
+    TableAnalysis result = table->analyze();
+    delete table;
+
+    result.print(stdout);
+    return EXIT_SUCCESS;
+}
+
+
+template <typename TKey>
+static int analyze(const char *fname, size_t bucket_cnt, size_t value_sz)
+{
+    if (value_sz == 4) return analyze<TKey, uint32_t>(fname, bucket_cnt);
+    return analyze<TKey, uint64_t>(fname, bucket_cnt);
+}
+
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s <table file> <bucket count> [key bytes] [value bytes]\n", progname);
+    fprintf(stderr, "    key and value sizes may be 4 or 8 bytes, and default to 4\n");
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc != 3 && argc != 5) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *fname = argv[1];
+    size_t bucket_cnt = strtoull(argv[2], nullptr, 10);
+    size_t key_sz = (argc == 5) ? strtoull(argv[3], nullptr, 10) : 4;
+    size_t value_sz = (argc == 5) ? strtoull(argv[4], nullptr, 10) : 4;
+
+    if (bucket_cnt == 0 || (key_sz != 4 && key_sz != 8) || (value_sz != 4 && value_sz != 8)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    try {
+        if (key_sz == 4) return analyze<uint32_t>(fname, bucket_cnt, value_sz);
+        return analyze<uint64_t>(fname, bucket_cnt, value_sz);
+    } catch (std::exception &e) {
+        fprintf(stderr, "%s: unable to analyze %s: %s\n", argv[0], fname, e.what());
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,209 @@
+/*
+ * kvs-loadgen.cpp
+ * Drive a kvs-server with a mix of gets and puts, and report throughput
+ *
+ * Each connection runs on its own thread. It first stores its share of
+ * the keys, and then, until time is up, sends depth requests at once, each
+ * for batch uniformly random keys, and waits for all of their responses
+ * before sending the next round. A depth of 1 measures the latency of
+ * single requests; raising it shows what pipelining buys.
+ *
+ * A read only server (a kvs-replica, say) refuses the stores, in which case
+ * the keys are assumed to have been stored through its primary, and the
+ * run goes ahead; with 100% gets, that spreads read load over replicas.
+ */
+#include "net/client.hpp"
+#include "io/exceptions.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+struct Options
+{
+    const char *address;
+    uint16_t port;
+    size_t connections;
+    double seconds;
+    size_t depth;
+    uint64_t keys;
+    unsigned get_pct;
+    size_t batch;
+};
+
+struct Result
+{
+    size_t requests;
+    size_t items;
+    size_t hits;
+    std::vector<double> rounds;
+};
+
+
+/*
+ * Store keys [first, last), each with a value of twice the key, unless the
+ * server is read only.
+ */
+static void load(KVClient &client, uint64_t first, uint64_t last)
+{
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> values;
+
+    for (uint64_t key=first; key<last; key+=max_frame_items) {
+        size_t cnt = std::min((uint64_t) max_frame_items, last - key);
+        keys.resize(cnt);
+        values.resize(cnt);
+        for (size_t i=0; i<cnt; i++) {
+            keys[i] = key + i;
+            values[i] = 2 * (key + i);
+        }
+        client.send_put(keys.data(), values.data(), cnt);
+    }
+
+    while (client.get_outstanding()) {
+        status_t status = client.receive().status;
+        if (status != status_t::OK && status != status_t::READ_ONLY) throw IOException();
+    }
+}
+
+
+static void drive(const Options &opts, size_t id, std::atomic<size_t> *ready,
+        std::atomic<bool> *go, Result *result)
+{
+    KVClient client(opts.address, opts.port);
+
+    uint64_t per = opts.keys / opts.connections + 1;
+    load(client, 1 + id * per, std::min(1 + (id + 1) * per, opts.keys + 1));
+
+    std::mt19937_64 rng(id + 1);
+    std::uniform_int_distribution<uint64_t> pick(1, opts.keys);
+    std::uniform_int_distribution<unsigned> pct(0, 99);
+    std::vector<uint64_t> keys(opts.batch);
+    std::vector<uint64_t> values(opts.batch);
+
+    // start the clock together, once every connection has loaded
+    (*ready)++;
+    while (!go->load()) std::this_thread::yield();
+
+    auto start = std::chrono::steady_clock::now();
+    auto stop = start + std::chrono::duration<double>(opts.seconds);
+
+    while (std::chrono::steady_clock::now() < stop) {
+        auto sent = std::chrono::steady_clock::now();
+        for (size_t r=0; r<opts.depth; r++) {
+            for (size_t i=0; i<opts.batch; i++) {
+                keys[i] = pick(rng);
+                values[i] = 2 * keys[i];
+            }
+
+            if (pct(rng) < opts.get_pct) {
+                client.send_get(keys.data(), opts.batch);
+            } else {
+                client.send_put(keys.data(), values.data(), opts.batch);
+            }
+        }
+        client.flush();
+
+        for (size_t r=0; r<opts.depth; r++) {
+            Response response = client.receive();
+            if (response.status != status_t::OK) throw IOException();
+
+            for (auto hit : response.found) {
+                if (hit) result->hits++;
+            }
+        }
+
+        std::chrono::duration<double, std::micro> elapsed =
+                std::chrono::steady_clock::now() - sent;
+        result->rounds.push_back(elapsed.count());
+        result->requests += opts.depth;
+        result->items += opts.depth * opts.batch;
+    }
+}
+
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s <address> <port> [connections] [seconds] [depth] [keys] "
+            "[get percent] [batch]\n", progname);
+    fprintf(stderr, "    defaults: 4 connections, 5 seconds, a depth of 16, 100000 keys,\n");
+    fprintf(stderr, "    90%% gets and 1 key per request\n");
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || argc > 9) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Options opts;
+    opts.address = argv[1];
+    unsigned long port = strtoul(argv[2], nullptr, 10);
+    opts.port = port;
+    opts.connections = (argc > 3) ? strtoull(argv[3], nullptr, 10) : 4;
+    opts.seconds = (argc > 4) ? strtod(argv[4], nullptr) : 5;
+    opts.depth = (argc > 5) ? strtoull(argv[5], nullptr, 10) : 16;
+    opts.keys = (argc > 6) ? strtoull(argv[6], nullptr, 10) : 100000;
+    opts.get_pct = (argc > 7) ? strtoul(argv[7], nullptr, 10) : 90;
+    opts.batch = (argc > 8) ? strtoull(argv[8], nullptr, 10) : 1;
+
+    if (port == 0 || port > UINT16_MAX || opts.connections == 0 || opts.seconds <= 0 ||
+            opts.depth == 0 || opts.keys == 0 || opts.get_pct > 100 || opts.batch == 0 ||
+            opts.batch > max_frame_items) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Result> results(opts.connections, Result());
+    std::vector<std::thread> threads;
+    std::atomic<size_t> ready(0);
+    std::atomic<bool> go(false);
+    std::atomic<size_t> failed(0);
+
+    for (size_t i=0; i<opts.connections; i++) {
+        threads.emplace_back([&, i]() {
+            try {
+                drive(opts, i, &ready, &go, &results[i]);
+            } catch (std::exception &e) {
+                fprintf(stderr, "connection %zu: %s\n", i, e.what());
+                failed++;
+            }
+        });
+    }
+
+    while (ready.load() + failed.load() < opts.connections) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    go.store(true);
+    for (auto &thread : threads) thread.join();
+    if (failed) return EXIT_FAILURE;
+
+    Result total = Result();
+    for (auto &result : results) {
+        total.requests += result.requests;
+        total.items += result.items;
+        total.hits += result.hits;
+        total.rounds.insert(total.rounds.end(), result.rounds.begin(), result.rounds.end());
+    }
+    std::sort(total.rounds.begin(), total.rounds.end());
+
+    auto percentile = [&total](double p) {
+        if (total.rounds.empty()) return 0.0;
+        return total.rounds[(size_t) (p * (total.rounds.size() - 1))];
+    };
+
+    printf("requests/s:  %.0f\n", total.requests / opts.seconds);
+    printf("keys/s:      %.0f\n", total.items / opts.seconds);
+    printf("round trips: %zu of %zu requests each\n", total.rounds.size(), opts.depth);
+    printf("round p50:   %.1f us\n", percentile(0.5));
+    printf("round p99:   %.1f us\n", percentile(0.99));
+    if (opts.get_pct) printf("get hits:    %zu\n", total.hits);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+/*
+ * kvs-replica.cpp
+ * Follow a kvs-server's table, and serve reads from the copy
+ *
+ * The replica keeps its copy of the table in the given file, which is
+ * replaced by a snapshot from the primary when it first connects, and
+ * then kept up to date from the primary's changes (see net/replica.hpp).
+ * Once the snapshot is in, the copy is served read only on the given port
+ * with the same protocol as kvs-server, so clients can spread their reads
+ * over any number of replicas; writes are refused with READ_ONLY, and
+ * have to go to the primary. Other processes can also open read only
+ * tables on the file directly.
+ *
+ * Every report interval seconds, how far behind the primary the replica
+ * is gets printed to stderr.
+ */
+#include "net/replica.hpp"
+#include "net/server.hpp"
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+static Replica *replica = nullptr;
+static KVServer *server = nullptr;
+static volatile sig_atomic_t stopping = 0;
+
+static void handle_signal(int)
+{
+    stopping = 1;
+    if (server) server->stop();
+}
+
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s <primary address> <replication port> <table file> [port] "
+            "[address] [report interval]\n", progname);
+    fprintf(stderr, "    port defaults to 7071, address to 127.0.0.1, and the report\n");
+    fprintf(stderr, "    interval (in seconds, 0 for never) to 10\n");
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 4 || argc > 7) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *primary_address = argv[1];
+    unsigned long primary_port = strtoul(argv[2], nullptr, 10);
+    const char *fname = argv[3];
+    unsigned long port = (argc > 4) ? strtoul(argv[4], nullptr, 10) : 7071;
+    const char *address = (argc > 5) ? argv[5] : "127.0.0.1";
+    unsigned long report_interval = (argc > 6) ? strtoul(argv[6], nullptr, 10) : 10;
+
+    if (primary_port == 0 || primary_port > UINT16_MAX || port > UINT16_MAX) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = handle_signal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    replica = new Replica(fname, primary_address, primary_port);
+    std::thread follower([]() { replica->run(); });
+
+    // nothing can be served until there is a table to serve
+    while (!stopping && !replica->get_bucket_count()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    int status = EXIT_SUCCESS;
+    ServedTable *table = nullptr;
+    std::atomic<bool> done(false);
+    std::thread reporter;
+
+    if (!stopping) {
+        try {
+            table = new ServedTable(fname, replica->get_bucket_count(), open_t::READ_ONLY);
+            server = new KVServer(table, port, address);
+        } catch (std::exception &e) {
+            fprintf(stderr, "%s: unable to serve %s on %s: %s\n", argv[0], fname, address,
+                    e.what());
+            status = EXIT_FAILURE;
+        }
+    }
+
+    if (server) {
+        if (report_interval) {
+            reporter = std::thread([report_interval, &done]() {
+                auto interval = std::chrono::seconds(report_interval);
+                auto last = std::chrono::steady_clock::now();
+                while (!done.load()) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    if (std::chrono::steady_clock::now() - last < interval) continue;
+
+                    fprintf(stderr, "%s, applied up to change %llu, %llu behind\n",
+                            replica->is_connected() ? "connected" : "disconnected",
+                            (unsigned long long) replica->get_applied(),
+                            (unsigned long long) replica->get_lag());
+                    last = std::chrono::steady_clock::now();
+                }
+            });
+        }
+
+        printf("replicating %s:%lu into %s\n", primary_address, primary_port, fname);
+        printf("serving %s on %s:%u\n", fname, address, server->get_port());
+        fflush(stdout);
+
+        try {
+            server->run();
+        } catch (std::exception &e) {
+            fprintf(stderr, "%s: %s\n", argv[0], e.what());
+            status = EXIT_FAILURE;
+        }
+    }
+
+    done.store(true);
+    if (reporter.joinable()) reporter.join();
+    replica->stop();
+    follower.join();
+
+    delete server;
+    server = nullptr;
+    delete table;
+    delete replica;
+    return status;
+}
@@ -0,0 +1,163 @@
+/*
+ * kvs-server.cpp
+ * Serve a table file over TCP
+ *
+ * The table is a HashTable with 64 bit keys and values, opened read-write
+ * (or created) on the given file, and published every publish_interval
+ * seconds so that read only tables elsewhere can follow along. It is
+ * closed cleanly on SIGINT or SIGTERM.
+ *
+ * Given a RESP port, the same table is also served over the Redis protocol
+ * there (see net/resp.hpp), from a second event loop, so that Redis load
+ * tools can be pointed at it.
+ *
+ * Given a replication port, the table's changes are logged, and shipped
+ * to any kvs-replica that connects there (see net/primary.hpp).
+ */
+#include "net/server.hpp"
+#include "net/primary.hpp"
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+static KVServer *server = nullptr;
+static KVServer *resp_server = nullptr;
+static ReplicationPrimary *primary = nullptr;
+
+/*
+ * The number of changes kept for replicas to catch up from, before one
+ * that has fallen behind has to be sent a new snapshot.
+ */
+static constexpr size_t const log_capacity = 1 << 20;
+
+static void handle_signal(int)
+{
+    if (server) server->stop();
+    if (resp_server) resp_server->stop();
+    if (primary) primary->stop();
+}
+
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s <table file> <bucket count> [port] [address] [publish interval] "
+            "[RESP port] [replication port]\n", progname);
+    fprintf(stderr, "    port defaults to 7070, address to 127.0.0.1, and the publish\n");
+    fprintf(stderr, "    interval (in seconds, 0 for never) to 1. RESP and replication\n");
+    fprintf(stderr, "    are off by default, or with a port of 0\n");
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || argc > 8) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *fname = argv[1];
+    size_t bucket_cnt = strtoull(argv[2], nullptr, 10);
+    unsigned long port = (argc > 3) ? strtoul(argv[3], nullptr, 10) : 7070;
+    const char *address = (argc > 4) ? argv[4] : "127.0.0.1";
+    unsigned long publish_interval = (argc > 5) ? strtoul(argv[5], nullptr, 10) : 1;
+    unsigned long resp_port = (argc > 6) ? strtoul(argv[6], nullptr, 10) : 0;
+    unsigned long repl_port = (argc > 7) ? strtoul(argv[7], nullptr, 10) : 0;
+
+    if (bucket_cnt == 0 || port > UINT16_MAX || resp_port > UINT16_MAX ||
+            repl_port > UINT16_MAX) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    ServedTable *table = nullptr;
+    try {
+        table = new ServedTable(fname, bucket_cnt);
+        server = new KVServer(table, port, address);
+        if (resp_port) resp_server = new KVServer(table, resp_port, address, wire_t::RESP);
+        if (repl_port) {
+            table->enable_change_log(log_capacity);
+            primary = new ReplicationPrimary(table, fname, repl_port, address);
+        }
+    } catch (std::exception &e) {
+        fprintf(stderr, "%s: unable to serve %s on %s: %s\n", argv[0], fname, address,
+                e.what());
+        delete resp_server;
+        delete server;
+        delete table;
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = handle_signal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    std::atomic<bool> done(false);
+    std::thread publisher;
+    if (publish_interval) {
+        publisher = std::thread([table, publish_interval, &done]() {
+            auto interval = std::chrono::seconds(publish_interval);
+            auto step = std::chrono::milliseconds(100);
+            auto last = std::chrono::steady_clock::now();
+            while (!done.load()) {
+                std::this_thread::sleep_for(step);
+                if (std::chrono::steady_clock::now() - last < interval) continue;
+
+                try {
+                    table->publish();
+                } catch (std::exception &e) {
+                    fprintf(stderr, "unable to publish: %s\n", e.what());
+                }
+                last = std::chrono::steady_clock::now();
+            }
+        });
+    }
+
+    printf("serving %s on %s:%u\n", fname, address, server->get_port());
+    if (resp_server) printf("serving RESP on %s:%u\n", address, resp_server->get_port());
+    if (primary) printf("replicating on %s:%u\n", address, primary->get_port());
+    fflush(stdout);
+
+    std::atomic<int> status(EXIT_SUCCESS);
+    auto serve = [&status, argv](auto *loop) {
+        try {
+            loop->run();
+        } catch (std::exception &e) {
+            fprintf(stderr, "%s: %s\n", argv[0], e.what());
+            status = EXIT_FAILURE;
+
+            // one loop failing takes the others down with it
+            handle_signal(0);
+        }
+    };
+
+    std::thread resp_loop;
+    if (resp_server) resp_loop = std::thread(serve, resp_server);
+    std::thread primary_loop;
+    if (primary) primary_loop = std::thread(serve, primary);
+    serve(server);
+
+    if (resp_server) {
+        resp_server->stop();
+        resp_loop.join();
+    }
+    if (primary) {
+        primary->stop();
+        primary_loop.join();
+    }
+
+    done.store(true);
+    if (publisher.joinable()) publisher.join();
+
+    delete primary;
+    primary = nullptr;
+    delete resp_server;
+    resp_server = nullptr;
+    delete server;
+    server = nullptr;
+    delete table;
+    return status;
+}